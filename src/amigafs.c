@@ -19,12 +19,23 @@
 #include <proto/exec.h>
 #include <proto/dos.h>
 #include <dos/dos.h>
+#include <dos/exall.h>
+#include <dos/doshunks.h>
 #include <exec/execbase.h>
+#include <clib/alib_protos.h>
 
 #define RL_AMIGA_PATH_MAX 108
 
 #define HANDLE_FROM_LOCK(lock) ((rl_client_handle_t*) (lock)->fl_Key)
 
+int rl_amigafs_max_read_window = 8;
+
+rl_blockcache_t rl_amigafs_block_cache;
+
+/* Block hashes from the controller are used as cache keys as they are. */
+RL_STATIC_ASSERT(hash_blocks_are_cache_blocks, RL_HASH_BLOCK_SIZE == RL_BLOCKCACHE_BLOCK_SIZE);
+RL_STATIC_ASSERT(hashes_are_cache_hashes, RL_HASH_SIZE == RL_BLOCKCACHE_HASH_SIZE);
+
 static LONG translate_error_code(rl_uint32 error_code);
 static const char* get_packet_type_name(const struct DosPacket* packet);
 static void construct_bstr(char *start, LONG max_size, const char *input);
@@ -94,6 +105,40 @@ static void normalize_object_path(
 	}
 }
 
+/*
+ * If [object_name_bstr] is just the name of an entry in the directory
+ * [dir_lock] (or the root), copy it to [name] and set [*parent_id] to the
+ * directory's handle, so it can be opened relative to that. Returns non-zero
+ * for anything else, which has to be opened by its full path.
+ */
+static int relative_object_name(
+	rl_amigafs_t *fs,
+	struct FileLock *dir_lock,
+	const void *object_name_bstr,
+	char *name,
+	size_t name_size,
+	rl_uint32 *parent_id)
+{
+	const rl_client_handle_t *handle = dir_lock ? HANDLE_FROM_LOCK(dir_lock) : &fs->root_handle;
+	const size_t length = BSTR_LEN(object_name_bstr);
+
+	if (RL_HANDLE_DIR != handle->type && RL_HANDLE_DEVICE != handle->type)
+		return 1;
+
+	if (0 == length || length >= name_size)
+		return 1;
+
+	rl_memcpy(name, BSTR_PTR(object_name_bstr), length);
+	name[length] = '\0';
+
+	/* Device names, parent references and subdirectories. */
+	if (rl_strchr(name, ':') || rl_strchr(name, '/'))
+		return 1;
+
+	*parent_id = handle->handle_id;
+	return 0;
+}
+
 static void dump_pending_ops(rl_amigafs_t *fs)
 {
 	int index = 0;
@@ -121,6 +166,7 @@ static rl_pending_operation_t *alloc_pending(rl_amigafs_t *self, struct DosPacke
 		return NULL;
 
 	op->request_seqno = self->seqno++;
+	op->seqno_count = 1;
 	op->next = self->pending;
 	op->input_packet = packet;
 	op->expected_answer_type = expected_answer_type;
@@ -322,13 +368,23 @@ void rl_amigafs_free_lock(rl_amigafs_t *fs, struct FileLock *lock)
 	/* Don't free the device handle (it lives inside the amigafs struct). */
 	if (RL_HANDLE_DEVICE != handle->type)
 	{
-		/* Clean up the server-side handle. */
-		RL_MSG_INIT(msg, RL_MSG_CLOSE_HANDLE_REQUEST);
-		msg.close_handle_request.hdr_sequence_num = fs->seqno++;
-		msg.close_handle_request.handle = handle->handle_id;
-		RL_LOG_DEBUG(("transmitting close request for handle %d", handle->handle_id));
-		if (0 != peer_transmit_message(fs->peer, &msg))
-			RL_LOG_WARNING(("Couldn't transmit close handle request for id %d", handle->handle_id));
+		/* Clean up the server-side handle, unless it's gone already. */
+		if (handle->flags & RL_CLIENT_FLAG_WHOLE_FILE)
+		{
+			if (handle->whole_file)
+				rl_free_sized(handle->whole_file, handle->size_lo);
+		}
+		else
+		{
+			RL_MSG_INIT(msg, RL_MSG_CLOSE_HANDLE_REQUEST);
+			msg.close_handle_request.hdr_sequence_num = fs->seqno++;
+			msg.close_handle_request.handle = handle->handle_id;
+			RL_LOG_DEBUG(("transmitting close request for handle %d", handle->handle_id));
+			if (0 != peer_transmit_message(fs->peer, &msg))
+				RL_LOG_WARNING(("Couldn't transmit close handle request for id %d", handle->handle_id));
+		}
+		if (handle->dir_batch)
+			rl_free_sized(handle->dir_batch, RL_FSCLIENT_DIR_BATCH_SIZE);
 		RL_FREE_TYPED(rl_client_handle_t, handle);
 	}
 
@@ -372,6 +428,8 @@ static void action_delete_object	(rl_amigafs_t *fs, struct DosPacket *packet);
 static void action_copy_dir			(rl_amigafs_t *fs, struct DosPacket *packet);
 static void action_examine_object	(rl_amigafs_t *fs, struct DosPacket *packet);
 static void action_examine_next		(rl_amigafs_t *fs, struct DosPacket *packet);
+static void action_examine_all		(rl_amigafs_t *fs, struct DosPacket *packet);
+static void action_examine_all_end	(rl_amigafs_t *fs, struct DosPacket *packet);
 static void action_disk_info		(rl_amigafs_t *fs, struct DosPacket *packet);
 static void action_info				(rl_amigafs_t *fs, struct DosPacket *packet);
 static void action_parent			(rl_amigafs_t *fs, struct DosPacket *packet);
@@ -448,6 +506,53 @@ static void action_is_filesystem(rl_amigafs_t *fs, struct DosPacket* packet)
  */
 static void complete_findinput(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *msg);
 
+/*
+ * Send the open_handle request [open_msg] for [op] as a compound request,
+ * along with a close of the handle it opens that only runs if the whole file
+ * comes back with the open. Small files are then read in a single round
+ * trip, and leave no handle open on the controller.
+ */
+static int transmit_open_and_close(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *open_msg)
+{
+	const int framing = fs->peer->framing;
+	rl_msg_t close_msg, msg;
+	rl_uint32 open_size, close_size, size;
+	rl_uint8 *operations, *cursor;
+	size_t used;
+	int result = -1;
+
+	/* The handle opened by the first operation. */
+	RL_MSG_INIT(close_msg, RL_MSG_CLOSE_HANDLE_REQUEST);
+	close_msg.close_handle_request.handle = RL_COMPOUND_HANDLE_REF;
+
+	open_size = (rl_uint32) rl_msg_encoded_size(open_msg, framing);
+	close_size = (rl_uint32) rl_msg_encoded_size(&close_msg, framing);
+	size = 2 * RL_COMPOUND_RECORD_SIZE + open_size + close_size;
+
+	if (NULL == (operations = (rl_uint8 *) rl_alloc_sized(size)))
+		return -1;
+
+	cursor = operations;
+	rl_encode_compound_record(&cursor, 0, open_size);
+	if (0 != rl_encode_msg(open_msg, framing, cursor, (int) open_size, &used))
+		goto cleanup;
+	cursor += open_size;
+
+	rl_encode_compound_record(&cursor, RL_COMPOUND_OPF_IF_WHOLE, close_size);
+	if (0 != rl_encode_msg(&close_msg, framing, cursor, (int) close_size, &used))
+		goto cleanup;
+
+	RL_MSG_INIT(msg, RL_MSG_COMPOUND_REQUEST);
+	msg.compound_request.hdr_sequence_num = op->request_seqno;
+	msg.compound_request.operations.base = operations;
+	msg.compound_request.operations.length = size;
+	result = peer_transmit_message(fs->peer, &msg);
+
+cleanup:
+	rl_free_sized(operations, size);
+	return result;
+}
+
 static void action_findinput(rl_amigafs_t *fs, struct DosPacket *packet)
 {
 	struct FileLock * const dir_lock =
@@ -461,6 +566,7 @@ static void action_findinput(rl_amigafs_t *fs, struct DosPacket *packet)
 	rl_pending_operation_t *pending_op = NULL;
 	LONG error_code = 0;
 	rl_msg_t msg;
+	char name[RL_AMIGA_PATH_MAX];
 
     RL_LOG_DEBUG(("FINDINPUT: directory=\"%d\", name=\"%Q\"",
 				dir_handle->handle_id, packet->dp_Arg3));
@@ -498,7 +604,7 @@ static void action_findinput(rl_amigafs_t *fs, struct DosPacket *packet)
 	}
 
 	/* Construct a pending open for the file. */
-	pending_op = alloc_pending(fs, packet, RL_MSG_OPEN_HANDLE_ANSWER, complete_findinput);
+	pending_op = alloc_pending(fs, packet, RL_MSG_COMPOUND_ANSWER, complete_findinput);
 	if (!pending_op)
 	{
 		error_code = ERROR_NO_FREE_STORE;
@@ -506,10 +612,19 @@ static void action_findinput(rl_amigafs_t *fs, struct DosPacket *packet)
 	}
 
 	RL_MSG_INIT(msg, RL_MSG_OPEN_HANDLE_REQUEST);
-	msg.open_handle_request.hdr_sequence_num	= pending_op->request_seqno;
 	msg.open_handle_request.path				= filename_cstr; /* FIXME: Are they always null-terminated? */
 	msg.open_handle_request.mode				= RL_OPENFLAG_READ;
-	if (0 != peer_transmit_message(fs->peer, &msg))
+	msg.open_handle_request.inline_size		= RL_FSCLIENT_INLINE_READ_SIZE;
+	msg.open_handle_request.max_hashes		= fs->block_cache->max_blocks ? RL_FSCLIENT_MAX_BLOCK_HASHES : 0;
+
+	/* Names in the directory are opened relative to its handle. */
+	if (0 == relative_object_name(fs, dir_lock, filename_bstr, name, sizeof(name), &msg.open_handle_request.parent))
+	{
+		msg.open_handle_request.path			= name;
+		msg.open_handle_request.mode			|= RL_OPENFLAG_RELATIVE;
+	}
+
+	if (0 != transmit_open_and_close(fs, pending_op, &msg))
 		goto error;
 
 	return;
@@ -523,45 +638,359 @@ error:
 	reply_to_packet(fs, packet);
 }
 
-static void complete_findinput(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *msg)
+/* Network data needn't be aligned, so it's taken a byte at a time. */
+static rl_uint32 get_longword(const rl_uint8 *p)
+{
+	return ((rl_uint32) p[0] << 24) | ((rl_uint32) p[1] << 16) | ((rl_uint32) p[2] << 8) | p[3];
+}
+
+static void put_longword(rl_uint8 *p, rl_uint32 value)
+{
+	p[0] = (rl_uint8) (value >> 24);
+	p[1] = (rl_uint8) (value >> 16);
+	p[2] = (rl_uint8) (value >> 8);
+	p[3] = (rl_uint8) value;
+}
+
+/* Non-zero if the start of the file that came along with the open answer
+ * [msg] is that of an executable. */
+static int is_executable(const rl_msg_t *msg)
+{
+	const rl_net_array_t * const inline_data = &msg->open_handle_answer.inline_data;
+
+	return inline_data->length >= 4 && HUNK_HEADER == get_longword((const rl_uint8 *) inline_data->base);
+}
+
+/* Executables are read by LoadSeg from start to end as soon as they're
+ * opened; let the controller know, so that it fetches the whole file while
+ * the first hunks are being loaded. */
+static void advise_if_executable(rl_amigafs_t *fs, const rl_msg_t *msg)
+{
+	rl_msg_t advise_msg;
+
+	if (msg->open_handle_answer.inline_data.length >= msg->open_handle_answer.size || !is_executable(msg))
+		return;
+
+	RL_MSG_INIT(advise_msg, RL_MSG_ADVISE_FILE_REQUEST);
+	advise_msg.advise_file_request.hdr_sequence_num = fs->seqno++;
+	advise_msg.advise_file_request.handle = msg->open_handle_answer.handle;
+	advise_msg.advise_file_request.offset = 0;
+	advise_msg.advise_file_request.length = 0;
+	advise_msg.advise_file_request.advice = RL_ADVISE_WILLNEED | RL_ADVISE_SEQUENTIAL;
+	peer_transmit_message(fs->peer, &advise_msg);
+}
+
+static void complete_delta(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *msg);
+
+/*
+ * A rebuilt executable mostly consists of the blocks of its previous
+ * version, moved about. If the cache still holds some of those and misses
+ * some of the new version, describe them to the controller and have it send
+ * the new version as a delta against them. Returns non-zero if the open
+ * [packet] is answered once the delta has arrived.
+ */
+static int request_delta(rl_amigafs_t *fs, struct DosPacket *packet, rl_client_handle_t *handle, const rl_msg_t *msg)
+{
+	const rl_uint32 file_id = handle->cache_file;
+	const rl_uint32 block_count = (handle->size_lo + RL_BLOCKCACHE_BLOCK_SIZE - 1) / RL_BLOCKCACHE_BLOCK_SIZE;
+	const rl_uint32 prev_count = rl_blockcache_previous_count(fs->block_cache, file_id);
+	rl_pending_operation_t *pending_op;
+	rl_uint8 *signatures = NULL;
+	rl_uint32 count = 0, size = 0, index;
+	rl_msg_t delta_msg;
+	int result = 0;
+
+	if (0 == prev_count)
+		return 0;
+
+	if (!is_executable(msg))
+		goto cleanup;
+
+	for (index = 0; index < block_count; ++index)
+	{
+		if (!rl_blockcache_contains(fs->block_cache, file_id, index))
+			break;
+	}
+
+	if (index == block_count)
+		goto cleanup;
+
+	size = RL_MIN_MACRO(prev_count, RL_FSCLIENT_MAX_DELTA_BLOCKS) * RL_DELTA_SIGNATURE_SIZE;
+
+	if (NULL == (signatures = (rl_uint8 *) rl_alloc_sized(size)))
+		goto cleanup;
+
+	for (index = 0; index < prev_count && count < RL_FSCLIENT_MAX_DELTA_BLOCKS; ++index)
+	{
+		rl_uint8 * const out = signatures + count * RL_DELTA_SIGNATURE_SIZE;
+		const rl_uint8 *data;
+		rl_uint32 hash[2];
+
+		if (NULL == (data = rl_blockcache_previous_block(fs->block_cache, file_id, index, hash)))
+			continue;
+
+		put_longword(out, rl_rollsum(data, RL_BLOCKCACHE_BLOCK_SIZE));
+		put_longword(out + 4, hash[0]);
+		put_longword(out + 8, hash[1]);
+		++count;
+	}
+
+	if (0 == count || NULL == (pending_op = alloc_pending(fs, packet, RL_MSG_DELTA_ANSWER, complete_delta)))
+		goto cleanup;
+
+	/* Whatever the answer, the open succeeded. */
+	pending_op->callback_handles_errors = 1;
+
+	RL_MSG_INIT(delta_msg, RL_MSG_DELTA_REQUEST);
+	delta_msg.delta_request.hdr_sequence_num = pending_op->request_seqno;
+	delta_msg.delta_request.handle = handle->handle_id;
+	delta_msg.delta_request.signatures.base = signatures;
+	delta_msg.delta_request.signatures.length = count * RL_DELTA_SIGNATURE_SIZE;
+
+	if (0 != peer_transmit_message(fs->peer, &delta_msg))
+	{
+		unlink_pending(fs, pending_op);
+		goto cleanup;
+	}
+
+	RL_LOG_DEBUG(("asking for \"%s\" as a delta against %u blocks", handle->path, count));
+	result = 1;
+
+cleanup:
+	if (signatures)
+		rl_free_sized(signatures, size);
+
+	/* One try only. */
+	if (!result)
+		rl_blockcache_drop_previous(fs->block_cache, file_id);
+
+	return result;
+}
+
+/*
+ * Rebuild the start of a file from delta instructions into the block cache,
+ * a block at a time. Stops at a block the cache has let go of since it was
+ * described; the rest is read as usual.
+ */
+static void apply_delta(rl_amigafs_t *fs, rl_client_handle_t *handle, const rl_msg_delta_answer_t *answer)
+{
+	const rl_uint8 *p = (const rl_uint8 *) answer->instructions.base;
+	const rl_uint8 * const end = p + answer->instructions.length;
+	rl_uint32 offset = 0, filled = 0;
+	rl_uint8 *block;
+
+	if (NULL == (block = (rl_uint8 *) rl_alloc_sized(RL_BLOCKCACHE_BLOCK_SIZE)))
+		return;
+
+	while (p < end && offset + filled < answer->length)
+	{
+		const rl_uint8 *data;
+		rl_uint32 length;
+
+		if (RL_DELTA_COPY == p[0] && (rl_uint32) (end - p) >= 1 + RL_HASH_SIZE)
+		{
+			/* Having just been used, the block isn't the one that storing
+			 * the blocks it goes into evicts. */
+			if (NULL == (data = rl_blockcache_lookup_hash(fs->block_cache, get_longword(p + 1), get_longword(p + 5))))
+				break;
+
+			length = RL_BLOCKCACHE_BLOCK_SIZE;
+			p += 1 + RL_HASH_SIZE;
+		}
+		else if (RL_DELTA_LITERAL == p[0] && (rl_uint32) (end - p) >= 1 + 4 &&
+			get_longword(p + 1) <= (rl_uint32) (end - p) - (1 + 4))
+		{
+			data = p + 1 + 4;
+			length = get_longword(p + 1);
+			p += 1 + 4 + length;
+		}
+		else
+		{
+			RL_LOG_DEBUG(("bad delta instruction %u for \"%s\"", p[0], handle->path));
+			break;
+		}
+
+		while (length > 0)
+		{
+			const rl_uint32 chunk = RL_MIN_MACRO(length, RL_BLOCKCACHE_BLOCK_SIZE - filled);
+
+			rl_memcpy(block + filled, data, chunk);
+			data += chunk;
+			length -= chunk;
+			filled += chunk;
+
+			if (RL_BLOCKCACHE_BLOCK_SIZE == filled)
+			{
+				rl_blockcache_store(fs->block_cache, handle->cache_file, handle->size_lo, offset, block, filled);
+				offset += filled;
+				filled = 0;
+			}
+		}
+	}
+
+	/* The last block of the file is a short one. */
+	rl_blockcache_store(fs->block_cache, handle->cache_file, handle->size_lo, offset, block, filled);
+
+	RL_LOG_DEBUG(("rebuilt %u bytes of \"%s\" from a delta", offset + filled, handle->path));
+	rl_free_sized(block, RL_BLOCKCACHE_BLOCK_SIZE);
+}
+
+static void complete_delta(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *msg)
+{
+	struct DosPacket * const packet = op->input_packet;
+	struct FileHandle * const fh = BCPL_CAST(struct FileHandle, packet->dp_Arg1);
+	rl_client_handle_t * const handle = HANDLE_FROM_LOCK((struct FileLock *) fh->fh_Arg1);
+
+	if (RL_MSG_DELTA_ANSWER == rl_msg_kind_of(msg))
+		apply_delta(fs, handle, &msg->delta_answer);
+	else
+		RL_LOG_DEBUG(("delta of \"%s\" failed with error %u", handle->path, msg->error_answer.error_code));
+
+	rl_blockcache_drop_previous(fs->block_cache, handle->cache_file);
+
+	reply_to_packet(fs, packet);
+	unlink_pending(fs, op);
+}
+
+/*
+ * Decode the answer to the open from the compound answer [msg] into
+ * [answer], and set [*closed] if the close that went along with it ran.
+ * Returns non-zero if the answer is malformed.
+ */
+static int decode_open_and_close(rl_amigafs_t *fs, const rl_msg_t *msg, rl_msg_t *answer, int *closed)
+{
+	const unsigned char *cursor = (const unsigned char *) msg->compound_answer.answers.base;
+	int size = (int) msg->compound_answer.answers.length;
+	rl_net_array_t frame;
+	rl_uint8 status;
+
+	*closed = 0;
+
+	if (0 != rl_decode_compound_record(&cursor, &size, &status, &frame) ||
+		0 != rl_decode_msg(frame.base, (int) frame.length, fs->peer->framing, answer))
+		return 1;
+
+	/* Closes are only answered if they fail. */
+	if (size > 0 && 0 == rl_decode_compound_record(&cursor, &size, &status, &frame))
+		*closed = RL_COMPOUND_RAN == status && 0 == frame.length;
+
+	return 0;
+}
+
+static void complete_findinput(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *compound_msg)
 {
 	struct DosPacket * const packet = op->input_packet;
 	struct FileHandle * const fh = BCPL_CAST(struct FileHandle, op->input_packet->dp_Arg1);
 	const void *filename_bstr = BCPL_CAST(const void, packet->dp_Arg3);
+	rl_msg_t answer;
+	const rl_msg_t * const msg = &answer;
+	int deferred = 0;
+	int closed;
 
+	if (0 != decode_open_and_close(fs, compound_msg, &answer, &closed))
+	{
+		packet->dp_Res1 = DOSFALSE;
+		packet->dp_Res2 = ERROR_DEVICE_NOT_MOUNTED;
+		closed = 1;
+	}
+	else if (RL_MSG_ERROR_ANSWER == rl_msg_kind_of(msg))
+	{
+		packet->dp_Res1 = DOSFALSE;
+		packet->dp_Res2 = translate_error_code(msg->error_answer.error_code);
+		closed = 1;
+	}
 	/* Make sure the client is getting a lock on a file. */
-	if (RL_NODE_TYPE_FILE != msg->open_handle_answer.type)
+	else if (RL_NODE_TYPE_FILE != msg->open_handle_answer.type)
 	{
 		packet->dp_Res1 = DOSFALSE;
 		packet->dp_Res2 = ERROR_OBJECT_WRONG_TYPE;
 	}
 	else
 	{
-		struct FileLock *file_lock;
+		const rl_uint32 size = msg->open_handle_answer.size;
+		struct FileLock *file_lock = NULL;
+		rl_uint8 *whole_file = NULL;
 
-		file_lock = allocate_lock(fs,
+		/* If the controller has let go of its handle already, the file is
+		 * read from memory. */
+		if (closed && size > 0)
+			whole_file = (rl_uint8 *) rl_alloc_sized(size);
+
+		if ((closed && size > 0 && !whole_file) ||
+			NULL == (file_lock = allocate_lock(fs,
 				RL_HANDLE_FILE,
 				msg->open_handle_answer.handle,
 				SHARED_LOCK,
 				BSTR_PTR(filename_bstr),
-				msg->open_handle_answer.size);
-
-		if (!file_lock)
+				size)))
 		{
+			if (whole_file)
+				rl_free_sized(whole_file, size);
+
 			packet->dp_Res1 = DOSFALSE;
 			packet->dp_Res2 = ERROR_NO_FREE_STORE;
 		}
 		else
 		{
+			rl_client_handle_t * const handle = HANDLE_FROM_LOCK(file_lock);
+			const rl_net_array_t * const inline_data = &msg->open_handle_answer.inline_data;
+			struct FileLock * const dir_lock = BCPL_CAST(struct FileLock, packet->dp_Arg2);
+			const char *cache_path = BSTR_PTR(filename_bstr);
+			const char *colon;
+			char full_path[RL_AMIGA_PATH_MAX];
+			rl_uint32 parent_id;
+
+			/* Key the cache on the path the server saw, which for relative
+			 * opens is the name inside the directory. */
+			if (0 == relative_object_name(fs, dir_lock, filename_bstr, full_path, sizeof(full_path), &parent_id))
+			{
+				normalize_object_path(fs, full_path, sizeof(full_path), dir_lock, filename_bstr);
+				cache_path = full_path;
+			}
+			else if (NULL != (colon = rl_strchr(cache_path, ':')))
+			{
+				cache_path = colon + 1;
+			}
+
+			handle->cache_file = rl_blockcache_open_file(fs->block_cache,
+					cache_path, msg->open_handle_answer.size, msg->open_handle_answer.stamp,
+					msg->open_handle_answer.block_hashes.base,
+					msg->open_handle_answer.block_hashes.length / RL_HASH_SIZE);
+
+			/* The start of the file came along; the first reads are served
+			 * from the buffer and the cache without going to the network. */
+			if (inline_data->length > 0)
+			{
+				rl_blockcache_store(fs->block_cache, handle->cache_file, handle->size_lo,
+						0, inline_data->base, inline_data->length);
+
+				handle->buffer_start = 0;
+				handle->buffer_len = RL_MIN_MACRO(inline_data->length, sizeof(handle->buffer));
+				rl_memcpy(handle->buffer, inline_data->base, handle->buffer_len);
+
+				advise_if_executable(fs, msg);
+			}
+
+			if (closed)
+			{
+				handle->flags |= RL_CLIENT_FLAG_WHOLE_FILE;
+				handle->whole_file = whole_file;
+				rl_memcpy(whole_file, inline_data->base, RL_MIN_MACRO(inline_data->length, size));
+				RL_LOG_DEBUG(("\"%s\" came along whole, %u bytes", handle->path, size));
+			}
+
 			packet->dp_Res1 = DOSTRUE;
 			packet->dp_Res2 = 0;
 			fh->fh_Type = fs->device_port;
 			fh->fh_Arg1 = (LONG) file_lock;
+
+			if (!closed)
+				deferred = request_delta(fs, packet, handle, msg);
 		}
 	}
 
 	/* If we failed, clean up the server-side handle. */
-	if (DOSFALSE == packet->dp_Res1)
+	if (DOSFALSE == packet->dp_Res1 && !closed)
 	{
 		rl_msg_t close_msg;
 		RL_MSG_INIT(close_msg, RL_MSG_CLOSE_HANDLE_REQUEST);
@@ -570,7 +999,9 @@ static void complete_findinput(rl_amigafs_t *fs, rl_pending_operation_t *op, con
 		peer_transmit_message(fs->peer, &close_msg);
 	}
 
-	reply_to_packet(fs, packet);
+	if (!deferred)
+		reply_to_packet(fs, packet);
+
 	unlink_pending(fs, op);
 }
 
@@ -694,89 +1125,448 @@ static void action_examine_object(rl_amigafs_t *fs, struct DosPacket *packet)
 	reply_to_packet(fs, packet);
 }
 
-/*
- *	ACTION_EXAMINE_NEXT	ExNext(...)
- *
- *	ARG1:	LOCK -	Lock on directory being examined
- *	ARG2:	BPTR -	FileInfoBlock to fill in
- *
- *	RES1:	Success/Failure (DOSTRUE/DOSFALSE)
- *	RES2:	Failure code if RES1 = DOSFALSE
- */
-static void complete_examine_next(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *msg);
-static void action_examine_next(rl_amigafs_t *fs, struct DosPacket *packet)
+/*
+ * Directory listing.
+ *
+ * ExNext() and ExAll() hand out entries from a batch fetched with an
+ * examine_all request, and only go to the network when the next entry isn't
+ * in the batch. Entries are numbered from the start of the directory; the
+ * number of the next one is also the cookie that continues a listing on the
+ * controller and the key ExAll() callers keep in eac_LastKey.
+ */
+typedef struct rl_batch_entry_tag
+{
+	rl_uint32 size;
+	rl_uint32 date;
+	rl_uint32 protection;
+	rl_uint8 type;
+	char name[256];
+} rl_batch_entry_t;
+
+/* Forget the batch, so that a new listing sees the directory as it is now. */
+static void restart_listing(rl_client_handle_t *handle)
+{
+	handle->dir_next = 0;
+	handle->dir_batch_first = 0;
+	handle->dir_batch_count = 0;
+	handle->dir_batch_end = 0;
+}
+
+/*
+ * Take the entries of an examine_all answer, starting at entry [first], as
+ * the handle's batch. Returns non-zero if the answer is malformed.
+ */
+static int store_batch(rl_client_handle_t *handle, rl_uint32 first, const rl_msg_examine_all_answer_t *answer)
+{
+	const rl_uint8 * const entries = (const rl_uint8 *) answer->entries.base;
+	const rl_uint32 length = answer->entries.length;
+	rl_uint32 pos = 0, count = 0;
+
+	restart_listing(handle);
+
+	if (length > RL_FSCLIENT_DIR_BATCH_SIZE)
+		return 1;
+
+	while (pos < length)
+	{
+		if (length - pos < RL_DIRENTRY_HEADER_SIZE)
+			return 1;
+
+		pos += RL_DIRENTRY_HEADER_SIZE + entries[pos + RL_DIRENTRY_HEADER_SIZE - 1];
+		++count;
+	}
+
+	if (pos > length)
+		return 1;
+
+	rl_memcpy(handle->dir_batch, entries, length);
+	handle->dir_batch_length = length;
+	handle->dir_batch_first = first;
+	handle->dir_batch_count = count;
+	handle->dir_next = first;
+	handle->dir_cursor = 0;
+	handle->dir_cursor_index = first;
+
+	/* An empty batch can only mean the end; don't ask again. */
+	handle->dir_batch_end = answer->end_of_sequence || 0 == count;
+	return 0;
+}
+
+/* Decode entry [index] into [entry]. Returns non-zero if it's not in the
+ * batch. */
+static int get_batch_entry(rl_client_handle_t *handle, rl_uint32 index, rl_batch_entry_t *entry)
+{
+	const unsigned char *cursor;
+	rl_uint8 name_length;
+
+	if (index < handle->dir_batch_first || index - handle->dir_batch_first >= handle->dir_batch_count)
+		return 1;
+
+	if (index < handle->dir_cursor_index)
+	{
+		handle->dir_cursor = 0;
+		handle->dir_cursor_index = handle->dir_batch_first;
+	}
+
+	/* store_batch() has checked the lengths. */
+	while (handle->dir_cursor_index < index)
+	{
+		handle->dir_cursor += RL_DIRENTRY_HEADER_SIZE + handle->dir_batch[handle->dir_cursor + RL_DIRENTRY_HEADER_SIZE - 1];
+		++handle->dir_cursor_index;
+	}
+
+	cursor = handle->dir_batch + handle->dir_cursor;
+	rl_decode_int4(&cursor, &entry->size);
+	rl_decode_int4(&cursor, &entry->date);
+	rl_decode_int4(&cursor, &entry->protection);
+	rl_decode_int1(&cursor, &entry->type);
+	rl_decode_int1(&cursor, &name_length);
+	rl_memcpy(entry->name, cursor, name_length);
+	entry->name[name_length] = '\0';
+	return 0;
+}
+
+/* Non-zero if the next entry has to be fetched before it can be handed out. */
+static int need_batch(const rl_client_handle_t *handle)
+{
+	return !handle->dir_batch_end || handle->dir_next < handle->dir_batch_first;
+}
+
+static void to_datestamp(rl_uint32 seconds, struct DateStamp *stamp)
+{
+	stamp->ds_Days = seconds / (24 * 60 * 60);
+	stamp->ds_Minute = (seconds % (24 * 60 * 60)) / 60;
+	stamp->ds_Tick = (seconds % 60) * TICKS_PER_SECOND;
+}
+
+static void complete_examine_batch(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *msg);
+
+/*
+ * Ask for the batch starting at the handle's next entry; [packet] is carried
+ * on with when it arrives. Returns an error code if the request couldn't be
+ * sent.
+ */
+static LONG request_batch(rl_amigafs_t *fs, struct DosPacket *packet, rl_client_handle_t *handle)
+{
+	rl_pending_operation_t *pending_op;
+	rl_msg_t msg;
+
+	if (!handle->dir_batch)
+	{
+		if (NULL == (handle->dir_batch = (rl_uint8 *) rl_alloc_sized(RL_FSCLIENT_DIR_BATCH_SIZE)))
+			return ERROR_NO_FREE_STORE;
+	}
+
+	if (NULL == (pending_op = alloc_pending(fs, packet, RL_MSG_EXAMINE_ALL_ANSWER, complete_examine_batch)))
+		return ERROR_NO_FREE_STORE;
+
+	pending_op->detail.examine.first = handle->dir_next;
+
+	RL_MSG_INIT(msg, RL_MSG_EXAMINE_ALL_REQUEST);
+	msg.examine_all_request.hdr_sequence_num = pending_op->request_seqno;
+	msg.examine_all_request.handle = handle->handle_id;
+	msg.examine_all_request.cookie = handle->dir_next;
+	msg.examine_all_request.max_size = RL_FSCLIENT_DIR_BATCH_SIZE;
+
+	if (0 != peer_transmit_message(fs->peer, &msg))
+	{
+		unlink_pending(fs, pending_op);
+		return ERROR_DEVICE_NOT_MOUNTED;
+	}
+
+	return 0;
+}
+
+/*
+ *	ACTION_EXAMINE_NEXT	ExNext(...)
+ *
+ *	ARG1:	LOCK -	Lock on directory being examined
+ *	ARG2:	BPTR -	FileInfoBlock to fill in
+ *
+ *	RES1:	Success/Failure (DOSTRUE/DOSFALSE)
+ *	RES2:	Failure code if RES1 = DOSFALSE
+ */
+
+/* Answer [packet] from the batch. Returns non-zero (without answering) if the
+ * next entry has to be fetched first. */
+static int serve_examine_next(rl_amigafs_t *fs, struct DosPacket *packet, rl_client_handle_t *handle)
+{
+	struct FileInfoBlock * const fib = BCPL_CAST(struct FileInfoBlock, packet->dp_Arg2);
+	rl_batch_entry_t entry;
+
+	if (0 == get_batch_entry(handle, handle->dir_next, &entry))
+	{
+		++handle->dir_next;
+
+		rl_memset(fib, 0, sizeof(*fib));
+		fib->fib_DiskKey = 0L;
+		fib->fib_DirEntryType = RL_NODE_TYPE_DIRECTORY == entry.type ? 1 : -1;
+		fib->fib_EntryType = fib->fib_DirEntryType; /* FIXME: Is this right? */
+		construct_bstr(fib->fib_FileName, sizeof(fib->fib_FileName), entry.name);
+		/* These set bits in the protection mask indicate forbidden actions,
+		 * not caps. Really weird. */
+		fib->fib_Protection = entry.protection;
+		fib->fib_Size = entry.size;
+		fib->fib_NumBlocks = entry.size;
+		to_datestamp(entry.date, &fib->fib_Date);
+		fib->fib_Comment[0] = '\0';
+		packet->dp_Res1 = DOSTRUE;
+		packet->dp_Res2 = 0;
+	}
+	else if (need_batch(handle))
+	{
+		return 1;
+	}
+	else
+	{
+		handle->flags &= ~(RL_CLIENT_FLAG_FILE_ENUM_IN_PROGRESS);
+		packet->dp_Res1 = DOSFALSE;
+		packet->dp_Res2 = ERROR_NO_MORE_ENTRIES;
+	}
+
+	reply_to_packet(fs, packet);
+	return 0;
+}
+
+static void action_examine_next(rl_amigafs_t *fs, struct DosPacket *packet)
+{
+	struct FileLock *lock = BCPL_CAST(struct FileLock, packet->dp_Arg1);
+	rl_client_handle_t *handle = HANDLE_FROM_LOCK(lock);
+	LONG error_code;
+
+	if (0 == (handle->flags & RL_CLIENT_FLAG_FILE_ENUM_IN_PROGRESS))
+	{
+		restart_listing(handle);
+		handle->flags |= RL_CLIENT_FLAG_FILE_ENUM_IN_PROGRESS;
+	}
+
+	if (0 == serve_examine_next(fs, packet, handle))
+		return;
+
+	if (0 == (error_code = request_batch(fs, packet, handle)))
+		return;
+
+	packet->dp_Res1 = DOSFALSE;
+	packet->dp_Res2 = error_code;
+	reply_to_packet(fs, packet);
+}
+
+/*
+ *	ACTION_EXAMINE_ALL	ExAll(...)
+ *
+ *	ARG1:	LOCK -	Lock on directory to examine
+ *	ARG2:	APTR -	Buffer to store results in
+ *	ARG3:	LONG -	Length (in bytes) of the buffer
+ *	ARG4:	LONG -	Type of request (ED_NAME ... ED_OWNER)
+ *	ARG5:	APTR -	ExAllControl with the state between calls
+ *
+ *	RES1:	LONG -	Continuation flag; DOSFALSE when done (or on failure)
+ *	RES2:	CODE -	ERROR_NO_MORE_ENTRIES when done, or a failure code
+ */
+
+/* Size of the ExAllData fields for each request type; the strings follow. */
+static const rl_uint8 exall_field_sizes[ED_OWNER + 1] =
+{
+	0, 8, 12, 16, 20, 32, 36, 40
+};
+
+static int exall_matches(const struct ExAllControl *control, LONG type, struct ExAllData *data)
+{
+	if (control->eac_MatchString && !MatchPatternNoCase((CONST_STRPTR) control->eac_MatchString, (STRPTR) data->ed_Name))
+		return 0;
+
+	if (control->eac_MatchFunc && !CallHookA(control->eac_MatchFunc, (Object *) &type, data))
+		return 0;
+
+	return 1;
+}
+
+/* Fill the caller's buffer from the batch. Returns non-zero (without
+ * answering) if the next entry has to be fetched first, which is only done
+ * while the buffer is still empty. */
+static int serve_examine_all(rl_amigafs_t *fs, struct DosPacket *packet, rl_client_handle_t *handle)
+{
+	struct ExAllControl * const control = (struct ExAllControl *) packet->dp_Arg5;
+	const LONG type = packet->dp_Arg4;
+	UBYTE *buffer = (UBYTE *) packet->dp_Arg2;
+	LONG space = packet->dp_Arg3;
+	struct ExAllData *last = NULL;
+	rl_batch_entry_t entry;
+
+	for (;;)
+	{
+		struct ExAllData * const data = (struct ExAllData *) buffer;
+		LONG name_length, needed;
+
+		if (0 != get_batch_entry(handle, handle->dir_next, &entry))
+		{
+			if (!need_batch(handle))
+			{
+				packet->dp_Res1 = DOSFALSE;
+				packet->dp_Res2 = ERROR_NO_MORE_ENTRIES;
+			}
+			else if (0 == control->eac_Entries)
+			{
+				return 1;
+			}
+			else
+			{
+				/* The caller comes back for the rest. */
+				packet->dp_Res1 = DOSTRUE;
+				packet->dp_Res2 = 0;
+			}
+			break;
+		}
+
+		/* The name and an empty comment follow the fields; keep the next
+		 * entry longword aligned. */
+		name_length = (LONG) rl_strlen(entry.name);
+		needed = (exall_field_sizes[type] + name_length + 2 + 3) & ~3;
+
+		if (needed > space)
+		{
+			packet->dp_Res1 = control->eac_Entries ? DOSTRUE : DOSFALSE;
+			packet->dp_Res2 = control->eac_Entries ? 0 : ERROR_NO_FREE_STORE;
+			break;
+		}
+
+		data->ed_Next = NULL;
+		data->ed_Name = buffer + exall_field_sizes[type];
+		rl_memcpy(data->ed_Name, entry.name, name_length + 1);
+
+		if (type >= ED_TYPE)
+			data->ed_Type = RL_NODE_TYPE_DIRECTORY == entry.type ? ST_USERDIR : ST_FILE;
+		if (type >= ED_SIZE)
+			data->ed_Size = entry.size;
+		if (type >= ED_PROTECTION)
+			data->ed_Prot = entry.protection;
+		if (type >= ED_DATE)
+		{
+			struct DateStamp stamp;
+			to_datestamp(entry.date, &stamp);
+			data->ed_Days = stamp.ds_Days;
+			data->ed_Mins = stamp.ds_Minute;
+			data->ed_Ticks = stamp.ds_Tick;
+		}
+		if (type >= ED_COMMENT)
+		{
+			data->ed_Comment = data->ed_Name + name_length + 1;
+			data->ed_Comment[0] = '\0';
+		}
+		if (type >= ED_OWNER)
+		{
+			data->ed_OwnerUID = 0;
+			data->ed_OwnerGID = 0;
+		}
+
+		control->eac_LastKey = ++handle->dir_next;
+
+		/* Entries that don't match are overwritten by the next one. */
+		if (!exall_matches(control, type, data))
+			continue;
+
+		if (last)
+			last->ed_Next = data;
+
+		last = data;
+		buffer += needed;
+		space -= needed;
+		++control->eac_Entries;
+	}
+
+	reply_to_packet(fs, packet);
+	return 0;
+}
+
+static void action_examine_all(rl_amigafs_t *fs, struct DosPacket *packet)
 {
 	struct FileLock *lock = BCPL_CAST(struct FileLock, packet->dp_Arg1);
-	rl_client_handle_t *handle = HANDLE_FROM_LOCK(lock);
-	rl_msg_t msg;
-	rl_pending_operation_t *pending_op = NULL;
+	struct ExAllControl * const control = (struct ExAllControl *) packet->dp_Arg5;
+	const LONG type = packet->dp_Arg4;
+	rl_client_handle_t *handle = lock ? HANDLE_FROM_LOCK(lock) : &fs->root_handle;
 	LONG error_code;
 
-	pending_op = alloc_pending(fs, packet, RL_MSG_FIND_NEXT_FILE_ANSWER, complete_examine_next);
-	if (!pending_op)
+	RL_LOG_DEBUG(("EXAMINE_ALL handle=%d type=%d key=%u", handle->handle_id, (int) type, control->eac_LastKey));
+
+	control->eac_Entries = 0;
+
+	if (RL_HANDLE_FILE == handle->type)
 	{
-		error_code = ERROR_NO_FREE_STORE;
+		error_code = ERROR_OBJECT_WRONG_TYPE;
 		goto error;
 	}
 
-	RL_MSG_INIT(msg, RL_MSG_FIND_NEXT_FILE_REQUEST);
-	msg.find_next_file_request.hdr_sequence_num	= pending_op->request_seqno;
-	msg.find_next_file_request.handle = HANDLE_FROM_LOCK(lock)->handle_id;
-	msg.find_next_file_request.reset =
-		(handle->flags & RL_CLIENT_FLAG_FILE_ENUM_IN_PROGRESS) ? 0 : 1;
-
-	if (0 != peer_transmit_message(fs->peer, &msg))
+	if (type < ED_NAME || type > ED_OWNER)
 	{
-		error_code = ERROR_DEVICE_NOT_MOUNTED;
+		error_code = ERROR_BAD_NUMBER;
 		goto error;
 	}
 
-	handle->flags |= RL_CLIENT_FLAG_FILE_ENUM_IN_PROGRESS;
-	return;
+	if (0 == control->eac_LastKey)
+		restart_listing(handle);
+	else
+		handle->dir_next = control->eac_LastKey;
 
-error:
-	if (pending_op)
-		unlink_pending(fs, pending_op);
+	if (0 == serve_examine_all(fs, packet, handle))
+		return;
+
+	if (0 == (error_code = request_batch(fs, packet, handle)))
+		return;
 
+error:
 	packet->dp_Res1 = DOSFALSE;
 	packet->dp_Res2 = error_code;
 	reply_to_packet(fs, packet);
 }
 
-static void complete_examine_next(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *msg)
+/*
+ *	ACTION_EXAMINE_ALL_END	ExAllEnd(...)
+ *
+ *	ARG1-5:	As for ACTION_EXAMINE_ALL
+ *
+ *	RES1:	BOOL -	DOSTRUE
+ */
+static void action_examine_all_end(rl_amigafs_t *fs, struct DosPacket *packet)
+{
+	struct FileLock *lock = BCPL_CAST(struct FileLock, packet->dp_Arg1);
+
+	restart_listing(lock ? HANDLE_FROM_LOCK(lock) : &fs->root_handle);
+
+	packet->dp_Res1 = DOSTRUE;
+	packet->dp_Res2 = 0;
+	reply_to_packet(fs, packet);
+}
+
+static void complete_examine_batch(rl_amigafs_t *fs, rl_pending_operation_t *op, const rl_msg_t *msg)
 {
 	struct DosPacket * const packet = op->input_packet;
 	struct FileLock * const lock = BCPL_CAST(struct FileLock, packet->dp_Arg1);
-	struct FileInfoBlock * const fib = BCPL_CAST(struct FileInfoBlock, packet->dp_Arg2);
-	rl_client_handle_t *handle = HANDLE_FROM_LOCK(lock);
-	const rl_msg_find_next_file_answer_t * const answer = &msg->find_next_file_answer;
-	
-	if (answer->end_of_sequence)
+	rl_client_handle_t * const handle = lock ? HANDLE_FROM_LOCK(lock) : &fs->root_handle;
+	const rl_uint32 first = op->detail.examine.first;
+	LONG error_code;
+	int more;
+
+	unlink_pending(fs, op);
+
+	if (0 != store_batch(handle, first, &msg->examine_all_answer))
 	{
-		handle->flags &= ~(RL_CLIENT_FLAG_FILE_ENUM_IN_PROGRESS);
-		packet->dp_Res1 = DOSFALSE;
-		packet->dp_Res2 = ERROR_NO_MORE_ENTRIES;
+		RL_LOG_WARNING(("malformed directory batch for handle %d", handle->handle_id));
+		error_code = ERROR_DEVICE_NOT_MOUNTED;
+		goto error;
 	}
+
+	if (ACTION_EXAMINE_ALL == packet->dp_Type)
+		more = serve_examine_all(fs, packet, handle);
 	else
-	{
-		rl_memset(fib, 0, sizeof(*fib));
-		fib->fib_DiskKey = 0L;
-		fib->fib_DirEntryType = RL_NODE_TYPE_DIRECTORY == answer->type ? 1 : -1;
-		fib->fib_EntryType = fib->fib_DirEntryType; /* FIXME: Is this right? */
-		construct_bstr(fib->fib_FileName, sizeof(fib->fib_FileName), answer->name);
-		/* Set protection bits for regular files. These set bits in the
-		 * protection mask indicate forbidden actions, not caps. Really weird.
-		 * */
-		fib->fib_Protection = FIBF_WRITE | FIBF_DELETE /* simulate R/O FS */;
-		fib->fib_Size = answer->size;
-		fib->fib_NumBlocks = answer->size;
-		fib->fib_Comment[0] = '\0';
-		packet->dp_Res1 = DOSTRUE;
-		packet->dp_Res2 = 0;
-	}
+		more = serve_examine_next(fs, packet, handle);
 
+	if (0 == more || 0 == (error_code = request_batch(fs, packet, handle)))
+		return;
+
+error:
+	packet->dp_Res1 = DOSFALSE;
+	packet->dp_Res2 = error_code;
 	reply_to_packet(fs, packet);
-	unlink_pending(fs, op);
 }
 
 /* Helper function to populate a InfoData struct from the specified fs. */
@@ -874,6 +1664,7 @@ static void action_locate_object(rl_amigafs_t *fs, struct DosPacket* packet)
 	const LONG mode = packet->dp_Arg3;
 	struct FileLock *result_lock = NULL;
 	char full_path[RL_AMIGA_PATH_MAX];
+	char name[RL_AMIGA_PATH_MAX];
 	rl_client_handle_t *handle = NULL;
 	rl_pending_operation_t *pending_op;
 	rl_msg_t msg;
@@ -913,6 +1704,14 @@ static void action_locate_object(rl_amigafs_t *fs, struct DosPacket* packet)
 	msg.open_handle_request.hdr_sequence_num	= pending_op->request_seqno;
 	msg.open_handle_request.path				= &full_path[0];
 	msg.open_handle_request.mode				= RL_OPENFLAG_READ;
+
+	/* Names in the directory are looked up relative to its handle. */
+	if (0 == relative_object_name(fs, dir_lock, object_name_bstr, name, sizeof(name), &msg.open_handle_request.parent))
+	{
+		msg.open_handle_request.path			= name;
+		msg.open_handle_request.mode			|= RL_OPENFLAG_RELATIVE;
+	}
+
 	if (0 != peer_transmit_message(fs->peer, &msg))
 	{
 		error_code = ERROR_NOT_A_DOS_DISK;
@@ -1154,41 +1953,133 @@ complete_read(rl_amigafs_t *self, rl_pending_operation_t *op, const rl_msg_t *ms
 static int
 transmit_read_request(peer_t *peer, rl_client_handle_t *handle, rl_pending_operation_t *op, rl_uint32 count);
 
+static void
+complete_windowed_read(rl_amigafs_t *self, rl_pending_operation_t *op, const rl_msg_t *msg);
+
+static int
+transmit_read_segments(rl_amigafs_t *self, rl_client_handle_t *handle, rl_pending_operation_t *op);
+
+static rl_uint32
+current_time_ms(void);
+
 static int
-buffer_overlap(rl_client_handle_t *handle, struct DosPacket *packet, rl_uint32* offset, rl_uint32* count);
+buffer_overlap(rl_client_handle_t *handle, rl_uint32 bytes_to_read, rl_uint32* offset, rl_uint32* count);
+
+static int
+fill_buffer_from_cache(rl_amigafs_t *self, rl_client_handle_t *handle);
+
+static rl_uint32
+uncached_length(rl_amigafs_t *self, rl_client_handle_t *handle, rl_uint32 count);
+
+static void
+serve_read(rl_amigafs_t *self, struct DosPacket *packet, rl_uint32 bytes_done);
 
 static void
 action_read(rl_amigafs_t *self, struct DosPacket *packet)
+{
+	struct FileLock *lock = (struct FileLock *) packet->dp_Arg1;
+	rl_client_handle_t *handle = HANDLE_FROM_LOCK(lock);
+
+	RL_LOG_DEBUG(("action_read \"%s\", %d bytes", handle->path, (int) packet->dp_Arg3));
+
+	serve_read(self, packet, 0);
+}
+
+/* Carry on with a read that has [bytes_done] bytes of the request done. */
+static void
+serve_read(rl_amigafs_t *self, struct DosPacket *packet, rl_uint32 bytes_done)
 {
 	LONG error_code = ERROR_SEEK_ERROR; /* TODO: What to use for real read errors? */
 	struct FileLock *lock = (struct FileLock *) packet->dp_Arg1;
 	rl_client_handle_t *handle = HANDLE_FROM_LOCK(lock);
-	rl_uint32 bytes_remaining = (rl_uint32) packet->dp_Arg3;
+	rl_uint32 bytes_remaining = (rl_uint32) packet->dp_Arg3 - bytes_done;
+	rl_uint32 bytes_to_fetch;
 
 	rl_pending_operation_t *pending_op;
 
-	RL_LOG_DEBUG(("action_read \"%s\", %d bytes", handle->path, (int) packet->dp_Arg3));
+	/* Files that came along whole are all here. */
+	if (handle->flags & RL_CLIENT_FLAG_WHOLE_FILE)
+	{
+		const rl_uint32 count = handle->offset_lo < handle->size_lo ?
+			RL_MIN_MACRO(bytes_remaining, handle->size_lo - handle->offset_lo) : 0;
+
+		if (count > 0)
+		{
+			rl_memcpy((char*) packet->dp_Arg2 + bytes_done, handle->whole_file + handle->offset_lo, count);
+			handle->offset_lo += count;
+		}
+
+		packet->dp_Res1 = bytes_done + count;
+		packet->dp_Res2 = 0;
+		reply_to_packet(self, packet);
+		return;
+	}
 
-	/* See if we can satisfy some of the request from the read buffer. */
+	/* See if we can satisfy some of the request from the read buffer,
+	 * refilling it from the block cache for as long as that has the data. */
+	for (;;)
 	{
 		rl_uint32 offset, count;
-		if (buffer_overlap(handle, packet, &offset, &count))
+		if (buffer_overlap(handle, bytes_remaining, &offset, &count))
 		{
 			/* We can return (some) buffered data. */
+			rl_memcpy((char*) packet->dp_Arg2 + ((rl_uint32) packet->dp_Arg3 - bytes_remaining), &handle->buffer[offset], count);
 			handle->offset_lo += count;
 			bytes_remaining -= count;
-			rl_memcpy((char*) packet->dp_Arg2, &handle->buffer[offset], count);
+		}
 
-			/* Early out for request served entirely from buffer. */
-			if (0 == bytes_remaining)
-			{
-				RL_LOG_DEBUG(("early out servicing %u bytes from buffer", count));
-				packet->dp_Res1 = count;
-				packet->dp_Res2 = 0;
-				reply_to_packet(self, packet);
-				return;
-			}
+		if (0 == bytes_remaining || !fill_buffer_from_cache(self, handle))
+			break;
+	}
+
+	/* Early out for request served entirely from buffer. */
+	if (0 == bytes_remaining)
+	{
+		RL_LOG_DEBUG(("early out servicing %d bytes from buffer", (int) packet->dp_Arg3));
+		packet->dp_Res1 = packet->dp_Arg3;
+		packet->dp_Res2 = 0;
+		reply_to_packet(self, packet);
+		return;
+	}
+
+	/* Only fetch up to the next block the cache has; the read carries on
+	 * from the cache once that has arrived. */
+	bytes_to_fetch = uncached_length(self, handle, bytes_remaining);
+
+	/* Reads larger than the read buffer are split into segments that are
+	 * streamed straight into the caller's buffer, several at a time, so that
+	 * the link stays busy. Each segment gets its own sequence number. */
+	if (bytes_to_fetch > sizeof(handle->buffer))
+	{
+		pending_op = alloc_pending(self, packet, RL_MSG_READ_STREAM_ANSWER, complete_windowed_read);
+		if (!pending_op)
+		{
+			error_code = ERROR_NO_FREE_STORE;
+			goto error;
+		}
+
+		pending_op->detail.read.destination = (char*) packet->dp_Arg2 + ((rl_uint32) packet->dp_Arg3 - bytes_remaining);
+
+		if (0 != rl_readwin_begin(&handle->read_window, &self->read_estimator,
+					pending_op->detail.read.destination, handle->offset_lo, bytes_to_fetch,
+					RL_FSCLIENT_READ_SEGMENT_SIZE, current_time_ms()))
+		{
+			error_code = ERROR_NO_FREE_STORE;
+			goto error;
+		}
+
+		/* reserve a sequence number for every segment */
+		pending_op->seqno_count = handle->read_window.segment_count;
+		pending_op->callback_handles_errors = 1;
+		self->seqno += pending_op->seqno_count - 1;
+
+		if (0 != transmit_read_segments(self, handle, pending_op))
+		{
+			rl_readwin_end(&handle->read_window, current_time_ms());
+			goto error;
 		}
+
+		return;
 	}
 
 	/* We have to round-trip to the server for more buffer data.
@@ -1206,7 +2097,7 @@ action_read(rl_amigafs_t *self, struct DosPacket *packet)
 		pending_op->detail.read.destination = (char*) packet->dp_Arg2 + bytes_read;
 	}
 
-	if (0 != transmit_read_request(self->peer, handle, pending_op, bytes_remaining))
+	if (0 != transmit_read_request(self->peer, handle, pending_op, bytes_to_fetch))
 		goto error;
 
 	return;
@@ -1229,20 +2120,20 @@ transmit_read_request(peer_t *peer, rl_client_handle_t *handle, rl_pending_opera
 	msg.read_file_request.handle			= handle->handle_id;
 	msg.read_file_request.offset_hi			= handle->offset_hi;
 	msg.read_file_request.offset_lo			= handle->offset_lo;
-	/* TODO: split into multiple packets on request side or in answer w/ continuations? */
+	/* Small reads ask for a full buffer so later reads hit the buffer; large
+	 * reads go through read_stream instead. */
 	msg.read_file_request.length			= RL_MAX_MACRO(count, sizeof(handle->buffer));
 
 	return peer_transmit_message(peer, &msg);
 }
 
 static int
-buffer_overlap(rl_client_handle_t *handle, struct DosPacket *packet, rl_uint32* offset, rl_uint32* count)
+buffer_overlap(rl_client_handle_t *handle, rl_uint32 bytes_to_read, rl_uint32* offset, rl_uint32* count)
 {
 	rl_uint32 lo = handle->buffer_start;
 	rl_uint32 hi = handle->buffer_start + handle->buffer_len;
 	rl_uint32 out_offset;
 	rl_uint32 avail = 0;
-	rl_uint32 bytes_to_read = (rl_uint32) packet->dp_Arg3;
 
 	/* See if the buffer lies after the cursor */
 	if (handle->offset_lo < lo)
@@ -1259,6 +2150,45 @@ buffer_overlap(rl_client_handle_t *handle, struct DosPacket *packet, rl_uint32*
 	return 1;
 }
 
+static rl_uint32
+uncached_length(rl_amigafs_t *self, rl_client_handle_t *handle, rl_uint32 count)
+{
+	const rl_uint32 end = handle->offset_lo + count;
+	rl_uint32 index;
+
+	if (RL_BLOCKCACHE_NO_FILE == handle->cache_file)
+		return count;
+
+	/* The block at the read position is missing, or we wouldn't be here. */
+	for (index = handle->offset_lo / RL_BLOCKCACHE_BLOCK_SIZE + 1; index * RL_BLOCKCACHE_BLOCK_SIZE < end; ++index)
+	{
+		if (rl_blockcache_contains(self->block_cache, handle->cache_file, index))
+			return index * RL_BLOCKCACHE_BLOCK_SIZE - handle->offset_lo;
+	}
+
+	return count;
+}
+
+static int
+fill_buffer_from_cache(rl_amigafs_t *self, rl_client_handle_t *handle)
+{
+	const rl_uint32 index = handle->offset_lo / RL_BLOCKCACHE_BLOCK_SIZE;
+	const rl_uint8 *data;
+	rl_uint32 length;
+
+	if (NULL == (data = rl_blockcache_lookup(self->block_cache, handle->cache_file, index, &length)))
+		return 0;
+
+	/* A short last block might not reach the read position. */
+	if (index * RL_BLOCKCACHE_BLOCK_SIZE + length <= handle->offset_lo)
+		return 0;
+
+	rl_memcpy(handle->buffer, data, length);
+	handle->buffer_start = index * RL_BLOCKCACHE_BLOCK_SIZE;
+	handle->buffer_len = length;
+	return 1;
+}
+
 static rl_uint32
 readop_bytes_read(rl_pending_operation_t *op, struct DosPacket *packet)
 {
@@ -1277,6 +2207,9 @@ complete_read(rl_amigafs_t *self, rl_pending_operation_t *op, const rl_msg_t *ms
 	rl_uint32 amount_left = (rl_uint32) packet->dp_Arg3 - readop_bytes_read(op, packet);
 	rl_uint32 slice_amount;
 
+	rl_blockcache_store(self->block_cache, handle->cache_file, handle->size_lo,
+			handle->offset_lo, msg->read_file_answer.data.base, amount_read);
+
 	/* Move data from the packet's transfer buffer into the destination.
 	 *
 	 * The read can have been much greater than requested, so only copy the
@@ -1319,17 +2252,117 @@ complete_read(rl_amigafs_t *self, rl_pending_operation_t *op, const rl_msg_t *ms
 	 */
 	else
 	{
-		/* Just grab the next sequence number and requeue the same operation */
-		op->request_seqno = self->seqno++;
+		/* The rest may be cached. */
+		const rl_uint32 bytes_done = readop_bytes_read(op, packet);
+		unlink_pending(self, op);
+		serve_read(self, packet, bytes_done);
+	}
+}
+
+static rl_uint32
+current_time_ms(void)
+{
+	struct DateStamp now;
+	DateStamp(&now);
+	return ((rl_uint32) now.ds_Days * 24 * 60 + (rl_uint32) now.ds_Minute) * 60 * 1000 +
+		(rl_uint32) now.ds_Tick * (1000 / TICKS_PER_SECOND);
+}
+
+static int
+transmit_read_segments(rl_amigafs_t *self, rl_client_handle_t *handle, rl_pending_operation_t *op)
+{
+	rl_uint32 segment, offset, length;
 
-		if (0 != transmit_read_request(self->peer, handle, op, packet->dp_Arg3 - readop_bytes_read(op, packet)))
+	while (rl_readwin_next(&handle->read_window, current_time_ms(), &segment, &offset, &length))
+	{
+		rl_msg_t msg;
+		RL_MSG_INIT(msg, RL_MSG_READ_STREAM_REQUEST);
+		msg.read_stream_request.hdr_sequence_num	= op->request_seqno + segment;
+		msg.read_stream_request.handle				= handle->handle_id;
+		msg.read_stream_request.offset_hi			= handle->offset_hi;
+		msg.read_stream_request.offset_lo			= offset;
+		msg.read_stream_request.length				= length;
+
+		if (0 != peer_transmit_message(self->peer, &msg))
 		{
-			packet->dp_Res1 = 0;
-			packet->dp_Res2 = ERROR_SEEK_ERROR;
-			reply_to_packet(self, packet);
+			rl_readwin_fail(&handle->read_window, segment);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+complete_windowed_read(rl_amigafs_t *self, rl_pending_operation_t *op, const rl_msg_t *msg)
+{
+	register struct DosPacket * const packet = op->input_packet;
+	struct FileLock *lock = (struct FileLock *) packet->dp_Arg1;
+	rl_client_handle_t *handle = HANDLE_FROM_LOCK(lock);
+	rl_readwin_t * const win = &handle->read_window;
+	const rl_uint32 segment = msg->read_stream_answer.hdr_in_reply_to - op->request_seqno;
+
+	if (RL_MSG_ERROR_ANSWER == rl_msg_kind_of(msg))
+	{
+		RL_LOG_DEBUG(("read segment %u failed with error %u", segment, msg->error_answer.error_code));
+		packet->dp_Res2 = translate_error_code(msg->error_answer.error_code);
+		rl_readwin_fail(win, segment);
+	}
+	else if (0 != rl_readwin_deliver(win, segment,
+				msg->read_stream_answer.data.base,
+				msg->read_stream_answer.data.length,
+				msg->read_stream_answer.final,
+				current_time_ms()))
+	{
+		RL_LOG_DEBUG(("unexpected data for read segment %u", segment));
+		packet->dp_Res2 = ERROR_SEEK_ERROR;
+		rl_readwin_fail(win, segment);
+	}
+
+	/* Keep the window full. */
+	if (!win->failed && 0 != transmit_read_segments(self, handle, op))
+		packet->dp_Res2 = ERROR_SEEK_ERROR;
+
+	/* The operation has to stay around until every segment has been
+	 * answered, even after a failure, or late answers would find nothing to
+	 * match against. */
+	if (!rl_readwin_finished(win))
+		return;
+
+	if (win->failed)
+	{
+		packet->dp_Res1 = -1;
+	}
+	else
+	{
+		const rl_uint32 amount_read = rl_readwin_result(win);
+
+		rl_blockcache_store(self->block_cache, handle->cache_file, handle->size_lo,
+				win->offset, win->destination, amount_read);
+
+		handle->offset_lo += amount_read;
+		op->detail.read.destination += amount_read;
+
+		packet->dp_Res1 = readop_bytes_read(op, packet);
+		packet->dp_Res2 = 0;
+
+		/* The window stopped short of cached blocks; carry on from them. */
+		if (amount_read == win->length && (rl_uint32) packet->dp_Res1 < (rl_uint32) packet->dp_Arg3)
+		{
+			const rl_uint32 bytes_done = (rl_uint32) packet->dp_Res1;
+
+			rl_readwin_end(win, current_time_ms());
 			unlink_pending(self, op);
+			serve_read(self, packet, bytes_done);
+			return;
 		}
 	}
+
+	rl_readwin_end(win, current_time_ms());
+
+	RL_LOG_DEBUG(("Returning DOS result %d from windowed read", packet->dp_Res1));
+	reply_to_packet(self, packet);
+	unlink_pending(self, op);
 }
 
 /*
@@ -1597,6 +2630,14 @@ static void process_fs_packet(rl_amigafs_t *self, struct DosPacket* packet)
 		case ACTION_END:
 			handler = action_end;
 			break;
+
+		case ACTION_EXAMINE_ALL:
+			handler = action_examine_all;
+			break;
+
+		case ACTION_EXAMINE_ALL_END:
+			handler = action_examine_all_end;
+			break;
 		default:
 			break;
 		}
@@ -1621,6 +2662,13 @@ int rl_amigafs_init(rl_amigafs_t *self, peer_t *peer, const char *device_name)
 	rl_memset(self, 0, sizeof(rl_amigafs_t));
 
 	self->peer = peer;
+	rl_readwin_estimator_init(&self->read_estimator, (rl_uint32) rl_amigafs_max_read_window);
+
+	/* Files have to be reopened (and revalidated) before the new session
+	 * gets any cached data for them. */
+	self->block_cache = &rl_amigafs_block_cache;
+	rl_blockcache_new_session(self->block_cache);
+	self->pushed_file = RL_BLOCKCACHE_NO_FILE;
 	self->root_handle.type = RL_HANDLE_DEVICE;
 	self->root_handle.handle_id = (rl_uint32) -1;
 	rl_string_copy(sizeof(self->root_handle.path), self->root_handle.path, device_name);
@@ -1649,12 +2697,23 @@ void rl_amigafs_destroy(rl_amigafs_t *self)
 {
 	RL_LOG_DEBUG(("rl_amigafs_destroy %p", self));
 
+	if (self->block_cache)
+	{
+		const rl_blockcache_stats_t *stats = &self->block_cache->stats;
+		RL_LOG_INFO(("block cache: %u hits (%u shared), %u misses, %u blocks cached, %u evicted, %u invalidated",
+					stats->hits, stats->shared_hits, stats->misses, self->block_cache->block_count,
+					stats->evictions, stats->invalidations));
+	}
+
 	if (self->device_list)
 		unmount_volume(self->device_list);
 
 	if (self->device_port)
 		DeleteMsgPort(self->device_port);
 
+	if (self->root_handle.dir_batch)
+		rl_free_sized(self->root_handle.dir_batch, RL_FSCLIENT_DIR_BATCH_SIZE);
+
 	self->peer = 0;
 }
 
@@ -1677,7 +2736,7 @@ find_pending_op(rl_amigafs_t *self, const rl_msg_t *msg)
 
 	while (op)
 	{
-		if (seqno == op->request_seqno)
+		if (seqno - op->request_seqno < op->seqno_count)
 			return op;
 		else
 			op = op->next;
@@ -1717,11 +2776,43 @@ static LONG translate_error_code(rl_uint32 error_code)
 	}
 }
 
+/*
+ * Cache data the controller sent without being asked, ahead of the file
+ * being opened. The open finds the same size and stamp and keeps the blocks,
+ * so the reads that follow don't go to the network.
+ */
+static void stage_pushed_file(rl_amigafs_t *self, const rl_msg_t *msg)
+{
+	const rl_msg_push_file_request_t * const push = &msg->push_file_request;
+
+	/* The first frame registers the file; the rest follow in order. */
+	if (0 == push->offset)
+	{
+		self->pushed_file = rl_blockcache_open_file(self->block_cache,
+				push->path, push->size, push->stamp,
+				push->block_hashes.base, push->block_hashes.length / RL_HASH_SIZE);
+	}
+
+	if (RL_BLOCKCACHE_NO_FILE == self->pushed_file)
+		return;
+
+	RL_LOG_DEBUG(("pushed: %s, %u bytes at %u", push->path, push->data.length, push->offset));
+	rl_blockcache_store(self->block_cache, self->pushed_file, push->size,
+			push->offset, push->data.base, push->data.length);
+}
+
 int rl_amigafs_process_network_message(rl_amigafs_t *self, const rl_msg_t *msg)
 {
 	const rl_msg_kind_t msg_kind = rl_msg_kind_of(msg);
 	int status = 0;
 	rl_pending_operation_t *pending_op = NULL;
+
+	/* Not an answer, and not answered. */
+	if (RL_MSG_PUSH_FILE_REQUEST == msg_kind)
+	{
+		stage_pushed_file(self, msg);
+		return 0;
+	}
 	
 	/* If there isn't any pending operation for this message, throw it away. */
 	if (NULL == (pending_op = find_pending_op(self, msg)))
@@ -1732,7 +2823,8 @@ int rl_amigafs_process_network_message(rl_amigafs_t *self, const rl_msg_t *msg)
 		return 1;
 	}
 
-	if (msg_kind == pending_op->expected_answer_type)
+	if (msg_kind == pending_op->expected_answer_type ||
+		(msg_kind == RL_MSG_ERROR_ANSWER && pending_op->callback_handles_errors))
 	{
 		(*pending_op->callback)(self, pending_op, msg);
 	}
@@ -9,6 +9,8 @@
 
 #include "util.h"
 #include "rlnet.h"
+#include "readwin.h"
+#include "blockcache.h"
 
 struct FileLock;
 struct peer_tag;
@@ -23,6 +25,39 @@ struct DeviceList;
 /* Limit the paths we keep track of in client handles. */
 #define RL_FSCLIENT_MAX_PATH (108)
 
+/* Size of the segments large reads are split into. */
+#define RL_FSCLIENT_READ_SEGMENT_SIZE (16384)
+
+/* Upper bound on the number of segments in flight per read; set from the
+ * command line. */
+extern int rl_amigafs_max_read_window;
+
+/* Bytes from the start of a file asked to come along with the answer when
+ * it's opened. They fill the read buffer, and the block cache beyond it.
+ * Files no larger than this are closed on the controller in the same round
+ * trip, and read from memory. */
+#define RL_FSCLIENT_INLINE_READ_SIZE (8192)
+
+/* Blocks of a file that are asked to be named by their contents when it's
+ * opened, so that the block cache can serve data it holds under another
+ * name or from an earlier version of the file. */
+#define RL_FSCLIENT_MAX_BLOCK_HASHES (1024)
+
+/* Most blocks of the previous version of a rebuilt executable described to
+ * the controller when it's opened, so that the new version can be sent as a
+ * delta against them. */
+#define RL_FSCLIENT_MAX_DELTA_BLOCKS (256)
+
+/* Size of the directory entry batches fetched for ExNext() and ExAll(). */
+#define RL_FSCLIENT_DIR_BATCH_SIZE (4096)
+
+/* Default memory budget for the block cache. */
+#define RL_FSCLIENT_BLOCK_CACHE_SIZE (512 * 1024)
+
+/* Block cache shared by all devices. It outlives sessions so that repeated
+ * runs of the same program find their data already here. */
+extern rl_blockcache_t rl_amigafs_block_cache;
+
 typedef enum rl_client_handle_type_tag
 {
 	RL_HANDLE_FILE,
@@ -34,7 +69,11 @@ typedef enum rl_client_handle_type_tag
 
 enum rl_client_handle_flags_tag
 {
-	RL_CLIENT_FLAG_FILE_ENUM_IN_PROGRESS = 1
+	RL_CLIENT_FLAG_FILE_ENUM_IN_PROGRESS = 1,
+
+	/* The whole file came along when it was opened, and the controller has
+	 * closed its handle already; reads are served from [whole_file]. */
+	RL_CLIENT_FLAG_WHOLE_FILE = 2
 };
 
 /* FIXME: Add size_hi, perhaps. AmigaOS doesn't really support >2GB files anyway though. */
@@ -53,10 +92,34 @@ typedef struct rl_client_handle_tag
 	/* The handle's path, used to compute relative paths for locks. */
 	char path[RL_FSCLIENT_MAX_PATH];
 
-	/* State for read buffering. */
+	/* State for read buffering. The buffer holds exactly one cache block
+	 * when refilled from the block cache. */
 	rl_uint32 buffer_start;
 	rl_uint32 buffer_len;
-	rl_uint8 buffer[4096];
+	rl_uint8 buffer[RL_BLOCKCACHE_BLOCK_SIZE];
+
+	/* The file's [size_lo] bytes with RL_CLIENT_FLAG_WHOLE_FILE. */
+	rl_uint8 *whole_file;
+
+	/* Block cache id of the file, or RL_BLOCKCACHE_NO_FILE. */
+	rl_uint32 cache_file;
+
+	/* Segments of the large read in progress, if any. */
+	rl_readwin_t read_window;
+
+	/* Directory listing state. [dir_batch] holds the packed entries (see
+	 * protocol.h) [dir_batch_first] up to [dir_batch_first + dir_batch_count]
+	 * as fetched with examine_all; [dir_batch_end] is set if the directory
+	 * ends there. [dir_next] is the next entry to hand out, and
+	 * [dir_cursor] the offset of entry [dir_cursor_index] in the batch. */
+	rl_uint8 *dir_batch;
+	rl_uint32 dir_batch_length;
+	rl_uint32 dir_batch_first;
+	rl_uint32 dir_batch_count;
+	int dir_batch_end;
+	rl_uint32 dir_next;
+	rl_uint32 dir_cursor;
+	rl_uint32 dir_cursor_index;
 } rl_client_handle_t;
 
 typedef struct rl_pending_read_tag
@@ -76,6 +139,12 @@ typedef struct rl_pending_stat_tag
 	size_t length;
 } rl_pending_stat_t;
 
+typedef struct rl_pending_examine_tag
+{
+	/* The entry the requested batch starts at. */
+	rl_uint32 first;
+} rl_pending_examine_t;
+
 typedef void (*rl_completion_callback_fn_t)
 	(struct rl_amigafs_tag *fs,
 	 struct rl_pending_operation_tag *op,
@@ -86,6 +155,14 @@ typedef struct rl_pending_operation_tag
 	/* The sequence number for the request associated with this operation. */
 	rl_uint32 request_seqno;
 
+	/* Number of consecutive sequence numbers (starting at request_seqno)
+	 * belonging to this operation. */
+	rl_uint32 seqno_count;
+
+	/* Non-zero if error answers should go to the completion callback rather
+	 * than failing the operation right away. */
+	int callback_handles_errors;
+
 	/* The next pending operation in the chain. */
 	struct rl_pending_operation_tag *next;
 
@@ -103,6 +180,7 @@ typedef struct rl_pending_operation_tag
 		rl_pending_stat_t stat;
 		rl_pending_read_t read;
 		rl_pending_write_t write;
+		rl_pending_examine_t examine;
 	} detail;
 
 } rl_pending_operation_t;
@@ -127,6 +205,15 @@ typedef struct rl_amigafs_tag
 
 	/* Our root handle for the device. */
 	rl_client_handle_t				root_handle;
+
+	/* Link measurements used to size read windows. */
+	rl_readwin_estimator_t			read_estimator;
+
+	/* Cache of file data, checked before reads go to the network. */
+	rl_blockcache_t					*block_cache;
+
+	/* The cache's id for the file the controller is pushing, if any. */
+	rl_uint32						pushed_file;
 } rl_amigafs_t;
 
 
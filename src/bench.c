@@ -0,0 +1,185 @@
+#include "config.h"
+#include "util.h"
+#include "readwin.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Host benchmarks for the modules that do no I/O of their own. Each bench_*
+ * function times one module and prints what a single operation costs.
+ */
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/* Pipelined reads */
+
+/*
+ * The cost of a pipelined read per segment: reads of [segments] segments of
+ * [segment_size] bytes are requested and answered newest first, so they
+ * complete out of order, and the data is copied into place as the target
+ * does. Small segments show the bookkeeping alone.
+ */
+static void
+bench_readwin(rl_uint32 segment_size, rl_uint32 segments, int reads)
+{
+	static rl_uint8 destination[64 * 16384];
+	static rl_uint8 data[16384];
+	rl_readwin_estimator_t est;
+	rl_uint32 now = 0;
+	double start;
+	int i;
+
+	rl_readwin_estimator_init(&est, 8);
+
+	start = now_ns();
+	for (i = 0; i < reads; ++i)
+	{
+		rl_readwin_t win;
+		rl_uint32 outstanding[64];
+		rl_uint32 count = 0;
+
+		if (0 != rl_readwin_begin(&win, &est, destination, 0, segments * segment_size, segment_size, now))
+			return;
+
+		while (!rl_readwin_finished(&win))
+		{
+			rl_uint32 segment, offset, length;
+
+			while (rl_readwin_next(&win, now, &segment, &offset, &length))
+				outstanding[count++] = segment;
+
+			now += 2;
+			--count;
+			rl_readwin_deliver(&win, outstanding[count], data, length, 1, now);
+		}
+
+		rl_readwin_end(&win, now);
+	}
+
+	printf("readwin: %5u byte segments, %2u per read: %7.1f ns per segment\n",
+			segment_size, segments, (now_ns() - start) / ((double) reads * segments));
+}
+
+/* What copying a segment costs on its own, for comparison. */
+static void
+bench_copy(rl_uint32 segment_size, int count)
+{
+	static rl_uint8 destination[64 * 16384];
+	static rl_uint8 data[16384];
+	double start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < count; ++i)
+		rl_memcpy(destination + (i % 64) * segment_size, data, segment_size);
+
+	printf("memcpy:  %5u bytes: %7.1f ns\n", segment_size, (now_ns() - start) / count);
+}
+
+/* Hash tables */
+
+#define BENCH_MAX_KEYS (4096)
+
+static char bench_keys[2 * BENCH_MAX_KEYS][32];
+
+/* Paths like the ones handles are on; the second half aren't inserted. */
+static void
+make_keys(void)
+{
+	int i;
+
+	for (i = 0; i < 2 * BENCH_MAX_KEYS; ++i)
+		rl_format_msg(bench_keys[i], sizeof(bench_keys[i]), "/home/amiga/libs/file%d.library", i);
+}
+
+/*
+ * The cost of looking up string keys in a table of [count], [lookups] times,
+ * hits and misses separately.
+ */
+static void
+bench_dict(int count, int lookups)
+{
+	rl_dict_t dict;
+	double start, hit, miss;
+	int i, found = 0;
+
+	if (0 != rl_dict_init(&dict, 0, 0, NULL, NULL, NULL))
+		return;
+
+	for (i = 0; i < count; ++i)
+		rl_dict_insert(&dict, bench_keys[i], bench_keys[i]);
+
+	start = now_ns();
+	for (i = 0; i < lookups; ++i)
+		found += NULL != rl_dict_find(&dict, bench_keys[(i * 7) % count]);
+	hit = (now_ns() - start) / lookups;
+
+	start = now_ns();
+	for (i = 0; i < lookups; ++i)
+		found += NULL != rl_dict_find(&dict, bench_keys[BENCH_MAX_KEYS + (i * 7) % count]);
+	miss = (now_ns() - start) / lookups;
+
+	printf("dict:    %4d keys: %7.1f ns per hit, %7.1f ns per miss%s\n",
+			count, hit, miss, found == lookups ? "" : " (wrong results)");
+
+	rl_dict_destroy(&dict);
+}
+
+/* The same lookups as a scan comparing every key, for comparison. */
+static void
+bench_scan(int count, int lookups)
+{
+	double start;
+	int i, j, found = 0;
+
+	start = now_ns();
+	for (i = 0; i < lookups; ++i)
+	{
+		const char * const key = bench_keys[(i * 7) % count];
+
+		for (j = 0; j < count; ++j)
+		{
+			if (0 == strcmp(bench_keys[j], key))
+			{
+				++found;
+				break;
+			}
+		}
+	}
+
+	printf("scan:    %4d keys: %7.1f ns per hit%s\n",
+			count, (now_ns() - start) / lookups, found == lookups ? "" : " (wrong results)");
+}
+
+int main(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	if (0 != rl_init_alloc())
+		return 1;
+
+	bench_readwin(64, 16, 200000);
+	bench_readwin(64, 64, 50000);
+	bench_readwin(16384, 16, 5000);
+	bench_copy(16384, 100000);
+
+	make_keys();
+	bench_dict(16, 2000000);
+	bench_dict(256, 2000000);
+	bench_dict(4096, 2000000);
+	bench_scan(16, 2000000);
+	bench_scan(256, 200000);
+	bench_scan(4096, 20000);
+
+	rl_fini_alloc();
+	return 0;
+}
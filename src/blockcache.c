@@ -0,0 +1,566 @@
+#include "blockcache.h"
+
+static rl_uint32
+bucket_of(rl_uint32 file_id, rl_uint32 index)
+{
+	return (file_id * 31 + index) & (RL_BLOCKCACHE_BUCKETS - 1);
+}
+
+static rl_uint32
+content_bucket_of(rl_uint32 hash_lo)
+{
+	/* The hashes are well mixed already. */
+	return hash_lo & (RL_BLOCKCACHE_BUCKETS - 1);
+}
+
+static rl_blockcache_file_t *
+find_file(rl_blockcache_t *cache, rl_uint32 file_id)
+{
+	return (rl_blockcache_file_t *) rl_dict_find(&cache->files_by_id, &file_id);
+}
+
+static void
+set_hashes(rl_blockcache_file_t *file, const rl_uint8 *hashes, rl_uint32 hash_count)
+{
+	rl_uint32 i;
+
+	if (file->hashes)
+		rl_free_sized(file->hashes, file->hash_count * 2 * sizeof(rl_uint32));
+
+	file->hashes = NULL;
+	file->hash_count = 0;
+
+	if (0 == hash_count || NULL == hashes)
+		return;
+
+	/* Without them blocks are only found by position. */
+	if (NULL == (file->hashes = (rl_uint32 *) rl_alloc_sized(hash_count * 2 * sizeof(rl_uint32))))
+		return;
+
+	for (i = 0; i < hash_count * 2; ++i, hashes += 4)
+	{
+		file->hashes[i] = ((rl_uint32) hashes[0] << 24) | ((rl_uint32) hashes[1] << 16) |
+			((rl_uint32) hashes[2] << 8) | hashes[3];
+	}
+
+	file->hash_count = hash_count;
+}
+
+static void
+drop_previous(rl_blockcache_file_t *file)
+{
+	if (file->prev_hashes)
+		rl_free_sized(file->prev_hashes, file->prev_hash_count * 2 * sizeof(rl_uint32));
+
+	file->prev_hashes = NULL;
+	file->prev_hash_count = 0;
+	file->prev_size = 0;
+}
+
+/* Keep the hashes of the file's current version as those of the previous
+ * one. */
+static void
+keep_previous(rl_blockcache_file_t *file)
+{
+	drop_previous(file);
+
+	file->prev_hashes = file->hashes;
+	file->prev_hash_count = file->hash_count;
+	file->prev_size = file->size;
+
+	file->hashes = NULL;
+	file->hash_count = 0;
+}
+
+static void
+free_file(void *ptr)
+{
+	rl_blockcache_file_t * const file = (rl_blockcache_file_t *) ptr;
+	set_hashes(file, NULL, 0);
+	drop_previous(file);
+	RL_FREE_TYPED(rl_blockcache_file_t, file);
+}
+
+/* Length of the block at [index], or 0 if it's past the end of the file. */
+static rl_uint32
+block_length(const rl_blockcache_file_t *file, rl_uint32 index)
+{
+	const rl_uint32 offset = index * RL_BLOCKCACHE_BLOCK_SIZE;
+
+	if (offset >= file->size)
+		return 0;
+
+	return RL_MIN_MACRO(file->size - offset, RL_BLOCKCACHE_BLOCK_SIZE);
+}
+
+/* Forget files from earlier sessions that have nothing cached. */
+static int
+is_stale_file(const void *key, void *value, void *context)
+{
+	rl_blockcache_t * const cache = (rl_blockcache_t *) context;
+	rl_blockcache_file_t * const file = (rl_blockcache_file_t *) value;
+
+	(void) key;
+
+	if (0 != file->block_count || file->session == cache->session)
+		return 0;
+
+	/* The id table owns the file. */
+	rl_dict_erase(&cache->files_by_id, &file->id);
+	return 1;
+}
+
+static void
+lru_unlink(rl_blockcache_t *cache, rl_blockcache_block_t *block)
+{
+	if (block->lru_prev)
+		block->lru_prev->lru_next = block->lru_next;
+	else
+		cache->lru_head = block->lru_next;
+
+	if (block->lru_next)
+		block->lru_next->lru_prev = block->lru_prev;
+	else
+		cache->lru_tail = block->lru_prev;
+
+	block->lru_prev = block->lru_next = NULL;
+}
+
+static void
+lru_push_front(rl_blockcache_t *cache, rl_blockcache_block_t *block)
+{
+	block->lru_prev = NULL;
+	block->lru_next = cache->lru_head;
+
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = block;
+	else
+		cache->lru_tail = block;
+
+	cache->lru_head = block;
+}
+
+static void
+hash_unlink(rl_blockcache_t *cache, rl_blockcache_block_t *block)
+{
+	rl_blockcache_block_t **link = &cache->buckets[bucket_of(block->file_id, block->index)];
+
+	while (*link != block)
+		link = &(*link)->hash_next;
+
+	*link = block->hash_next;
+	block->hash_next = NULL;
+}
+
+static void
+content_unlink(rl_blockcache_t *cache, rl_blockcache_block_t *block)
+{
+	rl_blockcache_block_t **link = &cache->content_buckets[content_bucket_of(block->hash_lo)];
+
+	while (*link != block)
+		link = &(*link)->content_next;
+
+	*link = block->content_next;
+	block->content_next = NULL;
+}
+
+static void
+content_link(rl_blockcache_t *cache, rl_blockcache_block_t *block, rl_uint32 hash_hi, rl_uint32 hash_lo)
+{
+	rl_blockcache_block_t **bucket = &cache->content_buckets[content_bucket_of(hash_lo)];
+
+	block->hashed = 1;
+	block->hash_hi = hash_hi;
+	block->hash_lo = hash_lo;
+	block->content_next = *bucket;
+	*bucket = block;
+}
+
+/* Let go of a block that belongs to a file, leaving it only to be found by
+ * content. */
+static void
+orphan_block(rl_blockcache_t *cache, rl_blockcache_block_t *block)
+{
+	rl_blockcache_file_t *file;
+
+	hash_unlink(cache, block);
+
+	if (NULL != (file = find_file(cache, block->file_id)))
+		--file->block_count;
+
+	block->file_id = RL_BLOCKCACHE_NO_FILE;
+}
+
+/* Take a block out of the cache, leaving its memory to the caller. */
+static void
+detach_block(rl_blockcache_t *cache, rl_blockcache_block_t *block)
+{
+	lru_unlink(cache, block);
+
+	if (RL_BLOCKCACHE_NO_FILE != block->file_id)
+		orphan_block(cache, block);
+
+	if (block->hashed)
+		content_unlink(cache, block);
+
+	block->hashed = 0;
+	--cache->block_count;
+}
+
+static rl_blockcache_block_t *
+find_block(rl_blockcache_t *cache, rl_uint32 file_id, rl_uint32 index)
+{
+	rl_blockcache_block_t *block = cache->buckets[bucket_of(file_id, index)];
+
+	while (block)
+	{
+		if (block->file_id == file_id && block->index == index)
+			return block;
+		block = block->hash_next;
+	}
+
+	return NULL;
+}
+
+/* The block holding [length] bytes with the given hash, if any. */
+static rl_blockcache_block_t *
+find_content(rl_blockcache_t *cache, rl_uint32 hash_hi, rl_uint32 hash_lo, rl_uint32 length)
+{
+	rl_blockcache_block_t *block = cache->content_buckets[content_bucket_of(hash_lo)];
+
+	while (block)
+	{
+		if (block->hash_lo == hash_lo && block->hash_hi == hash_hi && block->length == length)
+			return block;
+		block = block->content_next;
+	}
+
+	return NULL;
+}
+
+/* The cached copy of the contents the file's block at [index] is known to
+ * have, if any. */
+static rl_blockcache_block_t *
+find_block_content(rl_blockcache_t *cache, const rl_blockcache_file_t *file, rl_uint32 index)
+{
+	if (index >= file->hash_count)
+		return NULL;
+
+	return find_content(cache, file->hashes[index * 2], file->hashes[index * 2 + 1], block_length(file, index));
+}
+
+void
+rl_blockcache_init(rl_blockcache_t *cache, rl_uint32 budget)
+{
+	rl_memset(cache, 0, sizeof(*cache));
+	cache->max_blocks = budget / RL_BLOCKCACHE_BLOCK_SIZE;
+	cache->next_file_id = RL_BLOCKCACHE_NO_FILE + 1;
+
+	if (0 != rl_dict_init(&cache->files_by_path, 0, 0, NULL, NULL, NULL) ||
+		0 != rl_dict_init(&cache->files_by_id, 0, sizeof(rl_uint32), NULL, NULL, free_file))
+	{
+		cache->max_blocks = 0;
+	}
+}
+
+void
+rl_blockcache_destroy(rl_blockcache_t *cache)
+{
+	rl_blockcache_block_t *block = cache->lru_head;
+
+	while (block)
+	{
+		rl_blockcache_block_t *next = block->lru_next;
+		RL_FREE_TYPED(rl_blockcache_block_t, block);
+		block = next;
+	}
+
+	rl_dict_destroy(&cache->files_by_path);
+	rl_dict_destroy(&cache->files_by_id);
+
+	rl_memset(cache, 0, sizeof(*cache));
+}
+
+void
+rl_blockcache_new_session(rl_blockcache_t *cache)
+{
+	++cache->session;
+}
+
+rl_uint32
+rl_blockcache_open_file(
+	rl_blockcache_t *cache,
+	const char *path,
+	rl_uint32 size,
+	rl_uint32 stamp,
+	const rl_uint8 *hashes,
+	rl_uint32 hash_count)
+{
+	rl_blockcache_file_t *file;
+
+	if (0 == cache->max_blocks || rl_strlen(path) >= RL_BLOCKCACHE_MAX_PATH)
+		return RL_BLOCKCACHE_NO_FILE;
+
+	if (NULL != (file = (rl_blockcache_file_t *) rl_dict_find(&cache->files_by_path, path)))
+	{
+		if (file->size != size || file->stamp != stamp)
+		{
+			RL_LOG_DEBUG(("block cache: %s changed, dropping %u blocks", path, file->block_count));
+			rl_blockcache_invalidate_file(cache, file->id);
+			keep_previous(file);
+			file->size = size;
+			file->stamp = stamp;
+		}
+	}
+	else
+	{
+		rl_dict_erase_if(&cache->files_by_path, is_stale_file, cache);
+
+		if (NULL == (file = RL_ALLOC_TYPED_ZERO(rl_blockcache_file_t)))
+			return RL_BLOCKCACHE_NO_FILE;
+
+		file->id = cache->next_file_id++;
+		if (RL_BLOCKCACHE_NO_FILE == cache->next_file_id)
+			++cache->next_file_id;
+
+		file->size = size;
+		file->stamp = stamp;
+		rl_string_copy(sizeof(file->path), file->path, path);
+
+		if (0 != rl_dict_insert(&cache->files_by_id, &file->id, file))
+		{
+			free_file(file);
+			return RL_BLOCKCACHE_NO_FILE;
+		}
+
+		if (0 != rl_dict_insert(&cache->files_by_path, file->path, file))
+		{
+			rl_dict_erase(&cache->files_by_id, &file->id);
+			return RL_BLOCKCACHE_NO_FILE;
+		}
+	}
+
+	set_hashes(file, hashes, hash_count);
+	file->session = cache->session;
+	return file->id;
+}
+
+void
+rl_blockcache_invalidate_file(rl_blockcache_t *cache, rl_uint32 file_id)
+{
+	rl_blockcache_block_t *block = cache->lru_head;
+
+	while (block)
+	{
+		rl_blockcache_block_t *next = block->lru_next;
+
+		if (block->file_id == file_id && block->hashed)
+		{
+			orphan_block(cache, block);
+		}
+		else if (block->file_id == file_id)
+		{
+			detach_block(cache, block);
+			RL_FREE_TYPED(rl_blockcache_block_t, block);
+			++cache->stats.invalidations;
+		}
+
+		block = next;
+	}
+}
+
+const rl_uint8 *
+rl_blockcache_lookup(rl_blockcache_t *cache, rl_uint32 file_id, rl_uint32 index, rl_uint32 *length_out)
+{
+	rl_blockcache_block_t *block;
+
+	if (RL_BLOCKCACHE_NO_FILE == file_id)
+		return NULL;
+
+	if (NULL == (block = find_block(cache, file_id, index)))
+	{
+		rl_blockcache_file_t *file;
+
+		if (NULL == (file = find_file(cache, file_id)) ||
+			NULL == (block = find_block_content(cache, file, index)))
+		{
+			++cache->stats.misses;
+			return NULL;
+		}
+
+		++cache->stats.shared_hits;
+	}
+
+	++cache->stats.hits;
+
+	if (cache->lru_head != block)
+	{
+		lru_unlink(cache, block);
+		lru_push_front(cache, block);
+	}
+
+	*length_out = block->length;
+	return block->data;
+}
+
+int
+rl_blockcache_contains(rl_blockcache_t *cache, rl_uint32 file_id, rl_uint32 index)
+{
+	rl_blockcache_file_t *file;
+
+	if (RL_BLOCKCACHE_NO_FILE == file_id || NULL == (file = find_file(cache, file_id)))
+		return 0;
+
+	return NULL != find_block(cache, file_id, index) || NULL != find_block_content(cache, file, index);
+}
+
+rl_uint32
+rl_blockcache_previous_count(rl_blockcache_t *cache, rl_uint32 file_id)
+{
+	rl_blockcache_file_t *file;
+
+	if (RL_BLOCKCACHE_NO_FILE == file_id || NULL == (file = find_file(cache, file_id)))
+		return 0;
+
+	return RL_MIN_MACRO(file->prev_hash_count, file->prev_size / RL_BLOCKCACHE_BLOCK_SIZE);
+}
+
+const rl_uint8 *
+rl_blockcache_previous_block(rl_blockcache_t *cache, rl_uint32 file_id, rl_uint32 index, rl_uint32 hash_out[2])
+{
+	rl_blockcache_block_t *block;
+	rl_blockcache_file_t *file;
+
+	if (index >= rl_blockcache_previous_count(cache, file_id))
+		return NULL;
+
+	file = find_file(cache, file_id);
+	hash_out[0] = file->prev_hashes[index * 2];
+	hash_out[1] = file->prev_hashes[index * 2 + 1];
+
+	if (NULL == (block = find_content(cache, hash_out[0], hash_out[1], RL_BLOCKCACHE_BLOCK_SIZE)))
+		return NULL;
+
+	return block->data;
+}
+
+void
+rl_blockcache_drop_previous(rl_blockcache_t *cache, rl_uint32 file_id)
+{
+	rl_blockcache_file_t *file;
+
+	if (RL_BLOCKCACHE_NO_FILE != file_id && NULL != (file = find_file(cache, file_id)))
+		drop_previous(file);
+}
+
+const rl_uint8 *
+rl_blockcache_lookup_hash(rl_blockcache_t *cache, rl_uint32 hash_hi, rl_uint32 hash_lo)
+{
+	rl_blockcache_block_t *block;
+
+	if (NULL == (block = find_content(cache, hash_hi, hash_lo, RL_BLOCKCACHE_BLOCK_SIZE)))
+		return NULL;
+
+	if (cache->lru_head != block)
+	{
+		lru_unlink(cache, block);
+		lru_push_front(cache, block);
+	}
+
+	return block->data;
+}
+
+static void
+insert_block(rl_blockcache_t *cache, rl_blockcache_file_t *file, rl_uint32 index, const rl_uint8 *data, rl_uint32 length)
+{
+	rl_blockcache_block_t *block;
+	const int hashed = index < file->hash_count;
+
+	if (NULL != (block = find_block(cache, file->id, index)))
+	{
+		lru_unlink(cache, block);
+	}
+	else if (hashed && NULL != (block = find_block_content(cache, file, index)))
+	{
+		/* Already here under another name. */
+		lru_unlink(cache, block);
+		lru_push_front(cache, block);
+		return;
+	}
+	else
+	{
+		if (cache->block_count >= cache->max_blocks)
+		{
+			/* Recycle the least recently used block. */
+			block = cache->lru_tail;
+			detach_block(cache, block);
+			++cache->stats.evictions;
+		}
+		else if (NULL == (block = RL_ALLOC_TYPED(rl_blockcache_block_t)))
+		{
+			return;
+		}
+
+		block->file_id = file->id;
+		block->index = index;
+		block->lru_prev = block->lru_next = NULL;
+		block->hashed = 0;
+
+		block->hash_next = cache->buckets[bucket_of(file->id, index)];
+		cache->buckets[bucket_of(file->id, index)] = block;
+
+		++file->block_count;
+		++cache->block_count;
+		++cache->stats.insertions;
+	}
+
+	rl_memcpy(block->data, data, length);
+	block->length = length;
+	lru_push_front(cache, block);
+
+	if (hashed && !block->hashed && length == block_length(file, index))
+		content_link(cache, block, file->hashes[index * 2], file->hashes[index * 2 + 1]);
+}
+
+void
+rl_blockcache_store(
+	rl_blockcache_t *cache,
+	rl_uint32 file_id,
+	rl_uint32 file_size,
+	rl_uint32 offset,
+	const void *data,
+	rl_uint32 length)
+{
+	const rl_uint8 *bytes = (const rl_uint8 *) data;
+	rl_blockcache_file_t *file;
+	rl_uint32 skip;
+
+	if (RL_BLOCKCACHE_NO_FILE == file_id || 0 == length)
+		return;
+
+	if (NULL == (file = find_file(cache, file_id)))
+		return;
+
+	/* Skip ahead to the first block boundary. */
+	skip = (RL_BLOCKCACHE_BLOCK_SIZE - offset % RL_BLOCKCACHE_BLOCK_SIZE) % RL_BLOCKCACHE_BLOCK_SIZE;
+	if (skip >= length)
+		return;
+
+	bytes += skip;
+	offset += skip;
+	length -= skip;
+
+	while (length > 0)
+	{
+		rl_uint32 chunk = RL_MIN_MACRO(length, RL_BLOCKCACHE_BLOCK_SIZE);
+
+		if (chunk < RL_BLOCKCACHE_BLOCK_SIZE && offset + chunk != file_size)
+			break;
+
+		insert_block(cache, file, offset / RL_BLOCKCACHE_BLOCK_SIZE, bytes, chunk);
+
+		bytes += chunk;
+		offset += chunk;
+		length -= chunk;
+	}
+}
@@ -0,0 +1,193 @@
+#ifndef RLAUNCH_BLOCKCACHE_H
+#define RLAUNCH_BLOCKCACHE_H
+
+#include "util.h"
+
+/*
+ * Block cache for remote file data.
+ *
+ * File contents are cached in fixed-size blocks keyed by (file, block index)
+ * and evicted least recently used first once the memory budget is reached.
+ *
+ * Files are identified by path, and remember the size and modification stamp
+ * the server reported when they were last opened. Reopening a file with a
+ * different size or stamp drops its blocks. A file's blocks are only served
+ * once the file has been opened in the current session, so a new session
+ * never sees data it hasn't revalidated.
+ *
+ * When the server names a file's blocks by the hashes of their contents,
+ * blocks are also found by hash: a block read through one file serves any
+ * other with the same contents, and blocks of a file that changed are kept
+ * for as long as the budget allows, in case the new version still has them.
+ * Blocks with the same contents are only stored once.
+ *
+ * A file that changed also remembers the hashes of its previous version, so
+ * that the blocks of it still cached can be described to the server, which
+ * may send the new version as a delta against them.
+ */
+
+#define RL_BLOCKCACHE_BLOCK_SIZE (4096)
+#define RL_BLOCKCACHE_MAX_PATH (108)
+#define RL_BLOCKCACHE_BUCKETS (256)
+
+/* Size of the block hashes taken by rl_blockcache_open_file(). */
+#define RL_BLOCKCACHE_HASH_SIZE (8)
+
+/* File id that never has any cached blocks. */
+#define RL_BLOCKCACHE_NO_FILE (0)
+
+typedef struct rl_blockcache_stats_tag
+{
+	rl_uint32 hits;
+	rl_uint32 misses;
+	rl_uint32 insertions;
+	rl_uint32 evictions;
+	rl_uint32 invalidations;
+
+	/* Hits on blocks read through another file, or an earlier version */
+	rl_uint32 shared_hits;
+} rl_blockcache_stats_t;
+
+typedef struct rl_blockcache_block_tag
+{
+	/* LRU chain, most recently used first. */
+	struct rl_blockcache_block_tag *lru_prev;
+	struct rl_blockcache_block_tag *lru_next;
+
+	/* Hash bucket chain. */
+	struct rl_blockcache_block_tag *hash_next;
+
+	/* Content bucket chain, for blocks whose hash is known. */
+	struct rl_blockcache_block_tag *content_next;
+	rl_uint32 hash_hi;
+	rl_uint32 hash_lo;
+	int hashed;
+
+	/* RL_BLOCKCACHE_NO_FILE once the file has changed; such blocks are
+	 * only found by content. */
+	rl_uint32 file_id;
+	rl_uint32 index;
+
+	/* Valid bytes; less than a block only for the last block of a file. */
+	rl_uint32 length;
+
+	rl_uint8 data[RL_BLOCKCACHE_BLOCK_SIZE];
+} rl_blockcache_block_t;
+
+typedef struct rl_blockcache_file_tag
+{
+	rl_uint32 id;
+	rl_uint32 size;
+	rl_uint32 stamp;
+
+	/* Session the file was last validated in. */
+	rl_uint32 session;
+
+	/* Number of cached blocks belonging to the file. */
+	rl_uint32 block_count;
+
+	/* Content hashes of the first [hash_count] blocks, high and low words
+	 * in turn, if the server sent them. */
+	rl_uint32 *hashes;
+	rl_uint32 hash_count;
+
+	/* Likewise for the version before the file last changed. */
+	rl_uint32 *prev_hashes;
+	rl_uint32 prev_hash_count;
+	rl_uint32 prev_size;
+
+	char path[RL_BLOCKCACHE_MAX_PATH];
+} rl_blockcache_file_t;
+
+typedef struct rl_blockcache_tag
+{
+	rl_uint32 max_blocks;
+	rl_uint32 block_count;
+
+	rl_blockcache_block_t *buckets[RL_BLOCKCACHE_BUCKETS];
+	rl_blockcache_block_t *content_buckets[RL_BLOCKCACHE_BUCKETS];
+	rl_blockcache_block_t *lru_head;
+	rl_blockcache_block_t *lru_tail;
+
+	/* rl_blockcache_file_t by path and by id */
+	rl_dict_t files_by_path;
+	rl_dict_t files_by_id;
+	rl_uint32 next_file_id;
+	rl_uint32 session;
+
+	rl_blockcache_stats_t stats;
+} rl_blockcache_t;
+
+/* Set up a cache using at most [budget] bytes of block data. A budget
+ * smaller than a block (or running out of memory here) disables caching. */
+void
+rl_blockcache_init(rl_blockcache_t *cache, rl_uint32 budget);
+
+void
+rl_blockcache_destroy(rl_blockcache_t *cache);
+
+/* Start a new session. Files must be reopened before their blocks are
+ * served again. */
+void
+rl_blockcache_new_session(rl_blockcache_t *cache);
+
+/* Register an opened file and return its id. Cached blocks are kept if
+ * [size] and [stamp] match what was seen before. [hashes] names the contents
+ * of the file's first [hash_count] blocks, RL_BLOCKCACHE_HASH_SIZE bytes
+ * each, most significant first; it may be NULL. Returns
+ * RL_BLOCKCACHE_NO_FILE if the file can't be tracked. */
+rl_uint32
+rl_blockcache_open_file(
+	rl_blockcache_t *cache,
+	const char *path,
+	rl_uint32 size,
+	rl_uint32 stamp,
+	const rl_uint8 *hashes,
+	rl_uint32 hash_count);
+
+/* Drop all blocks of a file. Blocks with a known hash are only let go of,
+ * and still serve other files with the same contents. */
+void
+rl_blockcache_invalidate_file(rl_blockcache_t *cache, rl_uint32 file_id);
+
+/* Look up a block, by its contents if the file's copy isn't cached. Returns
+ * its data and sets [*length_out], or returns NULL on a miss. */
+const rl_uint8 *
+rl_blockcache_lookup(rl_blockcache_t *cache, rl_uint32 file_id, rl_uint32 index, rl_uint32 *length_out);
+
+/* Non-zero if the block is cached. Unlike a lookup this doesn't count as a
+ * use. */
+int
+rl_blockcache_contains(rl_blockcache_t *cache, rl_uint32 file_id, rl_uint32 index);
+
+/* Number of whole blocks of the file's previous version with known
+ * contents. */
+rl_uint32
+rl_blockcache_previous_count(rl_blockcache_t *cache, rl_uint32 file_id);
+
+/* Data of the previous version's block at [index] if it's still cached,
+ * with its hash in [hash_out], high word first. Doesn't count as a use. */
+const rl_uint8 *
+rl_blockcache_previous_block(rl_blockcache_t *cache, rl_uint32 file_id, rl_uint32 index, rl_uint32 hash_out[2]);
+
+/* Forget the hashes of the file's previous version. */
+void
+rl_blockcache_drop_previous(rl_blockcache_t *cache, rl_uint32 file_id);
+
+/* Look up a whole block by the hash of its contents. */
+const rl_uint8 *
+rl_blockcache_lookup_hash(rl_blockcache_t *cache, rl_uint32 hash_hi, rl_uint32 hash_lo);
+
+/* Insert the blocks covered by [length] bytes of file data read at
+ * [offset]. Only whole blocks are stored, plus a partial last block when the
+ * data ends at [file_size]. */
+void
+rl_blockcache_store(
+	rl_blockcache_t *cache,
+	rl_uint32 file_id,
+	rl_uint32 file_size,
+	rl_uint32 offset,
+	const void *data,
+	rl_uint32 length);
+
+#endif
@@ -4,10 +4,13 @@
 #include "peer.h"
 #include "rlnet.h"
 #include "socket_includes.h"
+#include "evloop.h"
 #include "controller.h"
+#include "packcache.h"
 #include "version.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef RL_POSIX
@@ -44,6 +47,10 @@ static int on_connected(peer_t *peer)
 	if (0 == peer_transmit_message(peer, &msg))
 	{
 		self->state = CONTROLLER_WAIT_EXECUTABLE_LAUNCHED;
+
+		/* The executable follows right behind, so loading it needn't wait
+		 * for the target to ask. */
+		rl_file_server_push(peer);
 		return 0;
 	}
 	else
@@ -88,7 +95,13 @@ static int on_message_received(peer_t *peer, const rl_msg_t *msg)
 	return 0;
 }
 
-static const peer_callbacks_t controller_callbacks = { on_message_received, on_connected };
+static rl_uint32 compress_frame(peer_t *peer, const rl_uint8 *data, rl_uint32 length, rl_uint8 *out, rl_uint32 out_size)
+{
+	rl_controller_t *self = (rl_controller_t*) peer->userdata;
+	return rl_packcache_compress(self->packcache, data, length, out, out_size, NULL);
+}
+
+static const peer_callbacks_t controller_callbacks = { on_message_received, on_connected, compress_frame };
 
 static peer_t *connect_to_target(const char* machine, const char* port)
 {
@@ -176,23 +189,8 @@ static peer_t *connect_to_target(const char* machine, const char* port)
 				goto cleanup;
       }
 
-      /* Switch back to blocking mode */
-#if defined(RL_POSIX)
-      if (0 != fcntl(sock, F_SETFL, fd_opts))
-      {
-        RL_LOG_CONSOLE(("couldn't switch socket back to blocking"));
-				goto cleanup;
-      }
-#elif defined(RL_WIN32)
-      ioctl_arg = 0;
-      if (0 != ioctlsocket(sock, FIONBIO, &ioctl_arg))
-      {
-        RL_LOG_CONSOLE(("couldn't switch socket back to blocking"));
-        goto cleanup;
-      }
-#else
-#error unknown platform
-#endif
+      /* The socket stays non-blocking; the event loop services it until it
+       * would block. */
     }
     else if (0 != connect_rc)
     {
@@ -234,7 +232,10 @@ static const char * const usage_string =
 "\n\nA networked programming testing and development solution for the Amiga.\n"
 "\n"
 "Usage:\n"
-" rl-controller [-fsroot <r>] [-port <#>] [-log <..>] <host> <exe_path> [args]\n"
+" rl-controller [-fsroot <r>] [-port <#>] [-threads <#>] [-uring]\n"
+"               [-nostatcache] [-noindex] [-maxfiles <#>]\n"
+"               [-compress <off|on|auto>] [-push <KiB>] [-log <..>]\n"
+"               <host> <exe_path> [args]\n"
 "\n"
 "Arguments:\n"
 "  <host>         Hostname to connect to (mandatory)\n"
@@ -251,6 +252,34 @@ static const char * const usage_string =
 "\n"
 "  -port          The TCP port to connect to (default: 7001)\n"
 "\n"
+"  -uring         Send and read file data through io_uring (Linux 5.7+),\n"
+"                 falling back to regular I/O where it's unavailable.\n"
+"\n"
+"  -threads       Number of threads doing file system work, so that slow\n"
+"                 disks don't hold up other requests. 0 does all file\n"
+"                 serving on the network thread. (default: 4)\n"
+"\n"
+"  -nostatcache   Look up every file on disk instead of remembering what\n"
+"                 was found (and not found) until it changes (Linux).\n"
+"\n"
+"  -noindex       Only find files whose names are capitalized the way\n"
+"                 they are on disk, instead of indexing fsroot in the\n"
+"                 background and matching names without regard to case\n"
+"                 (Linux).\n"
+"\n"
+"  -maxfiles      Number of files and directories the target's handles\n"
+"                 keep open on the host; less recently used ones are\n"
+"                 reopened as needed (POSIX). (default: 64)\n"
+"\n"
+"  -compress      When to compress data sent to the target: 'on' always,\n"
+"                 'auto' only while it pays off, 'off' never. Compressed\n"
+"                 data is kept for sending again. (default: auto)\n"
+"\n"
+"  -push          KiB of the executable to send along with the launch\n"
+"                 request, read while connecting, so the target has them\n"
+"                 before it starts loading. 0 disables it (POSIX, at most\n"
+"                 1024). (default: 256)\n"
+"\n"
 "  -log           Specifies log levels (default: 'c')\n"
 "                 0: disable everything    a: everything\n"
 "                 d: debug channel         i: info channel\n"
@@ -259,44 +288,120 @@ static const char * const usage_string =
 
 static int pump_peer_state_machine(peer_t *peer)
 {
+	rl_controller_t *ctrl = (rl_controller_t*) peer->userdata;
+	int result = 0;
 	int peer_status = 0;
-	int first_update = 1;
+	int interest = RL_EVLOOP_READ | RL_EVLOOP_WRITE | RL_EVLOOP_EDGE;
+	const int wakeup_fd = rl_file_server_wakeup_fd(ctrl);
+	const int change_fd = rl_file_server_change_fd(ctrl);
+	const int index_fd = rl_file_server_index_fd(ctrl);
+#if defined(RL_LINUX)
+	const int uring_fd = rl_transport_uring_fd(&peer->transport);
+#else
+	const int uring_fd = -1;
+#endif
+	rl_evloop_t loop;
 
-    do
+	if (0 != rl_evloop_init(&loop))
+		return -1;
+
+	/* Start out interested in writing to get the handshake going. */
+	if (0 != rl_evloop_add(&loop, peer->fd, interest, peer))
 	{
-		int select_status;
-		int max_fd = 0;
-		struct timeval timeout;
-        fd_set input_set, output_set;
+		result = -1;
+		goto cleanup;
+	}
 
-		FD_ZERO(&input_set);
-		FD_ZERO(&output_set);
+	/* Finished file system jobs are answered from here as well. */
+	if (-1 != wakeup_fd && 0 != rl_evloop_add(&loop, wakeup_fd, RL_EVLOOP_READ, ctrl))
+	{
+		result = -1;
+		goto cleanup;
+	}
 
-		FD_SET(peer->fd, &input_set);
-		if (first_update)
+	/* Changes to the served files are picked up here. */
+	if (-1 != change_fd && 0 != rl_evloop_add(&loop, change_fd, RL_EVLOOP_READ, &ctrl->statcache))
+	{
+		result = -1;
+		goto cleanup;
+	}
+
+	if (-1 != index_fd && 0 != rl_evloop_add(&loop, index_fd, RL_EVLOOP_READ, &ctrl->pathindex))
+	{
+		result = -1;
+		goto cleanup;
+	}
+
+	/* With io_uring, writes are finished from here too. */
+	if (-1 != uring_fd && 0 != rl_evloop_add(&loop, uring_fd, RL_EVLOOP_READ, &peer->transport))
+	{
+		result = -1;
+		goto cleanup;
+	}
+
+    do
+	{
+		rl_evloop_event_t events[5];
+		int num_events;
+		int ready = 0;
+		int wanted;
+		int i;
+
+		/* Don't sleep while there's input left to read, or streams to
+		 * carry on with. */
+		num_events = rl_evloop_wait(&loop, events, 5,
+				((PEER_STATUS_INPUT_PENDING & peer_status) || rl_file_server_streams_ready(peer)) ? 0 : 1000);
+		if (-1 == num_events)
 		{
-			FD_SET(peer->fd, &output_set);
-			first_update = 0;
+			result = -1;
+			break;
 		}
-		max_fd = (int) (peer->fd + 1);
 
-		if (PEER_STATUS_NEED_OUTPUT & peer_status)
+		for (i = 0; i < num_events; ++i)
 		{
-			FD_SET(peer->fd, &output_set);
+			if (peer == events[i].userdata)
+				ready |= events[i].events;
+#if defined(RL_LINUX)
+			else if (&peer->transport == events[i].userdata)
+				rl_transport_on_uring_ready(&peer->transport);
+#endif
+			else if (&ctrl->statcache == events[i].userdata || &ctrl->pathindex == events[i].userdata)
+				rl_file_server_process_changes(ctrl);
+			else
+				rl_file_server_complete(peer);
 		}
 
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
+		if (PEER_STATUS_INPUT_PENDING & peer_status)
+			ready |= RL_EVLOOP_READ;
+
+		/* Queued here, sent by the update. */
+		rl_file_server_continue_streams(peer);
+
+		peer_status = peer_update(peer, RL_EVLOOP_READ & ready, RL_EVLOOP_WRITE & ready);
 
-		select_status = select(max_fd, &input_set, &output_set, NULL, &timeout);
-		if (-1 == select_status)
-			return -1;
+		/* Only ask for write readiness while there's something to write,
+		 * and io_uring isn't waiting for it already. */
+		wanted = RL_EVLOOP_READ | RL_EVLOOP_EDGE;
+		if ((PEER_STATUS_NEED_OUTPUT & peer_status) && -1 == uring_fd)
+			wanted |= RL_EVLOOP_WRITE;
 
-		peer_status = peer_update(peer, FD_ISSET(peer->fd, &input_set), FD_ISSET(peer->fd, &output_set));
+		if (wanted != interest && 0 == rl_evloop_modify(&loop, peer->fd, wanted, peer))
+			interest = wanted;
 	}
 	while (0 == (PEER_STATUS_REMOVE_ME & peer_status));
 
-	return 0;
+cleanup:
+	if (-1 != uring_fd)
+		rl_evloop_remove(&loop, uring_fd);
+	if (-1 != index_fd)
+		rl_evloop_remove(&loop, index_fd);
+	if (-1 != change_fd)
+		rl_evloop_remove(&loop, change_fd);
+	if (-1 != wakeup_fd)
+		rl_evloop_remove(&loop, wakeup_fd);
+	rl_evloop_remove(&loop, peer->fd);
+	rl_evloop_destroy(&loop);
+	return result;
 }
 
 int main(int argc, char** argv)
@@ -306,6 +411,12 @@ int main(int argc, char** argv)
 	const char* peer_hostname = NULL;
 	const char* peer_port = "7001";
 	const char *fsroot = "";
+	int num_workers = RL_DEFAULT_FILE_WORKERS;
+	int use_uring = 0;
+	int cache_stats = 1;
+	int index_names = 1;
+	rl_uint32 push_size = RL_DEFAULT_PUSH_SIZE;
+	peer_compress_mode_t compress_mode = PEER_COMPRESS_ADAPTIVE;
 	rl_controller_t ctrl;
 
 	memset(&ctrl, 0, sizeof(ctrl));
@@ -329,6 +440,48 @@ int main(int argc, char** argv)
 				++i;
 				peer_port = next_arg;
 			}
+			else if (!options_done && 0 == strcmp("-threads", this_arg))
+			{
+				++i;
+				num_workers = atoi(next_arg);
+			}
+			else if (!options_done && 0 == strcmp("-uring", this_arg))
+			{
+				use_uring = 1;
+			}
+			else if (!options_done && 0 == strcmp("-nostatcache", this_arg))
+			{
+				cache_stats = 0;
+			}
+			else if (!options_done && 0 == strcmp("-noindex", this_arg))
+			{
+				index_names = 0;
+			}
+			else if (!options_done && 0 == strcmp("-maxfiles", this_arg))
+			{
+				++i;
+				ctrl.max_open_files = (rl_uint32) RL_MAX_MACRO(atoi(next_arg), 1);
+			}
+			else if (!options_done && 0 == strcmp("-compress", this_arg))
+			{
+				++i;
+				if (0 == strcmp("off", next_arg))
+					compress_mode = PEER_COMPRESS_OFF;
+				else if (0 == strcmp("on", next_arg))
+					compress_mode = PEER_COMPRESS_ON;
+				else if (0 == strcmp("auto", next_arg))
+					compress_mode = PEER_COMPRESS_ADAPTIVE;
+				else
+				{
+					RL_LOG_CONSOLE(("%s", usage_string));
+					goto cleanup;
+				}
+			}
+			else if (!options_done && 0 == strcmp("-push", this_arg))
+			{
+				++i;
+				push_size = (rl_uint32) RL_MIN_MACRO(RL_MAX_MACRO(atoi(next_arg), 0), RL_MAX_PUSH_SIZE / 1024) * 1024;
+			}
 			else if (!options_done && 0 == strcmp("-log", this_arg))
 			{
 				++i;
@@ -372,34 +525,48 @@ int main(int argc, char** argv)
 	ctrl.state = CONTROLLER_INITIAL;
 	ctrl.root_handle.type = RL_NODE_TYPE_DIRECTORY;
 
-	if (fsroot[0])
-	{
-		rl_string_copy(sizeof(ctrl.root_handle.native_path), ctrl.root_handle.native_path, fsroot);
-	}
-	else
+	if (0 != rl_file_server_init(&ctrl, num_workers, cache_stats))
+		RL_LOG_WARNING(("couldn't start file system workers; serving files inline"));
+
 	{
+		char root_path[RL_MAX_NATIVE_PATH];
+		size_t dirlen;
+
+		if (fsroot[0])
+		{
+			rl_string_copy(sizeof(root_path), root_path, fsroot);
+		}
+		else
+		{
 #ifdef RL_WIN32
-		GetCurrentDirectoryA(sizeof(ctrl.root_handle.native_path), ctrl.root_handle.native_path);
+			GetCurrentDirectoryA(sizeof(root_path), root_path);
 #else
-		getcwd(ctrl.root_handle.native_path, sizeof(ctrl.root_handle.native_path));
+			if (NULL == getcwd(root_path, sizeof(root_path)))
+				root_path[0] = '\0';
 #endif
-	}
+		}
 
-	/* make sure root path stored doesn't contain a path separator */
-	{
-		size_t dirlen = strlen(ctrl.root_handle.native_path);
-		
-		if (dirlen > 0 && ctrl.root_handle.native_path[dirlen-1] == NATIVE_PATH_TERMINATOR)
+		/* make sure root path stored doesn't contain a path separator */
+		dirlen = strlen(root_path);
+
+		if (dirlen > 0 && root_path[dirlen-1] == NATIVE_PATH_TERMINATOR)
 		{
-			ctrl.root_handle.native_path[dirlen-1] = '\0';
+			root_path[dirlen-1] = '\0';
 		}
+
+		/* Set up virtual input/output files. */
+		ctrl.vinput_handle.type = RL_NODE_TYPE_FILE;
+		ctrl.voutput_handle.type = RL_NODE_TYPE_FILE;
+
+		if (0 != rl_filehandle_set_path(&ctrl, &ctrl.root_handle, root_path) ||
+			0 != rl_filehandle_set_path(&ctrl, &ctrl.vinput_handle, "(virtual input)") ||
+			0 != rl_filehandle_set_path(&ctrl, &ctrl.voutput_handle, "(virtual output)"))
+			goto cleanup;
 	}
 
-	/* Set up virtual input/output files. */
-	ctrl.vinput_handle.type = RL_NODE_TYPE_FILE;
-	ctrl.voutput_handle.type = RL_NODE_TYPE_FILE;
-	rl_string_copy(sizeof(ctrl.vinput_handle.native_path), ctrl.vinput_handle.native_path, "(virtual input)");
-	rl_string_copy(sizeof(ctrl.voutput_handle.native_path), ctrl.voutput_handle.native_path, "(virtual output)");
+	/* The tree is walked by as many threads as serve files, if any. */
+	if (index_names)
+		rl_file_server_index(&ctrl, num_workers > 0 ? num_workers : RL_DEFAULT_FILE_WORKERS);
 #ifdef RL_WIN32
 	ctrl.vinput_handle.handle = GetStdHandle(STD_INPUT_HANDLE);
 	ctrl.voutput_handle.handle = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -408,11 +575,42 @@ int main(int argc, char** argv)
 	ctrl.voutput_handle.handle = 1;
 #endif
 
+	if (PEER_COMPRESS_OFF != compress_mode)
+	{
+		if (NULL != (ctrl.packcache = RL_ALLOC_TYPED(rl_packcache_t)) &&
+			0 != rl_packcache_init(ctrl.packcache, RL_PACKCACHE_BUDGET))
+		{
+			RL_FREE_TYPED(rl_packcache_t, ctrl.packcache);
+			ctrl.packcache = NULL;
+		}
+
+		if (!ctrl.packcache)
+		{
+			RL_LOG_WARNING(("out of memory for the compressed data cache; not compressing"));
+			compress_mode = PEER_COMPRESS_OFF;
+		}
+	}
+
+	/* Read the executable while the name resolves and the connection is
+	 * made. */
+	rl_file_server_preload(&ctrl, push_size);
+
 	/* establish a connection */
 	if (NULL == (peer = connect_to_target(peer_hostname, peer_port)))
 		goto cleanup;
 
 	peer->userdata = &ctrl;
+	peer->compress_mode = compress_mode;
+
+	if (use_uring)
+	{
+#if defined(RL_LINUX)
+		if (0 != rl_transport_enable_uring(&peer->transport, RL_CONTROLLER_URING_ENTRIES))
+			RL_LOG_CONSOLE(("io_uring unavailable; using regular socket writes"));
+#else
+		RL_LOG_CONSOLE(("-uring is only supported on Linux"));
+#endif
+	}
 
 	pump_peer_state_machine(peer);
 
@@ -422,6 +620,12 @@ cleanup:
 		peer_destroy(peer);
 		RL_FREE_TYPED(peer_t, peer);
 	}
+	rl_file_server_destroy(&ctrl);
+	if (ctrl.packcache)
+	{
+		rl_packcache_destroy(ctrl.packcache);
+		RL_FREE_TYPED(rl_packcache_t, ctrl.packcache);
+	}
 	if (sockets_initialized)
 		rl_fini_socket();
 	return ctrl.result;
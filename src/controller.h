@@ -2,6 +2,7 @@
 #define RL_CONTROLLER_H
 
 #include "config.h"
+#include "protocol.h"
 
 typedef enum controller_state_tag
 {
@@ -12,8 +13,63 @@ typedef enum controller_state_tag
 } controller_state_t;
 
 enum {
-	/* Max number of simultaneous files open. */
-	RL_MAX_FILE_HANDLES = 16
+	/* Max number of simultaneous files open. The handle table starts out
+	 * with room for RL_FILE_HANDLE_CHUNK and grows as needed. */
+	RL_MAX_FILE_HANDLES = 4096,
+	RL_FILE_HANDLE_CHUNK = 16,
+
+	/* Handle ids carry the slot index in the low bits and the slot's
+	 * generation above them, so that ids of closed handles are rejected
+	 * even after their slot has been reused. */
+	RL_FILE_HANDLE_INDEX_BITS = 12,
+
+	/* Default number of handles that keep a file or directory open on the
+	 * host; see rl_controller_t. */
+	RL_DEFAULT_OPEN_FILES = 64,
+
+	/* Longest host path we serve. */
+	RL_MAX_NATIVE_PATH = 260,
+
+	/* Max number of bytes returned by a single read; the peer's negotiated
+	 * message size usually limits reads further. */
+	RL_MAX_READ_SIZE = 1024 * 1024,
+
+	/* Reads of a file that carry on where the previous one ended are
+	 * taken as sequential once there are this many in a row. The host is
+	 * then asked to fetch a window ahead of the reader that starts out at
+	 * RL_READAHEAD_MIN bytes and doubles, up to RL_READAHEAD_MAX, as long
+	 * as the reads keep going. */
+	RL_SEQUENTIAL_READS = 2,
+	RL_READAHEAD_MIN = 128 * 1024,
+	RL_READAHEAD_MAX = 4 * 1024 * 1024,
+
+	/* Most blocks named by their hashes in an open_handle answer. */
+	RL_MAX_BLOCK_HASHES = 4096,
+
+	/* Most bytes a single advise_file request has the host fetch. */
+	RL_MAX_ADVISE_SIZE = 16 * 1024 * 1024,
+
+	/* Most bytes of a file a delta answer rebuilds, and most blocks a delta
+	 * request may describe. */
+	RL_MAX_DELTA_SIZE = 16 * 1024 * 1024,
+	RL_MAX_DELTA_BLOCKS = 4096,
+
+	/* Least room left in a compound answer for an operation to be run. */
+	RL_COMPOUND_MIN_ROOM = 1024,
+
+	/* Default and most bytes of the executable pushed to the target along
+	 * with the launch request. */
+	RL_DEFAULT_PUSH_SIZE = 256 * 1024,
+	RL_MAX_PUSH_SIZE = 1024 * 1024,
+
+	/* Most bytes of compressed frame bodies kept for sending again. */
+	RL_PACKCACHE_BUDGET = 64 * 1024 * 1024,
+
+	/* Default number of file system worker threads. */
+	RL_DEFAULT_FILE_WORKERS = 4,
+
+	/* Submission ring size when writing through io_uring. */
+	RL_CONTROLLER_URING_ENTRIES = 256
 };
 
 typedef struct rl_filehandle_tag
@@ -24,11 +80,68 @@ typedef struct rl_filehandle_tag
 #elif defined(RL_POSIX)
 	int handle;
 	void *dir_handle; /* DIR* */
+
+	/* Directories: descriptor that relative opens are resolved against
+	 * with openat(), opened when first needed; 0 if none. */
+	int dir_fd;
 #endif
 
-	char native_path[260];
+	/* Shared by the handles on the same path; see rl_filehandle_set_path().
+	 * [native_path] points into [interned_path]. */
+	char *native_path;
+	struct rl_native_path_tag *interned_path;
+
 	int type;
 	unsigned int size;
+	unsigned int stamp;
+
+	/* Handles holding an open file or directory are kept in most recently
+	 * used order. Least recently used ones are parked, their descriptor
+	 * closed, and reopened with [open_flags] when they're used again (POSIX
+	 * only). [dir_position] counts the entries find_next_file has read, to
+	 * get back to where a parked directory listing was. */
+	struct rl_filehandle_tag *lru_prev;
+	struct rl_filehandle_tag *lru_next;
+	int in_lru;
+	int parked;
+	int open_flags;
+	rl_uint32 dir_position;
+
+	/* Read-ahead state (POSIX only): the offset and end of the last read,
+	 * the number of reads in a row that carried on from the one before,
+	 * the current window, and how far the host has been asked to fetch. */
+	rl_uint32 read_offset;
+	rl_uint32 read_end;
+	rl_uint32 sequential_reads;
+	rl_uint32 readahead_window;
+	rl_uint32 advised_end;
+
+	/* Worker jobs using the handle. The slot isn't reused, and a requested
+	 * close is put off, until they're all done. */
+	int jobs;
+	int opening;
+	int close_pending;
+
+	/* Directory scans run one at a time; later ones wait here. */
+	int scanning;
+	struct rl_fs_job_tag *waiting_head;
+	struct rl_fs_job_tag *waiting_tail;
+
+	/* Bulk listing position: the number of entries handed out so far, and
+	 * the packed entry that didn't fit in the last answer, if any. Room for
+	 * that (RL_DIRENTRY_MAX_SIZE bytes) is only allocated once the handle is
+	 * listed, as few handles ever are. */
+	rl_uint32 dir_cookie;
+	rl_uint32 held_length;
+	rl_uint8 *held_entry;
+
+	/* Position in the handle table, and the generation that goes into the
+	 * id; bumped whenever the slot is freed. Free slots are chained through
+	 * [next_free]. */
+	rl_uint32 index;
+	rl_uint32 generation;
+	rl_uint32 next_free;
+	int in_use;
 } rl_filehandle_t;
 
 typedef struct rl_controller_tag
@@ -39,7 +152,58 @@ typedef struct rl_controller_tag
 	rl_filehandle_t root_handle;
 	rl_filehandle_t vinput_handle;
 	rl_filehandle_t voutput_handle;
-	rl_filehandle_t handles[RL_MAX_FILE_HANDLES];
+
+	/* Slots for the handles opened by the target. They're allocated one at a
+	 * time and never move, so worker jobs can hold on to them. */
+	rl_filehandle_t **handles;
+	rl_uint32 num_handles;
+	rl_uint32 free_handle;
+
+	/* The native paths handles are on, by path. Programs open the same
+	 * files and directories over and over, and keep several handles on one
+	 * at a time, so they share a counted copy. Only used on the event loop
+	 * thread. */
+	rl_dict_t native_paths;
+
+	/* Handles holding a descriptor, most recently used first. Along with
+	 * the opens in flight on workers, there are at most [max_open_files] of
+	 * them, unless more are busy with worker jobs. Opens beyond that wait in
+	 * line. */
+	rl_filehandle_t *lru_head;
+	rl_filehandle_t *lru_tail;
+	rl_uint32 open_files;
+	rl_uint32 max_open_files;
+	rl_uint32 opens_in_flight;
+	struct rl_fs_job_tag *waiting_opens_head;
+	struct rl_fs_job_tag *waiting_opens_tail;
+
+	/* Threads doing blocking file system work, if any (POSIX) */
+	struct rl_workpool_tag *workers;
+
+	/* Cached file metadata, if any (Linux) */
+	struct rl_statcache_tag *statcache;
+
+	/* Case-insensitive index of the names below the root, if any (Linux) */
+	struct rl_pathindex_tag *pathindex;
+
+	/* Compound requests in progress */
+	struct rl_compound_tag *compounds;
+
+	/* Streaming reads still going: those read on the event loop thread, and
+	 * worker jobs waiting for their last round to go out before reading the
+	 * next (POSIX). */
+	struct rl_stream_tag *streams;
+	struct rl_fs_job_tag *stalled_streams;
+
+	/* The start of the executable, read and hashed while connecting
+	 * (POSIX). It's pushed to the target once it's [preload_ready] and the
+	 * launch request has gone out ([push_wanted]). */
+	struct rl_fs_job_tag *preload;
+	int preload_ready;
+	int push_wanted;
+
+	/* Compressed frame bodies, if compressing */
+	struct rl_packcache_tag *packcache;
 
 	/* Startup options */
 	const char* executable;
@@ -52,6 +216,52 @@ struct peer_tag;
 union rl_msg_tag;
 
 /* file_server.c */
+
+/* Replace the handle's path. Returns non-zero if out of memory. */
+int rl_filehandle_set_path(rl_controller_t *self, rl_filehandle_t *handle, const char *native_path);
+
+int rl_file_server_init(rl_controller_t *self, int num_workers, int cache_stats);
+void rl_file_server_destroy(rl_controller_t *self);
+
+/* Descriptor that turns readable when worker jobs have finished, or -1. */
+int rl_file_server_wakeup_fd(rl_controller_t *self);
+
+/* Index the names below the root so that they're found however they're
+ * capitalized, using [num_threads] to walk the tree. Call this once the root
+ * path is set. Returns non-zero if names are used as given. */
+int rl_file_server_index(rl_controller_t *self, int num_threads);
+
+/* Descriptor that turns readable when served files have changed, or -1. */
+int rl_file_server_change_fd(rl_controller_t *self);
+
+/* The same for the name index. */
+int rl_file_server_index_fd(rl_controller_t *self);
+
+/* Forget cached metadata of files that have changed, and update the name
+ * index. Call this before serving requests that arrived along with the
+ * changes. */
+void rl_file_server_process_changes(rl_controller_t *self);
+
+/* Send the answers for finished worker jobs. */
+void rl_file_server_complete(struct peer_tag *peer);
+
+/* Non-zero if streaming reads are waiting for the transport's output queue
+ * to drain, and it has. The event loop shouldn't sleep then. */
+int rl_file_server_streams_ready(struct peer_tag *peer);
+
+/* Carry on with streaming reads once everything before them has gone out. */
+void rl_file_server_continue_streams(struct peer_tag *peer);
+
+/* Start reading the first [max_size] bytes of the executable, so that they
+ * can be pushed to the target without waiting to be asked for. Call this
+ * once the root path is set, before connecting. Executables on the target's
+ * own volumes aren't preloaded. */
+void rl_file_server_preload(rl_controller_t *self, rl_uint32 max_size);
+
+/* Push the preloaded data to the target once the launch request is out;
+ * right away, or when the read finishes. */
+void rl_file_server_push(struct peer_tag *peer);
+
 int rl_file_serve(struct peer_tag *peer, const union rl_msg_tag *msg);
 
 #endif
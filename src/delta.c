@@ -0,0 +1,275 @@
+#include "delta.h"
+#include "protocol.h"
+#include "xxhash.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define RL_DELTA_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define BLOCK_SIZE RL_HASH_BLOCK_SIZE
+
+typedef struct rl_delta_signature_tag
+{
+	rl_uint32 weak;
+	rl_uint64 strong;
+
+	/* Next signature in the same bucket, plus one; zero ends the chain. */
+	rl_uint32 next;
+} rl_delta_signature_t;
+
+typedef struct rl_delta_encoder_tag
+{
+	rl_uint8 *out;
+	rl_uint32 out_size;
+	rl_uint32 used;
+
+	rl_delta_signature_t *signatures;
+	rl_uint32 *buckets;
+	rl_uint32 bucket_shift;
+} rl_delta_encoder_t;
+
+static rl_uint32
+decode32(const rl_uint8 *p)
+{
+	return ((rl_uint32) p[0] << 24) | ((rl_uint32) p[1] << 16) | ((rl_uint32) p[2] << 8) | p[3];
+}
+
+static void
+encode32(rl_uint8 *p, rl_uint32 value)
+{
+	p[0] = (rl_uint8) (value >> 24);
+	p[1] = (rl_uint8) (value >> 16);
+	p[2] = (rl_uint8) (value >> 8);
+	p[3] = (rl_uint8) value;
+}
+
+static rl_uint32
+bucket_of(const rl_delta_encoder_t *enc, rl_uint32 weak)
+{
+	return (weak * 2654435761u) >> enc->bucket_shift;
+}
+
+/* Sum of the bytes of the block at [p], and the sum of each byte times its
+ * distance from the end of the block, both modulo 2^32. */
+static void
+block_sums(const rl_uint8 *p, rl_uint32 *a_out, rl_uint32 *b_out)
+{
+#if defined(RL_DELTA_SSE2)
+	/* 16 bytes at a time: going through a chunk adds 16 times the sum of
+	 * the bytes before it to b, plus the chunk's own bytes weighted 16 down
+	 * to 1. */
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weights_lo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+	const __m128i weights_hi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+	__m128i sum = zero;
+	__m128i sum_before = zero;
+	__m128i weighted = zero;
+	rl_uint32 i;
+
+	for (i = 0; i < BLOCK_SIZE; i += 16)
+	{
+		const __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+
+		sum_before = _mm_add_epi32(sum_before, sum);
+		sum = _mm_add_epi32(sum, _mm_sad_epu8(v, zero));
+		weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weights_lo));
+		weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weights_hi));
+	}
+
+	/* The byte sums are in the low words of the two quadwords. */
+	sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+	sum_before = _mm_add_epi32(sum_before, _mm_srli_si128(sum_before, 8));
+	weighted = _mm_add_epi32(weighted, _mm_srli_si128(weighted, 8));
+	weighted = _mm_add_epi32(weighted, _mm_srli_si128(weighted, 4));
+
+	*a_out = (rl_uint32) _mm_cvtsi128_si32(sum);
+	*b_out = 16 * (rl_uint32) _mm_cvtsi128_si32(sum_before) + (rl_uint32) _mm_cvtsi128_si32(weighted);
+#else
+	rl_uint32 a = 0, b = 0;
+	rl_uint32 i;
+
+	for (i = 0; i < BLOCK_SIZE; ++i)
+	{
+		a += p[i];
+		b += a;
+	}
+
+	*a_out = a;
+	*b_out = b;
+#endif
+}
+
+/* The signature of a block matching the window at [p], if any. */
+static const rl_delta_signature_t *
+find_block(const rl_delta_encoder_t *enc, rl_uint32 weak, const rl_uint8 *p)
+{
+	rl_uint32 link = enc->buckets[bucket_of(enc, weak)];
+	rl_uint64 strong = 0;
+	int hashed = 0;
+
+	while (link)
+	{
+		const rl_delta_signature_t * const sig = &enc->signatures[link - 1];
+
+		if (sig->weak == weak)
+		{
+			if (!hashed)
+			{
+				strong = rl_xxhash64(p, BLOCK_SIZE, 0);
+				hashed = 1;
+			}
+
+			if (sig->strong == strong)
+				return sig;
+		}
+
+		link = sig->next;
+	}
+
+	return NULL;
+}
+
+static int
+emit_copy(rl_delta_encoder_t *enc, const rl_delta_signature_t *sig)
+{
+	if (enc->out_size - enc->used < 1 + RL_HASH_SIZE)
+		return 1;
+
+	enc->out[enc->used++] = RL_DELTA_COPY;
+	rl_xxhash64_encode(sig->strong, enc->out + enc->used);
+	enc->used += RL_HASH_SIZE;
+	return 0;
+}
+
+/* Returns the number of bytes that fit. */
+static rl_uint32
+emit_literal(rl_delta_encoder_t *enc, const rl_uint8 *data, rl_uint32 length)
+{
+	const rl_uint32 room = enc->out_size - enc->used;
+
+	if (0 == length || room <= 1 + 4)
+		return 0;
+
+	length = RL_MIN_MACRO(length, room - 1 - 4);
+
+	enc->out[enc->used++] = RL_DELTA_LITERAL;
+	encode32(enc->out + enc->used, length);
+	enc->used += 4;
+	rl_memcpy(enc->out + enc->used, data, length);
+	enc->used += length;
+	return length;
+}
+
+static int
+load_signatures(rl_delta_encoder_t *enc, const rl_uint8 *signatures, rl_uint32 count)
+{
+	rl_uint32 num_buckets = 2;
+	rl_uint32 i;
+
+	enc->bucket_shift = 31;
+	while (num_buckets < count * 2)
+	{
+		num_buckets <<= 1;
+		--enc->bucket_shift;
+	}
+
+	if (NULL == (enc->signatures = (rl_delta_signature_t *) rl_alloc_sized(count * sizeof(rl_delta_signature_t))))
+		return 1;
+
+	if (NULL == (enc->buckets = (rl_uint32 *) rl_alloc_sized(num_buckets * sizeof(rl_uint32))))
+		return 1;
+
+	rl_memset(enc->buckets, 0, num_buckets * sizeof(rl_uint32));
+
+	for (i = 0; i < count; ++i, signatures += RL_DELTA_SIGNATURE_SIZE)
+	{
+		rl_delta_signature_t * const sig = &enc->signatures[i];
+		rl_uint32 * const bucket = &enc->buckets[bucket_of(enc, decode32(signatures))];
+
+		sig->weak = decode32(signatures);
+		sig->strong = ((rl_uint64) decode32(signatures + 4) << 32) | decode32(signatures + 8);
+		sig->next = *bucket;
+		*bucket = i + 1;
+	}
+
+	return 0;
+}
+
+int
+rl_delta_encode(
+	const rl_uint8 *data,
+	rl_uint32 size,
+	const rl_uint8 *signatures,
+	rl_uint32 count,
+	rl_uint8 *out,
+	rl_uint32 out_size,
+	rl_uint32 *out_length,
+	rl_uint32 *covered,
+	rl_delta_stats_t *stats)
+{
+	rl_delta_encoder_t enc;
+	rl_uint32 pos = 0, literal_start = 0;
+	rl_uint32 a = 0, b = 0;
+	int result = 1;
+
+	rl_memset(&enc, 0, sizeof(enc));
+	enc.out = out;
+	enc.out_size = out_size;
+
+	if (count > 0 && 0 != load_signatures(&enc, signatures, count))
+		goto cleanup;
+
+	if (count > 0 && size >= BLOCK_SIZE)
+		block_sums(data, &a, &b);
+
+	while (count > 0 && pos + BLOCK_SIZE <= size)
+	{
+		const rl_uint32 weak = (a & 0xffff) | (b << 16);
+		const rl_delta_signature_t *sig;
+
+		/* Don't look further than the literal bytes before a match could
+		 * be sent. */
+		if (pos - literal_start + (1 + 4) + (1 + RL_HASH_SIZE) > enc.out_size - enc.used)
+			break;
+
+		if (NULL != (sig = find_block(&enc, weak, data + pos)))
+		{
+			stats->literal_bytes += emit_literal(&enc, data + literal_start, pos - literal_start);
+			emit_copy(&enc, sig);
+			++stats->copied_blocks;
+
+			pos += BLOCK_SIZE;
+			literal_start = pos;
+
+			if (pos + BLOCK_SIZE <= size)
+				block_sums(data + pos, &a, &b);
+			continue;
+		}
+
+		if (pos + BLOCK_SIZE == size)
+			break;
+
+		/* Roll the window along by a byte. */
+		a += data[pos + BLOCK_SIZE] - data[pos];
+		b += a - BLOCK_SIZE * data[pos];
+		++pos;
+	}
+
+	/* The rest goes as it is, as far as it fits. */
+	pos = emit_literal(&enc, data + literal_start, size - literal_start);
+	stats->literal_bytes += pos;
+
+	*out_length = enc.used;
+	*covered = literal_start + pos;
+	result = 0;
+
+cleanup:
+	if (enc.signatures)
+		rl_free_sized(enc.signatures, count * sizeof(rl_delta_signature_t));
+
+	if (enc.buckets)
+		rl_free_sized(enc.buckets, (1u << (32 - enc.bucket_shift)) * sizeof(rl_uint32));
+
+	return result;
+}
@@ -0,0 +1,46 @@
+#ifndef RLAUNCH_DELTA_H
+#define RLAUNCH_DELTA_H
+
+#include "util.h"
+
+/*
+ * rsync-style delta encoding for the controller.
+ *
+ * The target describes blocks it holds by signature (see delta/request in
+ * rlnet.msg). The encoder rolls a block-sized window along the current data
+ * a byte at a time and looks its weak checksum up among the signatures;
+ * where the XXH64 hash agrees as well, the window is sent as a reference to
+ * the block, and everything in between as literal bytes. Unlike hashing at
+ * fixed offsets, this finds blocks that moved, as code does when a function
+ * before it grows.
+ *
+ * Where SSE2 is available it's used to checksum fresh windows, which is
+ * most of the work when most of the blocks match.
+ */
+
+typedef struct rl_delta_stats_tag
+{
+	rl_uint32 copied_blocks;
+	rl_uint32 literal_bytes;
+} rl_delta_stats_t;
+
+/*
+ * Encode instructions that rebuild [size] bytes of [data] from the [count]
+ * blocks described by [signatures] into [out], using at most [out_size]
+ * bytes. [*out_length] gets the length of the instructions, and [*covered]
+ * how many bytes of the data they rebuild; less than [size] if they didn't
+ * all fit. Returns non-zero if out of memory.
+ */
+int
+rl_delta_encode(
+	const rl_uint8 *data,
+	rl_uint32 size,
+	const rl_uint8 *signatures,
+	rl_uint32 count,
+	rl_uint8 *out,
+	rl_uint32 out_size,
+	rl_uint32 *out_length,
+	rl_uint32 *covered,
+	rl_delta_stats_t *stats);
+
+#endif
@@ -0,0 +1,273 @@
+#include "evloop.h"
+#include "socket_includes.h"
+
+#if defined(RL_EVLOOP_EPOLL)
+#include <sys/epoll.h>
+#endif
+
+#if defined(RL_EVLOOP_EPOLL)
+
+static rl_uint32
+to_epoll_events(int interest)
+{
+	rl_uint32 events = 0;
+
+	if (interest & RL_EVLOOP_READ)
+		events |= EPOLLIN | EPOLLRDHUP;
+	if (interest & RL_EVLOOP_WRITE)
+		events |= EPOLLOUT;
+	if (interest & RL_EVLOOP_EDGE)
+		events |= EPOLLET;
+
+	return events;
+}
+
+static int
+control(rl_evloop_t *loop, int op, rl_socket_t fd, int interest, void *userdata)
+{
+	struct epoll_event ev;
+
+	rl_memset(&ev, 0, sizeof(ev));
+	ev.events = to_epoll_events(interest);
+	ev.data.ptr = userdata;
+
+	if (0 != epoll_ctl(loop->epoll_fd, op, fd, &ev))
+	{
+		RL_LOG_WARNING(("epoll_ctl(%d) failed for fd %d: %s", op, (int) fd, strerror(errno)));
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+rl_evloop_init(rl_evloop_t *loop)
+{
+	if (-1 == (loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)))
+	{
+		RL_LOG_WARNING(("epoll_create1 failed: %s", strerror(errno)));
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+rl_evloop_destroy(rl_evloop_t *loop)
+{
+	if (-1 != loop->epoll_fd)
+		close(loop->epoll_fd);
+
+	loop->epoll_fd = -1;
+}
+
+int
+rl_evloop_add(rl_evloop_t *loop, rl_socket_t fd, int interest, void *userdata)
+{
+	return control(loop, EPOLL_CTL_ADD, fd, interest, userdata);
+}
+
+int
+rl_evloop_modify(rl_evloop_t *loop, rl_socket_t fd, int interest, void *userdata)
+{
+	return control(loop, EPOLL_CTL_MOD, fd, interest, userdata);
+}
+
+void
+rl_evloop_remove(rl_evloop_t *loop, rl_socket_t fd)
+{
+	struct epoll_event ev;
+
+	/* pre-2.6.9 kernels insist on a non-NULL event */
+	rl_memset(&ev, 0, sizeof(ev));
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int
+rl_evloop_wait(rl_evloop_t *loop, rl_evloop_event_t *events, int max_events, int timeout_ms)
+{
+	struct epoll_event ready[64];
+	int count, i;
+
+	max_events = RL_MIN_MACRO(max_events, (int) (sizeof(ready) / sizeof(ready[0])));
+
+	if (-1 == (count = epoll_wait(loop->epoll_fd, ready, max_events, timeout_ms)))
+		return EINTR == errno ? 0 : -1;
+
+	for (i = 0; i < count; ++i)
+	{
+		events[i].userdata = ready[i].data.ptr;
+		events[i].events = 0;
+
+		/* errors and hangups are reported as readable so that the owner's
+		 * next read finds out what happened */
+		if (ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			events[i].events |= RL_EVLOOP_READ;
+		if (ready[i].events & EPOLLOUT)
+			events[i].events |= RL_EVLOOP_WRITE;
+	}
+
+	return count;
+}
+
+#else /* select() */
+
+static rl_evloop_entry_t *
+find_entry(rl_evloop_t *loop, rl_socket_t fd)
+{
+	int i;
+
+	for (i = 0; i < loop->num_entries; ++i)
+	{
+		if (loop->entries[i].fd == fd)
+			return &loop->entries[i];
+	}
+
+	return NULL;
+}
+
+int
+rl_evloop_init(rl_evloop_t *loop)
+{
+	rl_memset(loop, 0, sizeof(*loop));
+	return 0;
+}
+
+void
+rl_evloop_destroy(rl_evloop_t *loop)
+{
+	if (loop->entries)
+		rl_free_sized(loop->entries, loop->max_entries * sizeof(rl_evloop_entry_t));
+
+	loop->entries = NULL;
+	loop->num_entries = loop->max_entries = 0;
+}
+
+int
+rl_evloop_add(rl_evloop_t *loop, rl_socket_t fd, int interest, void *userdata)
+{
+	rl_evloop_entry_t *entry;
+
+#if defined(RL_POSIX)
+	if (fd >= FD_SETSIZE)
+	{
+		RL_LOG_WARNING(("fd %d is beyond FD_SETSIZE (%d)", (int) fd, FD_SETSIZE));
+		return 1;
+	}
+#endif
+
+	if (loop->num_entries == loop->max_entries)
+	{
+		const int new_max = loop->max_entries ? loop->max_entries * 2 : 8;
+		rl_evloop_entry_t *new_entries;
+
+		if (NULL == (new_entries = (rl_evloop_entry_t *) rl_alloc_sized(new_max * sizeof(rl_evloop_entry_t))))
+			return 1;
+
+		if (loop->entries)
+		{
+			rl_memcpy(new_entries, loop->entries, loop->num_entries * sizeof(rl_evloop_entry_t));
+			rl_free_sized(loop->entries, loop->max_entries * sizeof(rl_evloop_entry_t));
+		}
+
+		loop->entries = new_entries;
+		loop->max_entries = new_max;
+	}
+
+	entry = &loop->entries[loop->num_entries++];
+	entry->fd = fd;
+	entry->interest = interest;
+	entry->userdata = userdata;
+	return 0;
+}
+
+int
+rl_evloop_modify(rl_evloop_t *loop, rl_socket_t fd, int interest, void *userdata)
+{
+	rl_evloop_entry_t *entry;
+
+	if (NULL == (entry = find_entry(loop, fd)))
+		return 1;
+
+	entry->interest = interest;
+	entry->userdata = userdata;
+	return 0;
+}
+
+void
+rl_evloop_remove(rl_evloop_t *loop, rl_socket_t fd)
+{
+	rl_evloop_entry_t *entry;
+
+	if (NULL != (entry = find_entry(loop, fd)))
+		*entry = loop->entries[--loop->num_entries];
+}
+
+int
+rl_evloop_wait(rl_evloop_t *loop, rl_evloop_event_t *events, int max_events, int timeout_ms)
+{
+	fd_set read_fds, write_fds;
+	struct timeval timeout;
+	rl_socket_t max_fd = 0;
+	int i, result, count = 0;
+
+	FD_ZERO(&read_fds);
+	FD_ZERO(&write_fds);
+
+	for (i = 0; i < loop->num_entries; ++i)
+	{
+		const rl_evloop_entry_t *entry = &loop->entries[i];
+
+		if (entry->interest & RL_EVLOOP_READ)
+			FD_SET(entry->fd, &read_fds);
+		if (entry->interest & RL_EVLOOP_WRITE)
+			FD_SET(entry->fd, &write_fds);
+
+		if (entry->fd > max_fd)
+			max_fd = entry->fd;
+	}
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+#if defined(RL_AMIGA)
+	result = WaitSelect((int) max_fd + 1, &read_fds, &write_fds, NULL, &timeout, &loop->signals);
+#elif defined(RL_WIN32)
+	/* WinSock refuses to select() on empty sets */
+	if (0 == loop->num_entries)
+	{
+		Sleep(timeout_ms);
+		return 0;
+	}
+	result = select(0, &read_fds, &write_fds, NULL, &timeout);
+#else
+	result = select((int) max_fd + 1, &read_fds, &write_fds, NULL, &timeout);
+	if (-1 == result && EINTR == errno)
+		return 0;
+#endif
+
+	if (result <= 0)
+		return result;
+
+	for (i = 0; i < loop->num_entries && count < max_events; ++i)
+	{
+		const rl_evloop_entry_t *entry = &loop->entries[i];
+		int ready = 0;
+
+		if (FD_ISSET(entry->fd, &read_fds))
+			ready |= RL_EVLOOP_READ;
+		if (FD_ISSET(entry->fd, &write_fds))
+			ready |= RL_EVLOOP_WRITE;
+
+		if (ready)
+		{
+			events[count].userdata = entry->userdata;
+			events[count].events = ready;
+			++count;
+		}
+	}
+
+	return count;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef RLAUNCH_EVLOOP_H
+#define RLAUNCH_EVLOOP_H
+
+#include "util.h"
+#include "socket_types.h"
+
+/*
+ * Socket readiness notification.
+ *
+ * Sockets are registered once with the events they're interested in and a
+ * userdata pointer that comes back with every event, so dispatch only ever
+ * touches the sockets that are ready.
+ *
+ * On Linux this uses epoll. Sockets registered with RL_EVLOOP_EDGE are then
+ * edge-triggered: an event is only reported when new data arrives (or send
+ * space opens up), so the owner must read until the socket would block or
+ * remember itself that input is left. Elsewhere the loop falls back to
+ * select() (WaitSelect() on the Amiga), which is always level-triggered;
+ * code written for edge triggering works unchanged there.
+ */
+
+#if defined(RL_LINUX)
+#define RL_EVLOOP_EPOLL 1
+#endif
+
+enum
+{
+	RL_EVLOOP_READ		= 1 << 0,
+	RL_EVLOOP_WRITE		= 1 << 1,
+
+	/* registration flag only: report changes rather than states */
+	RL_EVLOOP_EDGE		= 1 << 2
+};
+
+typedef struct rl_evloop_event_tag
+{
+	void *userdata;
+
+	/* RL_EVLOOP_READ and/or RL_EVLOOP_WRITE */
+	int events;
+} rl_evloop_event_t;
+
+#if !defined(RL_EVLOOP_EPOLL)
+typedef struct rl_evloop_entry_tag
+{
+	rl_socket_t fd;
+	int interest;
+	void *userdata;
+} rl_evloop_entry_t;
+#endif
+
+typedef struct rl_evloop_tag
+{
+#if defined(RL_EVLOOP_EPOLL)
+	int epoll_fd;
+#else
+	/* registered sockets, unordered */
+	rl_evloop_entry_t *entries;
+	int num_entries;
+	int max_entries;
+#endif
+
+#if defined(RL_AMIGA)
+	/* Exec signals to wake up for as well; on return from rl_evloop_wait()
+	 * the ones that were received. */
+	unsigned long signals;
+#endif
+} rl_evloop_t;
+
+int
+rl_evloop_init(rl_evloop_t *loop);
+
+void
+rl_evloop_destroy(rl_evloop_t *loop);
+
+/* Start watching [fd] for [interest] (RL_EVLOOP_xxx flags). */
+int
+rl_evloop_add(rl_evloop_t *loop, rl_socket_t fd, int interest, void *userdata);
+
+/* Change the events [fd] is watched for. */
+int
+rl_evloop_modify(rl_evloop_t *loop, rl_socket_t fd, int interest, void *userdata);
+
+/* Stop watching [fd]. Must be called before the socket is closed. */
+void
+rl_evloop_remove(rl_evloop_t *loop, rl_socket_t fd);
+
+/*
+ * Wait up to [timeout_ms] milliseconds for events and store up to
+ * [max_events] of them. Returns the number of events stored (0 on timeout
+ * or when interrupted by a signal), or -1 on error.
+ */
+int
+rl_evloop_wait(rl_evloop_t *loop, rl_evloop_event_t *events, int max_events, int timeout_ms);
+
+#endif
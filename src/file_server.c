@@ -4,6 +4,10 @@
 #include "protocol.h"
 #include "peer.h"
 #include "rlnet.h"
+#include "xxhash.h"
+#include "delta.h"
+#include "lz.h"
+#include "packcache.h"
 
 #include <stdio.h>
 
@@ -21,15 +25,268 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include "workpool.h"
+#include "statcache.h"
+#include "pathindex.h"
 #endif
 
-static int reply_with_error(peer_t *peer, const rl_msg_t *msg, rl_uint32 error_code)
+/* With io_uring, the transport reads file payloads asynchronously itself,
+ * so regular file reads don't need a worker. */
+static int reads_in_transport(peer_t *peer)
+{
+#if defined(RL_LINUX)
+	return -1 != rl_transport_uring_fd(&peer->transport);
+#else
+	(void) peer;
+	return 0;
+#endif
+}
+
+/*
+ * Compound requests (see protocol.h).
+ *
+ * Their operations are served one after the other like any other request,
+ * but under the compound's sequence number. Answers to that number are
+ * collected into the compound's answer instead of being sent, and each
+ * operation starts once the one before it has been answered, which may be by
+ * a worker job. While an operation is being started, the peer's output limit
+ * is lowered to the room left in the compound answer, and the handlers size
+ * their answers by that as usual.
+ */
+typedef struct rl_compound_result_tag
+{
+	/* Set if the operation opened [handle], on a file of [size] bytes of
+	 * which the first [covered] have come back in the answers. */
+	int opened;
+	rl_uint32 handle;
+	rl_uint32 size;
+	rl_uint32 covered;
+} rl_compound_result_t;
+
+typedef struct rl_compound_tag
+{
+	struct rl_compound_tag *next;
+	rl_uint32 seqno;
+
+	/* Copy of the operations, which the decoded ones point into. The next
+	 * one starts at [position]; [started] of [count] have been. */
+	rl_uint8 *operations;
+	rl_uint32 operations_length;
+	rl_uint32 position;
+	rl_uint32 count;
+	rl_uint32 started;
+
+	/* The operation being served, and the earlier one whose handle it
+	 * refers to, or -1. */
+	rl_uint32 index;
+	rl_msg_t current;
+	int ref;
+
+	/* [waiting] until the current operation has been answered, [running]
+	 * inside run_compound(), and [failed] once an operation has. */
+	int waiting;
+	int running;
+	int failed;
+
+	rl_compound_result_t results[RL_COMPOUND_MAX_OPS];
+
+	/* The answer records so far; the current operation's starts at
+	 * [record]. Every operation still to come has [reserve] bytes held back
+	 * for it, enough for an error answer. */
+	rl_uint8 *answers;
+	rl_uint32 answers_size;
+	rl_uint32 answers_length;
+	rl_uint32 record;
+	rl_uint32 reserve;
+} rl_compound_t;
+
+static void run_compound(peer_t *peer, rl_compound_t *compound);
+
+static rl_compound_t *find_compound(rl_controller_t *self, rl_uint32 seqno)
+{
+	rl_compound_t *compound;
+
+	for (compound = self->compounds; compound; compound = compound->next)
+	{
+		if (seqno == compound->seqno)
+			return compound;
+	}
+
+	return NULL;
+}
+
+static void free_compound(rl_compound_t *compound)
+{
+	if (compound->operations)
+		rl_free_sized(compound->operations, compound->operations_length);
+	if (compound->answers)
+		rl_free_sized(compound->answers, compound->answers_size);
+	RL_FREE_TYPED(rl_compound_t, compound);
+}
+
+/* Bytes the answer to the current operation of [compound] may take up. */
+static rl_uint32 compound_room(const rl_compound_t *compound)
+{
+	return compound->answers_size - compound->answers_length -
+		(compound->count - compound->index - 1) * compound->reserve;
+}
+
+/*
+ * Encode [msg] into [frame], with [length] bytes of [fd] at [offset] as its
+ * trailing array (POSIX), using at most [room] bytes. Returns non-zero if it
+ * doesn't fit or the file can't be read.
+ */
+static int encode_captured(peer_t *peer, const rl_msg_t *msg, int fd, rl_uint32 offset, rl_uint32 length,
+		rl_uint8 *frame, rl_uint32 room, size_t *used)
+{
+	if (rl_msg_encoded_size(msg, peer->framing) + length > room ||
+		0 != rl_encode_msg(msg, peer->framing, frame, (int) room, used))
+		return 1;
+
+#if defined(RL_POSIX)
+	if (length > 0)
+	{
+		rl_uint8 *patch;
+		rl_uint32 done = 0;
+
+		/* The message was encoded with an empty trailing array; the file
+		 * bytes go after it, as they would on the wire. */
+		patch = frame + RL_FRAMING_LENGTH_OFFSET;
+		if (0 != rl_encode_length(&patch, peer->framing, (rl_uint32) *used + length))
+			return 1;
+		patch = frame + *used - 4;
+		rl_encode_int4(&patch, length);
+
+		while (done < length)
+		{
+			const ssize_t got = pread(fd, frame + *used + done, length - done, (off_t) offset + done);
+
+			if (got <= 0)
+				return 1;
+
+			done += (rl_uint32) got;
+		}
+
+		*used += length;
+	}
+#else
+	(void) fd;
+	(void) offset;
+#endif
+
+	return 0;
+}
+
+/*
+ * Add the answer [msg] to the compound request it belongs to, along with
+ * [length] bytes of [fd] at [offset] as its trailing array, and carry on
+ * with the compound. Returns non-zero if [msg] doesn't belong to one.
+ */
+static int capture_answer(peer_t *peer, const rl_msg_t *msg, int fd, rl_uint32 offset, rl_uint32 length)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_compound_t *compound;
+	rl_compound_result_t *result;
+	rl_uint8 *patch;
+	rl_msg_t error;
+	size_t used = 0;
+
+	if (NULL == self->compounds || NULL == (compound = find_compound(self, msg->error_answer.hdr_in_reply_to)))
+		return 1;
+
+	if (!compound->waiting)
+	{
+		RL_LOG_WARNING(("dropping extra %s for compound request %u", rl_msg_name(rl_msg_kind_of(msg)), compound->seqno));
+		return 0;
+	}
+
+	if (0 != encode_captured(peer, msg, fd, offset, length,
+				compound->answers + compound->answers_length, compound_room(compound), &used))
+	{
+		RL_LOG_WARNING(("%s doesn't fit in compound answer %u", rl_msg_name(rl_msg_kind_of(msg)), compound->seqno));
+
+		/* There's always room for an error. */
+		RL_MSG_INIT(error, RL_MSG_ERROR_ANSWER);
+		error.error_answer.hdr_in_reply_to = compound->seqno;
+		error.error_answer.error_code = RL_NETERR_INVALID_VALUE;
+		msg = &error;
+		length = 0;
+		rl_encode_msg(msg, peer->framing, compound->answers + compound->answers_length, (int) compound_room(compound), &used);
+	}
+
+	/* Keep track of how much of the files opened along the way has come
+	 * back, for RL_COMPOUND_OPF_IF_WHOLE. */
+	switch (rl_msg_kind_of(msg))
+	{
+		case RL_MSG_ERROR_ANSWER:
+			compound->failed = 1;
+			break;
+
+		case RL_MSG_OPEN_HANDLE_ANSWER:
+			result = &compound->results[compound->index];
+			result->opened = 1;
+			result->handle = msg->open_handle_answer.handle;
+			result->size = msg->open_handle_answer.size;
+			result->covered = msg->open_handle_answer.inline_data.length + length;
+			break;
+
+		case RL_MSG_READ_FILE_ANSWER:
+			if (compound->ref >= 0)
+			{
+				result = &compound->results[compound->ref];
+				if (compound->current.read_file_request.offset_lo == result->covered)
+					result->covered += msg->read_file_answer.data.length + length;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	patch = compound->answers + compound->record + 1;
+	rl_encode_int4(&patch, (rl_uint32) used);
+	compound->answers_length += (rl_uint32) used;
+	compound->waiting = 0;
+
+	if (!compound->running)
+		run_compound(peer, compound);
+
+	return 0;
+}
+
+/* Send the answer [msg], unless it belongs to a compound request. */
+static int transmit_answer(peer_t *peer, const rl_msg_t *msg)
+{
+	if (0 == capture_answer(peer, msg, -1, 0, 0))
+		return 0;
+
+	return peer_transmit_message(peer, msg);
+}
+
+#if defined(RL_POSIX)
+/* The same for answers that have [length] bytes of [fd] at [offset] as their
+ * trailing array. */
+static int transmit_file_answer(peer_t *peer, const rl_msg_t *msg, int fd, rl_uint32 offset, rl_uint32 length)
+{
+	if (0 == capture_answer(peer, msg, fd, offset, length))
+		return 0;
+
+	return peer_transmit_file_message(peer, msg, fd, offset, length);
+}
+#endif
+
+static void transmit_error(peer_t *peer, rl_uint32 seqno, rl_uint32 error_code)
 {
 	rl_msg_t reply;
 	RL_MSG_INIT(reply, RL_MSG_ERROR_ANSWER);
-	reply.error_answer.hdr_in_reply_to = msg->handshake_request.hdr_sequence_num;
+	reply.error_answer.hdr_in_reply_to = seqno;
 	reply.error_answer.error_code = error_code;
-	peer_transmit_message(peer, &reply);
+	transmit_answer(peer, &reply);
+}
+
+static int reply_with_error(peer_t *peer, const rl_msg_t *msg, rl_uint32 error_code)
+{
+	transmit_error(peer, msg->handshake_request.hdr_sequence_num, error_code);
 	return 1;
 }
 
@@ -45,9 +302,24 @@ rl_proto_neterror_t translate_posix_errno(void)
 	}
 }
 
+static unsigned int make_stamp(const struct stat *st_buf)
+{
+	/* Mix in the sub-second part; a rebuild often lands within the same
+	 * second as the previous one. */
+#if defined(RL_APPLE)
+	return (unsigned int) st_buf->st_mtime ^ (unsigned int) st_buf->st_mtimespec.tv_nsec;
+#else
+	return (unsigned int) st_buf->st_mtime ^ (unsigned int) st_buf->st_mtim.tv_nsec;
+#endif
+}
 #endif
 
 
+static rl_uint32 make_handle_id(const rl_filehandle_t *handle)
+{
+	return handle->index | (handle->generation << RL_FILE_HANDLE_INDEX_BITS);
+}
+
 static rl_filehandle_t *get_handle_from_id(rl_controller_t *self, peer_t *peer, rl_uint32 handle_id)
 {
 	if ((rl_uint32) -1 == handle_id)
@@ -62,13 +334,24 @@ static rl_filehandle_t *get_handle_from_id(rl_controller_t *self, peer_t *peer,
 	{
 		return &self->voutput_handle;
 	}
-	else if (handle_id >= RL_MAX_FILE_HANDLES)
-	{
-		return NULL;
-	}
 	else
 	{
-		return &self->handles[handle_id];
+		const rl_uint32 index = handle_id & ((1 << RL_FILE_HANDLE_INDEX_BITS) - 1);
+		rl_filehandle_t *handle;
+
+		if (index >= self->num_handles)
+			return NULL;
+
+		handle = self->handles[index];
+
+		/* Stale ids have an old generation. Handles being opened haven't
+		 * been handed out yet, and closed ones may only be waiting for
+		 * their jobs to finish. */
+		if (!handle->in_use || handle->opening || handle->close_pending ||
+			handle_id != make_handle_id(handle))
+			return NULL;
+
+		return handle;
 	}
 }
 
@@ -96,39 +379,158 @@ static int fix_path(char *dest, size_t dest_size, const char *input, const char
 #endif
 }
 
-static rl_filehandle_t *make_handle(rl_controller_t *self, const char *path, int mode, rl_uint32 *error_out)
+/* A native path and the number of handles on it. */
+typedef struct rl_native_path_tag
 {
-	rl_filehandle_t *slot;
-	rl_filehandle_t * const slot_end = &self->handles[RL_MAX_FILE_HANDLES];
-	char native_path[260];
+	rl_uint32 refs;
+	size_t size;
+	char path[1];
+} rl_native_path_t;
+
+static void free_interned_path(void *datum)
+{
+	rl_native_path_t * const interned = (rl_native_path_t *) datum;
+	rl_free_sized(interned, interned->size);
+}
+
+static void free_native_path(rl_controller_t *self, rl_filehandle_t *handle)
+{
+	rl_native_path_t * const interned = handle->interned_path;
+
+	if (!interned)
+		return;
+
+	/* The last handle on the path takes it out of the table, which frees it. */
+	if (0 == --interned->refs)
+		rl_dict_erase(&self->native_paths, interned->path);
+
+	handle->native_path = NULL;
+	handle->interned_path = NULL;
+}
+
+int rl_filehandle_set_path(rl_controller_t *self, rl_filehandle_t *handle, const char *native_path)
+{
+	rl_native_path_t *interned;
 
-	/* Fix the path */
-	if (0 != fix_path(native_path, sizeof(native_path), path, self->root_handle.native_path))
+	if (NULL == (interned = (rl_native_path_t *) rl_dict_find(&self->native_paths, native_path)))
 	{
-		*error_out = RL_NETERR_INVALID_VALUE;
-		return NULL;
+		const size_t length = rl_strlen(native_path);
+		const size_t size = sizeof(rl_native_path_t) + length;
+
+		if (NULL == (interned = (rl_native_path_t *) rl_alloc_sized(size)))
+			return 1;
+
+		interned->refs = 0;
+		interned->size = size;
+		rl_memcpy(interned->path, native_path, length + 1);
+
+		if (0 != rl_dict_insert(&self->native_paths, interned->path, interned))
+		{
+			rl_free_sized(interned, size);
+			return 1;
+		}
 	}
 
-	RL_LOG_DEBUG(("make_handle(\"%s\") => \"%s\"", path, native_path));
+	/* Taken before letting go of the old one, which may be the same. */
+	++interned->refs;
+
+	free_native_path(self, handle);
+	handle->native_path = interned->path;
+	handle->interned_path = interned;
+	return 0;
+}
+
+/* Add another chunk of slots to the handle table. */
+static int grow_handles(rl_controller_t *self)
+{
+	const rl_uint32 new_count = self->num_handles + RL_FILE_HANDLE_CHUNK;
+	rl_filehandle_t **new_handles;
+	rl_uint32 i;
+
+	if (new_count > RL_MAX_FILE_HANDLES)
+		return 1;
 
-	/* Find a free slot.
-	 *
-	 * $PERF: This is O(n) right now and could be made O(1) if RL_MAX_FILE_HANDLES
-	 * is ever greatly increased by using a free list.
-	 */
+	if (NULL == (new_handles = (rl_filehandle_t **) rl_alloc_sized(new_count * sizeof(rl_filehandle_t *))))
+		return 1;
 
-	for (slot=&self->handles[0]; slot != slot_end; ++slot)
+	/* New slots go on the free list in index order. Either all of them
+	 * are added, or the table stays as it was. */
+	for (i = self->num_handles; i < new_count; ++i)
 	{
-		if (!slot->handle)
-			break;
+		rl_filehandle_t *slot;
+
+		if (NULL == (slot = RL_ALLOC_TYPED_ZERO(rl_filehandle_t)))
+		{
+			while (i-- > self->num_handles)
+				RL_FREE_TYPED(rl_filehandle_t, new_handles[i]);
+
+			rl_free_sized(new_handles, new_count * sizeof(rl_filehandle_t *));
+			return 1;
+		}
+
+		slot->index = i;
+		slot->next_free = i + 1 < new_count ? i + 1 : self->free_handle;
+		new_handles[i] = slot;
 	}
 
-	if (slot_end == slot)
+	if (self->handles)
 	{
-		*error_out = RL_NETERR_TOO_MANY_FILES_OPEN;
-		return NULL; /* no free slots */
+		rl_memcpy(new_handles, self->handles, self->num_handles * sizeof(rl_filehandle_t *));
+		rl_free_sized(self->handles, self->num_handles * sizeof(rl_filehandle_t *));
+	}
+
+	self->handles = new_handles;
+	self->free_handle = self->num_handles;
+	self->num_handles = new_count;
+	return 0;
+}
+
+static rl_filehandle_t *alloc_slot(rl_controller_t *self)
+{
+	rl_filehandle_t *slot;
+	rl_uint32 index, generation;
+
+	if ((rl_uint32) -1 == self->free_handle && 0 != grow_handles(self))
+		return NULL;
+
+	slot = self->handles[self->free_handle];
+	self->free_handle = slot->next_free;
+
+	/* Start from a clean slate, keeping the slot's place and generation. */
+	index = slot->index;
+	generation = slot->generation;
+	rl_memset(slot, 0, sizeof(*slot));
+	slot->index = index;
+	slot->generation = generation;
+	slot->in_use = 1;
+	return slot;
+}
+
+/* Put a closed slot back on the free list. Its id goes stale. */
+static void release_slot(rl_controller_t *self, rl_filehandle_t *slot)
+{
+	free_native_path(self, slot);
+
+	/* Skip generations that would make ids look like the special ones. */
+	do
+	{
+		slot->generation = (slot->generation + 1) & ((1 << (31 - RL_FILE_HANDLE_INDEX_BITS)) - 1);
 	}
+	while (RL_FILEHANDLE_VIRTUAL_INPUT == make_handle_id(slot) ||
+		RL_FILEHANDLE_VIRTUAL_OUTPUT == make_handle_id(slot));
+
+	slot->in_use = 0;
+	slot->next_free = self->free_handle;
+	self->free_handle = slot->index;
+}
 
+/*
+ * Open [native_path] into [slot]. This is the blocking part of opening a
+ * handle and runs on a worker thread when there are any, so it must only
+ * touch [slot] (and the stat cache, which locks itself).
+ */
+static int open_native(rl_filehandle_t *slot, const char *native_path, int mode, struct rl_statcache_tag *statcache, rl_uint32 *error_out)
+{
 #if defined(RL_WIN32)
 	{
 		DWORD dwAttributes = 0;
@@ -146,7 +548,7 @@ static rl_filehandle_t *make_handle(rl_controller_t *self, const char *path, int
 			{
 				*error_out = RL_NETERR_NOT_FOUND;
 				slot->handle = NULL;
-				return NULL;
+				return 1;
 			}
 
 			if (FILE_ATTRIBUTE_DIRECTORY & dwAttributes)
@@ -197,11 +599,19 @@ static rl_filehandle_t *make_handle(rl_controller_t *self, const char *path, int
 				}
 
 				slot->handle = NULL;
-				return NULL;
+				return 1;
 			}
 
 			/* FIXME: 64-bit support */
 			slot->size = GetFileSize(slot->handle, NULL);
+
+			{
+				FILETIME write_time;
+				if (GetFileTime(slot->handle, NULL, NULL, &write_time))
+					slot->stamp = write_time.dwLowDateTime ^ write_time.dwHighDateTime;
+				else
+					slot->stamp = 0;
+			}
 		}
 		else
 		{
@@ -209,13 +619,14 @@ static rl_filehandle_t *make_handle(rl_controller_t *self, const char *path, int
 			slot->handle = INVALID_HANDLE_VALUE;
 			slot->find_handle = NULL;
 			slot->size = 0;
+			slot->stamp = 0;
 		}
 	}
 #elif defined(RL_POSIX)
 	{
 		struct stat st_buf;
 		int flags = 0;
-		struct stat st;
+		rl_statinfo_t info;
 
 #if !defined(RL_APPLE)
 		flags |= O_LARGEFILE;
@@ -224,14 +635,14 @@ static rl_filehandle_t *make_handle(rl_controller_t *self, const char *path, int
 		/* figure out if the requested path is a file or directory */
 		if (0 == (mode & RL_OPENFLAG_WRITE))
 		{
-			if (0 != stat(native_path, &st))
+			if (0 != rl_statcache_stat(statcache, native_path, &info) || !info.exists)
 			{
 				*error_out = RL_NETERR_NOT_FOUND;
 				slot->handle = 0;
-				return NULL;
+				return 1;
 			}
 
-			if (S_ISDIR(st.st_mode))
+			if (S_ISDIR(info.mode))
 				slot->type = RL_NODE_TYPE_DIRECTORY;
 			else
 				slot->type = RL_NODE_TYPE_FILE;
@@ -257,7 +668,7 @@ static rl_filehandle_t *make_handle(rl_controller_t *self, const char *path, int
 				else
 				{
 					*error_out = RL_NETERR_INVALID_VALUE;
-					return NULL;
+					return 1;
 				}
 			}
 
@@ -276,376 +687,3248 @@ static rl_filehandle_t *make_handle(rl_controller_t *self, const char *path, int
 				}
 
 				slot->handle = 0;
-				return NULL;
+				return 1;
 			}
 
+			/* Don't wait for the change report to stop answering from the
+			 * cache; the target is likely to look at the file right away. */
+			if (mode & RL_OPENFLAG_WRITE)
+				rl_statcache_invalidate(statcache, native_path);
+
 			slot->size = st_buf.st_size;
+			slot->stamp = make_stamp(&st_buf);
+
+			/* Reopening a parked handle mustn't bring a deleted file back. */
+			slot->open_flags = flags & ~O_CREAT;
 		}
 		else
 		{
 			/* mark the handle as a directory using -1 */
 			slot->handle = -1;
 			slot->size = 0;
+			slot->stamp = 0;
 		}
 	}
 #else
 #error "Implement me."
 #endif
 
-	rl_string_copy(sizeof(slot->native_path), slot->native_path, native_path);
-
 	*error_out = RL_NETERR_SUCCESS;
-	return slot;
+	return 0;
 }
 
-static INLINE rl_uint32 get_filehandle_index(rl_controller_t *self, rl_filehandle_t *handle)
+#if defined(RL_POSIX)
+/*
+ * Like open_native(), but opens [name] inside the directory [dir_fd] rather
+ * than walking all of [native_path] (which names the same thing, and is what
+ * the stat cache knows it as). Runs on worker threads like open_native().
+ */
+static int open_native_at(rl_filehandle_t *slot, int dir_fd, const char *name, const char *native_path, int mode, struct rl_statcache_tag *statcache, rl_uint32 *error_out)
 {
-	if (&self->root_handle == handle)
+	struct stat st_buf;
+	int flags;
+	int fd;
+
+	if (mode & RL_OPENFLAG_WRITE)
+		flags = (mode & RL_OPENFLAG_READ) ? O_RDWR : O_WRONLY;
+	else if (mode & RL_OPENFLAG_READ)
+		flags = O_RDONLY;
+	else
 	{
-		/* Treat the root handle specially, because it's used so frequently. */
-		return (rl_uint32) -1;
+		*error_out = RL_NETERR_INVALID_VALUE;
+		return 1;
 	}
-	else
+
+	if (mode & RL_OPENFLAG_CREATE)
+		flags |= O_CREAT;
+
+#if !defined(RL_APPLE)
+	flags |= O_LARGEFILE;
+#endif
+
+	if (statcache && 0 == (mode & RL_OPENFLAG_WRITE))
 	{
-		/* Just calculate the offset through pointer arithmetic to get an index
-		 * into the file handle array. This buys us O(1) lookup when processing
-		 * reads and writes.
-		 */
-		return (rl_uint32) (handle - &self->handles[0]);
+		rl_statinfo_t info;
+
+		if (0 == rl_statcache_lookup(statcache, native_path, &info) && !info.exists)
+		{
+			*error_out = RL_NETERR_NOT_FOUND;
+			slot->handle = 0;
+			return 1;
+		}
 	}
-}
 
-static int open_handle_request(peer_t *peer, const rl_msg_t *msg)
-{
-	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
-	rl_msg_t answer;
-	rl_uint32 error = RL_NETERR_NOT_FOUND;
-	rl_filehandle_t *handle;
+	/* Reads don't know whether they're after a file or a directory; the
+	 * descriptor tells, without a separate stat(). */
+	if (-1 == (fd = openat(dir_fd, name, flags, 0666)))
+	{
+		if (ENOENT == errno)
+		{
+			rl_statinfo_t info;
 
-	/* map the filename to a handle */
-	handle = make_handle(self, msg->open_handle_request.path, msg->open_handle_request.mode, &error);
+			/* Let the stat cache remember the miss, so that probes for
+			 * the name are answered without going to the file system. */
+			*error_out = RL_NETERR_NOT_FOUND;
+			rl_statcache_stat(statcache, native_path, &info);
+		}
+		else
+		{
+			*error_out = translate_posix_errno();
+		}
 
-	/* if we didn't get a file handle, return with an error */
-	if (!handle)
+		slot->handle = 0;
+		return 1;
+	}
+
+	if (0 != fstat(fd, &st_buf))
 	{
-		return reply_with_error(peer, msg, error);
+		*error_out = translate_posix_errno();
+		close(fd);
+		slot->handle = 0;
+		return 1;
+	}
+
+	if (S_ISDIR(st_buf.st_mode))
+	{
+		/* Keep the descriptor for opens inside the directory. */
+		slot->type = RL_NODE_TYPE_DIRECTORY;
+		slot->handle = -1;
+		slot->dir_fd = fd;
+		slot->size = 0;
+		slot->stamp = 0;
 	}
 	else
 	{
-		/* reply with the handle */
-		RL_MSG_INIT(answer, RL_MSG_OPEN_HANDLE_ANSWER);
-		answer.open_handle_answer.hdr_in_reply_to = msg->open_handle_request.hdr_sequence_num;
-		answer.open_handle_answer.handle = get_filehandle_index(self, handle);
-		answer.open_handle_answer.type = (rl_uint8) handle->type;
-		answer.open_handle_answer.size = (rl_uint32) handle->size;
-		return peer_transmit_message(peer, &answer);
+		if (mode & RL_OPENFLAG_WRITE)
+			rl_statcache_invalidate(statcache, native_path);
+
+		slot->type = RL_NODE_TYPE_FILE;
+		slot->handle = fd;
+		slot->size = st_buf.st_size;
+		slot->stamp = make_stamp(&st_buf);
+		slot->open_flags = flags & ~O_CREAT;
 	}
+
+	*error_out = RL_NETERR_SUCCESS;
+	return 0;
 }
+#endif
 
-static int close_handle_request(peer_t *peer, const rl_msg_t *msg)
+/* Whether [handle] holds a descriptor as soon as it's open. */
+static int holds_descriptor(const rl_filehandle_t *handle)
 {
-	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
-	rl_filehandle_t *handle;
-
-	/* Ignore attempts to close virtual input/output */
-	if (RL_FILEHANDLE_VIRTUAL_INPUT == msg->close_handle_request.handle ||
-		RL_FILEHANDLE_VIRTUAL_OUTPUT == msg->close_handle_request.handle)
-		return 0;
-
-	if (NULL == (handle = get_handle_from_id(self, peer, msg->close_handle_request.handle)))
-		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
-
-#if defined(RL_WIN32)
-	if (INVALID_HANDLE_VALUE != handle->handle)
-		CloseHandle(handle->handle);
-	handle->handle = NULL;
-#elif defined(RL_POSIX)
-	if (-1 == handle->handle)
-		close(handle->handle);
-	handle->handle = 0;
+#if defined(RL_POSIX)
+	return RL_NODE_TYPE_FILE == handle->type || handle->dir_fd > 0;
 #else
-#error "Implement me."
+	return RL_NODE_TYPE_FILE == handle->type;
 #endif
-	return 0;
 }
 
-static int find_next_file_request(peer_t *peer, const rl_msg_t *msg)
+/*
+ * Descriptor pool.
+ *
+ * Targets may hold on to any number of handles, but only the most recently
+ * used ones keep a descriptor open on the host. Files get one when they're
+ * opened and directories when they're listed; once there are more than
+ * [max_open_files] of them, the least recently used are parked and files
+ * are reopened when the target next uses them. Handles with worker jobs in
+ * flight are left alone, as the workers are using their descriptors.
+ */
+#if defined(RL_POSIX)
+static void untrack_handle(rl_controller_t *self, rl_filehandle_t *handle)
 {
-	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
-	rl_filehandle_t *handle;
-	rl_msg_t answer;
+	if (!handle->in_lru)
+		return;
 
-#if defined(RL_WIN32)
-	WIN32_FIND_DATAA find_data;
-	BOOL reset = msg->find_next_file_request.reset ? TRUE : FALSE;
-	BOOL has_file = TRUE;
-#elif(defined RL_POSIX)
-	struct dirent *dent;
-#endif
+	if (handle->lru_prev)
+		handle->lru_prev->lru_next = handle->lru_next;
+	else
+		self->lru_head = handle->lru_next;
 
-	if (NULL == (handle = get_handle_from_id(self, peer, msg->find_next_file_request.handle)))
-		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+	if (handle->lru_next)
+		handle->lru_next->lru_prev = handle->lru_prev;
+	else
+		self->lru_tail = handle->lru_prev;
 
-	if (RL_NODE_TYPE_DIRECTORY != handle->type)
-		return reply_with_error(peer, msg, RL_NETERR_NOT_A_DIRECTORY);
+	handle->lru_prev = NULL;
+	handle->lru_next = NULL;
+	handle->in_lru = 0;
+	--self->open_files;
+}
 
-#if defined(RL_WIN32)
-	do
+static void park_handle(rl_controller_t *self, rl_filehandle_t *handle)
+{
+	RL_LOG_DEBUG(("parking %s", handle->native_path));
+
+	if (handle->dir_handle)
 	{
-		if (reset)
-		{
+		closedir(handle->dir_handle);
+		handle->dir_handle = NULL;
+
+		/* Bulk listings start over and skip ahead; find_next_file skips
+		 * [dir_position] entries. */
+		handle->dir_cookie = 0;
+		handle->held_length = 0;
+	}
+
+	/* Opens inside the directory get a new one when they need it. */
+	if (handle->dir_fd > 0)
+	{
+		close(handle->dir_fd);
+		handle->dir_fd = 0;
+	}
+
+	if (RL_NODE_TYPE_FILE == handle->type && handle->handle > 0)
+	{
+		close(handle->handle);
+		handle->handle = -1;
+		handle->parked = 1;
+
+		/* The new descriptor has to be told again. */
+		handle->readahead_window = 0;
+	}
+
+	untrack_handle(self, handle);
+}
+
+/* Make [handle] the most recently used, parking others if there are too
+ * many. */
+static void track_handle(rl_controller_t *self, rl_filehandle_t *handle)
+{
+	rl_filehandle_t *victim, *prev;
+
+	if (self->lru_head == handle)
+		return;
+
+	untrack_handle(self, handle);
+
+	handle->lru_prev = NULL;
+	handle->lru_next = self->lru_head;
+
+	if (self->lru_head)
+		self->lru_head->lru_prev = handle;
+	else
+		self->lru_tail = handle;
+
+	self->lru_head = handle;
+	handle->in_lru = 1;
+	++self->open_files;
+
+	for (victim = self->lru_tail; victim && self->open_files + self->opens_in_flight > self->max_open_files; victim = prev)
+	{
+		prev = victim->lru_prev;
+
+		if (victim != handle && 0 == victim->jobs)
+			park_handle(self, victim);
+	}
+}
+#endif
+
+#if defined(RL_POSIX)
+/*
+ * Open the file the parked [handle] was on again into [*fd_out]. Blocks, and
+ * only reads the handle, so worker jobs can do it. Returns RL_NETERR_SUCCESS
+ * or an error code.
+ */
+static rl_uint32 reopen_file(const rl_filehandle_t *handle, int *fd_out)
+{
+	struct stat st_buf;
+	int fd;
+
+	if (-1 == (fd = open(handle->native_path, handle->open_flags)))
+		return translate_posix_errno();
+
+	/* Don't serve something else under the old handle if the file has
+	 * been replaced in the meantime. */
+	if (0 != fstat(fd, &st_buf) || make_stamp(&st_buf) != handle->stamp)
+	{
+		close(fd);
+		return RL_NETERR_IO_ERROR;
+	}
+
+	*fd_out = fd;
+	return RL_NETERR_SUCCESS;
+}
+#endif
+
+/*
+ * Get [handle] ready to serve a request, reopening it if it was parked.
+ * Returns RL_NETERR_SUCCESS or an error code. Event loop thread only.
+ */
+static rl_uint32 use_handle(rl_controller_t *self, rl_filehandle_t *handle)
+{
+#if defined(RL_POSIX)
+	rl_uint32 error;
+	int fd;
+
+	if (handle == &self->vinput_handle || handle == &self->voutput_handle)
+		return RL_NETERR_SUCCESS;
+
+	if (handle->parked)
+	{
+		if (RL_NETERR_SUCCESS != (error = reopen_file(handle, &fd)))
+			return error;
+
+		RL_LOG_DEBUG(("reopened %s", handle->native_path));
+		handle->handle = fd;
+		handle->parked = 0;
+	}
+
+	track_handle(self, handle);
+#else
+	(void) self;
+	(void) handle;
+#endif
+	return RL_NETERR_SUCCESS;
+}
+
+/*
+ * Like use_handle(), for requests a worker job serves: a parked handle is
+ * left for the job to reopen, so the event loop doesn't wait on the open.
+ */
+static void use_handle_in_job(rl_controller_t *self, rl_filehandle_t *handle)
+{
+#if defined(RL_POSIX)
+	if (handle != &self->vinput_handle && handle != &self->voutput_handle)
+		track_handle(self, handle);
+#else
+	(void) self;
+	(void) handle;
+#endif
+}
+
+/*
+ * Whether a read of [handle] is served by a worker job. Reads the transport
+ * makes itself stay on the event loop thread, unless the handle is parked,
+ * or the answers are compressed: a job reopens the file, or compresses the
+ * data, so the event loop doesn't.
+ */
+static int reads_in_job(const rl_controller_t *self, peer_t *peer, const rl_filehandle_t *handle)
+{
+	return NULL != self->workers && (handle->parked || peer_compresses(peer) || !reads_in_transport(peer));
+}
+
+#if defined(RL_POSIX)
+/*
+ * Spell [name], relative to the directory handle [dir], the way it's
+ * spelled on disk, going by the path index. Names that don't exist in any
+ * spelling are reported missing, unless the open may create them. Whatever
+ * the index can't tell is used as given.
+ */
+static rl_uint32 correct_case(rl_controller_t *self, const rl_filehandle_t *dir, const char *name, int mode, char *out, size_t out_size)
+{
+	const char * const root = self->root_handle.native_path;
+	const size_t root_length = rl_strlen(root);
+	char path[PATH_MAX];
+	char real[PATH_MAX];
+	size_t dir_length = 0;
+	rl_strbuf_t buf;
+
+	if (0 != rl_string_copy(out_size, out, name))
+		return RL_NETERR_INVALID_VALUE;
+
+	/* The index has paths relative to the root. */
+	rl_strbuf_init(&buf, path, sizeof(path));
+
+	if (dir != &self->root_handle)
+	{
+		if (0 != strncmp(dir->native_path, root, root_length) || '/' != dir->native_path[root_length] ||
+			!rl_strbuf_append(&buf, dir->native_path + root_length + 1) || !rl_strbuf_append(&buf, "/"))
+			return RL_NETERR_SUCCESS;
+
+		dir_length = rl_strlen(path);
+	}
+
+	if (!rl_strbuf_append(&buf, name))
+		return RL_NETERR_SUCCESS;
+
+	if (RL_PATHINDEX_MISSING == rl_pathindex_resolve(self->pathindex, path, real, sizeof(real), NULL) &&
+		0 == (mode & RL_OPENFLAG_CREATE))
+		return RL_NETERR_NOT_FOUND;
+
+	/* The directory's own path is spelled right already; it only comes
+	 * out differently if several names fold the same way. */
+	if (dir_length > 0 && 0 != memcmp(real, path, dir_length))
+		return RL_NETERR_SUCCESS;
+
+	if (0 != rl_string_copy(out_size, out, real + dir_length))
+		rl_string_copy(out_size, out, name);
+
+	return RL_NETERR_SUCCESS;
+}
+#endif
+
+/*
+ * Work out the native path the open_handle request [msg] is for. Relative
+ * opens name an entry of a directory handle; when it has a descriptor to
+ * resolve the name against, [*parent_out] is set to it and [*name_offset]
+ * to where the name starts in [native_path]. Returns an error code.
+ * Event loop thread only.
+ */
+static rl_uint32 resolve_open(rl_controller_t *self, peer_t *peer, const rl_msg_t *msg, char *native_path, size_t native_path_size, rl_filehandle_t **parent_out, size_t *name_offset)
+{
+	const char *name = msg->open_handle_request.path;
+	rl_filehandle_t *parent = &self->root_handle;
+#if defined(RL_POSIX)
+	char spelled[RL_MAX_NATIVE_PATH];
+	rl_uint32 error;
+#endif
+
+	*parent_out = NULL;
+	*name_offset = 0;
+
+	if (msg->open_handle_request.mode & RL_OPENFLAG_RELATIVE)
+	{
+		if (NULL == (parent = get_handle_from_id(self, peer, msg->open_handle_request.parent)))
+			return RL_NETERR_INVALID_VALUE;
+
+		if (RL_NODE_TYPE_DIRECTORY != parent->type)
+			return RL_NETERR_NOT_A_DIRECTORY;
+
+		/* Just a name; anything else comes as a full path. */
+		if ('\0' == name[0] || rl_strchr(name, '/') || rl_strchr(name, '\\') ||
+			0 == rl_strcmp(".", name) || 0 == rl_strcmp("..", name))
+			return RL_NETERR_INVALID_VALUE;
+	}
+
+#if defined(RL_POSIX)
+	if (self->pathindex)
+	{
+		if (0 != (error = correct_case(self, parent, name, msg->open_handle_request.mode, spelled, sizeof(spelled))))
+			return error;
+
+		name = spelled;
+	}
+#endif
+
+	if (0 != fix_path(native_path, native_path_size, name, parent->native_path))
+		return RL_NETERR_INVALID_VALUE;
+
+	if (0 == (msg->open_handle_request.mode & RL_OPENFLAG_RELATIVE))
+		return RL_NETERR_SUCCESS;
+
+#if defined(RL_POSIX)
+	if (RL_NETERR_SUCCESS == use_handle(self, parent))
+	{
+		/* Without a descriptor the name is looked up by its full path. */
+		if (parent->dir_fd <= 0 &&
+			-1 == (parent->dir_fd = open(parent->native_path, O_RDONLY | O_DIRECTORY)))
+			parent->dir_fd = 0;
+
+		if (parent->dir_fd > 0)
+		{
+			*parent_out = parent;
+			*name_offset = rl_strlen(native_path) - rl_strlen(name);
+		}
+	}
+#endif
+
+	return RL_NETERR_SUCCESS;
+}
+
+static void close_native(rl_controller_t *self, rl_filehandle_t *handle);
+
+static rl_filehandle_t *make_handle(rl_controller_t *self, peer_t *peer, const rl_msg_t *msg, rl_uint32 *error_out)
+{
+	rl_filehandle_t *slot, *parent;
+	char native_path[RL_MAX_NATIVE_PATH];
+	size_t name_offset;
+	int result;
+
+	if (0 != (*error_out = resolve_open(self, peer, msg, native_path, sizeof(native_path), &parent, &name_offset)))
+		return NULL;
+
+	RL_LOG_DEBUG(("make_handle(\"%s\") => \"%s\"", msg->open_handle_request.path, native_path));
+
+	if (NULL == (slot = alloc_slot(self)))
+	{
+		*error_out = RL_NETERR_TOO_MANY_FILES_OPEN;
+		return NULL; /* no free slots */
+	}
+
+#if defined(RL_POSIX)
+	if (parent)
+		result = open_native_at(slot, parent->dir_fd, native_path + name_offset, native_path, msg->open_handle_request.mode, self->statcache, error_out);
+	else
+#endif
+		result = open_native(slot, native_path, msg->open_handle_request.mode, self->statcache, error_out);
+
+	if (0 != result)
+	{
+		release_slot(self, slot);
+		return NULL;
+	}
+
+	if (0 != rl_filehandle_set_path(self, slot, native_path))
+	{
+		close_native(self, slot);
+		release_slot(self, slot);
+		*error_out = RL_NETERR_IO_ERROR;
+		return NULL;
+	}
+
+	if (holds_descriptor(slot))
+		use_handle(self, slot);
+
+	return slot;
+}
+
+#if defined(RL_POSIX)
+/* Have the host start reading [length] bytes at [offset] of [handle] into
+ * its cache; with [sequential], also have it read further ahead of reads
+ * than it normally would. */
+static void advise_host(const rl_filehandle_t *handle, rl_uint32 offset, rl_uint32 length, int sequential)
+{
+#if defined(RL_LINUX)
+	if (sequential)
+		posix_fadvise(handle->handle, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (length > 0)
+		posix_fadvise(handle->handle, (off_t) offset, (off_t) length, POSIX_FADV_WILLNEED);
+#elif defined(RL_APPLE)
+	struct radvisory advice;
+
+	(void) sequential;
+
+	if (length > 0)
+	{
+		advice.ra_offset = (off_t) offset;
+		advice.ra_count = (int) length;
+		fcntl(handle->handle, F_RDADVISE, &advice);
+	}
+#else
+	(void) handle;
+	(void) offset;
+	(void) length;
+	(void) sequential;
+#endif
+}
+
+/*
+ * Note that [handle] is being read, [length] bytes at [offset], and keep the
+ * host fetching ahead of reads that go through the file in order. Answers
+ * may carry less than was asked for, so any read that starts past the last
+ * one and no later than where it ended counts as carrying on.
+ */
+static void note_read(rl_filehandle_t *handle, rl_uint32 offset, rl_uint32 length)
+{
+	rl_uint32 start, end;
+	int sequential;
+
+	if (RL_NODE_TYPE_FILE != handle->type || handle->handle <= 0 || 0 == length)
+		return;
+
+	if (offset == handle->read_end || (offset > handle->read_offset && offset < handle->read_end))
+	{
+		++handle->sequential_reads;
+	}
+	else
+	{
+		handle->sequential_reads = 0;
+		handle->readahead_window = 0;
+
+		if (handle->advised_end <= offset)
+			handle->advised_end = 0;
+	}
+
+	handle->read_offset = offset;
+	handle->read_end = offset + RL_MIN_MACRO(length, (rl_uint32) handle->size - RL_MIN_MACRO(offset, (rl_uint32) handle->size));
+
+	if (handle->sequential_reads < RL_SEQUENTIAL_READS || handle->advised_end >= handle->size)
+		return;
+
+	/* Stay a window ahead of the reader. It's topped up once half of it
+	 * has been read, and grows as long as the reads go on. */
+	sequential = (0 == handle->readahead_window);
+
+	if (sequential)
+		handle->readahead_window = RL_READAHEAD_MIN;
+	else if (handle->advised_end > handle->read_end && handle->advised_end - handle->read_end >= handle->readahead_window / 2)
+		return;
+	else
+		handle->readahead_window = RL_MIN_MACRO(handle->readahead_window * 2, (rl_uint32) RL_READAHEAD_MAX);
+
+	start = RL_MAX_MACRO(handle->advised_end, handle->read_end);
+	end = handle->size - handle->read_end > handle->readahead_window ? handle->read_end + handle->readahead_window : (rl_uint32) handle->size;
+
+	RL_LOG_DEBUG(("read-ahead %u..%u of %s", start, end, handle->native_path));
+
+	advise_host(handle, start, start < end ? end - start : 0, sequential);
+	handle->advised_end = RL_MAX_MACRO(handle->advised_end, end);
+}
+#endif
+
+/* Bytes of file data and block hashes that may go along with the answer to
+ * the open_handle request [msg]. */
+static rl_uint32 answer_room(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_msg_t answer;
+	size_t max_length;
+
+	if (0 == (msg->open_handle_request.mode & RL_OPENFLAG_READ))
+		return 0;
+
+	RL_MSG_INIT(answer, RL_MSG_OPEN_HANDLE_ANSWER);
+	max_length = peer->transport.max_output_size - rl_msg_encoded_size(&answer, peer->framing);
+	return (rl_uint32) RL_MIN_MACRO(max_length, RL_MAX_READ_SIZE);
+}
+
+/* Split [room] bytes of an open_handle answer for a file of [size] bytes
+ * between the hashes of its first blocks and its first bytes. Hashes come
+ * first; each of them may save a whole block. */
+static void plan_answer(rl_uint32 room, rl_uint32 max_hashes, rl_uint32 inline_size, rl_uint32 size,
+		rl_uint32 *hash_count, rl_uint32 *inline_length)
+{
+	rl_uint32 count = (size + RL_HASH_BLOCK_SIZE - 1) / RL_HASH_BLOCK_SIZE;
+
+	count = RL_MIN_MACRO(count, max_hashes);
+	count = RL_MIN_MACRO(count, (rl_uint32) RL_MAX_BLOCK_HASHES);
+	count = RL_MIN_MACRO(count, room / RL_HASH_SIZE);
+
+	*hash_count = count;
+	*inline_length = RL_MIN_MACRO(RL_MIN_MACRO(inline_size, size), room - count * RL_HASH_SIZE);
+}
+
+static INLINE rl_uint32 get_filehandle_id(rl_controller_t *self, rl_filehandle_t *handle)
+{
+	if (&self->root_handle == handle)
+	{
+		/* Treat the root handle specially, because it's used so frequently. */
+		return (rl_uint32) -1;
+	}
+	else
+	{
+		/* The id leads straight back to the slot. */
+		return make_handle_id(handle);
+	}
+}
+
+/*
+ * Read up to [length] bytes at [offset] into [buffer]; [*bytes_read] is zero
+ * at end of file. Returns non-zero on error.
+ */
+static int read_at(rl_controller_t *self, rl_filehandle_t *handle, rl_uint32 offset, void *buffer, rl_uint32 length, rl_uint32 *bytes_read)
+{
+#if defined(RL_WIN32)
+	LARGE_INTEGER pos;
+	DWORD read_size = 0;
+
+	pos.QuadPart = offset;
+
+	if (INVALID_HANDLE_VALUE == handle->handle)
+		return 1;
+
+	/* Ignore seeks in standard input */
+	if (handle != &self->vinput_handle && !SetFilePointerEx(handle->handle, pos, NULL, FILE_BEGIN))
+		return 1;
+
+	if (0 == ReadFile(handle->handle, buffer, length, &read_size, NULL))
+	{
+		RL_LOG_DEBUG(("ReadFile failed w/ Win32 error %d", (int) GetLastError()));
+		return 1;
+	}
+
+	*bytes_read = (rl_uint32) read_size;
+	return 0;
+#elif defined(RL_POSIX)
+	ssize_t read_size;
+
+	if (-1 == (read_size = pread(handle->handle, buffer, length, (off_t) offset)))
+		return 1;
+
+	*bytes_read = (rl_uint32) read_size;
+	return 0;
+#else
+#error Implement me.
+#endif
+}
+
+/* Name the first [count] blocks of the file by their contents into [out],
+ * RL_HASH_SIZE bytes each. Returns non-zero if the file couldn't be read. */
+static int hash_blocks(rl_controller_t *self, rl_filehandle_t *handle, rl_uint32 count, rl_uint8 *out)
+{
+	rl_uint8 buffer[RL_HASH_BLOCK_SIZE * 8];
+	rl_uint32 offset = 0;
+	rl_uint32 index = 0;
+
+	while (index < count)
+	{
+		rl_uint32 length = RL_MIN_MACRO(count - index, sizeof(buffer) / RL_HASH_BLOCK_SIZE) * RL_HASH_BLOCK_SIZE;
+		rl_uint32 filled = 0;
+		rl_uint32 block;
+
+		if (offset >= handle->size)
+			return 1;
+
+		length = RL_MIN_MACRO(length, (rl_uint32) handle->size - offset);
+
+		while (filled < length)
+		{
+			rl_uint32 bytes_read = 0;
+
+			if (0 != read_at(self, handle, offset + filled, buffer + filled, length - filled, &bytes_read))
+				return 1;
+
+			if (0 == bytes_read)
+				break;
+
+			filled += bytes_read;
+		}
+
+		/* The file shrank under us. */
+		if (filled < length)
+			return 1;
+
+		for (block = 0; block < filled; block += RL_HASH_BLOCK_SIZE, ++index)
+		{
+			const rl_uint32 block_length = RL_MIN_MACRO(filled - block, (rl_uint32) RL_HASH_BLOCK_SIZE);
+			rl_xxhash64_encode(rl_xxhash64(buffer + block, block_length, 0), out + index * RL_HASH_SIZE);
+		}
+
+		offset += filled;
+	}
+
+	return 0;
+}
+
+/* Hashes of the first [count] blocks of the file, or NULL if they can't be
+ * had. Free with rl_free_sized(), [count] * RL_HASH_SIZE bytes. */
+static rl_uint8 *new_block_hashes(rl_controller_t *self, rl_filehandle_t *handle, rl_uint32 count)
+{
+	rl_uint8 *hashes;
+
+	if (NULL == (hashes = (rl_uint8 *) rl_alloc_sized(count * RL_HASH_SIZE)))
+		return NULL;
+
+	if (0 != hash_blocks(self, handle, count, hashes))
+	{
+		rl_free_sized(hashes, count * RL_HASH_SIZE);
+		return NULL;
+	}
+
+	return hashes;
+}
+
+/* Bytes of instructions that may go in the answer to a delta request. */
+static rl_uint32 delta_room(peer_t *peer)
+{
+	rl_msg_t answer;
+	size_t max_length;
+
+	RL_MSG_INIT(answer, RL_MSG_DELTA_ANSWER);
+	max_length = peer->transport.max_output_size - rl_msg_encoded_size(&answer, peer->framing);
+	return (rl_uint32) RL_MIN_MACRO(max_length, RL_MAX_READ_SIZE);
+}
+
+/*
+ * Encode the start of the file as a delta against the [count] blocks named
+ * by [signatures] into [out], using at most [out_size] bytes. [*out_length]
+ * gets the length of the instructions and [*covered] the number of bytes
+ * they rebuild. Returns RL_NETERR_SUCCESS or an error code.
+ */
+static rl_uint32 encode_delta(rl_controller_t *self, rl_filehandle_t *handle, const rl_uint8 *signatures, rl_uint32 count,
+		rl_uint8 *out, rl_uint32 out_size, rl_uint32 *out_length, rl_uint32 *covered)
+{
+	const rl_uint32 size = RL_MIN_MACRO((rl_uint32) handle->size, (rl_uint32) RL_MAX_DELTA_SIZE);
+	rl_delta_stats_t stats;
+	rl_uint32 error = RL_NETERR_SUCCESS;
+	rl_uint32 filled = 0;
+	rl_uint8 *data;
+
+	rl_memset(&stats, 0, sizeof(stats));
+
+	if (NULL == (data = (rl_uint8 *) rl_alloc_sized(size + 1)))
+		return RL_NETERR_IO_ERROR;
+
+	while (filled < size)
+	{
+		rl_uint32 bytes_read = 0;
+
+		if (0 != read_at(self, handle, filled, data + filled, size - filled, &bytes_read))
+		{
+			error = RL_NETERR_IO_ERROR;
+			goto cleanup;
+		}
+
+		if (0 == bytes_read)
+			break;
+
+		filled += bytes_read;
+	}
+
+	if (0 != rl_delta_encode(data, filled, signatures, count, out, out_size, out_length, covered, &stats))
+	{
+		error = RL_NETERR_IO_ERROR;
+		goto cleanup;
+	}
+
+cleanup:
+	rl_free_sized(data, size + 1);
+	return error;
+}
+
+#if defined(RL_POSIX)
+typedef struct rl_dir_entry_tag
+{
+	int end_of_sequence;
+	rl_uint8 type;
+	rl_uint32 size;
+	char name[NAME_MAX + 1];
+} rl_dir_entry_t;
+
+/*
+ * Read the next entry of the directory [handle] into [entry], starting over
+ * if [reset] is set. Returns RL_NETERR_SUCCESS or an error code. Runs on a
+ * worker thread when there are any; directory handles have at most one of
+ * these in flight.
+ */
+static rl_uint32 next_dir_entry(rl_filehandle_t *handle, int reset, rl_statcache_t *statcache, rl_dir_entry_t *entry)
+{
+	struct dirent *dent;
+
+	/* FIXME: This doesn't filter away '.' and '..' */
+	if (reset)
+	{
+		if (handle->dir_handle)
+		{
+			closedir(handle->dir_handle);
+			handle->dir_handle = NULL;
+		}
+
+		handle->dir_position = 0;
+	}
+
+	/* A bulk listing can't carry on from here. */
+	handle->dir_cookie = 0;
+
+	if (!handle->dir_handle)
+	{
+		rl_uint32 i;
+
+		if (NULL == (handle->dir_handle = opendir(handle->native_path)))
+			return RL_NETERR_IO_ERROR;
+
+		/* Get back to where the listing was when the handle was parked. */
+		for (i = 0; i < handle->dir_position; ++i)
+		{
+			if (NULL == readdir(handle->dir_handle))
+				break;
+		}
+	}
+
+	entry->end_of_sequence = 0;
+
+	// Set errno to zero before calling readdir; errno is not changed at end-of-directory
+	errno = 0;
+
+	if (NULL == (dent = readdir(handle->dir_handle)))
+	{
+		if (0 != errno)
+			return RL_NETERR_IO_ERROR;
+
+		entry->end_of_sequence = 1;
+		entry->type = RL_NODE_TYPE_DIRECTORY;
+		entry->name[0] = '\0';
+		entry->size = 0;
+	}
+	else
+	{
+		char item_path[NAME_MAX];
+		rl_strbuf_t path;
+		rl_statinfo_t info;
+
+		rl_strbuf_init(&path, item_path, sizeof(item_path));
+		rl_strbuf_append(&path, handle->native_path);
+		rl_strbuf_append(&path, "/");
+		rl_strbuf_append(&path, dent->d_name);
+
+		/* FIXME: Maybe we should just ignore the item. */
+		if (0 != rl_statcache_stat(statcache, item_path, &info) || !info.exists)
+			return RL_NETERR_IO_ERROR;
+
+		entry->type = S_ISDIR(info.mode) ?
+			RL_NODE_TYPE_DIRECTORY : RL_NODE_TYPE_FILE;
+		rl_string_copy(sizeof(entry->name), entry->name, dent->d_name);
+		entry->size = (rl_uint32) info.size;
+		++handle->dir_position;
+	}
+
+	return RL_NETERR_SUCCESS;
+}
+#endif
+
+/*
+ * Bulk directory listing.
+ *
+ * Entries are packed (see protocol.h) straight into the answer. The cookie is
+ * an entry index: a listing that picks up where the last answer ended simply
+ * carries on, anything else starts over and skips ahead. The entry that
+ * didn't fit in an answer is kept in the handle for the next one.
+ */
+static void pack_dir_entry(rl_uint8 *out, rl_uint32 *length, rl_uint8 type, rl_uint32 size, rl_uint32 date, rl_uint32 protection, const char *name)
+{
+	const size_t name_length = rl_strlen(name);
+
+	rl_encode_int4(&out, size);
+	rl_encode_int4(&out, date);
+	rl_encode_int4(&out, protection);
+	rl_encode_int1(&out, type);
+	rl_encode_int1(&out, (rl_uint8) name_length);
+	rl_memcpy(out, name, name_length);
+
+	*length = (rl_uint32) (RL_DIRENTRY_HEADER_SIZE + name_length);
+}
+
+static void rewind_dir(rl_filehandle_t *handle)
+{
+#if defined(RL_WIN32)
+	if (handle->find_handle)
+	{
+		FindClose(handle->find_handle);
+		handle->find_handle = NULL;
+	}
+#elif defined(RL_POSIX)
+	if (handle->dir_handle)
+		rewinddir((DIR *) handle->dir_handle);
+#else
+#error "Implement me."
+#endif
+
+	handle->dir_cookie = 0;
+	handle->held_length = 0;
+	handle->dir_position = 0;
+}
+
+/*
+ * Pack the next entry of the directory [handle] into [out], which has room
+ * for RL_DIRENTRY_MAX_SIZE bytes. [*length] is zero at the end of the
+ * directory.
+ */
+static rl_uint32 read_packed_entry(rl_filehandle_t *handle, struct rl_statcache_tag *statcache, rl_uint8 *out, rl_uint32 *length)
+{
+	/* We serve a read-only file system. */
+	const rl_uint32 protection = RL_PROTECT_WRITE | RL_PROTECT_DELETE;
+
+#if defined(RL_WIN32)
+	WIN32_FIND_DATAA find_data;
+
+	for (;;)
+	{
+		ULARGE_INTEGER write_time;
+		rl_uint32 date = 0;
+
+		if (!handle->find_handle)
+		{
+			char search_path[MAX_PATH];
+
+			rl_format_msg(search_path, sizeof(search_path), "%s\\*", handle->native_path);
+
+			handle->find_handle = FindFirstFileA(search_path, &find_data);
+			if (INVALID_HANDLE_VALUE == handle->find_handle)
+			{
+				handle->find_handle = NULL;
+				return RL_NETERR_IO_ERROR;
+			}
+		}
+		else if (!FindNextFileA(handle->find_handle, &find_data))
+		{
+			*length = 0;
+			return ERROR_NO_MORE_FILES == GetLastError() ? RL_NETERR_SUCCESS : RL_NETERR_IO_ERROR;
+		}
+
+		/* Skip dot files, like find_next_file does. */
+		if ('.' == find_data.cFileName[0] || rl_strlen(find_data.cFileName) > 255)
+			continue;
+
+		/* FILETIME counts 100ns intervals since 1601. */
+		write_time.LowPart = find_data.ftLastWriteTime.dwLowDateTime;
+		write_time.HighPart = find_data.ftLastWriteTime.dwHighDateTime;
+		write_time.QuadPart /= 10000000;
+
+		if (write_time.QuadPart > 11644473600ULL + RL_AMIGA_EPOCH_OFFSET)
+			date = (rl_uint32) (write_time.QuadPart - 11644473600ULL - RL_AMIGA_EPOCH_OFFSET);
+
+		pack_dir_entry(out, length,
+				(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? RL_NODE_TYPE_DIRECTORY : RL_NODE_TYPE_FILE,
+				find_data.nFileSizeLow, /* FIXME: 64-bit file sizes */
+				date, protection, find_data.cFileName);
+		return RL_NETERR_SUCCESS;
+	}
+#elif defined(RL_POSIX)
+	if (!handle->dir_handle)
+	{
+		if (NULL == (handle->dir_handle = opendir(handle->native_path)))
+			return RL_NETERR_IO_ERROR;
+	}
+
+	for (;;)
+	{
+		struct dirent *dent;
+		char item_path[RL_MAX_NATIVE_PATH + NAME_MAX + 2];
+		rl_strbuf_t path;
+		rl_statinfo_t info;
+		rl_uint32 date = 0;
+
+		errno = 0;
+
+		if (NULL == (dent = readdir(handle->dir_handle)))
+		{
+			*length = 0;
+			return 0 == errno ? RL_NETERR_SUCCESS : RL_NETERR_IO_ERROR;
+		}
+
+		if (0 == rl_strcmp(".", dent->d_name) || 0 == rl_strcmp("..", dent->d_name) ||
+			rl_strlen(dent->d_name) > 255)
+			continue;
+
+		rl_strbuf_init(&path, item_path, sizeof(item_path));
+		rl_strbuf_append(&path, handle->native_path);
+		rl_strbuf_append(&path, "/");
+		rl_strbuf_append(&path, dent->d_name);
+
+		/* Entries that have gone away (or dangling links) are left out. */
+		if (0 != rl_statcache_stat(statcache, item_path, &info) || !info.exists)
+			continue;
+
+		if (info.mtime > (time_t) RL_AMIGA_EPOCH_OFFSET)
+			date = (rl_uint32) (info.mtime - RL_AMIGA_EPOCH_OFFSET);
+
+		pack_dir_entry(out, length,
+				S_ISDIR(info.mode) ? RL_NODE_TYPE_DIRECTORY : RL_NODE_TYPE_FILE,
+				(rl_uint32) info.size, date,
+				protection | ((info.mode & (S_IRUSR | S_IRGRP | S_IROTH)) ? 0 : RL_PROTECT_READ),
+				dent->d_name);
+		return RL_NETERR_SUCCESS;
+	}
+#else
+#error "Implement me."
+#endif
+}
+
+/*
+ * Pack entries of the directory [handle], starting at entry [cookie], into
+ * [buffer] until it's full or the directory ends. Runs on a worker thread
+ * when there are any; it's serialised with the other directory scans.
+ */
+static rl_uint32 list_dir(rl_filehandle_t *handle, struct rl_statcache_tag *statcache, rl_uint32 cookie, rl_uint8 *buffer, rl_uint32 buffer_size, rl_uint32 *length, int *end_of_sequence)
+{
+	rl_uint32 error;
+
+	*length = 0;
+	*end_of_sequence = 0;
+
+	if (!handle->held_entry && NULL == (handle->held_entry = (rl_uint8 *) rl_alloc_sized(RL_DIRENTRY_MAX_SIZE)))
+		return RL_NETERR_IO_ERROR;
+
+	if (0 == cookie || cookie != handle->dir_cookie)
+	{
+		rewind_dir(handle);
+
+		while (handle->dir_cookie < cookie)
+		{
+			if (0 != (error = read_packed_entry(handle, statcache, handle->held_entry, &handle->held_length)))
+				return error;
+
+			if (0 == handle->held_length)
+			{
+				*end_of_sequence = 1;
+				return RL_NETERR_SUCCESS;
+			}
+
+			++handle->dir_cookie;
+		}
+
+		handle->held_length = 0;
+	}
+
+	for (;;)
+	{
+		if (0 == handle->held_length)
+		{
+			if (0 != (error = read_packed_entry(handle, statcache, handle->held_entry, &handle->held_length)))
+				return error;
+
+			if (0 == handle->held_length)
+			{
+				*end_of_sequence = 1;
+				break;
+			}
+		}
+
+		if (*length + handle->held_length > buffer_size)
+			break;
+
+		rl_memcpy(buffer + *length, handle->held_entry, handle->held_length);
+		*length += handle->held_length;
+		handle->held_length = 0;
+		++handle->dir_cookie;
+	}
+
+	return RL_NETERR_SUCCESS;
+}
+
+static void close_native(rl_controller_t *self, rl_filehandle_t *handle)
+{
+	/* Don't let the next user of the slot list this directory. */
+	rewind_dir(handle);
+
+	if (handle->held_entry)
+	{
+		rl_free_sized(handle->held_entry, RL_DIRENTRY_MAX_SIZE);
+		handle->held_entry = NULL;
+	}
+
+#if defined(RL_WIN32)
+	(void) self;
+
+	if (INVALID_HANDLE_VALUE != handle->handle)
+		CloseHandle(handle->handle);
+	handle->handle = NULL;
+#elif defined(RL_POSIX)
+	untrack_handle(self, handle);
+
+	if (handle->dir_handle)
+	{
+		closedir(handle->dir_handle);
+		handle->dir_handle = NULL;
+	}
+
+	if (handle->dir_fd > 0)
+	{
+		close(handle->dir_fd);
+		handle->dir_fd = 0;
+	}
+
+	/* Directories are marked with -1 and failed opens with 0; parked files
+	 * have nothing left to close. */
+	if (RL_NODE_TYPE_FILE == handle->type && handle->handle > 0)
+		close(handle->handle);
+	handle->handle = 0;
+	handle->parked = 0;
+#else
+#error "Implement me."
+#endif
+}
+
+/* A job or stream is done with [handle]. Closes it if that was requested
+ * while it was busy. */
+static void put_job_handle(rl_controller_t *self, rl_filehandle_t *handle)
+{
+	if (0 == --handle->jobs && handle->close_pending)
+	{
+		handle->close_pending = 0;
+		close_native(self, handle);
+
+		if (handle->in_use)
+			release_slot(self, handle);
+	}
+}
+
+#if defined(RL_POSIX)
+/*
+ * Worker jobs.
+ *
+ * With worker threads, everything that might block on the file system runs
+ * on them. A job carries the request to a worker and the result back, and
+ * the answer is sent from the event loop thread once the job has finished,
+ * so answers go out in whatever order the file system gets through the
+ * requests. Workers only touch the job and the handle it was submitted for;
+ * the handle is kept open until the last of its jobs is done.
+ */
+typedef struct rl_fs_job_tag
+{
+	rl_work_t work;
+
+	rl_controller_t *ctrl;
+	rl_filehandle_t *handle;
+	struct rl_fs_job_tag *next_waiting;
+
+	/* The handle was parked when the job was submitted. The job reopens
+	 * the file into [opened] and reads through that; the handle takes the
+	 * descriptor over when the job is done. */
+	int reopen;
+
+	rl_msg_kind_t kind;
+	rl_uint32 seqno;
+	rl_uint32 error;
+
+	/* open handle: [native_path] is opened into [opened], and up to [length]
+	 * bytes from the start of a file are read into [data], and up to
+	 * [max_hashes] of its blocks hashed into [hashes]; together they fit
+	 * [room]. Relative opens open the name at [name_offset] inside [dir_fd],
+	 * the descriptor of [parent], which the job keeps in use. */
+	int mode;
+	rl_uint32 room;
+	rl_uint32 max_hashes;
+	rl_uint32 hash_count;
+	rl_uint8 *hashes;
+	char native_path[RL_MAX_NATIVE_PATH];
+	rl_filehandle_t *parent;
+	int dir_fd;
+	size_t name_offset;
+	rl_filehandle_t opened;
+
+	/* find next file */
+	int reset;
+	rl_dir_entry_t entry;
+
+	/* examine all: entries from [cookie] on are packed into [data], up to
+	 * [length] bytes */
+	rl_uint32 cookie;
+	int end_of_sequence;
+
+	/* read file/stream: [length] bytes at [offset] are read into [data].
+	 * Streams are read in rounds of up to RL_MAX_READ_SIZE bytes, with
+	 * [remaining] bytes left to go at the start of a round. */
+	rl_uint32 offset;
+	rl_uint32 length;
+	rl_uint32 remaining;
+	rl_uint32 max_chunk;
+	rl_uint8 *data;
+	rl_uint32 data_size;
+	rl_uint32 data_length;
+
+	/* If [pack] is set, the answers to a read are compressed for a peer
+	 * using [framing] as well, one after the other into [packed]: the
+	 * compressed length of each body, zero if it didn't compress, and the
+	 * bytes. They're encoded into [frame] first, and [table] is the
+	 * compressor's scratch space. */
+	int pack;
+	int framing;
+	rl_uint8 *packed;
+	rl_uint32 packed_size;
+	rl_uint32 packed_length;
+	rl_uint8 *frame;
+	rl_uint32 frame_size;
+	rl_uint32 *table;
+
+	/* delta: the file is encoded against the [signature_count] blocks named
+	 * by [signatures] into [data], up to [length] bytes, rebuilding its first
+	 * [covered] bytes */
+	rl_uint8 *signatures;
+	rl_uint32 signature_count;
+	rl_uint32 covered;
+} rl_fs_job_t;
+
+/* Make [*buffer], of [*size] bytes, hold at least [length]; what's in it
+ * goes. */
+static int reserve(rl_uint8 **buffer, rl_uint32 *size, rl_uint32 length)
+{
+	if (length > *size)
+	{
+		if (*buffer)
+			rl_free_sized(*buffer, *size);
+
+		*size = 0;
+
+		if (NULL == (*buffer = (rl_uint8 *) rl_alloc_sized(length)))
+			return 1;
+
+		*size = length;
+	}
+
+	return 0;
+}
+
+/* Make room for [length] bytes of data. */
+static int reserve_job_data(rl_fs_job_t *job)
+{
+	job->data_length = 0;
+	return reserve(&job->data, &job->data_size, job->length);
+}
+
+static void read_job(rl_fs_job_t *job, rl_filehandle_t *handle)
+{
+	if (0 != reserve_job_data(job))
+	{
+		job->error = RL_NETERR_IO_ERROR;
+		return;
+	}
+
+	while (job->data_length < job->length)
+	{
+		rl_uint32 bytes_read = 0;
+
+		if (0 != read_at(job->ctrl, handle, job->offset + job->data_length,
+				job->data + job->data_length, job->length - job->data_length, &bytes_read))
+		{
+			job->error = RL_NETERR_IO_ERROR;
+			return;
+		}
+
+		if (0 == bytes_read)
+			break;
+
+		job->data_length += bytes_read;
+	}
+
+	job->error = RL_NETERR_SUCCESS;
+}
+
+/* Name the blocks of the data read by a job by their contents, as
+ * hash_blocks() does for a file. Leaves out the hashes if out of memory. */
+static void hash_job_data(rl_fs_job_t *job)
+{
+	rl_uint32 offset;
+	rl_uint32 index;
+
+	job->hash_count = (job->data_length + RL_HASH_BLOCK_SIZE - 1) / RL_HASH_BLOCK_SIZE;
+
+	if (0 == job->hash_count)
+		return;
+
+	if (NULL == (job->hashes = (rl_uint8 *) rl_alloc_sized(job->hash_count * RL_HASH_SIZE)))
+	{
+		job->hash_count = 0;
+		return;
+	}
+
+	for (offset = 0, index = 0; index < job->hash_count; offset += RL_HASH_BLOCK_SIZE, ++index)
+	{
+		const rl_uint32 block_length = RL_MIN_MACRO(job->data_length - offset, (rl_uint32) RL_HASH_BLOCK_SIZE);
+		rl_xxhash64_encode(rl_xxhash64(job->data + offset, block_length, 0), job->hashes + index * RL_HASH_SIZE);
+	}
+}
+
+/*
+ * Fill in [answer] for the part of a finished read, or read stream round,
+ * that starts [sent] bytes into its data. Returns the length of that part.
+ */
+static rl_uint32 read_answer(const rl_fs_job_t *job, rl_uint32 sent, rl_msg_t *answer)
+{
+	const rl_uint32 length = RL_MIN_MACRO(job->data_length - sent, job->max_chunk);
+
+	if (RL_MSG_READ_FILE_REQUEST == job->kind)
+	{
+		RL_MSG_INIT(*answer, RL_MSG_READ_FILE_ANSWER);
+		answer->read_file_answer.hdr_in_reply_to = job->seqno;
+		answer->read_file_answer.data.base = job->data + sent;
+		answer->read_file_answer.data.length = length;
+	}
+	else
+	{
+		/* A short read means end of file. */
+		const int final = job->remaining == job->data_length || job->data_length < job->length;
+
+		RL_MSG_INIT(*answer, RL_MSG_READ_STREAM_ANSWER);
+		answer->read_stream_answer.hdr_in_reply_to = job->seqno;
+		answer->read_stream_answer.final = (rl_uint8) (final && sent + length == job->data_length);
+		answer->read_stream_answer.data.base = job->data + sent;
+		answer->read_stream_answer.data.length = length;
+	}
+
+	return length;
+}
+
+/*
+ * Compress the frame body of [msg] the way the peer would (see
+ * compress_frame() in peer.c) into the next record of [packed]. Bodies too
+ * short to bother with get an empty record.
+ */
+static void pack_answer(rl_fs_job_t *job, const rl_msg_t *msg)
+{
+	const rl_uint32 header_size = (rl_uint32) rl_frame_header_size(job->framing);
+	rl_uint8 *record = job->packed + job->packed_length;
+	rl_uint32 packed_length = 0;
+	size_t frame_length = 0;
+
+	if (0 == rl_encode_msg(msg, job->framing, job->frame, (int) job->frame_size, &frame_length) &&
+		frame_length >= header_size + RL_COMPRESS_MIN_SIZE)
+	{
+		const rl_uint32 body_size = (rl_uint32) frame_length - header_size;
+
+		packed_length = rl_packcache_compress(job->ctrl->packcache, job->frame + header_size, body_size,
+				record + 4, body_size - 4 - 1, job->table);
+	}
+
+	rl_encode_int4(&record, packed_length);
+	job->packed_length += 4 + packed_length;
+}
+
+/*
+ * Compress the answers to a finished read, or read stream round, so the
+ * event loop only has to frame them; see peer_transmit_packed_message().
+ * If out of memory, [packed] is left empty and they go out as they are.
+ */
+static void pack_answers(rl_fs_job_t *job)
+{
+	const rl_uint32 count = job->data_length ? (job->data_length + job->max_chunk - 1) / job->max_chunk : 1;
+	rl_msg_t answer;
+	rl_uint32 sent = 0;
+	rl_uint32 first_length;
+	rl_uint32 frame_size;
+
+	job->packed_length = 0;
+
+	/* The first answer is the largest; a record is never larger than the
+	 * frame it was packed from. */
+	first_length = read_answer(job, 0, &answer);
+	frame_size = (rl_uint32) rl_msg_encoded_size(&answer, job->framing);
+
+	if (0 != reserve(&job->frame, &job->frame_size, frame_size) ||
+		0 != reserve(&job->packed, &job->packed_size,
+			job->data_length + count * (4 + frame_size - first_length)))
+		return;
+
+	if (NULL == job->table &&
+		NULL == (job->table = (rl_uint32 *) rl_alloc_sized(RL_LZ_TABLE_SIZE * sizeof(rl_uint32))))
+		return;
+
+	do
+	{
+		sent += read_answer(job, sent, &answer);
+		pack_answer(job, &answer);
+	} while (sent < job->data_length);
+}
+
+static void run_job(rl_work_t *work)
+{
+	rl_fs_job_t * const job = (rl_fs_job_t *) work;
+	rl_filehandle_t *handle = job->handle;
+
+	if (job->reopen)
+	{
+		if (RL_NETERR_SUCCESS != (job->error = reopen_file(handle, &job->opened.handle)))
+			return;
+
+		job->opened.type = handle->type;
+		job->opened.size = handle->size;
+		handle = &job->opened;
+	}
+
+	switch (job->kind)
+	{
+		case RL_MSG_OPEN_HANDLE_REQUEST:
+			if (job->parent)
+				open_native_at(&job->opened, job->dir_fd, job->native_path + job->name_offset, job->native_path, job->mode, job->ctrl->statcache, &job->error);
+			else
+				open_native(&job->opened, job->native_path, job->mode, job->ctrl->statcache, &job->error);
+
+			if (RL_NETERR_SUCCESS == job->error && RL_NODE_TYPE_FILE == job->opened.type)
+			{
+				plan_answer(job->room, job->max_hashes, job->length, (rl_uint32) job->opened.size,
+						&job->hash_count, &job->length);
+
+				if (job->hash_count > 0 &&
+					NULL == (job->hashes = new_block_hashes(job->ctrl, &job->opened, job->hash_count)))
+					job->hash_count = 0;
+
+				if (job->length > 0)
+					read_job(job, &job->opened);
+
+				/* The open still stands; the target reads the data itself. */
+				if (RL_NETERR_SUCCESS != job->error)
+				{
+					job->data_length = 0;
+					job->error = RL_NETERR_SUCCESS;
+				}
+			}
+			break;
+		case RL_MSG_FIND_NEXT_FILE_REQUEST:
+			job->error = next_dir_entry(job->handle, job->reset, job->ctrl->statcache, &job->entry);
+			break;
+		case RL_MSG_EXAMINE_ALL_REQUEST:
+			if (0 != reserve_job_data(job))
+				job->error = RL_NETERR_IO_ERROR;
+			else
+				job->error = list_dir(job->handle, job->ctrl->statcache, job->cookie, job->data, job->length, &job->data_length, &job->end_of_sequence);
+			break;
+		case RL_MSG_DELTA_REQUEST:
+			if (0 != reserve_job_data(job))
+				job->error = RL_NETERR_IO_ERROR;
+			else
+				job->error = encode_delta(job->ctrl, handle, job->signatures, job->signature_count,
+						job->data, job->length, &job->data_length, &job->covered);
+			break;
+		case RL_MSG_PUSH_FILE_REQUEST:
+			if (0 != open_native(&job->opened, job->native_path, RL_OPENFLAG_READ, job->ctrl->statcache, &job->error))
+				break;
+
+			if (RL_NODE_TYPE_FILE != job->opened.type)
+			{
+				job->error = RL_NETERR_NOT_A_FILE;
+				break;
+			}
+
+			job->length = RL_MIN_MACRO(job->length, (rl_uint32) job->opened.size);
+			read_job(job, &job->opened);
+
+			/* Nothing else uses the descriptor. */
+			close(job->opened.handle);
+
+			/* The file shrank under us; whatever was read is stale. */
+			if (RL_NETERR_SUCCESS == job->error && job->data_length < job->length)
+				job->error = RL_NETERR_IO_ERROR;
+
+			if (RL_NETERR_SUCCESS == job->error)
+				hash_job_data(job);
+			break;
+		default:
+			read_job(job, handle);
+
+			if (job->pack && RL_NETERR_SUCCESS == job->error)
+				pack_answers(job);
+			break;
+	}
+}
+
+static rl_fs_job_t *new_job(rl_controller_t *self, rl_filehandle_t *handle, const rl_msg_t *msg)
+{
+	rl_fs_job_t *job;
+
+	if (NULL == (job = RL_ALLOC_TYPED_ZERO(rl_fs_job_t)))
+		return NULL;
+
+	job->work.run = run_job;
+	job->ctrl = self;
+	job->handle = handle;
+	job->kind = rl_msg_kind_of(msg);
+	job->seqno = msg->handshake_request.hdr_sequence_num;
+	return job;
+}
+
+static int is_dir_scan(const rl_fs_job_t *job)
+{
+	return RL_MSG_FIND_NEXT_FILE_REQUEST == job->kind || RL_MSG_EXAMINE_ALL_REQUEST == job->kind;
+}
+
+static void free_job(rl_fs_job_t *job)
+{
+	if (job->data)
+		rl_free_sized(job->data, job->data_size);
+
+	if (job->hashes)
+		rl_free_sized(job->hashes, job->hash_count * RL_HASH_SIZE);
+
+	if (job->signatures)
+		rl_free_sized(job->signatures, job->signature_count * RL_DELTA_SIGNATURE_SIZE);
+
+	if (job->packed)
+		rl_free_sized(job->packed, job->packed_size);
+
+	if (job->frame)
+		rl_free_sized(job->frame, job->frame_size);
+
+	if (job->table)
+		rl_free_sized(job->table, RL_LZ_TABLE_SIZE * sizeof(rl_uint32));
+
+	RL_FREE_TYPED(rl_fs_job_t, job);
+}
+
+static void submit_job(rl_controller_t *self, rl_fs_job_t *job)
+{
+	rl_filehandle_t * const handle = job->handle;
+
+	++handle->jobs;
+	job->reopen = handle->parked;
+
+	/* A finished open holds a descriptor until its answer is sent, and the
+	 * event loop may be busy taking in more requests meanwhile. */
+	if (RL_MSG_OPEN_HANDLE_REQUEST == job->kind)
+	{
+		if (self->opens_in_flight >= self->max_open_files)
+		{
+			job->next_waiting = NULL;
+
+			if (self->waiting_opens_tail)
+				self->waiting_opens_tail->next_waiting = job;
+			else
+				self->waiting_opens_head = job;
+
+			self->waiting_opens_tail = job;
+			return;
+		}
+
+		++self->opens_in_flight;
+	}
+
+	/* Directory scans keep their place in the directory stream, so they
+	 * must run one at a time and in order. */
+	if (is_dir_scan(job))
+	{
+		if (handle->scanning)
+		{
+			job->next_waiting = NULL;
+
+			if (handle->waiting_tail)
+				handle->waiting_tail->next_waiting = job;
+			else
+				handle->waiting_head = job;
+
+			handle->waiting_tail = job;
+			return;
+		}
+
+		handle->scanning = 1;
+	}
+
+	rl_workpool_submit(self->workers, &job->work);
+}
+
+static int submit_open_handle(rl_controller_t *self, peer_t *peer, const rl_msg_t *msg)
+{
+	rl_filehandle_t *slot;
+	rl_fs_job_t *job;
+	rl_uint32 error;
+
+	if (NULL == (job = new_job(self, NULL, msg)))
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+	if (0 != (error = resolve_open(self, peer, msg, job->native_path, sizeof(job->native_path), &job->parent, &job->name_offset)))
+	{
+		free_job(job);
+		return reply_with_error(peer, msg, error);
+	}
+
+	/* Probes for files that are known not to exist are answered right
+	 * away. */
+	if (self->statcache && 0 == (msg->open_handle_request.mode & RL_OPENFLAG_WRITE))
+	{
+		rl_statinfo_t info;
+
+		if (0 == rl_statcache_lookup(self->statcache, job->native_path, &info) && !info.exists)
+		{
+			RL_LOG_DEBUG(("make_handle(\"%s\") => \"%s\" (known missing)", msg->open_handle_request.path, job->native_path));
+			free_job(job);
+			return reply_with_error(peer, msg, RL_NETERR_NOT_FOUND);
+		}
+	}
+
+	if (NULL == (slot = alloc_slot(self)))
+	{
+		free_job(job);
+		return reply_with_error(peer, msg, RL_NETERR_TOO_MANY_FILES_OPEN);
+	}
+
+	RL_LOG_DEBUG(("make_handle(\"%s\") => \"%s\" (queued)", msg->open_handle_request.path, job->native_path));
+
+	/* Keep the slot to ourselves until the open is done, and the parent
+	 * directory's descriptor open until it's been used. */
+	slot->opening = 1;
+	job->handle = slot;
+
+	if (job->parent)
+	{
+		job->dir_fd = job->parent->dir_fd;
+		++job->parent->jobs;
+	}
+
+	job->mode = msg->open_handle_request.mode;
+	job->room = answer_room(peer, msg);
+	job->max_hashes = msg->open_handle_request.max_hashes;
+	job->length = msg->open_handle_request.inline_size;
+	submit_job(self, job);
+	return 0;
+}
+
+static int submit_find_next_file(rl_controller_t *self, rl_filehandle_t *handle, peer_t *peer, const rl_msg_t *msg)
+{
+	rl_fs_job_t *job;
+
+	if (NULL == (job = new_job(self, handle, msg)))
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+	job->reset = msg->find_next_file_request.reset;
+	submit_job(self, job);
+	return 0;
+}
+
+static int submit_examine_all(rl_controller_t *self, rl_filehandle_t *handle, peer_t *peer, const rl_msg_t *msg, rl_uint32 max_size)
+{
+	rl_fs_job_t *job;
+
+	if (NULL == (job = new_job(self, handle, msg)))
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+	job->cookie = msg->examine_all_request.cookie;
+	job->length = max_size;
+	submit_job(self, job);
+	return 0;
+}
+
+static int submit_read(rl_controller_t *self, rl_filehandle_t *handle, peer_t *peer, const rl_msg_t *msg, rl_uint32 offset, rl_uint32 length)
+{
+	rl_msg_t answer;
+	rl_fs_job_t *job;
+	size_t max_chunk;
+
+	if (NULL == (job = new_job(self, handle, msg)))
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+	/* Size answers as large as the peer's negotiated message size allows. */
+	RL_MSG_INIT(answer, RL_MSG_READ_STREAM_ANSWER);
+	max_chunk = peer->transport.max_output_size - rl_msg_encoded_size(&answer, peer->framing);
+	job->max_chunk = (rl_uint32) RL_MIN_MACRO(max_chunk, RL_MAX_READ_SIZE);
+
+	job->offset = offset;
+
+	/* Compress the answers in the job too, rather than on the event loop. */
+	job->pack = NULL != self->packcache && peer_compresses(peer);
+	job->framing = peer->framing;
+
+	if (RL_MSG_READ_STREAM_REQUEST == job->kind)
+	{
+		job->remaining = length;
+		job->length = RL_MIN_MACRO(length, RL_MAX_READ_SIZE);
+	}
+	else
+	{
+		/* one answer only */
+		job->length = RL_MIN_MACRO(length, job->max_chunk);
+	}
+
+	submit_job(self, job);
+	return 0;
+}
+
+static int submit_delta(rl_controller_t *self, rl_filehandle_t *handle, peer_t *peer, const rl_msg_t *msg)
+{
+	const rl_msg_delta_request_t * const request = &msg->delta_request;
+	rl_fs_job_t *job;
+
+	if (NULL == (job = new_job(self, handle, msg)))
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+	/* The request goes away once it's been served. */
+	job->signature_count = request->signatures.length / RL_DELTA_SIGNATURE_SIZE;
+
+	if (job->signature_count > 0)
+	{
+		if (NULL == (job->signatures = (rl_uint8 *) rl_alloc_sized(request->signatures.length)))
+		{
+			job->signature_count = 0;
+			free_job(job);
+			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+		}
+
+		rl_memcpy(job->signatures, request->signatures.base, request->signatures.length);
+	}
+
+	job->length = delta_room(peer);
+	submit_job(self, job);
+	return 0;
+}
+
+/*
+ * Send the answers to a finished read, or read stream round, compressed if
+ * the job packed them. Returns non-zero if the last one is final.
+ */
+static int transmit_read_answers(peer_t *peer, rl_fs_job_t *job)
+{
+	const rl_uint8 *packed = job->packed_length ? job->packed : NULL;
+	rl_msg_t answer;
+	rl_uint32 sent = 0;
+
+	do
+	{
+		sent += read_answer(job, sent, &answer);
+
+		if (NULL == packed)
+		{
+			transmit_answer(peer, &answer);
+		}
+		else
+		{
+			const rl_uint8 *record;
+			rl_uint32 packed_length;
+
+			rl_decode_int4(&packed, &packed_length);
+			record = packed;
+			packed += packed_length;
+
+			if (0 != capture_answer(peer, &answer, -1, 0, 0))
+				peer_transmit_packed_message(peer, &answer, record, packed_length);
+		}
+	} while (sent < job->data_length);
+
+	return RL_MSG_READ_STREAM_ANSWER == rl_msg_kind_of(&answer) && answer.read_stream_answer.final;
+}
+
+/* Send the answers for a finished stream read round. Returns non-zero if
+ * there's more to read. */
+static int transmit_stream_round(peer_t *peer, rl_fs_job_t *job)
+{
+	const int final = transmit_read_answers(peer, job);
+
+	job->remaining -= job->data_length;
+
+	if (final)
+		return 0;
+
+	job->offset += job->data_length;
+	job->length = RL_MIN_MACRO(job->remaining, RL_MAX_READ_SIZE);
+	return 1;
+}
+
+/*
+ * Send the preloaded start of the executable as push_file requests, if it's
+ * been read and the launch request is out, and let go of it. Frames carry
+ * whole blocks, so the target caches each as it comes, and the hashes go
+ * along with the first.
+ */
+static void push_preload(peer_t *peer)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_fs_job_t * const job = self->preload;
+	rl_uint32 offset = 0;
+
+	if (!job || !self->preload_ready || !self->push_wanted)
+		return;
+
+	self->preload = NULL;
+
+	if (RL_NETERR_SUCCESS == job->error)
+		RL_LOG_DEBUG(("pushing %u bytes of %s", job->data_length, job->native_path));
+	else
+		RL_LOG_DEBUG(("not pushing %s: error %u", job->native_path, job->error));
+
+	while (RL_NETERR_SUCCESS == job->error && offset < job->data_length)
+	{
+		rl_msg_t msg;
+		size_t header;
+		rl_uint32 length;
+
+		RL_MSG_INIT(msg, RL_MSG_PUSH_FILE_REQUEST);
+		msg.push_file_request.size = (rl_uint32) job->opened.size;
+		msg.push_file_request.stamp = (rl_uint32) job->opened.stamp;
+		msg.push_file_request.offset = offset;
+		msg.push_file_request.path = self->executable;
+
+		if (0 == offset)
+		{
+			msg.push_file_request.block_hashes.base = job->hashes;
+			msg.push_file_request.block_hashes.length = job->hash_count * RL_HASH_SIZE;
+		}
+
+		header = rl_msg_encoded_size(&msg, peer->framing);
+
+		if (header + RL_HASH_BLOCK_SIZE > peer->transport.max_output_size)
+			break;
+
+		length = (rl_uint32) ((peer->transport.max_output_size - header) / RL_HASH_BLOCK_SIZE * RL_HASH_BLOCK_SIZE);
+		length = RL_MIN_MACRO(length, job->data_length - offset);
+
+		msg.push_file_request.data.base = job->data + offset;
+		msg.push_file_request.data.length = length;
+
+		if (0 != peer_transmit_message(peer, &msg))
+			break;
+
+		offset += length;
+	}
+
+	free_job(job);
+}
+
+static void finish_job(peer_t *peer, rl_fs_job_t *job)
+{
+	rl_controller_t * const self = job->ctrl;
+	rl_filehandle_t * const handle = job->handle;
+	rl_msg_t answer;
+
+	/* The preload isn't for any handle, nor answered. */
+	if (RL_MSG_PUSH_FILE_REQUEST == job->kind)
+	{
+		self->preload_ready = 1;
+		push_preload(peer);
+		return;
+	}
+
+	if (RL_MSG_OPEN_HANDLE_REQUEST == job->kind)
+	{
+		rl_fs_job_t *next;
+
+		handle->opening = 0;
+
+		/* Let the next open in line go ahead. */
+		if (NULL != (next = self->waiting_opens_head))
+		{
+			if (NULL == (self->waiting_opens_head = next->next_waiting))
+				self->waiting_opens_tail = NULL;
+
+			rl_workpool_submit(self->workers, &next->work);
+		}
+		else
+		{
+			--self->opens_in_flight;
+		}
+
+		if (RL_NETERR_SUCCESS == job->error)
+		{
+			handle->handle = job->opened.handle;
+			handle->type = job->opened.type;
+			handle->size = job->opened.size;
+			handle->stamp = job->opened.stamp;
+			handle->open_flags = job->opened.open_flags;
+			handle->dir_fd = job->opened.dir_fd;
+
+			if (0 != rl_filehandle_set_path(self, handle, job->native_path))
+				job->error = RL_NETERR_IO_ERROR;
+			else if (holds_descriptor(handle))
+				use_handle(self, handle);
+		}
+
+		/* The slot goes back once the job is done with it. */
+		if (RL_NETERR_SUCCESS != job->error)
+			handle->close_pending = 1;
+	}
+	else if (job->reopen)
+	{
+		/* The first job to reopen a parked file hands its descriptor to
+		 * the handle; others that were at it too close theirs. */
+		if (job->opened.handle > 0 && handle->parked)
+		{
+			RL_LOG_DEBUG(("reopened %s", handle->native_path));
+			handle->handle = job->opened.handle;
+			handle->parked = 0;
+		}
+		else if (job->opened.handle > 0)
+		{
+			close(job->opened.handle);
+		}
+
+		/* Later rounds of a stream read through the handle. */
+		job->reopen = 0;
+	}
+	else if (is_dir_scan(job))
+	{
+		rl_fs_job_t *next;
+
+		/* Let the next scan of this directory go ahead. */
+		if (NULL != (next = handle->waiting_head))
+		{
+			if (NULL == (handle->waiting_head = next->next_waiting))
+				handle->waiting_tail = NULL;
+
+			rl_workpool_submit(self->workers, &next->work);
+		}
+		else
+		{
+			handle->scanning = 0;
+		}
+	}
+
+	if (RL_NETERR_SUCCESS != job->error)
+	{
+		transmit_error(peer, job->seqno, job->error);
+	}
+	else
+	{
+		switch (job->kind)
+		{
+			case RL_MSG_OPEN_HANDLE_REQUEST:
+				RL_MSG_INIT(answer, RL_MSG_OPEN_HANDLE_ANSWER);
+				answer.open_handle_answer.hdr_in_reply_to = job->seqno;
+				answer.open_handle_answer.handle = get_filehandle_id(self, handle);
+				answer.open_handle_answer.type = (rl_uint8) handle->type;
+				answer.open_handle_answer.size = (rl_uint32) handle->size;
+				answer.open_handle_answer.stamp = (rl_uint32) handle->stamp;
+				answer.open_handle_answer.block_hashes.base = job->hashes;
+				answer.open_handle_answer.block_hashes.length = job->hash_count * RL_HASH_SIZE;
+				answer.open_handle_answer.inline_data.base = job->data;
+				answer.open_handle_answer.inline_data.length = job->data_length;
+				transmit_answer(peer, &answer);
+				note_read(handle, 0, job->data_length);
+				break;
+
+			case RL_MSG_FIND_NEXT_FILE_REQUEST:
+				RL_MSG_INIT(answer, RL_MSG_FIND_NEXT_FILE_ANSWER);
+				answer.find_next_file_answer.hdr_in_reply_to = job->seqno;
+				answer.find_next_file_answer.end_of_sequence = job->entry.end_of_sequence;
+				answer.find_next_file_answer.type = job->entry.type;
+				answer.find_next_file_answer.name = job->entry.name;
+				answer.find_next_file_answer.size = job->entry.size;
+				transmit_answer(peer, &answer);
+				break;
+
+			case RL_MSG_EXAMINE_ALL_REQUEST:
+				RL_MSG_INIT(answer, RL_MSG_EXAMINE_ALL_ANSWER);
+				answer.examine_all_answer.hdr_in_reply_to = job->seqno;
+				answer.examine_all_answer.end_of_sequence = (rl_uint8) job->end_of_sequence;
+				answer.examine_all_answer.entries.base = job->data;
+				answer.examine_all_answer.entries.length = job->data_length;
+				transmit_answer(peer, &answer);
+				break;
+
+			case RL_MSG_READ_FILE_REQUEST:
+				transmit_read_answers(peer, job);
+				break;
+
+			case RL_MSG_DELTA_REQUEST:
+				RL_MSG_INIT(answer, RL_MSG_DELTA_ANSWER);
+				answer.delta_answer.hdr_in_reply_to = job->seqno;
+				answer.delta_answer.length = job->covered;
+				answer.delta_answer.instructions.base = job->data;
+				answer.delta_answer.instructions.length = job->data_length;
+				transmit_answer(peer, &answer);
+				RL_LOG_DEBUG(("delta of %s: %u bytes in %u", handle->native_path, job->covered, job->data_length));
+				break;
+
+			case RL_MSG_READ_STREAM_REQUEST:
+				if (transmit_stream_round(peer, job))
+				{
+					/* Same job, next round, once this one has gone out;
+					 * see rl_file_server_continue_streams(). The handle
+					 * stays in use. */
+					job->next_waiting = self->stalled_streams;
+					self->stalled_streams = job;
+					return;
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	put_job_handle(self, handle);
+
+	if (job->parent)
+		put_job_handle(self, job->parent);
+
+	free_job(job);
+}
+#endif
+
+static int open_handle_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_msg_t answer;
+	rl_uint32 error = RL_NETERR_NOT_FOUND;
+	rl_filehandle_t *handle;
+
+#if defined(RL_POSIX)
+	if (self->workers)
+		return submit_open_handle(self, peer, msg);
+#endif
+
+	/* map the filename to a handle */
+	handle = make_handle(self, peer, msg, &error);
+
+	/* if we didn't get a file handle, return with an error */
+	if (!handle)
+	{
+		return reply_with_error(peer, msg, error);
+	}
+	else
+	{
+		rl_uint32 inline_length = 0;
+		rl_uint32 hash_count = 0;
+		rl_uint8 *hashes = NULL;
+		int result;
+
+		/* reply with the handle */
+		RL_MSG_INIT(answer, RL_MSG_OPEN_HANDLE_ANSWER);
+		answer.open_handle_answer.hdr_in_reply_to = msg->open_handle_request.hdr_sequence_num;
+		answer.open_handle_answer.handle = get_filehandle_id(self, handle);
+		answer.open_handle_answer.type = (rl_uint8) handle->type;
+		answer.open_handle_answer.size = (rl_uint32) handle->size;
+		answer.open_handle_answer.stamp = (rl_uint32) handle->stamp;
+
+		/* Send the start of small files along, so the first read doesn't
+		 * have to wait for another round trip, and name the blocks of the
+		 * file so the target can use the ones it already has. */
+		if (RL_NODE_TYPE_FILE == handle->type)
+		{
+			plan_answer(answer_room(peer, msg), msg->open_handle_request.max_hashes,
+					msg->open_handle_request.inline_size, (rl_uint32) handle->size,
+					&hash_count, &inline_length);
+		}
+
+		if (hash_count > 0 && NULL != (hashes = new_block_hashes(self, handle, hash_count)))
+		{
+			answer.open_handle_answer.block_hashes.base = hashes;
+			answer.open_handle_answer.block_hashes.length = hash_count * RL_HASH_SIZE;
+		}
+
+#if defined(RL_POSIX)
+		if (inline_length > 0)
+		{
+			note_read(handle, 0, inline_length);
+			result = transmit_file_answer(peer, &answer, handle->handle, 0, inline_length);
+		}
+		else
+		{
+			result = transmit_answer(peer, &answer);
+		}
+#else
+		{
+			rl_uint8 *data = NULL;
+			rl_uint32 bytes_read = 0;
+
+			if (inline_length > 0 && NULL != (data = (rl_uint8 *) rl_alloc_sized(inline_length)))
+			{
+				if (0 == read_at(self, handle, 0, data, inline_length, &bytes_read))
+				{
+					answer.open_handle_answer.inline_data.base = data;
+					answer.open_handle_answer.inline_data.length = bytes_read;
+				}
+			}
+
+			result = transmit_answer(peer, &answer);
+
+			if (data)
+				rl_free_sized(data, inline_length);
+		}
+#endif
+
+		if (hashes)
+			rl_free_sized(hashes, hash_count * RL_HASH_SIZE);
+
+		return result;
+	}
+}
+
+static int close_handle_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_filehandle_t *handle;
+
+	/* Ignore attempts to close virtual input/output */
+	if (RL_FILEHANDLE_VIRTUAL_INPUT == msg->close_handle_request.handle ||
+		RL_FILEHANDLE_VIRTUAL_OUTPUT == msg->close_handle_request.handle)
+		return 0;
+
+	if (NULL == (handle = get_handle_from_id(self, peer, msg->close_handle_request.handle)))
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+	/* Workers may still be using the handle. */
+	if (handle->jobs > 0)
+	{
+		handle->close_pending = 1;
+		return 0;
+	}
+
+	close_native(self, handle);
+
+	/* The root handle isn't in the table. */
+	if (handle->in_use)
+		release_slot(self, handle);
+
+	return 0;
+}
+
+static int find_next_file_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_filehandle_t *handle;
+	rl_msg_t answer;
+
+#if defined(RL_WIN32)
+	WIN32_FIND_DATAA find_data;
+	BOOL reset = msg->find_next_file_request.reset ? TRUE : FALSE;
+	BOOL has_file = TRUE;
+#elif(defined RL_POSIX)
+	rl_dir_entry_t entry;
+	rl_uint32 error;
+#endif
+
+	if (NULL == (handle = get_handle_from_id(self, peer, msg->find_next_file_request.handle)))
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+	if (RL_NODE_TYPE_DIRECTORY != handle->type)
+		return reply_with_error(peer, msg, RL_NETERR_NOT_A_DIRECTORY);
+
+	use_handle(self, handle);
+
+#if defined(RL_WIN32)
+	/* A bulk listing can't carry on from here. */
+	handle->dir_cookie = 0;
+
+	do
+	{
+		if (reset)
+		{
 			char search_path[MAX_PATH];
 			reset = FALSE;
 
-			if (handle->find_handle)
-			{
-				FindClose(handle->find_handle);
-				handle->find_handle = NULL;
-			}
+			if (handle->find_handle)
+			{
+				FindClose(handle->find_handle);
+				handle->find_handle = NULL;
+			}
+
+			rl_format_msg(search_path, sizeof(search_path), "%s\\*", handle->native_path);
+
+			handle->find_handle = FindFirstFile(search_path, &find_data);
+			if (INVALID_HANDLE_VALUE == handle->find_handle)
+			{
+				handle->find_handle = NULL;
+				return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+			}
+		}
+		else
+		{
+			if (!handle->find_handle)
+				return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+			else
+				has_file = FindNextFile(handle->find_handle, &find_data);
+		}
+	} while (has_file && '.' == find_data.cFileName[0]);
+
+	RL_MSG_INIT(answer, RL_MSG_FIND_NEXT_FILE_ANSWER);
+	answer.find_next_file_answer.hdr_in_reply_to = msg->find_next_file_request.hdr_sequence_num;
+	answer.find_next_file_answer.end_of_sequence = has_file ? 0 : 1;
+
+	if (has_file)
+	{
+		answer.find_next_file_answer.type = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
+			RL_NODE_TYPE_DIRECTORY : RL_NODE_TYPE_FILE;
+		answer.find_next_file_answer.name = &find_data.cFileName[0];
+		answer.find_next_file_answer.size = find_data.nFileSizeLow; /* FIXME: 64-bit file sizes */
+	}
+	else
+	{
+		answer.find_next_file_answer.type = RL_NODE_TYPE_DIRECTORY;
+		answer.find_next_file_answer.name = "";
+		answer.find_next_file_answer.size = 0;
+	}
+
+#elif defined(RL_POSIX)
+	if (self->workers)
+		return submit_find_next_file(self, handle, peer, msg);
+
+	if (0 != (error = next_dir_entry(handle, msg->find_next_file_request.reset, self->statcache, &entry)))
+		return reply_with_error(peer, msg, error);
+
+	RL_MSG_INIT(answer, RL_MSG_FIND_NEXT_FILE_ANSWER);
+	answer.find_next_file_answer.hdr_in_reply_to =
+		msg->find_next_file_request.hdr_sequence_num;
+	answer.find_next_file_answer.end_of_sequence = entry.end_of_sequence;
+	answer.find_next_file_answer.type = entry.type;
+	answer.find_next_file_answer.name = entry.name;
+	answer.find_next_file_answer.size = entry.size;
+
+#else
+#error "Implement me"
+#endif
+
+	return transmit_answer(peer, &answer);
+}
+
+static int examine_all_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	const rl_msg_examine_all_request_t * const request = &msg->examine_all_request;
+	rl_filehandle_t *handle;
+	rl_msg_t answer;
+	rl_uint8 *entries;
+	rl_uint32 max_size, length, error;
+	int end_of_sequence;
+
+	if (NULL == (handle = get_handle_from_id(self, peer, request->handle)))
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+	if (RL_NODE_TYPE_DIRECTORY != handle->type)
+		return reply_with_error(peer, msg, RL_NETERR_NOT_A_DIRECTORY);
+
+	use_handle(self, handle);
+
+	/* Fill the answer as far as the target wants and the frame allows. */
+	RL_MSG_INIT(answer, RL_MSG_EXAMINE_ALL_ANSWER);
+	answer.examine_all_answer.hdr_in_reply_to = request->hdr_sequence_num;
+	max_size = (rl_uint32) (peer->transport.max_output_size - rl_msg_encoded_size(&answer, peer->framing));
+	max_size = RL_MIN_MACRO(max_size, request->max_size);
+
+	/* Every answer must have room for an entry to make progress. */
+	if (max_size < RL_DIRENTRY_MAX_SIZE)
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+#if defined(RL_POSIX)
+	if (self->workers)
+		return submit_examine_all(self, handle, peer, msg, max_size);
+#endif
+
+	if (NULL == (entries = (rl_uint8 *) rl_alloc_sized(max_size)))
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+	if (0 != (error = list_dir(handle, self->statcache, request->cookie, entries, max_size, &length, &end_of_sequence)))
+	{
+		rl_free_sized(entries, max_size);
+		return reply_with_error(peer, msg, error);
+	}
+
+	answer.examine_all_answer.end_of_sequence = (rl_uint8) end_of_sequence;
+	answer.examine_all_answer.entries.base = entries;
+	answer.examine_all_answer.entries.length = length;
+	transmit_answer(peer, &answer);
+
+	rl_free_sized(entries, max_size);
+	return 0;
+}
+
+static int read_file_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_msg_t answer;
+	rl_filehandle_t *handle;
+	rl_uint8 read_buffer[4096];
+	rl_uint32 error;
+
+	const rl_msg_read_file_request_t * const request =
+		&msg->read_file_request;
+
+#ifdef RL_WIN32
+	LARGE_INTEGER pos;
+#endif
+
+	if (NULL == (handle = get_handle_from_id(self, peer, request->handle)))
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+	if (reads_in_job(self, peer, handle))
+		use_handle_in_job(self, handle);
+	else if (0 != (error = use_handle(self, handle)))
+		return reply_with_error(peer, msg, error);
+
+#ifdef RL_WIN32
+	if (INVALID_HANDLE_VALUE == handle->handle)
+		return reply_with_error(peer, msg, RL_NETERR_NOT_A_FILE);
+
+	pos.LowPart = request->offset_lo;
+	pos.HighPart = request->offset_hi;
+
+	/* Ignore seeks in standard input */
+	if (handle != &self->vinput_handle)
+	{
+	   	if (!SetFilePointerEx(handle->handle, pos, NULL, FILE_BEGIN))
+			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+	}
+
+	{
+		DWORD size_to_read = sizeof(read_buffer);
+		DWORD bytes_read = 0;
+
+		if (size_to_read > request->length)
+			size_to_read = request->length;
+
+		if (0 == ReadFile(handle->handle, &read_buffer[0], size_to_read, &bytes_read, NULL))
+		{
+			RL_LOG_DEBUG(("ReadFile failed w/ Win32 error %d", (int) GetLastError()));
+			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+		}
+
+		RL_LOG_DEBUG(("read %d bytes at offset %d from %s -> %d bytes read", size_to_read, pos.LowPart, handle->native_path, bytes_read));
+
+		RL_MSG_INIT(answer, RL_MSG_READ_FILE_ANSWER);
+		answer.read_file_answer.hdr_in_reply_to = request->hdr_sequence_num;
+		answer.read_file_answer.data.base = read_buffer;
+		answer.read_file_answer.data.length = bytes_read;
+		transmit_answer(peer, &answer);
+	}
+
+#elif defined(RL_POSIX)
+	if (0 == handle->handle)
+		return reply_with_error(peer, msg, RL_NETERR_NOT_A_FILE);
+
+	note_read(handle, request->offset_lo, request->length);
+
+	if (reads_in_job(self, peer, handle))
+		return submit_read(self, handle, peer, msg, request->offset_lo, request->length);
+
+	/* Regular files are answered without copying the data through our
+	 * address space; the transport sends it straight from the file. */
+	{
+		struct stat stat_buf;
+
+		if (0 == fstat(handle->handle, &stat_buf) && S_ISREG(stat_buf.st_mode))
+		{
+			rl_uint32 length = 0;
+			size_t max_length;
+
+			RL_MSG_INIT(answer, RL_MSG_READ_FILE_ANSWER);
+			answer.read_file_answer.hdr_in_reply_to = request->hdr_sequence_num;
 
-			rl_format_msg(search_path, sizeof(search_path), "%s\\*", handle->native_path);
+			/* Answer with as much as the peer's negotiated message size allows. */
+			max_length = peer->transport.max_output_size - rl_msg_encoded_size(&answer, peer->framing);
+			max_length = RL_MIN_MACRO(max_length, RL_MAX_READ_SIZE);
 
-			handle->find_handle = FindFirstFile(search_path, &find_data);
-			if (INVALID_HANDLE_VALUE == handle->find_handle)
+			if ((off_t) request->offset_lo < stat_buf.st_size)
 			{
-				handle->find_handle = NULL;
-				return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+				length = (rl_uint32) RL_MIN_MACRO(stat_buf.st_size - (off_t) request->offset_lo, (off_t) max_length);
+				length = RL_MIN_MACRO(length, request->length);
 			}
+
+			transmit_file_answer(peer, &answer, handle->handle, request->offset_lo, length);
+			return 0;
 		}
-		else
+	}
+
+	{
+		ssize_t read_size;
+		read_size = pread(
+				handle->handle,
+				read_buffer,
+				sizeof(read_buffer),
+				request->offset_lo);
+
+		if (-1 == read_size)
+			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+		RL_MSG_INIT(answer, RL_MSG_READ_FILE_ANSWER);
+		answer.read_file_answer.hdr_in_reply_to = request->hdr_sequence_num;
+		answer.read_file_answer.data.base = read_buffer;
+		answer.read_file_answer.data.length = (rl_uint32) read_size;
+		transmit_answer(peer, &answer);
+	}
+
+#else
+#error Implement me.
+#endif
+
+	return 0;
+}
+
+/*
+ * Streams read on the event loop thread are answered a chunk at a time: the
+ * first right away, and each after that once the transport has sent
+ * everything before it, from rl_file_server_continue_streams(). Regular
+ * files are sent in chunks as large as the peer's negotiated message size
+ * allows, straight from the file; everything else is copied through a small
+ * buffer. A stream keeps its handle in use until it's done.
+ */
+typedef struct rl_stream_tag
+{
+	struct rl_stream_tag *next;
+	rl_filehandle_t *handle;
+	rl_uint32 seqno;
+	rl_uint32 offset;
+	rl_uint32 remaining;
+	int from_file;
+} rl_stream_t;
+
+/* Send the next chunk of a stream. Returns non-zero once it's done. */
+static int next_stream_chunk(peer_t *peer, rl_stream_t *stream)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_msg_t answer;
+	rl_uint8 read_buffer[4096];
+	rl_uint32 bytes_read = 0;
+
+	RL_MSG_INIT(answer, RL_MSG_READ_STREAM_ANSWER);
+	answer.read_stream_answer.hdr_in_reply_to = stream->seqno;
+
+#if defined(RL_POSIX)
+	if (stream->from_file)
+	{
+		const size_t max_chunk = peer->transport.max_output_size - rl_msg_encoded_size(&answer, peer->framing);
+		const rl_uint32 chunk = (rl_uint32) RL_MIN_MACRO((size_t) stream->remaining, max_chunk);
+
+		stream->remaining -= chunk;
+		answer.read_stream_answer.final = (0 == stream->remaining);
+
+		if (0 != peer_transmit_file_message(peer, &answer, stream->handle->handle, stream->offset, chunk))
+			return 1;
+
+		stream->offset += chunk;
+		return answer.read_stream_answer.final;
+	}
+#endif
+
+	if (stream->remaining > 0 &&
+		0 != read_at(self, stream->handle, stream->offset, read_buffer,
+			RL_MIN_MACRO(stream->remaining, (rl_uint32) sizeof(read_buffer)), &bytes_read))
+	{
+		transmit_error(peer, stream->seqno, RL_NETERR_IO_ERROR);
+		return 1;
+	}
+
+	stream->offset += bytes_read;
+	stream->remaining -= bytes_read;
+
+	answer.read_stream_answer.final = (0 == stream->remaining || 0 == bytes_read);
+	answer.read_stream_answer.data.base = read_buffer;
+	answer.read_stream_answer.data.length = bytes_read;
+	peer_transmit_message(peer, &answer);
+	return answer.read_stream_answer.final;
+}
+
+static void free_stream(rl_controller_t *self, rl_stream_t *stream)
+{
+	put_job_handle(self, stream->handle);
+	RL_FREE_TYPED(rl_stream_t, stream);
+}
+
+static int read_stream_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_filehandle_t *handle;
+	rl_stream_t *stream;
+	rl_uint32 error;
+
+	const rl_msg_read_stream_request_t * const request =
+		&msg->read_stream_request;
+
+	if (NULL == (handle = get_handle_from_id(self, peer, request->handle)))
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+	/* Offsets past 4 GiB aren't served. */
+	if (0 != request->offset_hi)
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+	if (reads_in_job(self, peer, handle))
+		use_handle_in_job(self, handle);
+	else if (0 != (error = use_handle(self, handle)))
+		return reply_with_error(peer, msg, error);
+
+#if defined(RL_POSIX)
+	if (0 == handle->handle)
+		return reply_with_error(peer, msg, RL_NETERR_NOT_A_FILE);
+
+	note_read(handle, request->offset_lo, request->length);
+
+	if (reads_in_job(self, peer, handle))
+		return submit_read(self, handle, peer, msg, request->offset_lo, request->length);
+#endif
+
+	RL_LOG_DEBUG(("stream %u bytes at offset %u from %s", request->length, request->offset_lo, handle->native_path));
+
+	if (NULL == (stream = RL_ALLOC_TYPED_ZERO(rl_stream_t)))
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+	stream->handle = handle;
+	stream->seqno = request->hdr_sequence_num;
+	stream->offset = request->offset_lo;
+	stream->remaining = request->length;
+
+#if defined(RL_POSIX)
+	{
+		struct stat stat_buf;
+
+		if (0 == fstat(handle->handle, &stat_buf) && S_ISREG(stat_buf.st_mode))
 		{
-			if (!handle->find_handle)
-				return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+			stream->from_file = 1;
+
+			if ((off_t) stream->offset >= stat_buf.st_size)
+				stream->remaining = 0;
 			else
-				has_file = FindNextFile(handle->find_handle, &find_data);
+				stream->remaining = (rl_uint32) RL_MIN_MACRO(stat_buf.st_size - (off_t) stream->offset, (off_t) stream->remaining);
 		}
-	} while (has_file && '.' == find_data.cFileName[0]);
+	}
+#endif
 
-	RL_MSG_INIT(answer, RL_MSG_FIND_NEXT_FILE_ANSWER);
-	answer.find_next_file_answer.hdr_in_reply_to = msg->find_next_file_request.hdr_sequence_num;
-	answer.find_next_file_answer.end_of_sequence = has_file ? 0 : 1;
+	++handle->jobs;
 
-	if (has_file)
+	if (0 != next_stream_chunk(peer, stream))
 	{
-		answer.find_next_file_answer.type = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
-			RL_NODE_TYPE_DIRECTORY : RL_NODE_TYPE_FILE;
-		answer.find_next_file_answer.name = &find_data.cFileName[0];
-		answer.find_next_file_answer.size = find_data.nFileSizeLow; /* FIXME: 64-bit file sizes */
+		free_stream(self, stream);
+		return 0;
+	}
+
+	stream->next = self->streams;
+	self->streams = stream;
+	return 0;
+}
+
+static int write_file_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_msg_t answer;
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_filehandle_t *handle;
+	const rl_msg_write_file_request_t * request;
+
+	request	= &msg->write_file_request;
+	handle = get_handle_from_id(self, peer, request->handle);
+
+	RL_LOG_DEBUG(("write %d bytes against %s", request->data.length, handle->native_path));
+
+	if (handle == &self->voutput_handle)
+	{
+		fwrite(request->data.base, 1, request->data.length, stdout);
+    /* Flush data right away. */
+    fflush(stdout);
 	}
 	else
 	{
-		answer.find_next_file_answer.type = RL_NODE_TYPE_DIRECTORY;
-		answer.find_next_file_answer.name = "";
-		answer.find_next_file_answer.size = 0;
+		RL_LOG_WARNING(("generic file write not implemented"));
 	}
 
-#elif defined(RL_POSIX)
-	/* FIXME: This doesn't filter away '.' and '..' */
-	if (msg->find_next_file_request.reset && handle->dir_handle)
+	RL_MSG_INIT(answer, RL_MSG_WRITE_FILE_ANSWER);
+	answer.write_file_answer.hdr_in_reply_to = request->hdr_sequence_num;
+	transmit_answer(peer, &answer);
+
+	return 0;
+}
+
+static int advise_file_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	const rl_msg_advise_file_request_t * const request = &msg->advise_file_request;
+	rl_filehandle_t *handle;
+	rl_uint32 length;
+	int sequential = 0;
+
+	/* Hints aren't answered, so there's no one to tell about bad ones.
+	 * Parked handles aren't reopened for them if jobs could do that. */
+	if (NULL == (handle = get_handle_from_id(self, peer, request->handle)) ||
+		RL_NODE_TYPE_FILE != handle->type || request->offset >= handle->size ||
+		(self->workers && handle->parked) ||
+		RL_NETERR_SUCCESS != use_handle(self, handle))
+		return 0;
+
+	length = (rl_uint32) handle->size - request->offset;
+	if (request->length > 0)
+		length = RL_MIN_MACRO(length, request->length);
+	length = RL_MIN_MACRO(length, (rl_uint32) RL_MAX_ADVISE_SIZE);
+
+	RL_LOG_DEBUG(("advice %x for %u bytes at %u of %s", request->advice, length, request->offset, handle->native_path));
+
+	/* Reads that carry on from here get the read-ahead that sequential
+	 * ones would have earned. */
+	if (request->advice & RL_ADVISE_SEQUENTIAL)
 	{
-		closedir(handle->dir_handle);
-		handle->dir_handle = NULL;
+		sequential = (0 == handle->readahead_window);
+		handle->sequential_reads = RL_MAX_MACRO(handle->sequential_reads, (rl_uint32) RL_SEQUENTIAL_READS);
+		handle->readahead_window = RL_MAX_MACRO(handle->readahead_window, (rl_uint32) RL_READAHEAD_MIN);
+	}
+
+	if (0 == (request->advice & RL_ADVISE_WILLNEED))
+		length = 0;
+
+#if defined(RL_POSIX)
+	advise_host(handle, request->offset, length, sequential);
+#endif
+
+	if (length > 0)
+		handle->advised_end = RL_MAX_MACRO(handle->advised_end, request->offset + length);
+
+	return 0;
+}
+
+static int delta_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	const rl_msg_delta_request_t * const request = &msg->delta_request;
+	rl_msg_t answer;
+	rl_filehandle_t *handle;
+	rl_uint8 *out;
+	rl_uint32 room, length = 0, covered = 0, error;
+
+	if (NULL == (handle = get_handle_from_id(self, peer, request->handle)))
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+	if (RL_NODE_TYPE_FILE != handle->type)
+		return reply_with_error(peer, msg, RL_NETERR_NOT_A_FILE);
+
+	if (0 != request->signatures.length % RL_DELTA_SIGNATURE_SIZE ||
+		request->signatures.length / RL_DELTA_SIGNATURE_SIZE > RL_MAX_DELTA_BLOCKS)
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+	if (self->workers)
+		use_handle_in_job(self, handle);
+	else if (0 != (error = use_handle(self, handle)))
+		return reply_with_error(peer, msg, error);
+
+#if defined(RL_POSIX)
+	if (self->workers)
+		return submit_delta(self, handle, peer, msg);
+#endif
+
+	room = delta_room(peer);
+
+	if (NULL == (out = (rl_uint8 *) rl_alloc_sized(room)))
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+	if (0 != (error = encode_delta(self, handle, (const rl_uint8 *) request->signatures.base,
+					request->signatures.length / RL_DELTA_SIGNATURE_SIZE, out, room, &length, &covered)))
+	{
+		rl_free_sized(out, room);
+		return reply_with_error(peer, msg, error);
+	}
+
+	RL_MSG_INIT(answer, RL_MSG_DELTA_ANSWER);
+	answer.delta_answer.hdr_in_reply_to = request->hdr_sequence_num;
+	answer.delta_answer.length = covered;
+	answer.delta_answer.instructions.base = out;
+	answer.delta_answer.instructions.length = length;
+	transmit_answer(peer, &answer);
+	RL_LOG_DEBUG(("delta of %s: %u bytes in %u", handle->native_path, covered, length));
+
+	rl_free_sized(out, room);
+	return 0;
+}
+
+/* The handle that the compound operation [msg] works on (the parent of
+ * opens), or NULL if it can't be part of a compound request. Streams are
+ * answered more than once, and compounds don't nest. */
+static rl_uint32 *compound_op_handle(rl_msg_t *msg)
+{
+	switch (rl_msg_kind_of(msg))
+	{
+		case RL_MSG_OPEN_HANDLE_REQUEST:
+			return &msg->open_handle_request.parent;
+		case RL_MSG_CLOSE_HANDLE_REQUEST:
+			return &msg->close_handle_request.handle;
+		case RL_MSG_READ_FILE_REQUEST:
+			return &msg->read_file_request.handle;
+		case RL_MSG_WRITE_FILE_REQUEST:
+			return &msg->write_file_request.handle;
+		case RL_MSG_FIND_NEXT_FILE_REQUEST:
+			return &msg->find_next_file_request.handle;
+		case RL_MSG_EXAMINE_ALL_REQUEST:
+			return &msg->examine_all_request.handle;
+		case RL_MSG_ADVISE_FILE_REQUEST:
+			return &msg->advise_file_request.handle;
+		case RL_MSG_DELTA_REQUEST:
+			return &msg->delta_request.handle;
+		default:
+			return NULL;
+	}
+}
+
+/* Start the next operation of [compound]. */
+static void start_operation(peer_t *peer, rl_compound_t *compound)
+{
+	const size_t max_output_size = peer->transport.max_output_size;
+	const unsigned char *cursor = compound->operations + compound->position;
+	int size = (int) (compound->operations_length - compound->position);
+	rl_uint32 error = RL_NETERR_SUCCESS;
+	rl_uint32 *handle = NULL;
+	rl_net_array_t frame;
+	rl_msg_kind_t kind;
+	rl_uint8 flags, *patch;
+
+	/* The records were checked when the request came in. */
+	rl_decode_compound_record(&cursor, &size, &flags, &frame);
+	compound->position = compound->operations_length - (rl_uint32) size;
+	compound->index = compound->started++;
+	compound->ref = -1;
+
+	compound->record = compound->answers_length;
+	patch = compound->answers + compound->record;
+	rl_encode_compound_record(&patch, RL_COMPOUND_RAN, 0);
+	compound->answers_length += RL_COMPOUND_RECORD_SIZE;
+
+	if (0 != rl_decode_msg(frame.base, (int) frame.length, peer->framing, &compound->current) ||
+		NULL == (handle = compound_op_handle(&compound->current)))
+	{
+		error = RL_NETERR_BAD_REQUEST;
+	}
+	else if (*handle & RL_COMPOUND_HANDLE_REF)
+	{
+		const rl_uint32 ref = *handle & ~RL_COMPOUND_HANDLE_REF;
+
+		if (ref >= compound->index || !compound->results[ref].opened)
+		{
+			error = RL_NETERR_INVALID_VALUE;
+		}
+		else
+		{
+			*handle = compound->results[ref].handle;
+			compound->ref = (int) ref;
+		}
+	}
+
+	if (RL_NETERR_SUCCESS == error && (flags & RL_COMPOUND_OPF_IF_WHOLE) &&
+		(compound->ref < 0 || compound->results[compound->ref].covered < compound->results[compound->ref].size))
+	{
+		patch = compound->answers + compound->record;
+		rl_encode_int1(&patch, RL_COMPOUND_SKIPPED);
+		return;
+	}
+
+	if (RL_NETERR_SUCCESS == error && compound_room(compound) < RL_COMPOUND_MIN_ROOM)
+		error = RL_NETERR_INVALID_VALUE;
+
+	compound->waiting = 1;
+
+	if (RL_NETERR_SUCCESS != error)
+	{
+		transmit_error(peer, compound->seqno, error);
+		return;
+	}
+
+	kind = rl_msg_kind_of(&compound->current);
+	compound->current.handshake_request.hdr_sequence_num = compound->seqno;
+
+	peer->transport.max_output_size = compound_room(compound);
+	rl_file_serve(peer, &compound->current);
+	peer->transport.max_output_size = max_output_size;
+
+	/* These are only answered if they fail. */
+	if (compound->waiting && (RL_MSG_CLOSE_HANDLE_REQUEST == kind || RL_MSG_ADVISE_FILE_REQUEST == kind))
+		compound->waiting = 0;
+}
+
+/* Start operations of [compound] until one has to wait for its answer, and
+ * send the compound answer once they're all done or one has failed. */
+static void run_compound(peer_t *peer, rl_compound_t *compound)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_compound_t **link;
+	rl_msg_t answer;
+
+	compound->running = 1;
+
+	while (!compound->waiting && !compound->failed && compound->started < compound->count)
+		start_operation(peer, compound);
+
+	compound->running = 0;
+
+	if (compound->waiting)
+		return;
+
+	for (link = &self->compounds; *link != compound; link = &(*link)->next)
+		;
+	*link = compound->next;
+
+	RL_LOG_DEBUG(("compound request %u: %u of %u operations, %u bytes",
+				compound->seqno, compound->started, compound->count, compound->answers_length));
+
+	RL_MSG_INIT(answer, RL_MSG_COMPOUND_ANSWER);
+	answer.compound_answer.hdr_in_reply_to = compound->seqno;
+	answer.compound_answer.answers.base = compound->answers;
+	answer.compound_answer.answers.length = compound->answers_length;
+	peer_transmit_message(peer, &answer);
+
+	free_compound(compound);
+}
+
+static int compound_request(peer_t *peer, const rl_msg_t *msg)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	const rl_net_array_t * const operations = &msg->compound_request.operations;
+	const unsigned char *cursor = (const unsigned char *) operations->base;
+	int size = (int) operations->length;
+	rl_compound_t *compound;
+	rl_net_array_t frame;
+	rl_uint32 count = 0;
+	rl_uint8 flags;
+	rl_msg_t answer;
+
+	/* Check the records up front, so that running them needn't. */
+	while (size > 0)
+	{
+		if (0 != rl_decode_compound_record(&cursor, &size, &flags, &frame) || ++count > RL_COMPOUND_MAX_OPS)
+			return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+	}
+
+	if (0 == count)
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+
+	if (NULL == (compound = RL_ALLOC_TYPED_ZERO(rl_compound_t)))
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+	compound->seqno = msg->compound_request.hdr_sequence_num;
+	compound->count = count;
+	compound->operations_length = operations->length;
+
+	RL_MSG_INIT(answer, RL_MSG_COMPOUND_ANSWER);
+	compound->answers_size = (rl_uint32) (peer->transport.max_output_size - rl_msg_encoded_size(&answer, peer->framing));
+
+	RL_MSG_INIT(answer, RL_MSG_ERROR_ANSWER);
+	compound->reserve = RL_COMPOUND_RECORD_SIZE + (rl_uint32) rl_msg_encoded_size(&answer, peer->framing);
+
+	if (count * compound->reserve > compound->answers_size)
+	{
+		free_compound(compound);
+		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
 	}
 
-	if (!handle->dir_handle)
+	if (NULL == (compound->operations = (rl_uint8 *) rl_alloc_sized(compound->operations_length)) ||
+		NULL == (compound->answers = (rl_uint8 *) rl_alloc_sized(compound->answers_size)))
+	{
+		free_compound(compound);
+		return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+	}
+
+	rl_memcpy(compound->operations, operations->base, compound->operations_length);
+
+	compound->next = self->compounds;
+	self->compounds = compound;
+	run_compound(peer, compound);
+	return 0;
+}
+
+int rl_file_serve(peer_t *peer, const rl_msg_t *msg)
+{
+	switch (rl_msg_kind_of(msg))
 	{
-		if (NULL == (handle->dir_handle = opendir(handle->native_path)))
-			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+		case RL_MSG_READ_FILE_REQUEST:
+			read_file_request(peer, msg);
+			break;
+		case RL_MSG_READ_STREAM_REQUEST:
+			read_stream_request(peer, msg);
+			break;
+		case RL_MSG_WRITE_FILE_REQUEST:
+			write_file_request(peer, msg);
+			break;
+		case RL_MSG_OPEN_HANDLE_REQUEST:
+			open_handle_request(peer, msg);
+			break;
+		case RL_MSG_CLOSE_HANDLE_REQUEST:
+			close_handle_request(peer, msg);
+			break;
+		case RL_MSG_FIND_NEXT_FILE_REQUEST:
+			find_next_file_request(peer, msg);
+			break;
+		case RL_MSG_EXAMINE_ALL_REQUEST:
+			examine_all_request(peer, msg);
+			break;
+		case RL_MSG_ADVISE_FILE_REQUEST:
+			advise_file_request(peer, msg);
+			break;
+		case RL_MSG_DELTA_REQUEST:
+			delta_request(peer, msg);
+			break;
+		case RL_MSG_COMPOUND_REQUEST:
+			compound_request(peer, msg);
+			break;
+		default:
+		{
+			rl_msg_t answer;
+			RL_LOG_WARNING(("file server can't handle message '%s'", rl_msg_name(rl_msg_kind_of(msg))));
+			RL_MSG_INIT(answer, RL_MSG_ERROR_ANSWER);
+			answer.error_answer.hdr_in_reply_to = msg->open_handle_request.hdr_sequence_num;
+			answer.error_answer.error_code = RL_NETERR_BAD_REQUEST;
+			transmit_answer(peer, &answer);
+			break;
+		}
 	}
 
-	RL_MSG_INIT(answer, RL_MSG_FIND_NEXT_FILE_ANSWER);
-	answer.find_next_file_answer.hdr_in_reply_to =
-		msg->find_next_file_request.hdr_sequence_num;
+	return 0;
+}
+
+int rl_file_server_init(rl_controller_t *self, int num_workers, int cache_stats)
+{
+	/* The handle table grows on the first open. */
+	self->free_handle = (rl_uint32) -1;
 
-	answer.find_next_file_answer.end_of_sequence = 0;
+	if (0 != rl_dict_init(&self->native_paths, 64, 0, NULL, NULL, free_interned_path))
+		return 1;
 
-	// Set errno to zero before calling readdir; errno is not changed at end-of-directory
-	errno = 0;
+	if (0 == self->max_open_files)
+		self->max_open_files = RL_DEFAULT_OPEN_FILES;
 
-	if (NULL == (dent = readdir(handle->dir_handle)))
+#if defined(RL_POSIX)
+	if (cache_stats)
 	{
-		if (0 == errno)
+		if (NULL != (self->statcache = RL_ALLOC_TYPED(rl_statcache_t)) &&
+			0 != rl_statcache_init(self->statcache))
 		{
-			answer.find_next_file_answer.end_of_sequence = 1;
-			answer.find_next_file_answer.type = RL_NODE_TYPE_DIRECTORY;
-			answer.find_next_file_answer.name = "";
-			answer.find_next_file_answer.size = 0;
+			RL_FREE_TYPED(rl_statcache_t, self->statcache);
+			self->statcache = NULL;
 		}
-		else
-			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+
+		if (!self->statcache)
+			RL_LOG_INFO(("not caching file metadata"));
 	}
-	else
-	{
-		char item_path[NAME_MAX];
-		rl_strbuf_t path;
-		struct stat stat_buf;
 
-		rl_strbuf_init(&path, item_path, sizeof(item_path));
-		rl_strbuf_append(&path, handle->native_path);
-		rl_strbuf_append(&path, "/");
-		rl_strbuf_append(&path, dent->d_name);
+	if (num_workers <= 0)
+		return 0;
 
-		/* FIXME: Maybe we should just ignore the item. */
-		if (0 != stat(item_path, &stat_buf))
-			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+	if (NULL == (self->workers = RL_ALLOC_TYPED(rl_workpool_t)))
+		return 1;
 
-		answer.find_next_file_answer.end_of_sequence = 0;
-		answer.find_next_file_answer.type = S_ISDIR(stat_buf.st_mode) ?
-			RL_NODE_TYPE_DIRECTORY : RL_NODE_TYPE_FILE;
-		answer.find_next_file_answer.name = dent->d_name;
-		answer.find_next_file_answer.size = stat_buf.st_size;
+	if (0 != rl_workpool_init(self->workers, num_workers))
+	{
+		RL_FREE_TYPED(rl_workpool_t, self->workers);
+		self->workers = NULL;
+		return 1;
 	}
-
 #else
-#error "Implement me"
+	(void) self;
+	(void) num_workers;
+	(void) cache_stats;
 #endif
 
-	return peer_transmit_message(peer, &answer);
+	return 0;
 }
 
-static int read_file_request(peer_t *peer, const rl_msg_t *msg)
+int rl_file_server_index(rl_controller_t *self, int num_threads)
 {
-	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
-	rl_msg_t answer;
-	rl_filehandle_t *handle;
-	rl_uint8 read_buffer[4096];
-
-	const rl_msg_read_file_request_t * const request =
-		&msg->read_file_request;
+#if defined(RL_POSIX)
+	if (NULL != (self->pathindex = RL_ALLOC_TYPED(rl_pathindex_t)) &&
+		0 != rl_pathindex_init(self->pathindex, self->root_handle.native_path, num_threads))
+	{
+		RL_FREE_TYPED(rl_pathindex_t, self->pathindex);
+		self->pathindex = NULL;
+	}
 
-#ifdef RL_WIN32
-	LARGE_INTEGER pos;
+	if (self->pathindex)
+		return 0;
+#else
+	(void) num_threads;
+	(void) self;
 #endif
 
-	if (NULL == (handle = get_handle_from_id(self, peer, request->handle)))
-		return reply_with_error(peer, msg, RL_NETERR_INVALID_VALUE);
+	RL_LOG_INFO(("not indexing file names; they have to match case"));
+	return 1;
+}
 
-#ifdef RL_WIN32
-	if (INVALID_HANDLE_VALUE == handle->handle)
-		return reply_with_error(peer, msg, RL_NETERR_NOT_A_FILE);
+void rl_file_server_destroy(rl_controller_t *self)
+{
+	while (self->compounds)
+	{
+		rl_compound_t * const compound = self->compounds;
+		self->compounds = compound->next;
+		free_compound(compound);
+	}
 
-	pos.LowPart = request->offset_lo;
-	pos.HighPart = request->offset_hi;
+	/* Their handles are closed below. */
+	while (self->streams)
+	{
+		rl_stream_t * const stream = self->streams;
+		self->streams = stream->next;
+		RL_FREE_TYPED(rl_stream_t, stream);
+	}
 
-	/* Ignore seeks in standard input */
-	if (handle != &self->vinput_handle)
+#if defined(RL_POSIX)
+	while (self->stalled_streams)
 	{
-	   	if (!SetFilePointerEx(handle->handle, pos, NULL, FILE_BEGIN))
-			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+		rl_fs_job_t * const job = self->stalled_streams;
+		self->stalled_streams = job->next_waiting;
+		free_job(job);
 	}
 
+	/* Otherwise it's with the workers, and goes with their jobs. */
+	if (self->preload && self->preload_ready)
+		free_job(self->preload);
+	self->preload = NULL;
+
+	if (self->workers)
 	{
-		DWORD size_to_read = sizeof(read_buffer);
-		DWORD bytes_read = 0;
+		rl_work_t *work;
 
-		if (size_to_read > request->length)
-			size_to_read = request->length;
+		/* Jobs that haven't been answered by now never will be. */
+		rl_workpool_stop(self->workers);
 
-		if (0 == ReadFile(handle->handle, &read_buffer[0], size_to_read, &bytes_read, NULL))
+		work = rl_workpool_take_completed(self->workers);
+		while (work)
 		{
-			RL_LOG_DEBUG(("ReadFile failed w/ Win32 error %d", (int) GetLastError()));
-			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+			rl_work_t *next = work->next;
+			free_job((rl_fs_job_t *) work);
+			work = next;
 		}
 
-		RL_LOG_DEBUG(("read %d bytes at offset %d from %s -> %d bytes read", size_to_read, pos.LowPart, handle->native_path, bytes_read));
+		rl_workpool_destroy(self->workers);
+		RL_FREE_TYPED(rl_workpool_t, self->workers);
+		self->workers = NULL;
+	}
 
-		RL_MSG_INIT(answer, RL_MSG_READ_FILE_ANSWER);
-		answer.read_file_answer.hdr_in_reply_to = request->hdr_sequence_num;
-		answer.read_file_answer.data.base = read_buffer;
-		answer.read_file_answer.data.length = bytes_read;
-		peer_transmit_message(peer, &answer);
+	while (self->waiting_opens_head)
+	{
+		rl_fs_job_t * const job = self->waiting_opens_head;
+		self->waiting_opens_head = job->next_waiting;
+		free_job(job);
 	}
+	self->waiting_opens_tail = NULL;
 
-#elif defined(RL_POSIX)
-	if (0 == handle->handle)
-		return reply_with_error(peer, msg, RL_NETERR_NOT_A_FILE);
+	/* The workers are gone, so nothing else can be using it. */
+	if (self->statcache)
+	{
+		rl_statcache_destroy(self->statcache);
+		RL_FREE_TYPED(rl_statcache_t, self->statcache);
+		self->statcache = NULL;
+	}
 
+	if (self->pathindex)
 	{
-		ssize_t read_size;
-		read_size = pread(
-				handle->handle,
-				read_buffer,
-				sizeof(read_buffer),
-				request->offset_lo);
+		rl_pathindex_destroy(self->pathindex);
+		RL_FREE_TYPED(rl_pathindex_t, self->pathindex);
+		self->pathindex = NULL;
+	}
+#endif
 
-		if (-1 == read_size)
-			return reply_with_error(peer, msg, RL_NETERR_IO_ERROR);
+	if (self->handles)
+	{
+		rl_uint32 i;
 
-		RL_MSG_INIT(answer, RL_MSG_READ_FILE_ANSWER);
-		answer.read_file_answer.hdr_in_reply_to = request->hdr_sequence_num;
-		answer.read_file_answer.data.base = read_buffer;
-		answer.read_file_answer.data.length = (rl_uint32) read_size;
-		peer_transmit_message(peer, &answer);
+		for (i = 0; i < self->num_handles; ++i)
+		{
+			rl_filehandle_t * const slot = self->handles[i];
+
+			if (slot->in_use)
+			{
+				close_native(self, slot);
+				release_slot(self, slot);
+			}
+
+			RL_FREE_TYPED(rl_filehandle_t, slot);
+		}
+
+		rl_free_sized(self->handles, self->num_handles * sizeof(rl_filehandle_t *));
+		self->handles = NULL;
+		self->num_handles = 0;
 	}
 
+	close_native(self, &self->root_handle);
+	free_native_path(self, &self->root_handle);
+	free_native_path(self, &self->vinput_handle);
+	free_native_path(self, &self->voutput_handle);
+	rl_dict_destroy(&self->native_paths);
+}
+
+int rl_file_server_wakeup_fd(rl_controller_t *self)
+{
+#if defined(RL_POSIX)
+	if (self->workers)
+		return rl_workpool_wakeup_fd(self->workers);
 #else
-#error Implement me.
+	(void) self;
 #endif
-
-	return 0;
+	return -1;
 }
 
-static int write_file_request(peer_t *peer, const rl_msg_t *msg)
+void rl_file_server_complete(peer_t *peer)
 {
-	rl_msg_t answer;
+#if defined(RL_POSIX)
 	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
-	rl_filehandle_t *handle;
-	const rl_msg_write_file_request_t * request;
+	rl_work_t *work;
 
-	request	= &msg->write_file_request;
-	handle = get_handle_from_id(self, peer, request->handle);
+	if (!self->workers)
+		return;
 
-	RL_LOG_DEBUG(("write %d bytes against %s", request->data.length, handle->native_path));
+	work = rl_workpool_take_completed(self->workers);
+	while (work)
+	{
+		rl_work_t *next = work->next;
+		finish_job(peer, (rl_fs_job_t *) work);
+		work = next;
+	}
+#else
+	(void) peer;
+#endif
+}
 
-	if (handle == &self->voutput_handle)
+void rl_file_server_preload(rl_controller_t *self, rl_uint32 max_size)
+{
+#if defined(RL_POSIX)
+	rl_msg_t msg;
+	rl_fs_job_t *job;
+	rl_filehandle_t *parent;
+	rl_uint32 error;
+
+	/* Whole blocks only, like the target caches them. */
+	max_size = RL_MIN_MACRO(max_size, RL_MAX_PUSH_SIZE) / RL_HASH_BLOCK_SIZE * RL_HASH_BLOCK_SIZE;
+
+	if (0 == max_size || rl_strchr(self->executable, ':') || rl_strlen(self->executable) > 255)
+		return;
+
+	RL_MSG_INIT(msg, RL_MSG_OPEN_HANDLE_REQUEST);
+	msg.open_handle_request.path = self->executable;
+	msg.open_handle_request.mode = RL_OPENFLAG_READ;
+
+	if (NULL == (job = new_job(self, NULL, &msg)))
+		return;
+
+	job->kind = RL_MSG_PUSH_FILE_REQUEST;
+	job->length = max_size;
+
+	if (0 != (error = resolve_open(self, NULL, &msg, job->native_path, sizeof(job->native_path), &parent, &job->name_offset)))
 	{
-		fwrite(request->data.base, 1, request->data.length, stdout);
-    /* Flush data right away. */
-    fflush(stdout);
+		RL_LOG_DEBUG(("not preloading %s: error %u", self->executable, error));
+		free_job(job);
+		return;
+	}
+
+	self->preload = job;
+	self->preload_ready = 0;
+
+	if (self->workers)
+	{
+		rl_workpool_submit(self->workers, &job->work);
 	}
 	else
 	{
-		RL_LOG_WARNING(("generic file write not implemented"));
+		run_job(&job->work);
+		self->preload_ready = 1;
 	}
+#else
+	(void) self;
+	(void) max_size;
+#endif
+}
 
-	RL_MSG_INIT(answer, RL_MSG_WRITE_FILE_ANSWER);
-	answer.write_file_answer.hdr_in_reply_to = request->hdr_sequence_num;
-	peer_transmit_message(peer, &answer);
+void rl_file_server_push(peer_t *peer)
+{
+#if defined(RL_POSIX)
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
 
-	return 0;
+	self->push_wanted = 1;
+	push_preload(peer);
+#else
+	(void) peer;
+#endif
 }
 
-int rl_file_serve(peer_t *peer, const rl_msg_t *msg)
+int rl_file_server_streams_ready(peer_t *peer)
 {
-	switch (rl_msg_kind_of(msg))
+	const rl_controller_t * const self = (const rl_controller_t *) peer->userdata;
+
+	if (peer->transport.out_queue)
+		return 0;
+
+#if defined(RL_POSIX)
+	if (self->stalled_streams)
+		return 1;
+#endif
+
+	return NULL != self->streams;
+}
+
+void rl_file_server_continue_streams(peer_t *peer)
+{
+	rl_controller_t * const self = (rl_controller_t *) peer->userdata;
+	rl_stream_t **link = &self->streams;
+
+	if (!rl_file_server_streams_ready(peer))
+		return;
+
+#if defined(RL_POSIX)
+	while (self->stalled_streams)
 	{
-		case RL_MSG_READ_FILE_REQUEST:
-			read_file_request(peer, msg);
-			break;
-		case RL_MSG_WRITE_FILE_REQUEST:
-			write_file_request(peer, msg);
-			break;
-		case RL_MSG_OPEN_HANDLE_REQUEST:
-			open_handle_request(peer, msg);
-			break;
-		case RL_MSG_CLOSE_HANDLE_REQUEST:
-			close_handle_request(peer, msg);
-			break;
-		case RL_MSG_FIND_NEXT_FILE_REQUEST:
-			find_next_file_request(peer, msg);
-			break;
-		default:
+		rl_fs_job_t * const job = self->stalled_streams;
+		self->stalled_streams = job->next_waiting;
+		rl_workpool_submit(self->workers, &job->work);
+	}
+#endif
+
+	while (*link)
+	{
+		rl_stream_t * const stream = *link;
+
+		if (0 != next_stream_chunk(peer, stream))
 		{
-			rl_msg_t answer;
-			RL_LOG_WARNING(("file server can't handle message '%s'", rl_msg_name(rl_msg_kind_of(msg))));
-			RL_MSG_INIT(answer, RL_MSG_ERROR_ANSWER);
-			answer.error_answer.hdr_in_reply_to = msg->open_handle_request.hdr_sequence_num;
-			answer.error_answer.error_code = RL_NETERR_BAD_REQUEST;
-			peer_transmit_message(peer, &answer);
-			break;
+			*link = stream->next;
+			free_stream(self, stream);
+		}
+		else
+		{
+			link = &stream->next;
 		}
 	}
+}
 
-	return 0;
+int rl_file_server_change_fd(rl_controller_t *self)
+{
+#if defined(RL_POSIX)
+	if (self->statcache)
+		return rl_statcache_fd(self->statcache);
+#else
+	(void) self;
+#endif
+	return -1;
+}
+
+int rl_file_server_index_fd(rl_controller_t *self)
+{
+#if defined(RL_POSIX)
+	if (self->pathindex)
+		return rl_pathindex_fd(self->pathindex);
+#else
+	(void) self;
+#endif
+	return -1;
 }
 
+void rl_file_server_process_changes(rl_controller_t *self)
+{
+#if defined(RL_POSIX)
+	if (self->statcache)
+		rl_statcache_process_changes(self->statcache);
+	if (self->pathindex)
+		rl_pathindex_process_changes(self->pathindex);
+#else
+	(void) self;
+#endif
+}
@@ -0,0 +1,191 @@
+#include "lz.h"
+
+static INLINE rl_uint32
+read32(const rl_uint8 *p)
+{
+	return ((rl_uint32) p[0] << 24) | ((rl_uint32) p[1] << 16) | ((rl_uint32) p[2] << 8) | p[3];
+}
+
+static INLINE rl_uint32
+hash32(rl_uint32 value)
+{
+	return (value * 2654435761u) >> (32 - RL_LZ_TABLE_BITS);
+}
+
+/* Bytes it takes to store [length] in a nibble and extension bytes. */
+static INLINE rl_uint32
+length_size(rl_uint32 length)
+{
+	return length < 15 ? 0 : 1 + (length - 15) / 255;
+}
+
+static rl_uint8 *
+put_length(rl_uint8 *out, rl_uint32 length)
+{
+	if (length < 15)
+		return out;
+
+	length -= 15;
+
+	while (length >= 255)
+	{
+		*out++ = 255;
+		length -= 255;
+	}
+
+	*out++ = (rl_uint8) length;
+	return out;
+}
+
+/* Write a run: [literal_count] bytes at [literals], then a match of
+ * [match_length] bytes [distance] back unless [match_length] is zero.
+ * Returns NULL if it doesn't fit before [out_end]. */
+static rl_uint8 *
+put_run(rl_uint8 *out, rl_uint8 *out_end, const rl_uint8 *literals, rl_uint32 literal_count,
+		rl_uint32 match_length, rl_uint32 distance)
+{
+	const rl_uint32 match_code = match_length ? match_length - RL_LZ_MIN_MATCH : 0;
+	rl_uint32 size = 1 + length_size(literal_count) + literal_count;
+
+	if (match_length)
+		size += 2 + length_size(match_code);
+
+	if (size > (rl_uint32) (out_end - out))
+		return NULL;
+
+	*out++ = (rl_uint8) ((RL_MIN_MACRO(literal_count, 15) << 4) | RL_MIN_MACRO(match_code, 15));
+	out = put_length(out, literal_count);
+	rl_memcpy(out, literals, literal_count);
+	out += literal_count;
+
+	if (match_length)
+	{
+		*out++ = (rl_uint8) (distance >> 8);
+		*out++ = (rl_uint8) distance;
+		out = put_length(out, match_code);
+	}
+
+	return out;
+}
+
+rl_uint32
+rl_lz_compress(const rl_uint8 *data, rl_uint32 length, rl_uint8 *out, rl_uint32 out_size, rl_uint32 *table)
+{
+	const rl_uint8 *in = data;
+	const rl_uint8 *anchor = data;
+	const rl_uint8 * const end = data + length;
+	rl_uint8 *op = out;
+	rl_uint8 * const out_end = out + out_size;
+	rl_uint32 misses = 0;
+
+	/* Positions are stored plus one, so that zero is empty. */
+	rl_memset(table, 0, RL_LZ_TABLE_SIZE * sizeof(rl_uint32));
+
+	while (length >= RL_LZ_MIN_MATCH && in <= end - RL_LZ_MIN_MATCH)
+	{
+		const rl_uint32 value = read32(in);
+		rl_uint32 * const entry = &table[hash32(value)];
+		const rl_uint8 * const ref = data + *entry - 1;
+		const rl_uint8 *match_end;
+
+		if (0 == *entry || in - ref > RL_LZ_MAX_DISTANCE || read32(ref) != value)
+		{
+			*entry = (rl_uint32) (in - data) + 1;
+
+			/* The longer nothing matches, the further ahead to look. */
+			in += 1 + (misses++ >> 6);
+			continue;
+		}
+
+		*entry = (rl_uint32) (in - data) + 1;
+		misses = 0;
+
+		match_end = in + RL_LZ_MIN_MATCH;
+		while (match_end < end && *match_end == ref[match_end - in])
+			++match_end;
+
+		if (NULL == (op = put_run(op, out_end, anchor, (rl_uint32) (in - anchor),
+						(rl_uint32) (match_end - in), (rl_uint32) (in - ref))))
+			return 0;
+
+		in = anchor = match_end;
+	}
+
+	if (NULL == (op = put_run(op, out_end, anchor, (rl_uint32) (end - anchor), 0, 0)))
+		return 0;
+
+	return (rl_uint32) (op - out);
+}
+
+/* Add the extension bytes of a length that didn't fit its nibble. */
+static int
+get_length(const rl_uint8 **in, const rl_uint8 *end, rl_uint32 *length)
+{
+	rl_uint8 byte;
+
+	do
+	{
+		if (*in >= end)
+			return 1;
+
+		byte = *(*in)++;
+		*length += byte;
+	} while (255 == byte);
+
+	return 0;
+}
+
+int
+rl_lz_decompress(const rl_uint8 *data, rl_uint32 length, rl_uint8 *out, rl_uint32 out_length)
+{
+	const rl_uint8 *in = data;
+	const rl_uint8 * const end = data + length;
+	rl_uint8 *op = out;
+	rl_uint8 * const out_end = out + out_length;
+
+	while (in < end)
+	{
+		const rl_uint8 token = *in++;
+		rl_uint32 count = token >> 4;
+		rl_uint32 distance;
+		const rl_uint8 *ref;
+
+		if (15 == count && 0 != get_length(&in, end, &count))
+			return 1;
+
+		if (count > (rl_uint32) (end - in) || count > (rl_uint32) (out_end - op))
+			return 1;
+
+		rl_memcpy(op, in, count);
+		in += count;
+		op += count;
+
+		/* The last run has no match. */
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			return 1;
+
+		distance = ((rl_uint32) in[0] << 8) | in[1];
+		in += 2;
+
+		if (0 == distance || distance > (rl_uint32) (op - out))
+			return 1;
+
+		count = token & 15;
+		if (15 == count && 0 != get_length(&in, end, &count))
+			return 1;
+
+		count += RL_LZ_MIN_MATCH;
+		if (count > (rl_uint32) (out_end - op))
+			return 1;
+
+		/* Matches may overlap what they produce, so go a byte at a time. */
+		ref = op - distance;
+		while (count--)
+			*op++ = *ref++;
+	}
+
+	return op != out_end;
+}
@@ -0,0 +1,48 @@
+#ifndef RLAUNCH_LZ_H
+#define RLAUNCH_LZ_H
+
+#include "util.h"
+
+/*
+ * Byte-oriented LZ77 compression of frame bodies.
+ *
+ * The format is that of LZ4 blocks, except that match distances are stored
+ * most significant byte first. A block is a sequence of runs. Each starts
+ * with a token byte: the high nibble is the number of literal bytes that
+ * follow, the low nibble the length of the match after them less
+ * RL_LZ_MIN_MATCH. A nibble of 15 is followed by further bytes of length,
+ * added in, for as long as they're 255. After the literals comes the
+ * distance back to the match, a word. The last run has literals only.
+ *
+ * Decompressing takes no memory and no arithmetic beyond adding lengths, so
+ * that it keeps up with the network on a 68000. Compressing is greedy with a
+ * single-entry hash table, and speeds up through data that doesn't compress.
+ */
+
+enum
+{
+	RL_LZ_MIN_MATCH = 4,
+	RL_LZ_MAX_DISTANCE = 65535,
+
+	/* Entries in the table rl_lz_compress() works in. */
+	RL_LZ_TABLE_BITS = 12,
+	RL_LZ_TABLE_SIZE = 1 << RL_LZ_TABLE_BITS
+};
+
+/*
+ * Compress [length] bytes of [data] into [out], using [table] of
+ * RL_LZ_TABLE_SIZE entries as scratch space. Returns the compressed length,
+ * or 0 if it would exceed [out_size].
+ */
+rl_uint32
+rl_lz_compress(const rl_uint8 *data, rl_uint32 length, rl_uint8 *out, rl_uint32 out_size, rl_uint32 *table);
+
+/*
+ * Decompress [length] bytes of [data] into exactly [out_length] bytes at
+ * [out]. Returns non-zero if the data is malformed or doesn't decompress to
+ * that length; nothing is ever written outside [out].
+ */
+int
+rl_lz_decompress(const rl_uint8 *data, rl_uint32 length, rl_uint8 *out, rl_uint32 out_length);
+
+#endif
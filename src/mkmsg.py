@@ -84,7 +84,9 @@ types = {
 		'array'		: NetType('rl_net_array_t', 'array', -1, variable_length = True),
 		'byte'		: NetType('rl_uint8', 'byte', 1),
 		'word'		: NetType('rl_uint16', 'word', 2),
-		'longword'	: NetType('rl_uint32', 'longword', 4)
+		'longword'	: NetType('rl_uint32', 'longword', 4),
+		# message length; 2 or 4 bytes on the wire depending on the framing
+		'length'	: NetType('rl_uint32', 'length', 0)
 }
 
 def mkmsg(desc, output_prefix):
@@ -164,20 +166,29 @@ def mkmsg(desc, output_prefix):
 	# emit decoders, encoders and describers
 	for msg in messages:
 		ct_name = 'rl_msg_%s_%s_t' % (msg.name, msg.type)
+
+		# the header size depends on the framing in use
+		fixed_size = str(msg.fixed_size)
+		for name, type, guard in msg.fixed_fields:
+			if type.name == 'length':
+				fixed_size = '(%d + rl_length_size(framing))' % (msg.fixed_size)
 		source.write('/*')
 		source.write('-' * 70)
 		source.write('*/\n\n')
 
-		source.write('static int decode_%s_%s(const void *buffer_, int size, rl_msg_t *msg_out) {\n' % (msg.name, msg.type))
+		source.write('static int decode_%s_%s(const void *buffer_, int size, int framing, rl_msg_t *msg_out) {\n' % (msg.name, msg.type))
 		source.write('\tconst unsigned char *buffer = (const unsigned char *)buffer_;\n')
 		source.write('\t%s *target = &msg_out->%s_%s;\n' % (ct_name, msg.name, msg.type))
-		source.write('\tif (size < %d) return -1;\n' % (msg.fixed_size))
+		source.write('\tif (size < %s) return -1;\n' % (fixed_size))
 		for name, type, guard in msg.fixed_fields:
 			if guard:
 				source.write('\tif (%s)\n\t' % (guard));
-			source.write('\trl_decode_int%d(&buffer, &target->%s);\n' % (type.size, name))
+			if type.name == 'length':
+				source.write('\trl_decode_length(&buffer, framing, &target->%s);\n' % (name))
+			else:
+				source.write('\trl_decode_int%d(&buffer, &target->%s);\n' % (type.size, name))
 		if len(msg.var_fields) > 0:
-			source.write('\tsize -= %d;\n' % (msg.fixed_size))
+			source.write('\tsize -= %s;\n' % (fixed_size))
 			for name, type, guard in msg.var_fields:
 				if guard:
 					source.write('\tif (%s)\n\t' % (guard))
@@ -186,25 +197,24 @@ def mkmsg(desc, output_prefix):
 		source.write('\treturn 0;\n')
 		source.write('}\n\n')
 
-		source.write('static int encode_%s_%s(const rl_msg_t *msg, void *buffer_, int size) {\n' % (msg.name, msg.type))
+		source.write('static int encode_%s_%s(const rl_msg_t *msg, int framing, void *buffer_, int size) {\n' % (msg.name, msg.type))
 		source.write('\tconst int initial_size = size;\n')
 		source.write('\tconst %s *source = (const %s *)msg;\n' % (ct_name, ct_name))
 		source.write('\tunsigned char *buffer = (unsigned char *)buffer_;\n')
 		source.write('\tunsigned char *length_pos = NULL;\n')
 
-		length_type = None
+		source.write('\tif (size < %s) return -1;\n' % (fixed_size))
 
 		for name, type, guard in msg.fixed_fields:
-			if name == 'hdr_length':
-				length_type = type
-				source.write('\tlength_pos = buffer; buffer += %d;\n' % (type.size))
+			if type.name == 'length':
+				source.write('\tlength_pos = buffer; buffer += rl_length_size(framing);\n')
 				continue
 
 			if guard:
 				source.write('\tif (%s)\n\t' % (guard))
 			source.write('\trl_encode_int%d(&buffer, source->%s);\n' % (type.size, name))
 
-		source.write('\tsize -= %d;\n' % (msg.fixed_size))
+		source.write('\tsize -= %s;\n' % (fixed_size))
 		for name, type, guard in msg.fixed_fields:
 			if guard:
 				source.write('\tif (%s) size -= sizeof(%d);\n' % (guard, type.size))
@@ -212,10 +222,28 @@ def mkmsg(desc, output_prefix):
 		for name, type, guard in msg.var_fields:
 			source.write('\tif (0 != rl_encode_%s(&buffer, &size, source->%s)) return -1;\n' % (type.name, name))
 		
-		source.write('\trl_encode_int%d(&length_pos, (rl_uint%d)(initial_size - size));\n' % (length_type.size, length_type.size * 8))
+		source.write('\tif (0 != rl_encode_length(&length_pos, framing, (rl_uint32)(initial_size - size))) return -1;\n')
 		source.write('\treturn initial_size - size;\n')
 		source.write('}\n\n')
 
+		# emit size calculator
+		source.write('static int size_%s_%s(const rl_msg_t *msg, int framing) {\n' % (msg.name, msg.type))
+		source.write('\tconst %s *source = (const %s *)msg;\n' % (ct_name, ct_name))
+		source.write('\tint size = %s;\n' % (fixed_size))
+		for name, type, guard in msg.fixed_fields:
+			if guard:
+				source.write('\tif (%s) size += %d;\n' % (guard, type.size))
+		for name, type, guard in msg.var_fields:
+			if type.name == 'string':
+				# length byte, payload and null terminator
+				source.write('\tsize += (int) rl_strlen(source->%s) + 2;\n' % (name))
+			elif type.name == 'array':
+				source.write('\tsize += 4 + (int) source->%s.length;\n' % (name))
+		if len(msg.var_fields) == 0:
+			source.write('\t(void) source;\n')
+		source.write('\treturn size;\n')
+		source.write('}\n\n')
+
 		# emit describer
 		source.write('static void describe_%s_%s(char *buffer, size_t buffer_max, const rl_msg_t *msg) {\n' % (msg.name, msg.type))
 		source.write('\tconst %s *source = &msg->%s_%s;\n' % (ct_name, msg.name, msg.type))
@@ -254,8 +282,8 @@ def mkmsg(desc, output_prefix):
 
 	# emit decoder table
 	source.write('typedef void (*rl_describe_fn_t)(char *buffer, size_t max_buf, const rl_msg_t *msg);\n')
-	source.write('typedef int (*rl_decode_fn_t)(const void *buffer, int size, rl_msg_t *msg_out);\n')
-	source.write('typedef int (*rl_encode_fn_t)(const rl_msg_t *msg, void *buffer, int size);\n')
+	source.write('typedef int (*rl_decode_fn_t)(const void *buffer, int size, int framing, rl_msg_t *msg_out);\n')
+	source.write('typedef int (*rl_encode_fn_t)(const rl_msg_t *msg, int framing, void *buffer, int size);\n')
 
 	source.write('static const rl_decode_fn_t decoders[%d] = {\n' % (len(messages)))
 	for i in range(0, len(messages)):
@@ -276,6 +304,17 @@ def mkmsg(desc, output_prefix):
 		source.write('\n')
 	source.write('};\n')
 
+	# emit size calculator table
+	source.write('typedef int (*rl_size_fn_t)(const rl_msg_t *msg, int framing);\n')
+	source.write('static const rl_size_fn_t sizers[%d] = {\n' % (len(messages)))
+	for i in range(0, len(messages)):
+		msg = messages[i]
+		source.write('\tsize_%s_%s' % (msg.name, msg.type))
+		if i + 1 != len(messages):
+			source.write(',')
+		source.write('\n')
+	source.write('};\n')
+
 	# emit describer table
 	source.write('static const rl_describe_fn_t describers[%d] = {\n' % (len(messages)))
 	for i in range(0, len(messages)):
@@ -289,8 +328,9 @@ def mkmsg(desc, output_prefix):
 	# encoder and decoder functions
 	header.write(r'''
 #define rl_msg_kind_of(msg) ((rl_msg_kind_t) (msg)->handshake_request.hdr_type)
-int rl_decode_msg(const void *buffer, int size, rl_msg_t *msg_out);
-int rl_encode_msg(const rl_msg_t *message, void *buffer, int size, size_t *used_size);
+int rl_decode_msg(const void *buffer, int size, int framing, rl_msg_t *msg_out);
+int rl_encode_msg(const rl_msg_t *message, int framing, void *buffer, int size, size_t *used_size);
+size_t rl_msg_encoded_size(const rl_msg_t *message, int framing);
 void rl_describe_msg(const rl_msg_t *message, char *buffer, size_t max);
 const char *rl_msg_name(rl_msg_kind_t kind); 
 ''')
@@ -305,19 +345,19 @@ const char *rl_msg_name(rl_msg_kind_t kind);
 
 
 	source.write(r'''
-int rl_decode_msg(const void *buffer, int size, rl_msg_t *msg_out)
+int rl_decode_msg(const void *buffer, int size, int framing, rl_msg_t *msg_out)
 {
 	const rl_msg_kind_t kind = peek_msg_kind(buffer, size);
 	if (RL_MSG_BOGUS == kind)
 		return -1;
 	else
-		return (*decoders[kind])(buffer, size, msg_out);
+		return (*decoders[kind])(buffer, size, framing, msg_out);
 }
 
-int rl_encode_msg(const rl_msg_t *message, void *buffer, int size, size_t *used_size)
+int rl_encode_msg(const rl_msg_t *message, int framing, void *buffer, int size, size_t *used_size)
 {
 	int size_result;
-	size_result = (*encoders[rl_msg_kind_of(message)])(message, buffer, size);
+	size_result = (*encoders[rl_msg_kind_of(message)])(message, framing, buffer, size);
 
 	if (-1 == size_result)
 		return -1;
@@ -326,6 +366,11 @@ int rl_encode_msg(const rl_msg_t *message, void *buffer, int size, size_t *used_
 	return 0;
 }
 
+size_t rl_msg_encoded_size(const rl_msg_t *message, int framing)
+{
+	return (size_t) (*sizers[rl_msg_kind_of(message)])(message, framing);
+}
+
 void rl_describe_msg(const rl_msg_t *message, char *buffer, size_t max)
 {
 	(*describers[rl_msg_kind_of(message)])(buffer, max, message);
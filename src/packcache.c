@@ -0,0 +1,205 @@
+#include "packcache.h"
+#include "lz.h"
+#include "xxhash.h"
+
+static rl_uint32
+entry_size(const rl_packcache_entry_t *entry)
+{
+	return (rl_uint32) sizeof(rl_packcache_entry_t) + entry->packed_length;
+}
+
+static void
+free_entry(void *datum)
+{
+	rl_packcache_entry_t *entry = (rl_packcache_entry_t *) datum;
+	rl_free_sized(entry, entry_size(entry));
+}
+
+static void
+unlink_entry(rl_packcache_t *cache, rl_packcache_entry_t *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+link_entry(rl_packcache_t *cache, rl_packcache_entry_t *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+
+	cache->lru_head = entry;
+}
+
+static void
+remove_entry(rl_packcache_t *cache, rl_packcache_entry_t *entry)
+{
+	unlink_entry(cache, entry);
+	cache->used -= entry_size(entry);
+	rl_dict_erase(&cache->entries, entry->key);
+}
+
+/* Remember that the data [key] describes compressed to [packed_length]
+ * bytes at [packed], or didn't fit in [room] bytes if that's zero. */
+static void
+store(rl_packcache_t *cache, const rl_uint32 key[3], const rl_uint8 *packed, rl_uint32 packed_length, rl_uint32 room)
+{
+	const rl_uint32 size = (rl_uint32) sizeof(rl_packcache_entry_t) + packed_length;
+	rl_packcache_entry_t *entry;
+
+	if (size > cache->budget)
+		return;
+
+	if (NULL != (entry = (rl_packcache_entry_t *) rl_dict_find(&cache->entries, key)))
+		remove_entry(cache, entry);
+
+	while (cache->lru_tail && cache->used + size > cache->budget)
+	{
+		remove_entry(cache, cache->lru_tail);
+		++cache->stats.evictions;
+	}
+
+	if (NULL == (entry = (rl_packcache_entry_t *) rl_alloc_sized(size)))
+		return;
+
+	rl_memcpy(entry->key, key, sizeof(entry->key));
+	entry->packed_length = packed_length;
+	entry->room = room;
+	rl_memcpy(entry + 1, packed, packed_length);
+
+	if (0 != rl_dict_insert(&cache->entries, entry->key, entry))
+	{
+		free_entry(entry);
+		return;
+	}
+
+	link_entry(cache, entry);
+	cache->used += size;
+}
+
+int
+rl_packcache_init(rl_packcache_t *cache, rl_uint32 budget)
+{
+	rl_memset(cache, 0, sizeof(*cache));
+	cache->budget = budget;
+
+	if (NULL == (cache->table = (rl_uint32 *) rl_alloc_sized(RL_LZ_TABLE_SIZE * sizeof(rl_uint32))))
+		return 1;
+
+	if (0 != rl_dict_init(&cache->entries, 256, 3 * sizeof(rl_uint32), NULL, NULL, free_entry))
+	{
+		rl_free_sized(cache->table, RL_LZ_TABLE_SIZE * sizeof(rl_uint32));
+		cache->table = NULL;
+		return 1;
+	}
+
+#if defined(RL_POSIX)
+	pthread_mutex_init(&cache->lock, NULL);
+#endif
+	return 0;
+}
+
+void
+rl_packcache_destroy(rl_packcache_t *cache)
+{
+	RL_LOG_INFO(("packed data cache: %u hits, %u misses, %u evictions, %u bytes in use",
+				cache->stats.hits,
+				cache->stats.misses,
+				cache->stats.evictions,
+				cache->used));
+
+	rl_dict_destroy(&cache->entries);
+	rl_free_sized(cache->table, RL_LZ_TABLE_SIZE * sizeof(rl_uint32));
+	cache->table = NULL;
+
+#if defined(RL_POSIX)
+	pthread_mutex_destroy(&cache->lock);
+#endif
+}
+
+static void
+lock_cache(rl_packcache_t *cache)
+{
+#if defined(RL_POSIX)
+	pthread_mutex_lock(&cache->lock);
+#else
+	(void) cache;
+#endif
+}
+
+static void
+unlock_cache(rl_packcache_t *cache)
+{
+#if defined(RL_POSIX)
+	pthread_mutex_unlock(&cache->lock);
+#else
+	(void) cache;
+#endif
+}
+
+rl_uint32
+rl_packcache_compress(rl_packcache_t *cache, const rl_uint8 *data, rl_uint32 length, rl_uint8 *out, rl_uint32 out_size, rl_uint32 *table)
+{
+	rl_packcache_entry_t *entry;
+	rl_uint32 key[3];
+	rl_uint64 hash;
+	rl_uint32 packed_length;
+
+	if (NULL == table)
+		table = cache->table;
+
+	if (length < RL_PACKCACHE_MIN_SIZE)
+		return rl_lz_compress(data, length, out, out_size, table);
+
+	hash = rl_xxhash64(data, length, 0);
+	key[0] = (rl_uint32) (hash >> 32);
+	key[1] = (rl_uint32) hash;
+	key[2] = length;
+
+	lock_cache(cache);
+
+	/* Data that didn't compress may still fit in more room. */
+	entry = (rl_packcache_entry_t *) rl_dict_find(&cache->entries, key);
+
+	if (entry && (entry->packed_length || out_size <= entry->room))
+	{
+		++cache->stats.hits;
+		unlink_entry(cache, entry);
+		link_entry(cache, entry);
+
+		if (0 == entry->packed_length || entry->packed_length > out_size)
+			packed_length = 0;
+		else
+		{
+			packed_length = entry->packed_length;
+			rl_memcpy(out, entry + 1, packed_length);
+		}
+
+		unlock_cache(cache);
+		return packed_length;
+	}
+
+	++cache->stats.misses;
+	unlock_cache(cache);
+
+	packed_length = rl_lz_compress(data, length, out, out_size, table);
+
+	lock_cache(cache);
+	store(cache, key, out, packed_length, out_size);
+	unlock_cache(cache);
+	return packed_length;
+}
@@ -0,0 +1,90 @@
+#ifndef RLAUNCH_PACKCACHE_H
+#define RLAUNCH_PACKCACHE_H
+
+#include "util.h"
+
+#if defined(RL_POSIX)
+#include <pthread.h>
+#endif
+
+/*
+ * Cache of compressed frame bodies for the controller.
+ *
+ * Targets read the same file data over and over: executables are loaded on
+ * every run, and libraries, fonts and assets by every program that uses
+ * them. Compressed bodies are kept by the XXH64 hash and length of what was
+ * compressed, so that data is compressed once and then served from the
+ * cache. That data didn't compress is remembered as well, so it isn't tried
+ * again. Bodies shorter than RL_PACKCACHE_MIN_SIZE are compressed as they
+ * come, and entries are evicted least recently used first once they take up
+ * more than the budget.
+ *
+ * Worker jobs compress file payloads through the cache as well, so on POSIX
+ * it is locked; the compressing itself happens outside the lock, in the
+ * caller's own table.
+ */
+
+enum
+{
+	RL_PACKCACHE_MIN_SIZE = 4096
+};
+
+typedef struct rl_packcache_stats_tag
+{
+	rl_uint32 hits;
+	rl_uint32 misses;
+	rl_uint32 evictions;
+} rl_packcache_stats_t;
+
+typedef struct rl_packcache_entry_tag
+{
+	/* High and low words of the hash, and the length of the data. */
+	rl_uint32 key[3];
+
+	/* LRU chain, most recently used first. */
+	struct rl_packcache_entry_tag *lru_prev;
+	struct rl_packcache_entry_tag *lru_next;
+
+	/* Compressed length, with the compressed bytes following the entry, or
+	 * zero if the data didn't compress into [room] bytes. */
+	rl_uint32 packed_length;
+	rl_uint32 room;
+} rl_packcache_entry_t;
+
+typedef struct rl_packcache_tag
+{
+	/* rl_packcache_entry_t by key */
+	rl_dict_t entries;
+
+	rl_packcache_entry_t *lru_head;
+	rl_packcache_entry_t *lru_tail;
+
+	rl_uint32 budget;
+	rl_uint32 used;
+
+	/* rl_lz_compress() scratch space for the network thread */
+	rl_uint32 *table;
+
+	rl_packcache_stats_t stats;
+
+#if defined(RL_POSIX)
+	pthread_mutex_t lock;
+#endif
+} rl_packcache_t;
+
+/* Set up a cache holding at most [budget] bytes of compressed data. Returns
+ * non-zero if out of memory. */
+int
+rl_packcache_init(rl_packcache_t *cache, rl_uint32 budget);
+
+void
+rl_packcache_destroy(rl_packcache_t *cache);
+
+/* Compress [length] bytes of [data] into [out], like rl_lz_compress(), with
+ * [table] as its scratch space, or the cache's own one on the network
+ * thread if that's NULL. Returns the compressed length, or 0 if it exceeds
+ * [out_size]. */
+rl_uint32
+rl_packcache_compress(rl_packcache_t *cache, const rl_uint8 *data, rl_uint32 length, rl_uint8 *out, rl_uint32 out_size, rl_uint32 *table);
+
+#endif
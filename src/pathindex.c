@@ -0,0 +1,1105 @@
+#include "pathindex.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(RL_LINUX)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+#include "workpool.h"
+
+typedef struct rl_pathindex_entry_tag
+{
+	rl_statinfo_t info;
+
+	/* Directories: the inotify watch, or -1, and the number of entries
+	 * indexed right below them */
+	int wd;
+	rl_uint32 children;
+
+	/* Other names in the directory fold to the same key; the entry is for
+	 * one of them. */
+	int ambiguous;
+
+	/* A directory reached through a symbolic link, or one that couldn't be
+	 * read; nothing below it is indexed. */
+	int opaque;
+
+	/* Links the entries a scan found until they're added */
+	struct rl_pathindex_entry_tag *next;
+
+	/* Points past the end of [path] */
+	char *key;
+	size_t length;
+	char path[1];
+} rl_pathindex_entry_t;
+
+/* A directory being read, on a worker thread or not */
+typedef struct rl_pathindex_scan_tag
+{
+	rl_work_t work;
+	const rl_pathindex_t *index;
+	rl_pathindex_entry_t *dir;
+	int wd;
+	int unreadable;
+	int failed;
+
+	/* What's in [dir], linked through [next] */
+	rl_pathindex_entry_t *found;
+} rl_pathindex_scan_t;
+
+typedef struct rl_pathindex_tree_tag
+{
+	rl_pathindex_t *index;
+	const char *path;
+	size_t length;
+} rl_pathindex_tree_t;
+
+enum
+{
+	WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+		IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW
+};
+
+static void
+fold(char *out, const char *in, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; ++i)
+	{
+		const char ch = in[i];
+		out[i] = ch >= 'A' && ch <= 'Z' ? (char) (ch - 'A' + 'a') : ch;
+	}
+}
+
+static int
+is_dir(const rl_pathindex_entry_t *entry)
+{
+	return entry->info.exists && S_ISDIR(entry->info.mode);
+}
+
+/* Is [path] at or below [prefix]? Both are relative to the root. */
+static int
+in_tree(const char *path, size_t length, const char *prefix, size_t prefix_length)
+{
+	return length >= prefix_length && 0 == memcmp(path, prefix, prefix_length) &&
+		(length == prefix_length || '/' == path[prefix_length]);
+}
+
+/* Entry for [name] in the directory [dir_path], which is "" for the root.
+ * Returns NULL if out of memory, or if the path is too long to be opened. */
+static rl_pathindex_entry_t *
+new_entry(const char *dir_path, size_t dir_length, const char *name, size_t name_length)
+{
+	const size_t length = dir_length ? dir_length + 1 + name_length : name_length;
+	rl_pathindex_entry_t *entry;
+
+	if (length >= PATH_MAX)
+		return NULL;
+
+	if (NULL == (entry = (rl_pathindex_entry_t *) rl_alloc_sized_and_clear(sizeof(rl_pathindex_entry_t) + 2 * length + 1)))
+		return NULL;
+
+	if (dir_length)
+	{
+		rl_memcpy(entry->path, dir_path, dir_length);
+		entry->path[dir_length] = '/';
+	}
+
+	rl_memcpy(entry->path + length - name_length, name, name_length);
+	entry->path[length] = '\0';
+
+	entry->key = entry->path + length + 1;
+	fold(entry->key, entry->path, length + 1);
+
+	entry->length = length;
+	entry->wd = -1;
+	return entry;
+}
+
+static void
+free_entry(void *entry_)
+{
+	rl_pathindex_entry_t * const entry = (rl_pathindex_entry_t *) entry_;
+	rl_free_sized(entry, sizeof(rl_pathindex_entry_t) + 2 * entry->length + 1);
+}
+
+static rl_pathindex_entry_t *
+find_entry(const rl_pathindex_t *index, const char *key)
+{
+	return (rl_pathindex_entry_t *) rl_dict_find(&index->entries, key);
+}
+
+/* Host path of [path], relative to the root. */
+static int
+host_path(const rl_pathindex_t *index, const char *path, size_t length, char *out, size_t out_size)
+{
+	rl_strbuf_t buf;
+
+	rl_strbuf_init(&buf, out, out_size);
+
+	if (!rl_strbuf_append(&buf, index->root))
+		return 1;
+
+	if (length > 0 && (!rl_strbuf_append(&buf, "/") || !rl_strbuf_append_str_len(&buf, path, length)))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * stat() [name] in the directory [dir_fd], following symbolic links; the
+ * directories they lead to are reported through [opaque]. Returns non-zero
+ * if there's nothing there.
+ */
+static int
+stat_name(int dir_fd, const char *name, rl_statinfo_t *info, int *opaque)
+{
+	struct stat st;
+	int link;
+
+	if (0 != fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW))
+		return 1;
+
+	link = S_ISLNK(st.st_mode);
+
+	if (link && 0 != fstatat(dir_fd, name, &st, 0))
+		return 1;
+
+	info->exists = 1;
+	info->mode = st.st_mode;
+	info->size = st.st_size;
+	info->mtime = st.st_mtime;
+	*opaque = link && S_ISDIR(st.st_mode);
+	return 0;
+}
+
+/* The directory entry [entry] is in, or NULL for the root. */
+static rl_pathindex_entry_t *
+parent_of(const rl_pathindex_t *index, const rl_pathindex_entry_t *entry)
+{
+	char key[PATH_MAX];
+	const char *slash;
+
+	if (0 == entry->length)
+		return NULL;
+
+	if (NULL == (slash = strrchr(entry->key, '/')))
+		return find_entry(index, "");
+
+	rl_memcpy(key, entry->key, (size_t) (slash - entry->key));
+	key[slash - entry->key] = '\0';
+	return find_entry(index, key);
+}
+
+static int
+index_dir(rl_pathindex_t *index, rl_pathindex_entry_t *dir, int wd)
+{
+	if (wd >= index->max_wd)
+	{
+		const int new_max = RL_MAX_MACRO(wd + 1, index->max_wd * 2);
+		rl_pathindex_entry_t **new_index;
+
+		if (NULL == (new_index = (rl_pathindex_entry_t **) rl_alloc_sized_and_clear(new_max * sizeof(rl_pathindex_entry_t *))))
+			return 1;
+
+		if (index->dirs_by_wd)
+		{
+			rl_memcpy(new_index, index->dirs_by_wd, index->max_wd * sizeof(rl_pathindex_entry_t *));
+			rl_free_sized(index->dirs_by_wd, index->max_wd * sizeof(rl_pathindex_entry_t *));
+		}
+
+		index->dirs_by_wd = new_index;
+		index->max_wd = new_max;
+	}
+
+	dir->wd = wd;
+	index->dirs_by_wd[wd] = dir;
+	return 0;
+}
+
+/* Stop watching [entry], if it's a directory. Watches follow directories
+ * when they're moved, so they'd report changes under the wrong names. */
+static void
+forget_dir(rl_pathindex_t *index, rl_pathindex_entry_t *entry)
+{
+	if (-1 == entry->wd)
+		return;
+
+	if (index->dirs_by_wd[entry->wd] == entry)
+	{
+		inotify_rm_watch(index->notify_fd, entry->wd);
+		index->dirs_by_wd[entry->wd] = NULL;
+	}
+
+	entry->wd = -1;
+}
+
+/* Stop answering lookups, and stop watching. */
+static void
+give_up(rl_pathindex_t *index)
+{
+	int wd;
+
+	index->complete = 0;
+
+	for (wd = 0; wd < index->max_wd; ++wd)
+	{
+		if (index->dirs_by_wd[wd])
+		{
+			inotify_rm_watch(index->notify_fd, wd);
+			index->dirs_by_wd[wd] = NULL;
+		}
+	}
+
+	rl_dict_clear(&index->entries);
+}
+
+/*
+ * Add [entry], unless another name already folds to its key; the entry
+ * that's there is marked ambiguous then, and [entry] freed. Returns zero if
+ * it was added, 1 on a clash and -1 if the index is full.
+ */
+static int
+add_entry(rl_pathindex_t *index, rl_pathindex_entry_t *entry)
+{
+	rl_pathindex_entry_t *other;
+
+	if (NULL != (other = find_entry(index, entry->key)))
+	{
+		other->ambiguous = 1;
+		free_entry(entry);
+		return 1;
+	}
+
+	if (index->entries.num_elements >= RL_PATHINDEX_MAX_ENTRIES ||
+		0 != rl_dict_insert(&index->entries, entry->key, entry))
+	{
+		free_entry(entry);
+		return -1;
+	}
+
+	if (NULL != (other = parent_of(index, entry)))
+		++other->children;
+
+	return 0;
+}
+
+static int
+entry_in_tree(const void *key, void *value, void *context)
+{
+	rl_pathindex_entry_t * const entry = (rl_pathindex_entry_t *) value;
+	rl_pathindex_tree_t * const tree = (rl_pathindex_tree_t *) context;
+
+	(void) key;
+
+	if (!in_tree(entry->path, entry->length, tree->path, tree->length))
+		return 0;
+
+	forget_dir(tree->index, entry);
+	return 1;
+}
+
+/* Drop [entry] and everything below it. */
+static void
+remove_entry(rl_pathindex_t *index, rl_pathindex_entry_t *entry)
+{
+	rl_pathindex_entry_t * const parent = parent_of(index, entry);
+	char path[PATH_MAX];
+	rl_pathindex_tree_t tree;
+
+	if (parent)
+		--parent->children;
+
+	forget_dir(index, entry);
+
+	if (0 == entry->children)
+	{
+		rl_dict_erase(&index->entries, entry->key);
+		return;
+	}
+
+	rl_memcpy(path, entry->path, entry->length + 1);
+	tree.index = index;
+	tree.path = path;
+	tree.length = entry->length;
+	rl_dict_erase_if(&index->entries, entry_in_tree, &tree);
+}
+
+static void
+run_scan(rl_work_t *work)
+{
+	rl_pathindex_scan_t * const scan = (rl_pathindex_scan_t *) work;
+	const rl_pathindex_entry_t * const dir = scan->dir;
+	char path[PATH_MAX];
+	DIR *dir_handle;
+	struct dirent *item;
+	int fd;
+
+	/* Watch first, so that nothing added while we read goes unnoticed. */
+	if (0 != host_path(scan->index, dir->path, dir->length, path, sizeof(path)) ||
+		-1 == (scan->wd = inotify_add_watch(scan->index->notify_fd, path, WATCH_MASK)))
+	{
+		/* Most likely out of watches (fs.inotify.max_user_watches). */
+		RL_LOG_DEBUG(("can't watch %s: %s", path, strerror(errno)));
+		scan->failed = 1;
+		return;
+	}
+
+	if (-1 == (fd = open(path, O_RDONLY | O_DIRECTORY)))
+	{
+		scan->unreadable = 1;
+		return;
+	}
+
+	if (NULL == (dir_handle = fdopendir(fd)))
+	{
+		close(fd);
+		scan->unreadable = 1;
+		return;
+	}
+
+	while (NULL != (item = readdir(dir_handle)))
+	{
+		const char * const name = item->d_name;
+		rl_pathindex_entry_t *entry;
+		int opaque;
+
+		if ('.' == name[0] && ('\0' == name[1] || ('.' == name[1] && '\0' == name[2])))
+			continue;
+
+		/* Paths too long to be opened aren't indexed; they're missing. */
+		if (NULL == (entry = new_entry(dir->path, dir->length, name, rl_strlen(name))))
+		{
+			if (dir->length + 1 + rl_strlen(name) < PATH_MAX)
+				scan->failed = 1;
+			continue;
+		}
+
+		/* Dangling links are missing too. */
+		if (0 != stat_name(fd, name, &entry->info, &opaque))
+		{
+			free_entry(entry);
+			continue;
+		}
+
+		entry->opaque = opaque;
+		entry->next = scan->found;
+		scan->found = entry;
+	}
+
+	closedir(dir_handle);
+}
+
+static int
+start_scan(rl_pathindex_t *index, rl_pathindex_entry_t *dir, rl_workpool_t *pool, rl_work_t **finished)
+{
+	rl_pathindex_scan_t *scan;
+
+	if (NULL == (scan = RL_ALLOC_TYPED_ZERO(rl_pathindex_scan_t)))
+		return 1;
+
+	scan->work.run = run_scan;
+	scan->index = index;
+	scan->dir = dir;
+	scan->wd = -1;
+
+	if (pool)
+	{
+		rl_workpool_submit(pool, &scan->work);
+	}
+	else
+	{
+		run_scan(&scan->work);
+		scan->work.next = *finished;
+		*finished = &scan->work;
+	}
+
+	return 0;
+}
+
+/*
+ * Add what [scan] found to the index, and free it. Directories among it are
+ * read on [pool] if there is one, and right away, onto [finished], if not;
+ * [pending] counts the scans that haven't been added. Once [failed] is set
+ * nothing more is added.
+ */
+static void
+add_scan(rl_pathindex_t *index, rl_pathindex_scan_t *scan, rl_workpool_t *pool, rl_work_t **finished,
+	rl_uint32 *pending, int *failed)
+{
+	rl_pathindex_entry_t *entry;
+
+	--*pending;
+
+	if (-1 != scan->wd && 0 != index_dir(index, scan->dir, scan->wd))
+		scan->failed = 1;
+
+	*failed |= scan->failed;
+	scan->dir->opaque |= scan->unreadable;
+
+	while (NULL != (entry = scan->found))
+	{
+		scan->found = entry->next;
+		entry->next = NULL;
+
+		if (*failed)
+		{
+			free_entry(entry);
+			continue;
+		}
+
+		switch (add_entry(index, entry))
+		{
+		case 0:
+			if (is_dir(entry) && !entry->opaque)
+			{
+				if (0 != start_scan(index, entry, pool, finished))
+					*failed = 1;
+				else
+					++*pending;
+			}
+			break;
+
+		case -1:
+			*failed = 1;
+			break;
+		}
+	}
+
+	RL_FREE_TYPED(rl_pathindex_scan_t, scan);
+}
+
+/*
+ * Index everything below the directory [top], which is in the index
+ * already, reading the directories right here. Returns non-zero if
+ * something couldn't be indexed.
+ */
+static int
+walk(rl_pathindex_t *index, rl_pathindex_entry_t *top)
+{
+	rl_work_t *finished = NULL;
+	rl_uint32 pending = 1;
+	int failed = 0;
+
+	if (0 != start_scan(index, top, NULL, &finished))
+		return 1;
+
+	while (pending > 0)
+	{
+		rl_work_t *work = finished;
+
+		finished = NULL;
+
+		while (work)
+		{
+			rl_pathindex_scan_t * const scan = (rl_pathindex_scan_t *) work;
+
+			work = work->next;
+			add_scan(index, scan, NULL, &finished, &pending, &failed);
+		}
+	}
+
+	return failed;
+}
+
+/* Stop reading directories for the walk, and drop what they found. */
+static void
+stop_walk(rl_pathindex_t *index)
+{
+	rl_work_t *work;
+
+	rl_workpool_stop(index->pool);
+	work = rl_workpool_take_completed(index->pool);
+
+	while (work)
+	{
+		rl_pathindex_scan_t * const scan = (rl_pathindex_scan_t *) work;
+		rl_pathindex_entry_t *entry;
+
+		work = work->next;
+
+		if (-1 != scan->wd)
+			inotify_rm_watch(index->notify_fd, scan->wd);
+
+		while (NULL != (entry = scan->found))
+		{
+			scan->found = entry->next;
+			free_entry(entry);
+		}
+
+		RL_FREE_TYPED(rl_pathindex_scan_t, scan);
+	}
+
+	epoll_ctl(index->poll_fd, EPOLL_CTL_DEL, rl_workpool_wakeup_fd(index->pool), NULL);
+	rl_workpool_destroy(index->pool);
+	RL_FREE_TYPED(rl_workpool_t, index->pool);
+	index->pool = NULL;
+	index->pending = 0;
+}
+
+/*
+ * Start indexing the whole tree from scratch. Directories are read on a
+ * pool of threads and added by continue_walk() as they come back; lookups
+ * aren't answered until they all have. Changes are left in the queue
+ * meanwhile, and applied to the finished index.
+ */
+static int
+start_walk(rl_pathindex_t *index)
+{
+	rl_pathindex_entry_t *root;
+	struct epoll_event event;
+	int opaque;
+
+	index->complete = 0;
+	rl_dict_clear(&index->entries);
+
+	if (index->dirs_by_wd)
+		rl_memset(index->dirs_by_wd, 0, index->max_wd * sizeof(rl_pathindex_entry_t *));
+
+	if (NULL == (root = new_entry("", 0, "", 0)))
+		return 1;
+
+	if (0 != stat_name(AT_FDCWD, index->root, &root->info, &opaque) || !is_dir(root))
+	{
+		free_entry(root);
+		return 1;
+	}
+
+	if (0 != add_entry(index, root))
+		return 1;
+
+	if (NULL == (index->pool = RL_ALLOC_TYPED(rl_workpool_t)))
+		return 1;
+
+	if (0 != rl_workpool_init(index->pool, RL_MAX_MACRO(index->num_threads, 1)))
+	{
+		RL_FREE_TYPED(rl_workpool_t, index->pool);
+		index->pool = NULL;
+		return 1;
+	}
+
+	epoll_ctl(index->poll_fd, EPOLL_CTL_DEL, index->notify_fd, NULL);
+
+	rl_memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	index->pending = 1;
+	index->failed = 0;
+
+	if (0 != epoll_ctl(index->poll_fd, EPOLL_CTL_ADD, rl_workpool_wakeup_fd(index->pool), &event) ||
+		0 != start_scan(index, root, index->pool, NULL))
+	{
+		stop_walk(index);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Add the directories read since last time. Gives up if it can't. */
+static void
+continue_walk(rl_pathindex_t *index)
+{
+	rl_work_t *work = rl_workpool_take_completed(index->pool);
+	struct epoll_event event;
+
+	while (work)
+	{
+		rl_pathindex_scan_t * const scan = (rl_pathindex_scan_t *) work;
+
+		work = work->next;
+		add_scan(index, scan, index->pool, NULL, &index->pending, &index->failed);
+	}
+
+	if (!index->failed && index->pending > 0)
+		return;
+
+	stop_walk(index);
+
+	rl_memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+
+	if (index->failed || 0 != epoll_ctl(index->poll_fd, EPOLL_CTL_ADD, index->notify_fd, &event))
+	{
+		RL_LOG_WARNING(("couldn't index %s (more than %u names, or out of inotify watches?); names are used as given",
+					index->root, (unsigned int) RL_PATHINDEX_MAX_ENTRIES));
+		give_up(index);
+		return;
+	}
+
+	index->complete = 1;
+	RL_LOG_INFO(("path index: %u names below %s", (unsigned int) index->entries.num_elements - 1, index->root));
+}
+
+/* Add [entry] and what's below it. */
+static void
+insert_tree(rl_pathindex_t *index, rl_pathindex_entry_t *entry)
+{
+	switch (add_entry(index, entry))
+	{
+	case 0:
+		if (is_dir(entry) && !entry->opaque && 0 != walk(index, entry))
+			give_up(index);
+		break;
+
+	case -1:
+		give_up(index);
+		break;
+	}
+}
+
+/*
+ * Sort out the names in [dir] that fold to the same key as [name] by
+ * looking at all of them. The entry goes to the name it had if that's still
+ * there, and is ambiguous if there's more than one.
+ */
+static void
+rescan_name(rl_pathindex_t *index, rl_pathindex_entry_t *dir, const char *name)
+{
+	const size_t length = rl_strlen(name);
+	rl_pathindex_entry_t *probe, *old, *entry = NULL;
+	char path[PATH_MAX];
+	DIR *dir_handle = NULL;
+	struct dirent *item;
+	int count = 0;
+
+	if (NULL == (probe = new_entry(dir->path, dir->length, name, length)))
+	{
+		give_up(index);
+		return;
+	}
+
+	old = find_entry(index, probe->key);
+
+	if (0 == host_path(index, dir->path, dir->length, path, sizeof(path)))
+		dir_handle = opendir(path);
+
+	/* Without the directory, its removal is on the way. */
+	while (dir_handle && NULL != (item = readdir(dir_handle)))
+	{
+		rl_pathindex_entry_t *candidate;
+		int opaque;
+
+		if (rl_strlen(item->d_name) != length)
+			continue;
+
+		if (NULL == (candidate = new_entry(dir->path, dir->length, item->d_name, length)))
+			continue;
+
+		if (0 != strcmp(candidate->key, probe->key) ||
+			0 != stat_name(dirfd(dir_handle), item->d_name, &candidate->info, &opaque))
+		{
+			free_entry(candidate);
+			continue;
+		}
+
+		candidate->opaque = opaque;
+		++count;
+
+		if (!entry || (old && 0 == strcmp(old->path, candidate->path)))
+		{
+			if (entry)
+				free_entry(entry);
+			entry = candidate;
+		}
+		else
+		{
+			free_entry(candidate);
+		}
+	}
+
+	if (dir_handle)
+		closedir(dir_handle);
+
+	free_entry(probe);
+
+	if (old)
+		remove_entry(index, old);
+
+	if (entry)
+	{
+		entry->ambiguous = count > 1;
+		insert_tree(index, entry);
+	}
+}
+
+/* Bring the entry for [name] in [dir] in line with what's on disk. */
+static void
+update_name(rl_pathindex_t *index, rl_pathindex_entry_t *dir, const char *name)
+{
+	rl_pathindex_entry_t *entry, *old;
+	char path[PATH_MAX];
+	int opaque;
+
+	if (NULL == (entry = new_entry(dir->path, dir->length, name, rl_strlen(name))))
+	{
+		give_up(index);
+		return;
+	}
+
+	old = find_entry(index, entry->key);
+
+	if (old && (old->ambiguous || 0 != strcmp(old->path, entry->path)))
+	{
+		free_entry(entry);
+		rescan_name(index, dir, name);
+		return;
+	}
+
+	if (0 != host_path(index, entry->path, entry->length, path, sizeof(path)) ||
+		0 != stat_name(AT_FDCWD, path, &entry->info, &opaque))
+	{
+		free_entry(entry);
+		if (old)
+			remove_entry(index, old);
+		return;
+	}
+
+	entry->opaque = opaque;
+
+	if (old && is_dir(old) == is_dir(entry) && old->opaque == entry->opaque)
+	{
+		old->info = entry->info;
+		free_entry(entry);
+		return;
+	}
+
+	if (old)
+		remove_entry(index, old);
+
+	insert_tree(index, entry);
+}
+
+/* Adding and removing entries touches the directory's own times. */
+static void
+update_dir(rl_pathindex_t *index, rl_pathindex_entry_t *dir)
+{
+	char path[PATH_MAX];
+	rl_statinfo_t info;
+	int opaque;
+
+	if (0 == host_path(index, dir->path, dir->length, path, sizeof(path)) &&
+		0 == stat_name(AT_FDCWD, path, &info, &opaque))
+		dir->info = info;
+}
+
+static void
+cleanup(rl_pathindex_t *index)
+{
+	if (index->dirs_by_wd)
+		rl_free_sized(index->dirs_by_wd, index->max_wd * sizeof(rl_pathindex_entry_t *));
+
+	if (index->root)
+		rl_free_sized(index->root, index->root_size);
+
+	if (-1 != index->poll_fd)
+		close(index->poll_fd);
+
+	/* Closing the descriptor drops the watches. */
+	close(index->notify_fd);
+}
+
+int
+rl_pathindex_init(rl_pathindex_t *index, const char *root, int num_threads)
+{
+	rl_memset(index, 0, sizeof(*index));
+	index->num_threads = num_threads;
+	index->root_size = rl_strlen(root) + 1;
+	index->poll_fd = -1;
+
+	if (-1 == (index->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)))
+	{
+		RL_LOG_WARNING(("inotify unavailable: %s", strerror(errno)));
+		return 1;
+	}
+
+	if (-1 == (index->poll_fd = epoll_create1(EPOLL_CLOEXEC)) ||
+		NULL == (index->root = (char *) rl_alloc_sized(index->root_size)))
+		goto error;
+
+	rl_memcpy(index->root, root, index->root_size);
+
+	if (0 != rl_dict_init(&index->entries, 1024, 0, NULL, NULL, free_entry))
+		goto error;
+
+	if (0 != start_walk(index))
+	{
+		RL_LOG_WARNING(("couldn't start indexing %s", root));
+		rl_dict_destroy(&index->entries);
+		goto error;
+	}
+
+	RL_LOG_DEBUG(("path index: walking %s", root));
+	return 0;
+
+error:
+	cleanup(index);
+	return 1;
+}
+
+void
+rl_pathindex_destroy(rl_pathindex_t *index)
+{
+	const rl_pathindex_stats_t * const stats = &index->stats;
+
+	RL_LOG_INFO(("path index: %u lookups, %u corrected, %u missing, %u unknown, %u rebuilds",
+				stats->lookups, stats->corrected, stats->missing, stats->unknown, stats->rebuilds));
+
+	if (index->pool)
+		stop_walk(index);
+
+	rl_dict_destroy(&index->entries);
+	cleanup(index);
+}
+
+/* Spell [path] in [real] as far as the index knows it, the rest as given. */
+static rl_pathindex_result_t
+lookup(const rl_pathindex_t *index, const char *path, char *real, size_t real_size, rl_statinfo_t *info)
+{
+	const char * const given = path;
+	rl_pathindex_result_t result = RL_PATHINDEX_FOUND;
+	const rl_pathindex_entry_t *known = NULL;
+	char key[PATH_MAX];
+	size_t used = 0;
+	rl_strbuf_t buf;
+
+	if (!index->complete || NULL == (known = find_entry(index, "")))
+		result = RL_PATHINDEX_UNKNOWN;
+
+	while (RL_PATHINDEX_FOUND == result && '\0' != *path)
+	{
+		const rl_pathindex_entry_t *entry;
+		size_t length = 0;
+
+		while (path[length] && '/' != path[length])
+			++length;
+
+		/* Empty names, "." and ".." are left to the file system, as is
+		 * anything below files and unindexed directories. */
+		if (0 == length || (1 == length && '.' == path[0]) ||
+			(2 == length && '.' == path[0] && '.' == path[1]) ||
+			!is_dir(known) || known->opaque ||
+			used + length + 2 > sizeof(key))
+		{
+			result = RL_PATHINDEX_UNKNOWN;
+			break;
+		}
+
+		if (used > 0)
+			key[used++] = '/';
+
+		fold(key + used, path, length);
+		used += length;
+		key[used] = '\0';
+
+		if (NULL == (entry = find_entry(index, key)))
+		{
+			result = RL_PATHINDEX_MISSING;
+			break;
+		}
+
+		/* Which of the names was meant is up to the file system. */
+		if (entry->ambiguous)
+		{
+			result = RL_PATHINDEX_UNKNOWN;
+			break;
+		}
+
+		known = entry;
+		path += length;
+
+		if ('/' == *path)
+		{
+			if ('\0' == path[1])
+			{
+				result = RL_PATHINDEX_UNKNOWN;
+				break;
+			}
+
+			++path;
+		}
+	}
+
+	rl_strbuf_init(&buf, real, real_size);
+
+	if (known)
+	{
+		if (!rl_strbuf_append_str_len(&buf, known->path, known->length) ||
+			('\0' != *path && known->length > 0 && '/' != *path && !rl_strbuf_append(&buf, "/")))
+			known = NULL;
+	}
+
+	if (!rl_strbuf_append(&buf, path) || !known)
+	{
+		rl_strbuf_init(&buf, real, real_size);
+		rl_strbuf_append(&buf, given);
+		return RL_PATHINDEX_UNKNOWN;
+	}
+
+	if (RL_PATHINDEX_FOUND == result && info)
+		*info = known->info;
+
+	return result;
+}
+
+rl_pathindex_result_t
+rl_pathindex_resolve(rl_pathindex_t *index, const char *path, char *real, size_t real_size, rl_statinfo_t *info)
+{
+	rl_pathindex_result_t result = lookup(index, path, real, real_size, info);
+
+	/* It may have been created since changes were last read. */
+	if (RL_PATHINDEX_MISSING == result)
+	{
+		rl_pathindex_process_changes(index);
+		result = lookup(index, path, real, real_size, info);
+	}
+
+	++index->stats.lookups;
+
+	switch (result)
+	{
+	case RL_PATHINDEX_FOUND:
+		if (0 != strcmp(path, real))
+			++index->stats.corrected;
+		break;
+
+	case RL_PATHINDEX_MISSING:
+		++index->stats.missing;
+		break;
+
+	default:
+		++index->stats.unknown;
+		break;
+	}
+
+	return result;
+}
+
+int
+rl_pathindex_fd(const rl_pathindex_t *index)
+{
+	return index->poll_fd;
+}
+
+void
+rl_pathindex_process_changes(rl_pathindex_t *index)
+{
+	/* Aligned for struct inotify_event. */
+	union
+	{
+		struct inotify_event event;
+		char bytes[16 * 1024];
+	} buffer;
+	ssize_t size;
+	int overflowed = 0;
+
+	if (index->pool)
+	{
+		continue_walk(index);
+		return;
+	}
+
+	while ((size = read(index->notify_fd, &buffer, sizeof(buffer))) > 0)
+	{
+		const char *cursor = buffer.bytes;
+		const char * const end = buffer.bytes + size;
+
+		while (cursor < end)
+		{
+			const struct inotify_event * const event = (const struct inotify_event *) cursor;
+			rl_pathindex_entry_t *dir = NULL;
+
+			cursor += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+				overflowed = 1;
+
+			if (!index->complete || overflowed)
+				continue;
+
+			if (event->wd >= 0 && event->wd < index->max_wd)
+				dir = index->dirs_by_wd[event->wd];
+
+			if (!dir)
+				continue;
+
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+			{
+				/* Other directories are dealt with when the one they're in
+				 * reports them gone. */
+				if (0 == dir->length)
+				{
+					RL_LOG_WARNING(("path index: %s went away", index->root));
+					give_up(index);
+				}
+			}
+			else if (event->len > 0)
+			{
+				if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+					update_dir(index, dir);
+
+				update_name(index, dir, event->name);
+			}
+		}
+	}
+
+	if (overflowed && index->complete)
+	{
+		RL_LOG_DEBUG(("path index: change queue overflowed; walking %s again", index->root));
+		++index->stats.rebuilds;
+
+		if (0 != start_walk(index))
+		{
+			RL_LOG_WARNING(("couldn't index %s again; names are used as given", index->root));
+			give_up(index);
+		}
+	}
+}
+
+#else
+
+int
+rl_pathindex_init(rl_pathindex_t *index, const char *root, int num_threads)
+{
+	(void) root;
+	(void) num_threads;
+	rl_memset(index, 0, sizeof(*index));
+	index->notify_fd = -1;
+	index->poll_fd = -1;
+	return 1;
+}
+
+void
+rl_pathindex_destroy(rl_pathindex_t *index)
+{
+	(void) index;
+}
+
+rl_pathindex_result_t
+rl_pathindex_resolve(rl_pathindex_t *index, const char *path, char *real, size_t real_size, rl_statinfo_t *info)
+{
+	(void) index;
+	(void) info;
+	rl_string_copy(real_size, real, path);
+	return RL_PATHINDEX_UNKNOWN;
+}
+
+int
+rl_pathindex_fd(const rl_pathindex_t *index)
+{
+	return index->poll_fd;
+}
+
+void
+rl_pathindex_process_changes(rl_pathindex_t *index)
+{
+	(void) index;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef RLAUNCH_PATHINDEX_H
+#define RLAUNCH_PATHINDEX_H
+
+#include "util.h"
+#include "statcache.h"
+
+/*
+ * Case-insensitive index of the names below a directory (POSIX only).
+ *
+ * AmigaDOS doesn't care how names are capitalized, but most host file
+ * systems do, so a target asking for "libs/Foo.library" wouldn't find
+ * "Libs/foo.library". The index maps every path below the root, folded to
+ * lower case, to the path as it's spelled on disk and what stat() said
+ * about it. It knows which names don't exist in any spelling, too, without
+ * asking the file system.
+ *
+ * The tree is walked once by a pool of threads in the background, and kept
+ * current with inotify from then on. The walk goes on as the owner calls
+ * rl_pathindex_process_changes(), which it should do whenever the
+ * descriptor turns readable; that also reads changes, so they don't pile
+ * up. Changes are only seen once they've been read; rl_pathindex_resolve()
+ * reads them before it reports a path missing. If the change queue
+ * overflows the tree is walked again, the same way.
+ *
+ * Lookups the index can't answer come back RL_PATHINDEX_UNKNOWN, and the
+ * path should be used as given: until the walk is done, below directories
+ * reached through symbolic links (which aren't indexed), where several
+ * names only differ in case, and when the index is out of order
+ * altogether, which it is for good if the tree turns out too large. Where
+ * inotify isn't available, rl_pathindex_init() fails.
+ *
+ * Only ASCII letters are folded. Owner thread only.
+ */
+
+struct rl_pathindex_entry_tag;
+struct rl_workpool_tag;
+
+enum
+{
+	/* Trees with more names than this aren't indexed. */
+	RL_PATHINDEX_MAX_ENTRIES = 256 * 1024
+};
+
+typedef enum rl_pathindex_result_tag
+{
+	RL_PATHINDEX_FOUND,
+	RL_PATHINDEX_MISSING,
+	RL_PATHINDEX_UNKNOWN
+} rl_pathindex_result_t;
+
+typedef struct rl_pathindex_stats_tag
+{
+	rl_uint32 lookups;
+	rl_uint32 corrected;
+	rl_uint32 missing;
+	rl_uint32 unknown;
+	rl_uint32 rebuilds;
+} rl_pathindex_stats_t;
+
+typedef struct rl_pathindex_tag
+{
+	/* rl_pathindex_entry_t by folded path relative to the root, which is
+	 * "" itself */
+	rl_dict_t entries;
+
+	/* The indexed directory, and the number of threads that walk it */
+	char *root;
+	size_t root_size;
+	int num_threads;
+
+	/* Clear while lookups can't be answered */
+	int complete;
+
+	/* inotify descriptor, and the indexed directories by watch descriptor */
+	int notify_fd;
+	struct rl_pathindex_entry_tag **dirs_by_wd;
+	int max_wd;
+
+	/* What the owner watches: the walk's pool while the tree is walked,
+	 * [notify_fd] after that */
+	int poll_fd;
+
+	/* While the tree is walked: the pool reading directories, the number
+	 * of them not added yet, and whether something couldn't be */
+	struct rl_workpool_tag *pool;
+	rl_uint32 pending;
+	int failed;
+
+	rl_pathindex_stats_t stats;
+} rl_pathindex_t;
+
+int
+rl_pathindex_init(rl_pathindex_t *index, const char *root, int num_threads);
+
+/* Also logs how lookups went. */
+void
+rl_pathindex_destroy(rl_pathindex_t *index);
+
+/*
+ * Look up [path], relative to the root with '/' between names, ignoring
+ * case. [real] gets the path as it's spelled on disk as far as the index
+ * knows it, and the rest of it as given; for a path that's missing, that's
+ * where it would be created. When it's found, [info], unless NULL, gets
+ * what's known about it.
+ */
+rl_pathindex_result_t
+rl_pathindex_resolve(rl_pathindex_t *index, const char *path, char *real, size_t real_size, rl_statinfo_t *info);
+
+/* Readable when there are changes to process, or more of the walk. */
+int
+rl_pathindex_fd(const rl_pathindex_t *index);
+
+/* Carry on with the walk, or bring the index up to date with reported
+ * changes. */
+void
+rl_pathindex_process_changes(rl_pathindex_t *index);
+
+#endif
@@ -1,6 +1,7 @@
 #include "config.h"
 #include "util.h"
 #include "peer.h"
+#include "lz.h"
 #include "rlnet.h"
 #include "socket_includes.h"
 #include "version.h"
@@ -22,9 +23,19 @@ extern struct ExecBase *SysBase;
 
 enum
 {
-	RL_PING_TIMEOUT = 30 /* seconds */
+	RL_PING_TIMEOUT = 30, /* seconds */
+
+	/* Most frames adaptive compression lets pass before trying again. */
+	RL_COMPRESS_MAX_BACKOFF = 64
 };
 
+/* Size of the input ring, which bounds the largest message we accept. */
+#if defined(RL_AMIGA)
+#define RL_PEER_INPUT_BUFFER_SIZE (32 * 1024)
+#else
+#define RL_PEER_INPUT_BUFFER_SIZE (256 * 1024)
+#endif
+
 typedef enum peer_action_tag
 {
 	PEER_ACTION_RECEIVE_MESSAGE = 0,
@@ -38,17 +49,179 @@ typedef enum peer_action_tag
 
 typedef void (*peer_action_fn)(peer_t *self, const rl_msg_t *msg);
 
-static int enqueue_output_message(peer_t *peer, const rl_msg_t *msg)
+static rl_uint32 frame_header_size(const peer_t *peer)
+{
+	return (rl_uint32) rl_frame_header_size(peer->framing);
+}
+
+/* Returns non-zero if a frame of [frame_size] bytes should be compressed. */
+static int take_compress_turn(peer_t *peer, rl_uint32 frame_size)
+{
+	if (!peer_compresses(peer) ||
+		frame_size < frame_header_size(peer) + RL_COMPRESS_MIN_SIZE)
+		return 0;
+
+	if (PEER_COMPRESS_ADAPTIVE == peer->compress_mode && peer->compress_skip > 0)
+	{
+		--peer->compress_skip;
+		++peer->compress_stats.skipped;
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Returns a compressed copy of the frame in [buf], which replaces it, or
+ * [buf] itself if the frame didn't get smaller.
+ */
+static rl_transport_buf_t *compress_frame(peer_t *peer, rl_transport_buf_t *buf)
+{
+	const rl_uint32 header_size = frame_header_size(peer);
+	const rl_uint32 body_size = (rl_uint32) buf->used_size - header_size;
+	const rl_uint8 *body = buf->buffer + header_size;
+	rl_transport_buf_t *packed_buf;
+	rl_uint8 *cursor;
+	rl_uint32 packed_size = 0;
+
+	if (NULL == (packed_buf = rl_transport_alloc_buffer(&peer->transport, buf->used_size)))
+		return buf;
+
+	/* Leave room for the body length; what's left must save something. */
+	cursor = packed_buf->buffer + header_size + 4;
+
+	if (peer->callbacks.compress)
+	{
+		packed_size = (*peer->callbacks.compress)(peer, body, body_size, cursor, body_size - 4 - 1);
+	}
+	else if (NULL != peer->lz_table ||
+			NULL != (peer->lz_table = (rl_uint32 *) rl_alloc_sized(RL_LZ_TABLE_SIZE * sizeof(rl_uint32))))
+	{
+		packed_size = rl_lz_compress(body, body_size, cursor, body_size - 4 - 1, peer->lz_table);
+	}
+
+	if (0 == packed_size)
+	{
+		rl_transport_free_buffer(&peer->transport, packed_buf);
+
+		++peer->compress_stats.failures;
+		peer->compress_backoff = peer->compress_backoff ? RL_MIN_MACRO(peer->compress_backoff * 2, RL_COMPRESS_MAX_BACKOFF) : 1;
+		peer->compress_skip = peer->compress_backoff;
+		return buf;
+	}
+
+	peer->compress_backoff = 0;
+	++peer->compress_stats.frames;
+	peer->compress_stats.raw_bytes += body_size;
+	peer->compress_stats.packed_bytes += packed_size;
+
+	rl_memcpy(packed_buf->buffer, buf->buffer, header_size);
+	packed_buf->buffer[1] |= RL_PROTO_HDRF_COMPRESSED;
+	packed_buf->used_size = header_size + 4 + packed_size;
+
+	cursor = &packed_buf->buffer[RL_FRAMING_LENGTH_OFFSET];
+	rl_encode_length(&cursor, peer->framing, (rl_uint32) packed_buf->used_size);
+	cursor = &packed_buf->buffer[header_size];
+	rl_encode_int4(&cursor, body_size);
+
+	packed_buf->userdata = buf->userdata;
+	rl_transport_free_buffer(&peer->transport, buf);
+	return packed_buf;
+}
+
+/*
+ * Replace the compressed frame [*buf] with the frame it was compressed from.
+ * Returns non-zero if it's malformed.
+ */
+static int inflate_frame(peer_t *peer, char **buf, size_t *len)
+{
+	const rl_uint32 header_size = frame_header_size(peer);
+	const unsigned char *cursor = (const unsigned char *) *buf + header_size;
+	unsigned char *out, *patch;
+	rl_uint32 body_size;
+
+	if (*len < header_size + 4)
+		return 1;
+
+	rl_decode_int4(&cursor, &body_size);
+
+	if (body_size > peer->transport.max_input_size - header_size)
+		return 1;
+
+	if (NULL == peer->inflate_buffer &&
+		NULL == (peer->inflate_buffer = (char *) rl_alloc_sized(peer->transport.max_input_size)))
+		return 1;
+
+	out = (unsigned char *) peer->inflate_buffer;
+
+	if (0 != rl_lz_decompress(cursor, (rl_uint32) (*len - header_size - 4), out + header_size, body_size))
+		return 1;
+
+	rl_memcpy(out, *buf, header_size);
+	out[1] &= (unsigned char) ~RL_PROTO_HDRF_COMPRESSED;
+	patch = out + RL_FRAMING_LENGTH_OFFSET;
+	rl_encode_length(&patch, peer->framing, header_size + body_size);
+
+	++peer->compress_stats.inflated;
+	*buf = peer->inflate_buffer;
+	*len = header_size + body_size;
+	return 0;
+}
+
+/*
+ * Queue the frame for [msg] with its body replaced by the [packed_size] bytes
+ * at [packed], which are what compress_frame() would have made of it.
+ */
+static int enqueue_packed_message(peer_t *peer, const rl_msg_t *msg, const rl_uint8 *packed, rl_uint32 packed_size)
+{
+	const rl_uint32 header_size = frame_header_size(peer);
+	const rl_uint32 body_size = (rl_uint32) rl_msg_encoded_size(msg, peer->framing) - header_size;
+	rl_transport_buf_t *buf;
+	rl_uint8 *cursor;
+
+	if (NULL == (buf = rl_transport_alloc_buffer(&peer->transport, header_size + 4 + packed_size)))
+	{
+		RL_LOG_WARNING(("enqueue %s failed: couldn't allocate buffer space", rl_msg_name(rl_msg_kind_of(msg))));
+		return -1;
+	}
+
+	cursor = buf->buffer;
+	rl_encode_int1(&cursor, (rl_uint8) msg->handshake_request.hdr_type);
+	rl_encode_int1(&cursor, (rl_uint8) (msg->handshake_request.hdr_flags | RL_PROTO_HDRF_COMPRESSED));
+	rl_encode_length(&cursor, peer->framing, header_size + 4 + packed_size);
+	rl_encode_int4(&cursor, msg->handshake_request.hdr_sequence_num);
+	rl_encode_int4(&cursor, body_size);
+	rl_memcpy(cursor, packed, packed_size);
+
+	buf->used_size = header_size + 4 + packed_size;
+	buf->userdata = peer;
+
+	peer->compress_backoff = 0;
+	++peer->compress_stats.frames;
+	peer->compress_stats.raw_bytes += body_size;
+	peer->compress_stats.packed_bytes += packed_size;
+
+	if (0 != rl_transport_add_output_message(&peer->transport, buf))
+	{
+		RL_LOG_WARNING(("enqueue %s failed: transport didn't want more messages", rl_msg_name(rl_msg_kind_of(msg))));
+		rl_transport_free_buffer(&peer->transport, buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int enqueue_output_message(peer_t *peer, const rl_msg_t *msg, int may_compress)
 {
 	rl_transport_buf_t *buf = NULL;
 
-	if (NULL == (buf = rl_transport_alloc_buffer(&peer->transport)))
+	if (NULL == (buf = rl_transport_alloc_buffer(&peer->transport, rl_msg_encoded_size(msg, peer->framing))))
 	{
 		RL_LOG_WARNING(("enqueue %s failed: couldn't allocate buffer space", rl_msg_name(rl_msg_kind_of(msg))));
 		goto err_cleanup;
 	}
 
-	if (0 != rl_encode_msg(msg, buf->buffer, (int) buf->buffer_size, &buf->used_size))
+	if (0 != rl_encode_msg(msg, peer->framing, buf->buffer, (int) buf->buffer_size, &buf->used_size))
 	{
 		RL_LOG_WARNING(("enqueue %s failed: couldn't encode message", rl_msg_name(rl_msg_kind_of(msg))));
 		goto err_cleanup;
@@ -59,6 +232,93 @@ static int enqueue_output_message(peer_t *peer, const rl_msg_t *msg)
 
 	buf->userdata = peer;
 
+	if (may_compress && take_compress_turn(peer, (rl_uint32) buf->used_size))
+		buf = compress_frame(peer, buf);
+
+	if (0 != rl_transport_add_output_message(&peer->transport, buf))
+	{
+		RL_LOG_WARNING(("enqueue %s failed: transport didn't want more messages", rl_msg_name(rl_msg_kind_of(msg))));
+		goto err_cleanup;
+	}
+
+	return 0;
+
+err_cleanup:
+	if (buf)
+		rl_transport_free_buffer(&peer->transport, buf);
+	return -1;
+}
+
+#if defined(RL_POSIX)
+static int enqueue_output_file_message(peer_t *peer, const rl_msg_t *msg, int fd, rl_uint32 offset, rl_uint32 length)
+{
+	rl_transport_buf_t *buf = NULL;
+	rl_uint8 *patch;
+	size_t total_size;
+	const size_t encoded_size = rl_msg_encoded_size(msg, peer->framing);
+
+	/* Compressing needs the file bytes in memory, so then they're read into
+	 * the message instead of going straight from the file to the socket. */
+	const int compress = take_compress_turn(peer, (rl_uint32) (encoded_size + length));
+
+	if (NULL == (buf = rl_transport_alloc_buffer(&peer->transport, encoded_size + (compress ? length : 0))))
+	{
+		RL_LOG_WARNING(("enqueue %s failed: couldn't allocate buffer space", rl_msg_name(rl_msg_kind_of(msg))));
+		goto err_cleanup;
+	}
+
+	if (0 != rl_encode_msg(msg, peer->framing, buf->buffer, (int) buf->buffer_size, &buf->used_size))
+	{
+		RL_LOG_WARNING(("enqueue %s failed: couldn't encode message", rl_msg_name(rl_msg_kind_of(msg))));
+		goto err_cleanup;
+	}
+
+	/* The message was encoded with an empty trailing array; patch the array
+	 * and header lengths to cover the file bytes that follow on the wire. */
+	total_size = buf->used_size + length;
+	patch = &buf->buffer[RL_FRAMING_LENGTH_OFFSET];
+	if (0 != rl_encode_length(&patch, peer->framing, (rl_uint32) total_size))
+	{
+		RL_LOG_WARNING(("enqueue %s failed: %u byte file payload doesn't fit", rl_msg_name(rl_msg_kind_of(msg)), length));
+		goto err_cleanup;
+	}
+	patch = &buf->buffer[buf->used_size - 4];
+	rl_encode_int4(&patch, length);
+
+	buf->userdata = peer;
+
+	if (compress)
+	{
+		const size_t payload_start = buf->used_size;
+
+		while (buf->used_size < total_size)
+		{
+			const ssize_t got = pread(fd, buf->buffer + buf->used_size, total_size - buf->used_size,
+					(off_t) offset + (off_t) (buf->used_size - payload_start));
+
+			if (got <= 0)
+			{
+				RL_LOG_WARNING(("enqueue %s failed: couldn't read file payload", rl_msg_name(rl_msg_kind_of(msg))));
+				goto err_cleanup;
+			}
+
+			buf->used_size += (size_t) got;
+		}
+
+		buf = compress_frame(peer, buf);
+	}
+	else
+	{
+		if (-1 == (buf->file_fd = dup(fd)))
+		{
+			RL_LOG_WARNING(("enqueue %s failed: couldn't duplicate file descriptor", rl_msg_name(rl_msg_kind_of(msg))));
+			goto err_cleanup;
+		}
+
+		buf->file_offset = offset;
+		buf->file_remaining = length;
+	}
+
 	if (0 != rl_transport_add_output_message(&peer->transport, buf))
 	{
 		RL_LOG_WARNING(("enqueue %s failed: transport didn't want more messages", rl_msg_name(rl_msg_kind_of(msg))));
@@ -72,6 +332,7 @@ err_cleanup:
 		rl_transport_free_buffer(&peer->transport, buf);
 	return -1;
 }
+#endif
 
 static void invoke_action(peer_t *peer, peer_action_t action, const rl_msg_t *arg);
 
@@ -143,6 +404,9 @@ static void on_transmit_handshake(peer_t *self, const rl_msg_t *param_unused_)
 	request->hdr_sequence_num = 0;
 	request->version_major = RLAUNCH_VER_MAJOR;
 	request->version_minor = RLAUNCH_VER_MINOR;
+	request->framing_version = RL_FRAMING_LATEST;
+	request->max_message_size = (rl_uint32) self->transport.max_input_size;
+	request->compression = RL_COMPRESS_LZ;
 
 #if defined(RL_AMIGA)
 	request->platform_name = "AmigaOS";
@@ -196,7 +460,7 @@ static void on_transmit_handshake(peer_t *self, const rl_msg_t *param_unused_)
 	/* TODO: not used right now */
 	request->password_hash = "****";
 
-	if (0 != enqueue_output_message(self, &msg))
+	if (0 != enqueue_output_message(self, &msg, 1))
 	{
 		peer_set_state(self, PEER_ERROR);
 	}
@@ -216,14 +480,38 @@ static void on_receive_handshake(peer_t *self, const rl_msg_t *param)
 				param->handshake_request.platform_name,
 				param->handshake_request.platform_version));
 
-	/* Require exactly the same version */
+	/* Require the same major version; everything that can differ between
+	 * minor versions is negotiated below. */
 	if (param->handshake_request.version_major == RLAUNCH_VER_MAJOR &&
-		param->handshake_request.version_major == RLAUNCH_VER_MAJOR)
+		param->handshake_request.framing_version >= RL_FRAMING_V1)
 	{
+		size_t max_output_size = param->handshake_request.max_message_size;
+
+		/* The target answers with its own handshake, which must still go out
+		 * with V1 framing as that is what the controller expects. */
 		if (PEER_INIT_TARGET == self->init_mode)
 		{
 			invoke_action(self, PEER_ACTION_TRANSMIT_HANDSHAKE, NULL);
 		}
+
+		/* Switch to the best framing both sides support. Neither side sends
+		 * anything else until it has seen the other's handshake, so this can
+		 * happen independently on both ends. */
+		self->framing = RL_MIN_MACRO(param->handshake_request.framing_version, RL_FRAMING_LATEST);
+
+		if (RL_FRAMING_V1 == self->framing)
+			max_output_size = RL_MIN_MACRO(max_output_size, RL_FRAMING_V1_MAX_MESSAGE_SIZE);
+
+		self->transport.max_output_size = max_output_size;
+		self->remote_compression = param->handshake_request.compression;
+
+		RL_LOG_INFO(("%s: using framing v%d, max message size %u in / %u out, peer decompresses %02x",
+					self->ident,
+					self->framing,
+					(unsigned int) self->transport.max_input_size,
+					(unsigned int) self->transport.max_output_size,
+					self->remote_compression));
+
 		peer_set_state(self, PEER_CONNECTED);
 	}
 	else
@@ -245,7 +533,7 @@ static void on_transmit_message(peer_t *self, const rl_msg_t *param)
 		RL_LOG_NETWORK(("%s: on_transmit_message: %s", self->ident, desc));
 	}
 
-	if (0 != enqueue_output_message(self, param))
+	if (0 != enqueue_output_message(self, param, 1))
 	{
 		peer_set_state(self, PEER_ERROR);
 	}
@@ -360,13 +648,19 @@ static void invoke_action(peer_t *peer, peer_action_t action, const rl_msg_t *ar
 
 static int peer_peek_incoming(rl_transport_t *t, const char	*buf_, size_t len)
 {
-	const rl_uint8 *buf = (const rl_uint8 *) buf_;
-	rl_uint16 size = 0;
+	const peer_t *peer = (const peer_t *) t->userdata;
+	const unsigned char *cursor = (const unsigned char *) buf_ + RL_FRAMING_LENGTH_OFFSET;
+	const int header_size = RL_FRAMING_LENGTH_OFFSET + rl_length_size(peer->framing);
+	rl_uint32 size = 0;
+
+	if (len < (size_t) header_size)
+		return header_size;
 
-	if (len < 4)
-		return 4;
+	rl_decode_length(&cursor, peer->framing, &size);
 
-	size = (((rl_uint16)buf[2]) << 8) | (buf[3]);
+	/* a length that doesn't even cover the header can't be right */
+	if (size < (rl_uint32) header_size || size > 0x7fffffff)
+		return -1;
 
 	return (int) size;
 }
@@ -378,10 +672,19 @@ static int peer_deliver_incoming(rl_transport_t *t, char *buf, size_t len)
 
 	peer = (peer_t*) t->userdata;
 
+	if (RL_PROTO_HDRF_COMPRESSED & ((const unsigned char *) buf)[1])
+	{
+		if (0 != inflate_frame(peer, &buf, &len))
+		{
+			RL_LOG_WARNING(("%s: failed to inflate incoming message", peer->ident));
+			return 1;
+		}
+	}
+
 	if (RL_PACKET & rl_log_bits)
 		rl_dump_buffer(buf, len);
 
-	if (0 != rl_decode_msg(buf, (int) len, &msg))
+	if (0 != rl_decode_msg(buf, (int) len, peer->framing, &msg))
 	{
 		RL_LOG_WARNING(("%s: failed to decode incoming message", peer->ident));
 		return 1;
@@ -413,19 +716,33 @@ int peer_init(
 	self->state = PEER_INITIAL;
 	self->fd = fd;
 	self->next = NULL;
+	self->prev = NULL;
+	self->next_pending = NULL;
+	self->input_pending = 0;
+	self->poll_events = 0;
 	self->callbacks = *cb;
 	self->userdata = userdata;
 	self->update_result = 0;
 	self->init_mode = init_mode;
 	self->ping_on_wire = 0;
 	self->last_activity = rl_time(NULL);
+	self->framing = RL_FRAMING_V1;
+	self->remote_compression = 0;
+	self->compress_mode = PEER_COMPRESS_OFF;
+	self->compress_skip = 0;
+	self->compress_backoff = 0;
+	self->lz_table = NULL;
+	self->inflate_buffer = NULL;
+	rl_memset(&self->compress_stats, 0, sizeof(self->compress_stats));
 
 	RL_ASSERT(self->callbacks.on_message);
 	RL_ASSERT(self->callbacks.on_connected);
 
-	if (0 != rl_transport_init(&self->transport, &peer_transport_callbacks, 32768, self))
+	if (0 != rl_transport_init(&self->transport, &peer_transport_callbacks, RL_PEER_INPUT_BUFFER_SIZE, self))
 		return 1;
 
+	self->transport.max_output_size = RL_FRAMING_V1_MAX_MESSAGE_SIZE;
+
 	if (AF_INET == address->sa_family)
 	{
 		char addr_buffer[64];
@@ -468,6 +785,45 @@ int peer_init(
 void peer_destroy(peer_t *self)
 {
 	RL_LOG_DEBUG(("%s: destroying", self->ident));
+	RL_LOG_DEBUG(("%s: sent %u bytes in %u flushes using %u send calls (largest flush %u bytes)",
+				self->ident,
+				self->transport.stats.bytes_sent,
+				self->transport.stats.flushes,
+				self->transport.stats.send_calls,
+				self->transport.stats.max_flush_bytes));
+
+	{
+		int i;
+		for (i = 0; i < RL_TRANSPORT_SIZE_CLASSES; ++i)
+		{
+			const rl_transport_pool_t *pool = &self->transport.pools[i];
+			RL_LOG_DEBUG(("%s: %u byte buffers: %u hits, %u misses, high-water mark %u",
+						self->ident,
+						(unsigned int) rl_transport_size_class_capacity(i),
+						pool->hits,
+						pool->misses,
+						pool->high_water));
+		}
+	}
+
+	if (self->compress_stats.frames || self->compress_stats.failures || self->compress_stats.inflated)
+	{
+		RL_LOG_DEBUG(("%s: compressed %u frames from %u to %u bytes, %u didn't compress, %u skipped; inflated %u frames",
+					self->ident,
+					self->compress_stats.frames,
+					self->compress_stats.raw_bytes,
+					self->compress_stats.packed_bytes,
+					self->compress_stats.failures,
+					self->compress_stats.skipped,
+					self->compress_stats.inflated));
+	}
+
+	if (self->lz_table)
+		rl_free_sized(self->lz_table, RL_LZ_TABLE_SIZE * sizeof(rl_uint32));
+
+	if (self->inflate_buffer)
+		rl_free_sized(self->inflate_buffer, self->transport.max_input_size);
+
 	CloseSocket(self->fd);
 	rl_transport_destroy(&self->transport);
 }
@@ -478,6 +834,67 @@ int peer_transmit_message(peer_t* self, const rl_msg_t *msg)
 	return 0;
 }
 
+int peer_compresses(const peer_t *self)
+{
+	return PEER_COMPRESS_OFF != self->compress_mode && 0 != (RL_COMPRESS_LZ & self->remote_compression);
+}
+
+int peer_transmit_packed_message(peer_t *self, const rl_msg_t *msg, const rl_uint8 *packed, rl_uint32 packed_size)
+{
+	if (PEER_CONNECTED != self->state)
+	{
+		RL_LOG_WARNING(("%s[%s]: can't transmit packed message",
+					self->ident,
+					peer_state_name(self->state)));
+		peer_set_state(self, PEER_ERROR);
+		return -1;
+	}
+
+	if (RL_NETWORK & rl_log_bits)
+	{
+		char desc[256];
+		rl_describe_msg(msg, desc, sizeof(desc));
+		RL_LOG_NETWORK(("%s: transmit_packed_message: %s in %u bytes", self->ident, desc, packed_size));
+	}
+
+	if (0 != (packed_size ? enqueue_packed_message(self, msg, packed, packed_size) : enqueue_output_message(self, msg, 0)))
+	{
+		peer_set_state(self, PEER_ERROR);
+		return -1;
+	}
+
+	return 0;
+}
+
+#if defined(RL_POSIX)
+int peer_transmit_file_message(peer_t *self, const rl_msg_t *msg, int fd, rl_uint32 offset, rl_uint32 length)
+{
+	if (PEER_CONNECTED != self->state)
+	{
+		RL_LOG_WARNING(("%s[%s]: can't transmit file payload",
+					self->ident,
+					peer_state_name(self->state)));
+		peer_set_state(self, PEER_ERROR);
+		return -1;
+	}
+
+	if (RL_NETWORK & rl_log_bits)
+	{
+		char desc[256];
+		rl_describe_msg(msg, desc, sizeof(desc));
+		RL_LOG_NETWORK(("%s: transmit_file_message: %s + %u file bytes", self->ident, desc, length));
+	}
+
+	if (0 != enqueue_output_file_message(self, msg, fd, offset, length))
+	{
+		peer_set_state(self, PEER_ERROR);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 int peer_update(peer_t *self, int can_read, int can_write)
 {
 	int transport_status;
@@ -503,11 +920,17 @@ int peer_update(peer_t *self, int can_read, int can_write)
 
 	if (PEER_ERROR == self->state || PEER_DISCONNECTED == self->state)
 		self->update_result = PEER_STATUS_REMOVE_ME;
-	else if (RL_TRANSPORT_NEED_OUTPUT & transport_status)
-		self->update_result = PEER_STATUS_NEED_OUTPUT;
 	else
+	{
 		self->update_result = 0;
 
+		if (RL_TRANSPORT_NEED_OUTPUT & transport_status)
+			self->update_result |= PEER_STATUS_NEED_OUTPUT;
+
+		if (can_read && self->transport.input_pending)
+			self->update_result |= PEER_STATUS_INPUT_PENDING;
+	}
+
 	return self->update_result;
 }
 
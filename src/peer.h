@@ -51,8 +51,43 @@ typedef struct peer_callbacks_tag
 {
 	int (*on_message)(struct peer_tag *peer, const union rl_msg_tag *msg);
 	int (*on_connected)(struct peer_tag *peer);
+
+	/* Optional: compress a frame body, like rl_lz_compress(). Lets the owner
+	 * reuse what it compressed before; NULL compresses every time. */
+	rl_uint32 (*compress)(struct peer_tag *peer, const rl_uint8 *data, rl_uint32 length, rl_uint8 *out, rl_uint32 out_size);
 } peer_callbacks_t;
 
+/* When to compress outgoing frames, once the remote end has said it can
+ * decompress them. Adaptive compression stops trying for a while after
+ * frames didn't get any smaller, for longer each time. */
+typedef enum peer_compress_mode_tag
+{
+	PEER_COMPRESS_OFF,
+	PEER_COMPRESS_ON,
+	PEER_COMPRESS_ADAPTIVE
+} peer_compress_mode_t;
+
+enum
+{
+	/* Frame bodies shorter than this are always sent as they are. */
+	RL_COMPRESS_MIN_SIZE = 256
+};
+
+typedef struct peer_compress_stats_tag
+{
+	/* frames sent compressed, and their size before and after */
+	rl_uint32 frames;
+	rl_uint32 raw_bytes;
+	rl_uint32 packed_bytes;
+
+	/* frames that didn't get smaller, and frames adaptive mode didn't try */
+	rl_uint32 failures;
+	rl_uint32 skipped;
+
+	/* compressed frames received */
+	rl_uint32 inflated;
+} peer_compress_stats_t;
+
 typedef enum peer_init_mode_tag
 {
 	PEER_INIT_CONTROLLER,
@@ -61,8 +96,15 @@ typedef enum peer_init_mode_tag
 
 typedef struct peer_tag
 {
-	/* instrusively stored pointer for external linked list support */
+	/* instrusively stored pointers for external linked list support */
 	struct peer_tag		*next;
+	struct peer_tag		*prev;
+
+	/* event loop bookkeeping: a second list for peers that have input left
+	 * to read, and the events the socket is currently registered for */
+	struct peer_tag		*next_pending;
+	int					input_pending;
+	int					poll_events;
 
 	/* the state we're currently in */
 	peer_state_t		state;
@@ -80,7 +122,24 @@ typedef struct peer_tag
 	 * output messages to be written
 	 */
 	rl_transport_t		transport;
-	
+
+	/* message framing (RL_FRAMING_xxx) used in both directions; V1 until
+	 * the handshake has been exchanged */
+	int					framing;
+
+	/* RL_COMPRESS_xxx codecs the remote end can decompress (from its
+	 * handshake), when we use them, and the adaptive mode's state: frames
+	 * left to send as they are, and how many to skip after the next one
+	 * that doesn't compress. The table and the buffer compressed frames are
+	 * inflated into are allocated when first needed. */
+	int					remote_compression;
+	peer_compress_mode_t compress_mode;
+	rl_uint32			compress_skip;
+	rl_uint32			compress_backoff;
+	rl_uint32			*lz_table;
+	char				*inflate_buffer;
+	peer_compress_stats_t compress_stats;
+
 	/* callbacks and their user data */
 	void				*userdata;
 	peer_callbacks_t	callbacks;
@@ -106,11 +165,36 @@ void peer_destroy(peer_t *peer);
 enum
 {
 	PEER_STATUS_NEED_OUTPUT			= 1 << 0,
-	PEER_STATUS_REMOVE_ME			= 1 << 1
+	PEER_STATUS_REMOVE_ME			= 1 << 1,
+
+	/* the socket may still have input that didn't fit; update again with
+	 * can_read set without waiting for it to become readable */
+	PEER_STATUS_INPUT_PENDING		= 1 << 2
 };
 
 int peer_update(peer_t* peer, int can_read, int can_write);
 
 int peer_transmit_message(peer_t* self, const union rl_msg_tag *msg);
 
+/* Returns non-zero if frames to the remote end may be sent compressed. */
+int peer_compresses(const peer_t *self);
+
+/*
+ * Transmit [msg] with its frame body already compressed into the
+ * [packed_size] bytes at [packed], as rl_lz_compress() does it for frames
+ * the peer compresses itself, so that can happen on another thread. A
+ * [packed_size] of zero sends the message as it is, uncompressed.
+ */
+int peer_transmit_packed_message(peer_t* self, const union rl_msg_tag *msg, const rl_uint8 *packed, rl_uint32 packed_size);
+
+#if defined(RL_POSIX)
+/*
+ * Transmit a message whose last field is an (empty) array, followed by
+ * [length] bytes of the file [fd] starting at [offset] as the array payload.
+ * The file bytes are sent straight from the file to the socket. The peer
+ * keeps its own duplicate of [fd] until the data has been written.
+ */
+int peer_transmit_file_message(peer_t* self, const union rl_msg_tag *msg, int fd, rl_uint32 offset, rl_uint32 length);
+#endif
+
 #endif
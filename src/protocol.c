@@ -75,3 +75,21 @@ int rl_encode_array(unsigned char **cursor, int *size, const rl_net_array_t arra
 	return 0;
 }
 
+
+int rl_decode_compound_record(const unsigned char **cursor, int *size, rl_uint8 *tag, rl_net_array_t *frame)
+{
+	if (*size < RL_COMPOUND_RECORD_SIZE)
+		return -1;
+
+	rl_decode_int1(cursor, tag);
+	rl_decode_int4(cursor, &frame->length);
+	*size -= RL_COMPOUND_RECORD_SIZE;
+
+	if (frame->length > (rl_uint32) *size)
+		return -1;
+
+	frame->base = (const rl_uint8*) (*cursor);
+	*size -= (int) frame->length;
+	*cursor += frame->length;
+	return 0;
+}
@@ -9,14 +9,49 @@
 enum
 {
 	RL_PROTO_HDRF_REQUEST		= 1 << 0,
-	RL_PROTO_HDRF_ERROR			= 1 << 1
+	RL_PROTO_HDRF_ERROR			= 1 << 1,
+
+	/* The frame body is compressed; see RL_COMPRESS_LZ. */
+	RL_PROTO_HDRF_COMPRESSED	= 1 << 2
 };
 
 enum
 {
 	RL_OPENFLAG_READ			= 1 << 0,
 	RL_OPENFLAG_WRITE			= 1 << 1,
-	RL_OPENFLAG_CREATE			= 1 << 2
+	RL_OPENFLAG_CREATE			= 1 << 2,
+
+	/* The path is a single name inside the directory handle .parent */
+	RL_OPENFLAG_RELATIVE		= 1 << 3
+};
+
+/* open_handle answers name blocks of this size by their contents */
+enum
+{
+	RL_HASH_BLOCK_SIZE			= 4096,
+	RL_HASH_SIZE				= 8
+};
+
+/* delta requests and answers */
+enum
+{
+	RL_DELTA_SIGNATURE_SIZE		= 4 + RL_HASH_SIZE,
+
+	/* The next block is one the target holds; followed by its hash. */
+	RL_DELTA_COPY				= 1,
+
+	/* Followed by a longword count and that many bytes of the file. */
+	RL_DELTA_LITERAL			= 2
+};
+
+/* advise_file hints */
+enum
+{
+	/* The range is going to be read soon. */
+	RL_ADVISE_WILLNEED			= 1 << 0,
+
+	/* The file is going to be read from start to end. */
+	RL_ADVISE_SEQUENTIAL		= 1 << 1
 };
 
 typedef enum rl_node_type_tag
@@ -25,6 +60,31 @@ typedef enum rl_node_type_tag
 	RL_NODE_TYPE_DIRECTORY		= 2
 } rl_node_type_t;
 
+/*
+ * Directory entries in examine_all answers are packed back to back:
+ *
+ * size: longword
+ * date: longword, seconds since 1978-01-01 00:00:00 (the AmigaDOS epoch)
+ * protection: longword, RL_PROTECT_* bits
+ * type: byte, rl_node_type_t
+ * name length: byte
+ * name: [name length] bytes, no null termination
+ */
+#define RL_DIRENTRY_HEADER_SIZE (14)
+#define RL_DIRENTRY_MAX_SIZE (RL_DIRENTRY_HEADER_SIZE + 255)
+
+/* Seconds between the Unix and AmigaDOS epochs. */
+#define RL_AMIGA_EPOCH_OFFSET (252460800UL)
+
+/* Set bits deny access, like the AmigaDOS FIBF_* bits (same values). */
+enum
+{
+	RL_PROTECT_DELETE			= 1 << 0,
+	RL_PROTECT_EXECUTE			= 1 << 1,
+	RL_PROTECT_WRITE			= 1 << 2,
+	RL_PROTECT_READ				= 1 << 3
+};
+
 typedef enum rl_proto_neterror_tag {
 	RL_NETERR_SUCCESS				= 0,
 	RL_NETERR_ACCESS_DENIED			= 1,
@@ -39,6 +99,66 @@ typedef enum rl_proto_neterror_tag {
 	RL_NETERR_UNKNOWN				= 255 
 } rl_proto_neterror_t;
 
+/*
+ * Message framing. Both sides start out with V1 framing (16-bit hdr_length)
+ * and switch to the best framing they both support once the handshake has
+ * been exchanged. V2 framing widens hdr_length to 32 bits.
+ */
+enum
+{
+	RL_FRAMING_V1				= 1,
+	RL_FRAMING_V2				= 2,
+	RL_FRAMING_LATEST			= RL_FRAMING_V2
+};
+
+/* Largest message that can be described with V1 framing. */
+#define RL_FRAMING_V1_MAX_MESSAGE_SIZE (0xffff)
+
+/* Offset of hdr_length; it follows the type and flags bytes. */
+#define RL_FRAMING_LENGTH_OFFSET (2)
+
+/*
+ * Frame compression. Each side lists the codecs it can decompress in the
+ * .compression field of its handshake, and the other side may then send
+ * frames compressed with any of them. A compressed frame has
+ * RL_PROTO_HDRF_COMPRESSED set and keeps the header (with hdr_length
+ * covering the frame as sent), followed by a longword with the length of the
+ * body once decompressed, and the compressed body (see lz.h).
+ */
+enum
+{
+	RL_COMPRESS_LZ				= 1 << 0
+};
+
+/*
+ * Compound requests. Both .operations and .answers are records laid out
+ * back to back:
+ *
+ * tag: byte; RL_COMPOUND_OPF_* bits for operations, RL_COMPOUND_RAN or
+ *      RL_COMPOUND_SKIPPED for answers
+ * length: longword
+ * frame: [length] bytes, a request or answer encoded with the current framing
+ *
+ * Operations that aren't answered when they succeed (close_handle,
+ * advise_file) get an empty answer record. A handle (or .parent) of
+ * RL_COMPOUND_HANDLE_REF plus an operation's index refers to the handle that
+ * an earlier open_handle operation opened. Handle ids are always below it.
+ */
+#define RL_COMPOUND_HANDLE_REF (0x80000000UL)
+
+enum
+{
+	/* Run the operation only if its handle refers to a file that has come
+	 * back in full in the answers so far; otherwise it's skipped. */
+	RL_COMPOUND_OPF_IF_WHOLE	= 1 << 0,
+
+	RL_COMPOUND_RAN				= 0,
+	RL_COMPOUND_SKIPPED			= 1,
+
+	RL_COMPOUND_RECORD_SIZE		= 1 + 4,
+	RL_COMPOUND_MAX_OPS			= 8
+};
+
 #define RL_MSG_INIT(msg, kind) \
 do { \
 	rl_memset(&(msg), 0, sizeof(msg));		\
@@ -155,9 +275,62 @@ static INLINE void rl_encode_int4(unsigned char **cursor, rl_uint32 v)
 	*cursor += 4;
 }
 
+/* framing dependent hdr_length helpers */
+static INLINE int rl_length_size(int framing)
+{
+	return RL_FRAMING_V1 == framing ? 2 : 4;
+}
+
+/* Size of the common frame header: type, flags, length and sequence number. */
+static INLINE int rl_frame_header_size(int framing)
+{
+	return RL_FRAMING_LENGTH_OFFSET + rl_length_size(framing) + 4;
+}
+
+static INLINE void rl_decode_length(const unsigned char **cursor, int framing, rl_uint32 *result)
+{
+	if (RL_FRAMING_V1 == framing)
+	{
+		rl_uint16 value;
+		rl_decode_int2(cursor, &value);
+		*result = value;
+	}
+	else
+		rl_decode_int4(cursor, result);
+}
+
+static INLINE int rl_encode_length(unsigned char **cursor, int framing, rl_uint32 v)
+{
+	if (RL_FRAMING_V1 == framing)
+	{
+		if (v > RL_FRAMING_V1_MAX_MESSAGE_SIZE)
+			return -1;
+		rl_encode_int2(cursor, (rl_uint16) v);
+	}
+	else
+		rl_encode_int4(cursor, v);
+	return 0;
+}
+
 int rl_encode_array(unsigned char **cursor, int *size, const rl_net_array_t array);
 
 int rl_decode_array(const unsigned char **cursor, int *size, rl_net_array_t *result);
 
+/*
+ * Decode the compound record at [cursor] into its [*tag] and [*frame], like
+ * rl_decode_array(). Returns nonzero on error.
+ */
+int rl_decode_compound_record(const unsigned char **cursor, int *size, rl_uint8 *tag, rl_net_array_t *frame);
+
+/*
+ * Encode the tag and length of a compound record into [cursor]; the caller
+ * puts the [length] bytes of the frame right after them.
+ */
+static INLINE void rl_encode_compound_record(unsigned char **cursor, rl_uint8 tag, rl_uint32 length)
+{
+	rl_encode_int1(cursor, tag);
+	rl_encode_int4(cursor, length);
+}
+
 
 #endif
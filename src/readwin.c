@@ -0,0 +1,266 @@
+#include "readwin.h"
+
+enum
+{
+	RL_SEGMENT_IDLE = 0,
+	RL_SEGMENT_REQUESTED,
+	RL_SEGMENT_DONE
+};
+
+/* Window used until there are measurements to size it from. */
+#define RL_READWIN_INITIAL_WINDOW (4)
+
+/* Segments kept in flight per bandwidth-delay product. */
+#define RL_READWIN_GAIN (2)
+
+void
+rl_readwin_estimator_init(rl_readwin_estimator_t *est, rl_uint32 max_window)
+{
+	if (max_window < 1)
+		max_window = 1;
+
+	rl_memset(est, 0, sizeof(*est));
+	est->max_window = max_window;
+	est->window = RL_MIN_MACRO(RL_READWIN_INITIAL_WINDOW, max_window);
+}
+
+/* Add [sample] to [filter], dropping the oldest if it's full, and return
+ * the largest (if [largest]) or smallest sample it holds. */
+static rl_uint32
+filter_add(rl_readwin_filter_t *filter, rl_uint32 sample, int largest)
+{
+	rl_uint32 result = sample;
+	rl_uint32 i;
+
+	filter->samples[filter->next] = sample;
+	filter->next = (filter->next + 1) % RL_READWIN_FILTER_SAMPLES;
+
+	if (filter->count < RL_READWIN_FILTER_SAMPLES)
+		++filter->count;
+
+	for (i = 0; i < filter->count; ++i)
+	{
+		if (largest ? filter->samples[i] > result : filter->samples[i] < result)
+			result = filter->samples[i];
+	}
+
+	return result;
+}
+
+static void
+update_window(rl_readwin_estimator_t *est, rl_uint32 segment_size)
+{
+	rl_uint32 window;
+
+	/* coarse clocks can measure zero; keep what we have */
+	if (0 == est->min_rtt || 0 == est->max_rate)
+		return;
+
+	/* enough segments in flight to cover the bandwidth-delay product of the
+	 * unloaded link, with room to find out if there's more bandwidth */
+	window = (RL_READWIN_GAIN * est->max_rate * est->min_rtt + segment_size - 1) / segment_size;
+
+	window = RL_MAX_MACRO(window, 1);
+	window = RL_MIN_MACRO(window, est->max_window);
+
+	if (window != est->window)
+	{
+		RL_LOG_DEBUG(("read window %u -> %u (rtt %u/%ums, %u/%u bytes/ms)",
+					est->window, window, est->min_rtt, est->srtt, est->max_rate, est->rate));
+		est->window = window;
+	}
+}
+
+static rl_uint32
+segment_length(const rl_readwin_t *win, rl_uint32 segment)
+{
+	const rl_uint32 start = segment * win->segment_size;
+	return RL_MIN_MACRO(win->segment_size, win->length - start);
+}
+
+int
+rl_readwin_begin(
+	rl_readwin_t *win,
+	rl_readwin_estimator_t *est,
+	void *destination,
+	rl_uint32 offset,
+	rl_uint32 length,
+	rl_uint32 segment_size,
+	rl_uint32 now)
+{
+	rl_uint32 count;
+	rl_uint8 *block;
+
+	RL_ASSERT(segment_size > 0);
+	RL_ASSERT(length > 0);
+
+	rl_memset(win, 0, sizeof(*win));
+
+	count = (length + segment_size - 1) / segment_size;
+
+	win->state_size = count * (sizeof(rl_uint32) * 2 + 1);
+	if (NULL == (block = (rl_uint8 *) rl_alloc_sized_and_clear(win->state_size)))
+		return 1;
+
+	win->received = (rl_uint32 *) block;
+	win->sent_time = win->received + count;
+	win->state = (rl_uint8 *) (win->sent_time + count);
+
+	win->estimator = est;
+	win->destination = (rl_uint8 *) destination;
+	win->offset = offset;
+	win->length = length;
+	win->segment_size = segment_size;
+	win->segment_count = count;
+	win->end_segment = count;
+	win->start_time = now;
+	return 0;
+}
+
+void
+rl_readwin_end(rl_readwin_t *win, rl_uint32 now)
+{
+	const rl_uint32 elapsed = now - win->start_time;
+
+	rl_readwin_estimator_t * const est = win->estimator;
+	int measured = 0;
+
+	/* Only the best round trip of each read goes into the filter; later
+	 * segments of a long read wait behind the ones before them. */
+	if (win->min_rtt > 0)
+	{
+		est->min_rtt = filter_add(&est->rtt_samples, win->min_rtt, 0);
+		measured = 1;
+	}
+
+	/* A read with fewer segments than the window is limited by its own
+	 * length rather than the link. */
+	if (!win->failed && elapsed > 0 && win->segment_count > 1 && win->segment_count >= est->window)
+	{
+		const rl_uint32 rate = rl_readwin_result(win) / elapsed;
+
+		est->rate = est->rate ? (est->rate * 3 + rate) / 4 : rate;
+		est->max_rate = filter_add(&est->rate_samples, rate, 1);
+		measured = 1;
+	}
+
+	if (measured)
+		update_window(est, win->segment_size);
+
+	if (win->state)
+		rl_free_sized(win->received, win->state_size);
+
+	win->received = NULL;
+	win->sent_time = NULL;
+	win->state = NULL;
+}
+
+int
+rl_readwin_next(
+	rl_readwin_t *win,
+	rl_uint32 now,
+	rl_uint32 *segment_out,
+	rl_uint32 *offset_out,
+	rl_uint32 *length_out)
+{
+	const rl_uint32 segment = win->next_segment;
+
+	if (win->failed || segment >= win->end_segment)
+		return 0;
+
+	if (win->outstanding >= win->estimator->window)
+		return 0;
+
+	win->state[segment] = RL_SEGMENT_REQUESTED;
+	win->sent_time[segment] = now;
+	++win->outstanding;
+	++win->next_segment;
+
+	*segment_out = segment;
+	*offset_out = win->offset + segment * win->segment_size;
+	*length_out = segment_length(win, segment);
+	return 1;
+}
+
+int
+rl_readwin_deliver(
+	rl_readwin_t *win,
+	rl_uint32 segment,
+	const void *data,
+	rl_uint32 length,
+	int final,
+	rl_uint32 now)
+{
+	rl_uint32 room;
+
+	if (segment >= win->segment_count || RL_SEGMENT_REQUESTED != win->state[segment])
+		return 1;
+
+	room = segment_length(win, segment) - win->received[segment];
+	length = RL_MIN_MACRO(length, room);
+
+	rl_memcpy(win->destination + segment * win->segment_size + win->received[segment], data, length);
+	win->received[segment] += length;
+
+	if (!final)
+		return 0;
+
+	win->state[segment] = RL_SEGMENT_DONE;
+	--win->outstanding;
+
+	/* a short segment means we've hit the end of the file */
+	if (win->received[segment] < segment_length(win, segment) && segment + 1 < win->end_segment)
+		win->end_segment = segment + 1;
+
+	/* only full segments say something about the link */
+	if (win->received[segment] == win->segment_size)
+	{
+		rl_readwin_estimator_t * const est = win->estimator;
+		const rl_uint32 sample = now - win->sent_time[segment];
+
+		est->srtt = est->srtt ? (est->srtt * 7 + sample) / 8 : sample;
+
+		if (sample > 0 && (0 == win->min_rtt || sample < win->min_rtt))
+			win->min_rtt = sample;
+	}
+
+	return 0;
+}
+
+void
+rl_readwin_fail(rl_readwin_t *win, rl_uint32 segment)
+{
+	win->failed = 1;
+
+	if (segment < win->segment_count && RL_SEGMENT_REQUESTED == win->state[segment])
+	{
+		win->state[segment] = RL_SEGMENT_DONE;
+		--win->outstanding;
+	}
+}
+
+int
+rl_readwin_finished(const rl_readwin_t *win)
+{
+	if (win->outstanding > 0)
+		return 0;
+
+	return win->failed || win->next_segment >= win->end_segment;
+}
+
+rl_uint32
+rl_readwin_result(const rl_readwin_t *win)
+{
+	rl_uint32 total = 0;
+	rl_uint32 i;
+
+	for (i = 0; i < win->end_segment && RL_SEGMENT_DONE == win->state[i]; ++i)
+	{
+		total += win->received[i];
+
+		if (win->received[i] < segment_length(win, i))
+			break;
+	}
+
+	return total;
+}
@@ -0,0 +1,175 @@
+#ifndef RLAUNCH_READWIN_H
+#define RLAUNCH_READWIN_H
+
+#include "util.h"
+
+/*
+ * Pipelined reads.
+ *
+ * A large read is split into fixed-size segments that are requested
+ * separately, with up to [window] segment requests outstanding at a time.
+ * Segments can complete in any order (and in several pieces each); their data
+ * is copied straight to its final place in the destination buffer.
+ *
+ * The window is sized from the bandwidth-delay product of the link, measured
+ * over previous reads and kept in an estimator that outlives individual
+ * reads. The product is taken from the best delivery rate and the shortest
+ * segment round trip of the last RL_READWIN_FILTER_SAMPLES reads, which is
+ * what the link does unloaded; the rate a read achieves is bounded by the
+ * window it ran with, so the window is kept at twice the product, to find
+ * out whether more in flight delivers more. It grows that way while the rate
+ * keeps rising, and settles once the link is full. Older reads drop out of
+ * the filters, so the window also comes down again when the link gets slower
+ * or its round trip shorter. Reads too short to fill the window don't say
+ * anything about the rate. Time is passed in by the caller in milliseconds; any monotonic
+ * clock will do.
+ *
+ * This module does no I/O itself so that it can be used (and exercised)
+ * anywhere.
+ */
+
+enum
+{
+	/* Number of recent reads the round trip and rate filters look at */
+	RL_READWIN_FILTER_SAMPLES = 16
+};
+
+/* The last few samples of a measurement, newest at [next] - 1. */
+typedef struct rl_readwin_filter_tag
+{
+	rl_uint32 samples[RL_READWIN_FILTER_SAMPLES];
+	rl_uint32 count;
+	rl_uint32 next;
+} rl_readwin_filter_t;
+
+typedef struct rl_readwin_estimator_tag
+{
+	/* smoothed time from requesting a segment to having all of it, in ms,
+	 * and the shortest such time of the recent reads (0 until one is
+	 * measured) */
+	rl_uint32 srtt;
+	rl_uint32 min_rtt;
+	rl_readwin_filter_t rtt_samples;
+
+	/* smoothed delivery rate of whole reads, in bytes per ms, and the best
+	 * one of the recent reads */
+	rl_uint32 rate;
+	rl_uint32 max_rate;
+	rl_readwin_filter_t rate_samples;
+
+	/* current window, in segments */
+	rl_uint32 window;
+
+	/* upper bound for the window */
+	rl_uint32 max_window;
+} rl_readwin_estimator_t;
+
+void
+rl_readwin_estimator_init(rl_readwin_estimator_t *est, rl_uint32 max_window);
+
+typedef struct rl_readwin_tag
+{
+	rl_readwin_estimator_t *estimator;
+
+	/* destination buffer, and the file range it is read from */
+	rl_uint8 *destination;
+	rl_uint32 offset;
+	rl_uint32 length;
+
+	rl_uint32 segment_size;
+	rl_uint32 segment_count;
+
+	/* next segment to request */
+	rl_uint32 next_segment;
+
+	/* number of segments requested but not yet complete */
+	rl_uint32 outstanding;
+
+	/* segments at or past this one lie beyond end of file */
+	rl_uint32 end_segment;
+
+	/* non-zero once a segment has failed */
+	int failed;
+
+	rl_uint32 start_time;
+
+	/* shortest round trip of a full segment in this read, 0 if none */
+	rl_uint32 min_rtt;
+
+	/* per-segment state, allocated in one block */
+	rl_uint32 *received;
+	rl_uint32 *sent_time;
+	rl_uint8 *state;
+	size_t state_size;
+} rl_readwin_t;
+
+/*
+ * Start a read of [length] bytes at file offset [offset] into [destination].
+ * Returns non-zero if the segment state couldn't be allocated.
+ */
+int
+rl_readwin_begin(
+	rl_readwin_t *win,
+	rl_readwin_estimator_t *est,
+	void *destination,
+	rl_uint32 offset,
+	rl_uint32 length,
+	rl_uint32 segment_size,
+	rl_uint32 now);
+
+/*
+ * Finish a read (successful or not) and release the segment state. The
+ * shortest round trip of the read goes into the estimator, and so does the
+ * delivery rate of completed reads that had at least a window's worth of
+ * segments.
+ */
+void
+rl_readwin_end(rl_readwin_t *win, rl_uint32 now);
+
+/*
+ * Pick the next segment to request, if the window allows one. Returns
+ * non-zero and fills in the segment index and its file range if a request
+ * should be sent.
+ */
+int
+rl_readwin_next(
+	rl_readwin_t *win,
+	rl_uint32 now,
+	rl_uint32 *segment_out,
+	rl_uint32 *offset_out,
+	rl_uint32 *length_out);
+
+/*
+ * Store [length] bytes of data arriving for [segment]. [final] marks the last
+ * piece of the segment; a segment that ends short marks end of file.
+ * Returns non-zero if the data doesn't belong to an outstanding segment.
+ */
+int
+rl_readwin_deliver(
+	rl_readwin_t *win,
+	rl_uint32 segment,
+	const void *data,
+	rl_uint32 length,
+	int final,
+	rl_uint32 now);
+
+/*
+ * Mark an outstanding segment as failed. The read fails as a whole once
+ * every outstanding segment has been accounted for.
+ */
+void
+rl_readwin_fail(rl_readwin_t *win, rl_uint32 segment);
+
+/*
+ * Non-zero when nothing is outstanding and nothing more will be requested.
+ */
+int
+rl_readwin_finished(const rl_readwin_t *win);
+
+/*
+ * Number of bytes read from the start of the destination without holes.
+ */
+rl_uint32
+rl_readwin_result(const rl_readwin_t *win);
+
+#endif
@@ -10,6 +10,11 @@ struct Library *SocketBase = 0;
 
 #if defined(RL_POSIX)
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(RL_LINUX)
+#include <sys/sendfile.h>
 #endif
 
 #if defined(RL_WIN32)
@@ -55,11 +60,99 @@ int rl_configure_socket_blocking(rl_socket_t s, int should_block)
 	return IoctlSocket(s, FIONBIO, (char*) &value);
 #else
 	const int flags = fcntl(s, F_GETFL);
+	if (-1 == flags)
+		return -1;
 	if (should_block)
-		return fcntl(s, flags & ~(O_NONBLOCK));
+		return fcntl(s, F_SETFL, flags & ~(O_NONBLOCK));
 	else
-		return fcntl(s, flags | (O_NONBLOCK));
+		return fcntl(s, F_SETFL, flags | (O_NONBLOCK));
+#endif
+}
+
+int rl_socket_sendv(rl_socket_t s, const rl_iovec_t *vec, int count)
+{
+#if defined(RL_WIN32)
+	WSABUF bufs[RL_SOCKET_MAX_IOV];
+	DWORD bytes_sent = 0;
+	int i;
+
+	RL_ASSERT(count > 0 && count <= RL_SOCKET_MAX_IOV);
+
+	for (i = 0; i < count; ++i)
+	{
+		bufs[i].buf = (char *) vec[i].base;
+		bufs[i].len = (ULONG) vec[i].length;
+	}
+
+	if (0 != WSASend(s, bufs, (DWORD) count, &bytes_sent, 0, NULL, NULL))
+		return -1;
+
+	return (int) bytes_sent;
+#elif defined(RL_POSIX)
+	struct iovec iov[RL_SOCKET_MAX_IOV];
+	struct msghdr hdr;
+	int i;
+
+	RL_ASSERT(count > 0 && count <= RL_SOCKET_MAX_IOV);
+
+	for (i = 0; i < count; ++i)
+	{
+		iov[i].iov_base = (void *) vec[i].base;
+		iov[i].iov_len = vec[i].length;
+	}
+
+	rl_memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = count;
+
+	return (int) sendmsg(s, &hdr, 0);
+#else
+	/* No gather support in bsdsocket.library that we can rely on, so the
+	 * buffers go out one send() at a time, until one is cut short. */
+	int total = 0;
+	int i;
+
+	RL_ASSERT(count > 0);
+
+	for (i = 0; i < count; ++i)
+	{
+		const int rc = send(s, (char *) vec[i].base, (int) vec[i].length, 0);
+
+		/* Report what went out before the error; the caller finds the
+		 * error again on the next call. */
+		if (rc < 0)
+			return total > 0 ? total : -1;
+
+		total += rc;
+
+		if ((size_t) rc < vec[i].length)
+			break;
+	}
+
+	return total;
 #endif
 }
 
+#if defined(RL_POSIX)
+int rl_socket_sendfile(rl_socket_t s, int fd, rl_uint32 offset, size_t count)
+{
+#if defined(RL_LINUX)
+	off_t file_offset = (off_t) offset;
+	return (int) sendfile(s, fd, &file_offset, count);
+#else
+	char buffer[4096];
+	ssize_t read_size;
+
+	if (count > sizeof(buffer))
+		count = sizeof(buffer);
 
+	if (-1 == (read_size = pread(fd, buffer, count, (off_t) offset)))
+		return -1;
+
+	if (0 == read_size)
+		return 0;
+
+	return (int) send(s, buffer, (size_t) read_size, 0);
+#endif
+}
+#endif
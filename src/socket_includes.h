@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "socket_types.h"
+#include "util.h"
 
 #if defined(RL_AMIGA)
 #include <proto/socket.h>
@@ -54,6 +55,45 @@
  */
 int rl_configure_socket_blocking(rl_socket_t s, int should_block);
 
+/* Max number of buffers rl_socket_sendv() will pass to the OS in one call. */
+#define RL_SOCKET_MAX_IOV (16)
+
+typedef struct rl_iovec_tag
+{
+	const void *base;
+	size_t length;
+} rl_iovec_t;
+
+/*!
+ * \brief Gather-write a number of buffers to a socket with a single syscall.
+ * \param s The socket to write to.
+ * \param vec The buffers to write, in order.
+ * \param count Number of buffers in vec (at most RL_SOCKET_MAX_IOV).
+ * \return The number of bytes written (which can be less than the total), or
+ *         -1 on error (check RL_LAST_SOCKET_ERROR).
+ *
+ * Platforms without a gather-send primitive send the buffers one at a time,
+ * stopping at the first that doesn't go out completely.
+ */
+int rl_socket_sendv(rl_socket_t s, const rl_iovec_t *vec, int count);
+
+#if defined(RL_POSIX)
+/*!
+ * \brief Write a range of a file to a socket without copying it through user space.
+ * \param s The socket to write to.
+ * \param fd The file to read from.
+ * \param offset File offset to start at.
+ * \param count Number of bytes to send.
+ * \return The number of bytes written (which can be less than count, and is
+ *         0 if the file ends before offset), or -1 on error (check
+ *         RL_LAST_SOCKET_ERROR).
+ *
+ * Uses sendfile() on Linux. Other systems fall back to pread() + send()
+ * through a small bounce buffer.
+ */
+int rl_socket_sendfile(rl_socket_t s, int fd, rl_uint32 offset, size_t count);
+#endif
+
 int rl_init_socket(void);
 
 void rl_fini_socket(void);
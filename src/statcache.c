@@ -0,0 +1,638 @@
+#include "statcache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(RL_LINUX)
+#include <sys/inotify.h>
+#endif
+
+typedef struct rl_statcache_entry_tag
+{
+	rl_statinfo_t info;
+	size_t length;
+	char path[1];
+} rl_statcache_entry_t;
+
+typedef struct rl_statcache_watch_tag
+{
+	int wd;
+	size_t length;
+	char path[1];
+} rl_statcache_watch_t;
+
+static void
+to_statinfo(const struct stat *st, rl_statinfo_t *info)
+{
+	info->exists = 1;
+	info->mode = st->st_mode;
+	info->size = st->st_size;
+	info->mtime = st->st_mtime;
+}
+
+static int
+stat_path(const char *path, rl_statinfo_t *info)
+{
+	struct stat st;
+
+	if (0 == stat(path, &st))
+	{
+		to_statinfo(&st, info);
+		return 0;
+	}
+
+	rl_memset(info, 0, sizeof(*info));
+	return ENOENT == errno || ENOTDIR == errno ? 0 : 1;
+}
+
+#if defined(RL_LINUX)
+
+enum
+{
+	WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |
+		IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR
+};
+
+/*
+ * Copy [path] to [out] with repeated and trailing slashes and "." components
+ * taken out, so that every spelling of a path ends up with the same key.
+ * Fails on paths with ".." in them, as their entries couldn't be found from
+ * change reports.
+ */
+static int
+normalize(const char *path, char *out, size_t out_size, size_t *length)
+{
+	size_t used = 0;
+
+	if ('/' == *path)
+		out[used++] = '/';
+
+	for (;;)
+	{
+		size_t component = 0;
+
+		while ('/' == *path)
+			++path;
+
+		if ('\0' == *path)
+			break;
+
+		while (path[component] && '/' != path[component])
+			++component;
+
+		if (2 == component && '.' == path[0] && '.' == path[1])
+			return 1;
+
+		if (1 != component || '.' != path[0])
+		{
+			if (used + component + 2 > out_size)
+				return 1;
+
+			if (used > 0 && '/' != out[used - 1])
+				out[used++] = '/';
+
+			rl_memcpy(out + used, path, component);
+			used += component;
+		}
+
+		path += component;
+	}
+
+	if (0 == used)
+		return 1;
+
+	out[used] = '\0';
+	*length = used;
+	return 0;
+}
+
+static int
+is_root(const char *path, size_t length)
+{
+	return 1 == length && '/' == path[0];
+}
+
+/* Length of the directory part of the normalized [path], or zero if there
+ * isn't one. */
+static size_t
+parent_length(const char *path, size_t length)
+{
+	while (length > 0 && '/' != path[length - 1])
+		--length;
+
+	if (0 == length)
+		return 0;
+
+	/* The root keeps its slash. */
+	return 1 == length ? 1 : length - 1;
+}
+
+/* Is [path] at or below [prefix]? */
+static int
+in_tree(const char *path, size_t length, const char *prefix, size_t prefix_length)
+{
+	return length >= prefix_length && 0 == memcmp(path, prefix, prefix_length) &&
+		(length == prefix_length || '/' == path[prefix_length] || is_root(prefix, prefix_length));
+}
+
+static void
+free_entry(void *entry_)
+{
+	rl_statcache_entry_t * const entry = (rl_statcache_entry_t *) entry_;
+	rl_free_sized(entry, sizeof(rl_statcache_entry_t) + entry->length);
+}
+
+static void
+free_watch(void *watch_)
+{
+	rl_statcache_watch_t * const watch = (rl_statcache_watch_t *) watch_;
+	rl_free_sized(watch, sizeof(rl_statcache_watch_t) + watch->length);
+}
+
+static void
+remove_entry(rl_statcache_t *cache, const char *path)
+{
+	if (0 == rl_dict_erase(&cache->entries, path))
+		++cache->stats.invalidations;
+}
+
+typedef struct rl_statcache_tree_tag
+{
+	rl_statcache_t *cache;
+	const char *path;
+	size_t length;
+} rl_statcache_tree_t;
+
+static int
+entry_in_tree(const void *key, void *value, void *context)
+{
+	const rl_statcache_entry_t * const entry = (const rl_statcache_entry_t *) value;
+	rl_statcache_tree_t * const tree = (rl_statcache_tree_t *) context;
+
+	(void) key;
+
+	if (!in_tree(entry->path, entry->length, tree->path, tree->length))
+		return 0;
+
+	++tree->cache->stats.invalidations;
+	return 1;
+}
+
+/* Drop [path] and everything below it. */
+static void
+remove_tree(rl_statcache_t *cache, const char *path, size_t length)
+{
+	rl_statcache_tree_t tree;
+
+	tree.cache = cache;
+	tree.path = path;
+	tree.length = length;
+	rl_dict_erase_if(&cache->entries, entry_in_tree, &tree);
+}
+
+static void
+remove_all(rl_statcache_t *cache)
+{
+	rl_dict_clear(&cache->entries);
+	++cache->stats.flushes;
+}
+
+static int
+watch_in_tree(const void *key, void *value, void *context)
+{
+	const rl_statcache_watch_t * const watch = (const rl_statcache_watch_t *) value;
+	rl_statcache_tree_t * const tree = (rl_statcache_tree_t *) context;
+
+	(void) key;
+
+	if (!in_tree(watch->path, watch->length, tree->path, tree->length))
+		return 0;
+
+	inotify_rm_watch(tree->cache->notify_fd, watch->wd);
+	tree->cache->watches_by_wd[watch->wd] = NULL;
+	return 1;
+}
+
+/*
+ * Stop watching [path] and the directories below it; their watches follow
+ * the directories when they're moved, so they'd report changes under the
+ * wrong names.
+ */
+static void
+drop_watches(rl_statcache_t *cache, const char *path, size_t length)
+{
+	rl_statcache_tree_t tree;
+
+	tree.cache = cache;
+	tree.path = path;
+	tree.length = length;
+	rl_dict_erase_if(&cache->watches, watch_in_tree, &tree);
+}
+
+static int
+index_watch(rl_statcache_t *cache, rl_statcache_watch_t *watch)
+{
+	if (watch->wd >= cache->max_wd)
+	{
+		const int new_max = RL_MAX_MACRO(watch->wd + 1, cache->max_wd * 2);
+		rl_statcache_watch_t **new_index;
+
+		if (NULL == (new_index = (rl_statcache_watch_t **) rl_alloc_sized_and_clear(new_max * sizeof(rl_statcache_watch_t *))))
+			return 1;
+
+		if (cache->watches_by_wd)
+		{
+			rl_memcpy(new_index, cache->watches_by_wd, cache->max_wd * sizeof(rl_statcache_watch_t *));
+			rl_free_sized(cache->watches_by_wd, cache->max_wd * sizeof(rl_statcache_watch_t *));
+		}
+
+		cache->watches_by_wd = new_index;
+		cache->max_wd = new_max;
+	}
+
+	cache->watches_by_wd[watch->wd] = watch;
+	return 0;
+}
+
+/*
+ * Make sure changes to the entries of the directory [dir] are reported.
+ * Missing directories are replaced by the closest one above them that
+ * exists, which reports their creation. Returns non-zero if there's no
+ * watch, in which case nothing below [dir] can be cached.
+ */
+static int
+watch_directory(rl_statcache_t *cache, const char *dir, size_t length)
+{
+	char path[PATH_MAX];
+
+	rl_memcpy(path, dir, length);
+
+	for (;;)
+	{
+		rl_statcache_watch_t *watch;
+		int wd, status = 0;
+
+		path[length] = '\0';
+
+		pthread_mutex_lock(&cache->lock);
+		watch = (rl_statcache_watch_t *) rl_dict_find(&cache->watches, path);
+		pthread_mutex_unlock(&cache->lock);
+
+		if (watch)
+			return 0;
+
+		if (-1 == (wd = inotify_add_watch(cache->notify_fd, path, WATCH_MASK)))
+		{
+			if (ENOENT != errno && ENOTDIR != errno)
+			{
+				/* Most likely out of watches (fs.inotify.max_user_watches). */
+				RL_LOG_DEBUG(("can't watch %s: %s", path, strerror(errno)));
+				return 1;
+			}
+
+			/* Try a level up. */
+			if (is_root(path, length) || 0 == (length = parent_length(path, length)))
+				return 1;
+
+			continue;
+		}
+
+		pthread_mutex_lock(&cache->lock);
+
+		/* Another thread may have got here first; the kernel hands out the
+		 * same descriptor for the same directory. */
+		if (NULL == rl_dict_find(&cache->watches, path))
+		{
+			if (NULL != (watch = (rl_statcache_watch_t *) rl_alloc_sized(sizeof(rl_statcache_watch_t) + length)))
+			{
+				watch->wd = wd;
+				watch->length = length;
+				rl_memcpy(watch->path, path, length + 1);
+
+				if (0 != index_watch(cache, watch))
+				{
+					free_watch(watch);
+					status = 1;
+				}
+				else if (0 != rl_dict_insert(&cache->watches, watch->path, watch))
+				{
+					cache->watches_by_wd[wd] = NULL;
+					free_watch(watch);
+					status = 1;
+				}
+			}
+			else
+			{
+				status = 1;
+			}
+		}
+
+		pthread_mutex_unlock(&cache->lock);
+		return status;
+	}
+}
+
+int
+rl_statcache_init(rl_statcache_t *cache)
+{
+	rl_memset(cache, 0, sizeof(*cache));
+
+	if (-1 == (cache->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)))
+	{
+		RL_LOG_WARNING(("inotify unavailable: %s", strerror(errno)));
+		return 1;
+	}
+
+	if (0 != rl_dict_init(&cache->entries, RL_STATCACHE_MAX_ENTRIES, 0, NULL, NULL, free_entry))
+		goto error;
+
+	if (0 != rl_dict_init(&cache->watches, 0, 0, NULL, NULL, free_watch))
+	{
+		rl_dict_destroy(&cache->entries);
+		goto error;
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+	return 0;
+
+error:
+	close(cache->notify_fd);
+	cache->notify_fd = -1;
+	return 1;
+}
+
+void
+rl_statcache_destroy(rl_statcache_t *cache)
+{
+	const rl_statcache_stats_t * const stats = &cache->stats;
+	const rl_uint32 lookups = stats->hits + stats->misses;
+
+	RL_LOG_INFO(("stat cache: %u lookups, %u%% hits (%u negative), %u uncacheable, %u invalidated, %u flushes",
+				lookups, lookups ? (stats->hits * 100) / lookups : 0, stats->negative_hits,
+				stats->uncacheable, stats->invalidations, stats->flushes));
+
+	rl_dict_destroy(&cache->entries);
+	rl_dict_destroy(&cache->watches);
+
+	if (cache->watches_by_wd)
+		rl_free_sized(cache->watches_by_wd, cache->max_wd * sizeof(rl_statcache_watch_t *));
+
+	/* Closing the descriptor drops the watches. */
+	close(cache->notify_fd);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+int
+rl_statcache_lookup(rl_statcache_t *cache, const char *path, rl_statinfo_t *info)
+{
+	char key[PATH_MAX];
+	size_t length;
+	rl_statcache_entry_t *entry;
+
+	if (0 != normalize(path, key, sizeof(key), &length))
+		return 1;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (NULL != (entry = (rl_statcache_entry_t *) rl_dict_find(&cache->entries, key)))
+	{
+		*info = entry->info;
+		++cache->stats.hits;
+		if (!info->exists)
+			++cache->stats.negative_hits;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	return entry ? 0 : 1;
+}
+
+int
+rl_statcache_stat(rl_statcache_t *cache, const char *path, rl_statinfo_t *info)
+{
+	char key[PATH_MAX];
+	size_t length, dir_length;
+	rl_uint32 generation;
+	rl_statcache_entry_t *entry;
+
+	if (!cache)
+		return stat_path(path, info);
+
+	if (0 == rl_statcache_lookup(cache, path, info))
+		return 0;
+
+	/* The directory has to be watched before we look, so that no change
+	 * after the stat() goes unnoticed. */
+	if (0 != normalize(path, key, sizeof(key), &length) ||
+		0 == (dir_length = parent_length(key, length)) ||
+		0 != watch_directory(cache, key, dir_length))
+	{
+		pthread_mutex_lock(&cache->lock);
+		++cache->stats.uncacheable;
+		pthread_mutex_unlock(&cache->lock);
+		return stat_path(path, info);
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	generation = cache->generation;
+	++cache->stats.misses;
+	pthread_mutex_unlock(&cache->lock);
+
+	if (0 != stat_path(key, info))
+		return 1;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (generation == cache->generation && NULL == rl_dict_find(&cache->entries, key))
+	{
+		if (cache->entries.num_elements >= RL_STATCACHE_MAX_ENTRIES)
+			remove_all(cache);
+
+		if (NULL != (entry = (rl_statcache_entry_t *) rl_alloc_sized(sizeof(rl_statcache_entry_t) + length)))
+		{
+			entry->info = *info;
+			entry->length = length;
+			rl_memcpy(entry->path, key, length + 1);
+
+			if (0 != rl_dict_insert(&cache->entries, entry->path, entry))
+				free_entry(entry);
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+void
+rl_statcache_invalidate(rl_statcache_t *cache, const char *path)
+{
+	char key[PATH_MAX];
+	size_t length, dir_length;
+
+	if (!cache || 0 != normalize(path, key, sizeof(key), &length))
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* Lookups already under way may have seen the old state. */
+	++cache->generation;
+
+	remove_entry(cache, key);
+
+	if (0 != (dir_length = parent_length(key, length)))
+	{
+		key[dir_length] = '\0';
+		remove_entry(cache, key);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int
+rl_statcache_fd(const rl_statcache_t *cache)
+{
+	return cache->notify_fd;
+}
+
+void
+rl_statcache_process_changes(rl_statcache_t *cache)
+{
+	/* Aligned for struct inotify_event. */
+	union
+	{
+		struct inotify_event event;
+		char bytes[16 * 1024];
+	} buffer;
+	ssize_t size;
+
+	while ((size = read(cache->notify_fd, &buffer, sizeof(buffer))) > 0)
+	{
+		const char *cursor = buffer.bytes;
+		const char * const end = buffer.bytes + size;
+
+		pthread_mutex_lock(&cache->lock);
+
+		++cache->generation;
+
+		while (cursor < end)
+		{
+			const struct inotify_event * const event = (const struct inotify_event *) cursor;
+			rl_statcache_watch_t *watch = NULL;
+
+			cursor += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				RL_LOG_DEBUG(("stat cache: change queue overflowed"));
+				remove_all(cache);
+				continue;
+			}
+
+			if (event->wd >= 0 && event->wd < cache->max_wd)
+				watch = cache->watches_by_wd[event->wd];
+
+			if (!watch)
+				continue;
+
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+			{
+				char path[PATH_MAX];
+				size_t length = watch->length;
+
+				/* The watch goes away with the tree. */
+				rl_memcpy(path, watch->path, length + 1);
+				remove_tree(cache, path, length);
+				drop_watches(cache, path, length);
+			}
+			else if (event->len > 0)
+			{
+				char path[PATH_MAX];
+				rl_strbuf_t buf;
+
+				rl_strbuf_init(&buf, path, sizeof(path));
+				if (!rl_strbuf_append_str_len(&buf, watch->path, watch->length) ||
+					(!is_root(watch->path, watch->length) && !rl_strbuf_append(&buf, "/")) ||
+					!rl_strbuf_append(&buf, event->name))
+				{
+					remove_all(cache);
+					continue;
+				}
+
+				/* Adding or removing entries touches the directory's own
+				 * modification time. */
+				if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+					remove_entry(cache, watch->path);
+
+				/* Whatever was cached below a directory that came or went is
+				 * stale too. */
+				if (event->mask & IN_ISDIR)
+				{
+					remove_tree(cache, path, rl_strlen(path));
+
+					if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+						drop_watches(cache, path, rl_strlen(path));
+				}
+				else
+				{
+					remove_entry(cache, path);
+				}
+			}
+		}
+
+		pthread_mutex_unlock(&cache->lock);
+	}
+}
+
+#else
+
+int
+rl_statcache_init(rl_statcache_t *cache)
+{
+	rl_memset(cache, 0, sizeof(*cache));
+	cache->notify_fd = -1;
+	return 1;
+}
+
+void
+rl_statcache_destroy(rl_statcache_t *cache)
+{
+	(void) cache;
+}
+
+int
+rl_statcache_stat(rl_statcache_t *cache, const char *path, rl_statinfo_t *info)
+{
+	(void) cache;
+	return stat_path(path, info);
+}
+
+int
+rl_statcache_lookup(rl_statcache_t *cache, const char *path, rl_statinfo_t *info)
+{
+	(void) cache;
+	(void) path;
+	(void) info;
+	return 1;
+}
+
+void
+rl_statcache_invalidate(rl_statcache_t *cache, const char *path)
+{
+	(void) cache;
+	(void) path;
+}
+
+int
+rl_statcache_fd(const rl_statcache_t *cache)
+{
+	return cache->notify_fd;
+}
+
+void
+rl_statcache_process_changes(rl_statcache_t *cache)
+{
+	(void) cache;
+}
+
+#endif
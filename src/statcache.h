@@ -0,0 +1,110 @@
+#ifndef RLAUNCH_STATCACHE_H
+#define RLAUNCH_STATCACHE_H
+
+#include "util.h"
+
+/*
+ * Path-keyed cache of file metadata for the controller (POSIX only).
+ *
+ * Remembers what stat() said about a path, including that it doesn't exist,
+ * so that the targets' repeated probes for the same files (icons, catalogs,
+ * ENV: fallbacks) don't go to the file system every time.
+ *
+ * The cache is kept coherent with inotify: the directory holding each cached
+ * path is watched (or, for missing paths, the closest directory above it that
+ * exists), and entries are dropped as changes are reported. Changes are only
+ * seen once rl_statcache_process_changes() has read them, so the owner should
+ * do that before serving requests that arrived at the same time. Where
+ * inotify isn't available rl_statcache_init() fails and callers should stat
+ * directly (rl_statcache_stat() with a NULL cache does that).
+ *
+ * Lookups may come from any thread; processing changes is for the owner.
+ * Changes through symbolic links to outside the watched directories aren't
+ * noticed.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+typedef struct rl_statinfo_tag
+{
+	int exists;
+	mode_t mode;
+	off_t size;
+	time_t mtime;
+} rl_statinfo_t;
+
+struct rl_statcache_watch_tag;
+
+enum
+{
+	/* The cache is emptied when it reaches this size. */
+	RL_STATCACHE_MAX_ENTRIES = 8192
+};
+
+typedef struct rl_statcache_stats_tag
+{
+	rl_uint32 hits;
+	rl_uint32 negative_hits;
+	rl_uint32 misses;
+	rl_uint32 uncacheable;
+	rl_uint32 invalidations;
+	rl_uint32 flushes;
+} rl_statcache_stats_t;
+
+typedef struct rl_statcache_tag
+{
+	pthread_mutex_t lock;
+
+	/* rl_statcache_entry_t by normalized path */
+	rl_dict_t entries;
+
+	/* Bumped whenever changes have been processed. Lookups that missed
+	 * don't store what they found if it has moved on in the meantime. */
+	rl_uint32 generation;
+
+	/* inotify descriptor, and the watched directories by path and by
+	 * watch descriptor */
+	int notify_fd;
+	rl_dict_t watches;
+	struct rl_statcache_watch_tag **watches_by_wd;
+	int max_wd;
+
+	rl_statcache_stats_t stats;
+} rl_statcache_t;
+
+int
+rl_statcache_init(rl_statcache_t *cache);
+
+/* Also logs the hit rates. */
+void
+rl_statcache_destroy(rl_statcache_t *cache);
+
+/*
+ * stat() [path] through the cache. A missing path isn't an error; it comes
+ * back with [info->exists] clear. Returns non-zero on other errors.
+ */
+int
+rl_statcache_stat(rl_statcache_t *cache, const char *path, rl_statinfo_t *info);
+
+/* Look [path] up without going to the file system. Returns non-zero if it
+ * isn't cached. */
+int
+rl_statcache_lookup(rl_statcache_t *cache, const char *path, rl_statinfo_t *info);
+
+/* Forget [path] (and the stamp of the directory holding it) now, for
+ * changes made by the caller that shouldn't wait for their report. A NULL
+ * cache is ignored. */
+void
+rl_statcache_invalidate(rl_statcache_t *cache, const char *path);
+
+/* Readable when there are changes to process. */
+int
+rl_statcache_fd(const rl_statcache_t *cache);
+
+/* Drop the entries that reported changes affect. Owner thread only. */
+void
+rl_statcache_process_changes(rl_statcache_t *cache);
+
+#endif
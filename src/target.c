@@ -5,6 +5,7 @@
 #include "protocol.h"
 #include "rlnet.h"
 #include "socket_includes.h"
+#include "evloop.h"
 #include "version.h"
 
 #if defined(RL_POSIX)
@@ -44,36 +45,21 @@ extern struct DosLibrary *DOSBase;
 #endif
 static struct MsgPort* g_process_msg_port = NULL;
 
-#elif defined(RL_WIN32)
-static volatile long sigbreak_occured = 0;
-# define SIGBREAKF_CTRL_C 1
-# define WaitSelect(nfds,r,w,e,t,sigmask) (*sigmask = sigbreak_occured, select(nfds,r,w,e,t))
-
-#elif defined(RL_POSIX)
+#else
 static volatile long sigbreak_occured = 0;
 # define SIGBREAKF_CTRL_C 1
-# define WaitSelect(nfds,r,w,e,t,sigmask) (*sigmask = 0, select(nfds,r,w,e,t))
 
 #endif
 
-static rl_socket_t add_peers_to_fd_set(fd_set *read_fds, fd_set *write_fds, peer_t *head)
-{
-	rl_socket_t max = 0;
-	while (head)
-	{
-		const rl_socket_t this_fd = head->fd;
+/* Pending connections the OS will queue up for us. */
+#define RL_TARGET_LISTEN_BACKLOG (128)
 
-		FD_SET(this_fd, read_fds);
+/* Events handled per wakeup. */
+#define RL_TARGET_MAX_EVENTS (64)
 
-		if (head->update_result & PEER_STATUS_NEED_OUTPUT)
-			FD_SET(this_fd, write_fds);
-
-		if (this_fd > max)
-			max = this_fd;
-		head = head->next;
-	}
-	return max;
-}
+/* Connections accepted per wakeup, so a flood of them can't starve the
+ * peers we already have. */
+#define RL_TARGET_MAX_ACCEPTS (16)
 
 #if defined(RL_AMIGA)
 typedef struct launch_msg_tag
@@ -291,6 +277,8 @@ static int on_message_received(peer_t *peer, const rl_msg_t *msg)
 	else if (fs)
 		return rl_amigafs_process_network_message(fs, msg);
 #endif
+	else if (RL_MSG_PUSH_FILE_REQUEST == rl_msg_kind_of(msg))
+		return 0; /* nowhere to stage it; it'll be read instead */
 	else
 		return 1;
 }
@@ -300,7 +288,7 @@ static int on_connected(struct peer_tag *peer)
 	return 0;
 }
 
-static const peer_callbacks_t server_callbacks = { on_message_received, on_connected };
+static const peer_callbacks_t server_callbacks = { on_message_received, on_connected, NULL };
 
 static peer_t *accept_peer(rl_socket_t server_fd)
 {
@@ -314,7 +302,9 @@ static peer_t *accept_peer(rl_socket_t server_fd)
 	peer_fd = (rl_socket_t) accept(server_fd, (struct sockaddr*) &remote_addr, &remote_addr_len);
 	if (INVALID_SOCKET == peer_fd)
 	{
-		RL_LOG_WARNING(("couldn't accept connection"));
+		/* nothing (more) to accept */
+		if (EWOULDBLOCK != RL_LAST_SOCKET_ERROR)
+			RL_LOG_WARNING(("couldn't accept connection"));
 		goto error_cleanup;
 	}
 
@@ -325,6 +315,13 @@ static peer_t *accept_peer(rl_socket_t server_fd)
 		goto error_cleanup;
 	}
 
+	/* Peers are serviced until their sockets would block. */
+	if (0 != rl_configure_socket_blocking(peer_fd, 0))
+	{
+		RL_LOG_WARNING(("couldn't make connection non-blocking"));
+		goto error_cleanup;
+	}
+
 	if (NULL == (peer = RL_ALLOC_TYPED_ZERO(peer_t)))
 	{
 		RL_LOG_WARNING(("out of memory allocating peer_t"));
@@ -373,27 +370,162 @@ error_cleanup:
 	return NULL;
 }
 
+typedef struct serve_state_tag
+{
+	rl_evloop_t loop;
+
+	/* all live peers */
+	peer_t *peers;
+
+	/* peers that have input left to read */
+	peer_t *pending;
+
+	/* peers to destroy at the end of the current iteration */
+	peer_t *doomed;
+} serve_state_t;
+
+static void unlink_peer(serve_state_t *state, peer_t *peer)
+{
+	if (peer->prev)
+		peer->prev->next = peer->next;
+	else
+		state->peers = peer->next;
+
+	if (peer->next)
+		peer->next->prev = peer->prev;
+
+	peer->next = peer->prev = NULL;
+}
+
+static void update_peer(serve_state_t *state, peer_t *peer, int can_read, int can_write)
+{
+	int status, interest;
+
+	/* already on its way out */
+	if (PEER_STATUS_REMOVE_ME & peer->update_result)
+		return;
+
+	status = peer_update(peer, can_read, can_write);
+
+	if (PEER_STATUS_REMOVE_ME & status)
+	{
+		/* Destruction waits until the end of the iteration, as the peer can
+		 * still be referenced by events we haven't dispatched yet. */
+		unlink_peer(state, peer);
+		peer->next = state->doomed;
+		state->doomed = peer;
+		return;
+	}
+
+	if ((PEER_STATUS_INPUT_PENDING & status) && !peer->input_pending)
+	{
+		peer->input_pending = 1;
+		peer->next_pending = state->pending;
+		state->pending = peer;
+	}
+
+	/* Only ask for write readiness while there's something to write. */
+	interest = RL_EVLOOP_READ | RL_EVLOOP_EDGE;
+	if (PEER_STATUS_NEED_OUTPUT & status)
+		interest |= RL_EVLOOP_WRITE;
+
+	if (interest != peer->poll_events)
+	{
+		if (0 == rl_evloop_modify(&state->loop, peer->fd, interest, peer))
+			peer->poll_events = interest;
+	}
+}
+
+static void destroy_peer(serve_state_t *state, peer_t *peer)
+{
+	rl_evloop_remove(&state->loop, peer->fd);
+
+#if defined(RL_AMIGA)
+	if (peer->userdata)
+		rl_amigafs_destroy((rl_amigafs_t *) peer->userdata);
+#endif
+
+	peer_destroy(peer);
+	RL_FREE_TYPED(peer_t, peer);
+}
+
+static void destroy_doomed_peers(serve_state_t *state)
+{
+	while (state->doomed)
+	{
+		peer_t *peer = state->doomed;
+		state->doomed = peer->next;
+
+		if (peer->input_pending)
+		{
+			peer_t **link = &state->pending;
+			while (*link != peer)
+				link = &(*link)->next_pending;
+			*link = peer->next_pending;
+		}
+
+		destroy_peer(state, peer);
+	}
+}
+
+static void accept_peers(serve_state_t *state, rl_socket_t server_fd)
+{
+	int i;
+
+	for (i = 0; i < RL_TARGET_MAX_ACCEPTS; ++i)
+	{
+		peer_t *new_peer;
+
+		if (NULL == (new_peer = accept_peer(server_fd)))
+			break;
+
+		RL_LOG_INFO(("new connection from %s", new_peer->ident));
+
+		new_peer->poll_events = RL_EVLOOP_READ | RL_EVLOOP_EDGE;
+		if (0 != rl_evloop_add(&state->loop, new_peer->fd, new_peer->poll_events, new_peer))
+		{
+			destroy_peer(state, new_peer);
+			continue;
+		}
+
+		new_peer->next = state->peers;
+		if (state->peers)
+			state->peers->prev = new_peer;
+		state->peers = new_peer;
+
+		update_peer(state, new_peer, 1, 1);
+	}
+}
+
 static void serve(const rl_socket_t server_fd)
 {
-	fd_set read_fds, write_fds;
-	peer_t *peers = NULL;
+	serve_state_t state;
+	rl_evloop_event_t events[RL_TARGET_MAX_EVENTS];
+	time_t last_tick = rl_time(NULL);
+
+	rl_memset(&state, 0, sizeof(state));
+
+	if (0 != rl_evloop_init(&state.loop))
+		return;
+
+	/* The listener is level-triggered so connections we leave queued are
+	 * reported again. */
+	if (0 != rl_evloop_add(&state.loop, server_fd, RL_EVLOOP_READ, NULL))
+		goto cleanup;
 
 	for (;;)
 	{
-		rl_socket_t new_peer_socket = INVALID_SOCKET;
-		int nfds, num_ready_fds;
-		rl_socket_t max_peer_fd;
-		struct timeval timeout;
-		unsigned long signal_mask = SIGBREAKF_CTRL_C;
-		peer_t *new_peer;
+		int num_events, i;
+		unsigned long signal_mask = 0;
+		time_t now;
 
 #if defined(RL_AMIGA)
 		/* Also wake on messages due to process termination */
-		signal_mask |= 1 << g_process_msg_port->mp_SigBit;
+		signal_mask = SIGBREAKF_CTRL_C | (1 << g_process_msg_port->mp_SigBit);
 
 		/* On the Amiga, add the signal bits for all file systems we're serving as well. */
 		{
-			peer_t *peer = peers;
+			peer_t *peer = state.peers;
 			while (peer)
 			{
 				rl_amigafs_t *device = (rl_amigafs_t *) peer->userdata;
@@ -401,39 +533,38 @@ static void serve(const rl_socket_t server_fd)
 				peer = peer->next;
 			}
 		}
-#endif
-		FD_ZERO(&read_fds);
-		FD_ZERO(&write_fds);
-		FD_SET(server_fd, &read_fds);
-
-		max_peer_fd = add_peers_to_fd_set(&read_fds, &write_fds, peers);
 
-		nfds = (int) (server_fd > max_peer_fd ? server_fd : max_peer_fd);
-
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
+		state.loop.signals = signal_mask;
+#endif
 
-		num_ready_fds = WaitSelect(nfds+1, &read_fds, &write_fds, NULL, &timeout, &signal_mask);
+		/* Don't sleep while some peer still has input waiting. */
+		num_events = rl_evloop_wait(&state.loop, events, RL_TARGET_MAX_EVENTS, state.pending ? 0 : 1000);
 
 #if defined(RL_AMIGA)
+		signal_mask = state.loop.signals;
+
 		/* See if any file systems need attention. */
 		{
-			peer_t *peer = peers;
+			peer_t *peer = state.peers;
 			while (peer)
 			{
+				peer_t *next = peer->next;
 				rl_amigafs_t *amifs = (rl_amigafs_t *) peer->userdata;
 				if (signal_mask & (1 << amifs->device_port->mp_SigBit))
 				{
 					rl_amigafs_process_device_message(amifs);
+
+					/* flush whatever the file system wants to send */
+					update_peer(&state, peer, 0, 0);
 				}
-				peer = peer->next;
+				peer = next;
 			}
 		}
 
 		if (signal_mask & (1 << g_process_msg_port->mp_SigBit))
 		{
 			launch_msg_t *msg = (launch_msg_t*) GetMsg(g_process_msg_port);
-			peer_t *peer = peers;
+			peer_t *peer = state.peers;
 
 			RL_LOG_INFO(("%s launch completed; result %d", msg->command_path, msg->result_code));
 
@@ -445,6 +576,7 @@ static void serve(const rl_socket_t server_fd)
 					RL_MSG_INIT(req, RL_MSG_EXECUTABLE_DONE_REQUEST);
 					req.executable_done_request.result_code = msg->result_code;
 					peer_transmit_message(peer, &req);
+					update_peer(&state, peer, 0, 0);
 					break;
 				}
 				peer = peer->next;
@@ -457,6 +589,8 @@ static void serve(const rl_socket_t server_fd)
 
 			RL_FREE_TYPED(launch_msg_t, msg);
 		}
+#else
+		signal_mask = (unsigned long) sigbreak_occured;
 #endif
 
 		if (signal_mask & SIGBREAKF_CTRL_C)
@@ -464,75 +598,68 @@ static void serve(const rl_socket_t server_fd)
 			RL_LOG_INFO(("breaking on ctrl+c"));
 			break;
 		}
-
-		else if (-1 == num_ready_fds)
+		else if (-1 == num_events)
 		{
-			RL_LOG_WARNING(("select() failed"));
+			RL_LOG_WARNING(("waiting for socket events failed"));
 			break;
 		}
 
-		if (FD_ISSET(server_fd, &read_fds))
-		{
-			RL_LOG_INFO(("new connection available"));
-			new_peer = accept_peer(server_fd);
-			if (!new_peer)
-				continue;
-			new_peer->next = peers;
-			peers = new_peer;
-			new_peer_socket = new_peer->fd;
-		}
-	
+		/* Peers that couldn't read everything last time go first. */
 		{
-			peer_t* ci;
-			peer_t *prev = NULL, *next = NULL;
+			peer_t *retry = state.pending;
+			state.pending = NULL;
 
-			for (ci = peers; ci; )
+			while (retry)
 			{
-				const int can_read = (ci->fd == new_peer_socket) || FD_ISSET(ci->fd, &read_fds);
-				const int can_write = (ci->fd == new_peer_socket) || FD_ISSET(ci->fd, &write_fds);
-				int status;
-
-				prev = next;
-				next = ci->next;
-
-				status = peer_update(ci, can_read, can_write);
+				peer_t *peer = retry;
+				retry = peer->next_pending;
+				peer->next_pending = NULL;
+				peer->input_pending = 0;
+				update_peer(&state, peer, 1, 0);
+			}
+		}
 
-				if (PEER_STATUS_REMOVE_ME & status)
-				{
-					if (prev)
-						prev->next = next;
-					else
-						peers = next;
+		for (i = 0; i < num_events; ++i)
+		{
+			peer_t *peer = (peer_t *) events[i].userdata;
 
-#if defined(RL_AMIGA)
-					if (ci->userdata)
-						rl_amigafs_destroy((rl_amigafs_t *)ci->userdata);
-#endif
+			if (!peer)
+				accept_peers(&state, server_fd);
+			else
+				update_peer(&state, peer,
+						0 != (RL_EVLOOP_READ & events[i].events),
+						0 != (RL_EVLOOP_WRITE & events[i].events));
+		}
 
-					peer_destroy(ci);
-					RL_FREE_TYPED(peer_t, ci);
-				}
+		/* Once a second, let every peer check for timeouts and send pings. */
+		now = rl_time(NULL);
+		if (now != last_tick)
+		{
+			peer_t *peer = state.peers;
+			last_tick = now;
 
-				ci = next;
+			while (peer)
+			{
+				peer_t *next = peer->next;
+				update_peer(&state, peer, 0, 0);
+				peer = next;
 			}
 		}
+
+		destroy_doomed_peers(&state);
 	}
 
-	{
-		peer_t* ci;
-		for (ci = peers; ci; )
-		{
-			peer_t *next = ci->next;
+	destroy_doomed_peers(&state);
 
-#if defined(RL_AMIGA)
-			if (ci->userdata)
-				rl_amigafs_destroy((rl_amigafs_t *)ci->userdata);
-#endif
-			peer_destroy(ci);
-			RL_FREE_TYPED(peer_t, ci);
-			ci = next;
-		}
+	while (state.peers)
+	{
+		peer_t *peer = state.peers;
+		unlink_peer(&state, peer);
+		destroy_peer(&state, peer);
 	}
+
+cleanup:
+	rl_evloop_destroy(&state.loop);
 }
 
 static void common_main(const char *bind_address, int bind_port)
@@ -576,7 +703,14 @@ static void common_main(const char *bind_address, int bind_port)
 	}
 	RL_LOG_DEBUG(("bind ok"));
 
-	if (0 != listen(listener_fd, 2))
+	/* Connections are accepted in batches; don't block when we run out. */
+	if (0 != rl_configure_socket_blocking(listener_fd, 0))
+	{
+		RL_LOG_CONSOLE(("Couldn't make the listening socket non-blocking"));
+		goto cleanup;
+	}
+
+	if (0 != listen(listener_fd, RL_TARGET_LISTEN_BACKLOG))
 	{
 		RL_LOG_CONSOLE(("listen() failed"));
 		goto cleanup;
@@ -620,6 +754,7 @@ int main(const char *args)
 
 	char bind_address[64] = "0.0.0.0";
 	int bind_port = 7001;
+	rl_uint32 cache_size = RL_FSCLIENT_BLOCK_CACHE_SIZE;
 
 	SysBase = *((struct ExecBase**) 4);
 
@@ -636,10 +771,10 @@ int main(const char *args)
 
 	if (this_process->pr_CLI)
 	{
-		LONG argument_values[3] = { 0l, 0l, 0l };
+		LONG argument_values[5] = { 0l, 0l, 0l, 0l, 0l };
 		struct RDArgs* args;
 
-		if (NULL != (args = ReadArgs("ADDRESS,PORT/N,LOG", &argument_values[0], NULL)))
+		if (NULL != (args = ReadArgs("ADDRESS,PORT/N,LOG,READWINDOW/K/N,CACHEKB/K/N", &argument_values[0], NULL)))
 		{
 			if (argument_values[0])
 				rl_format_msg(bind_address, sizeof(bind_address), "%s", (const char*) argument_values[0]);
@@ -647,6 +782,10 @@ int main(const char *args)
 				bind_port = *((LONG*)argument_values[1]);
 			if (argument_values[2])
 				rl_toggle_log_bits((const char *) argument_values[2]);
+			if (argument_values[3])
+				rl_amigafs_max_read_window = (int) *((LONG*)argument_values[3]);
+			if (argument_values[4])
+				cache_size = (rl_uint32) *((LONG*)argument_values[4]) * 1024;
 			FreeArgs(args);
 		}
 		else
@@ -668,6 +807,8 @@ int main(const char *args)
 	rl_init_socket();
 	rl_init_alloc();
 
+	rl_blockcache_init(&rl_amigafs_block_cache, cache_size);
+
 	/* Initialize message port for async spawn results */
 	if (!(g_process_msg_port = CreateMsgPort()))
 		goto cleanup;
@@ -678,6 +819,8 @@ cleanup:
 	if (g_process_msg_port)
 		DeleteMsgPort(g_process_msg_port);
 
+	rl_blockcache_destroy(&rl_amigafs_block_cache);
+
 	rl_fini_alloc();
 	rl_fini_socket();
 
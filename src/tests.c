@@ -0,0 +1,698 @@
+#include "config.h"
+#include "util.h"
+#include "readwin.h"
+#include "lz.h"
+#include "delta.h"
+#include "xxhash.h"
+#include "protocol.h"
+#include "rlnet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Host tests for the modules that do no I/O of their own. Each test_*
+ * function checks one module; failed checks are counted and reported, and
+ * the program exits non-zero if there were any.
+ */
+
+static int check_failures = 0;
+
+#define CHECK(x) \
+	do { \
+		if (!(x)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			++check_failures; \
+		} \
+	} while (0)
+
+/* Pipelined reads */
+
+#define SEGMENT_SIZE (16384)
+
+typedef struct sim_link_tag
+{
+	/* round trip without data, in ms, and bytes the link carries per ms */
+	rl_uint32 rtt;
+	rl_uint32 rate;
+} sim_link_t;
+
+/*
+ * Run a read of [length] bytes through [est] over a simulated link, starting
+ * at [*now] and advancing it. Requests reach the server after half the round
+ * trip; the answers then share the link one after the other and arrive half
+ * a round trip after they've been sent.
+ */
+static void
+sim_read(rl_readwin_estimator_t *est, const sim_link_t *link, rl_uint32 length, rl_uint32 *now, rl_uint8 *buffer)
+{
+	rl_readwin_t win;
+	rl_uint32 pending[64];
+	rl_uint32 arrival[64];
+	rl_uint32 head = 0, tail = 0;
+	rl_uint32 link_free = *now;
+
+	CHECK(0 == rl_readwin_begin(&win, est, buffer, 0, length, SEGMENT_SIZE, *now));
+
+	while (!rl_readwin_finished(&win))
+	{
+		rl_uint32 segment, offset, seg_length;
+
+		while (rl_readwin_next(&win, *now, &segment, &offset, &seg_length))
+		{
+			const rl_uint32 start = RL_MAX_MACRO(link_free, *now + link->rtt / 2);
+
+			link_free = start + (seg_length + link->rate - 1) / link->rate;
+			pending[tail % 64] = segment;
+			arrival[tail % 64] = link_free + link->rtt / 2;
+			++tail;
+		}
+
+		CHECK(head < tail);
+		if (head == tail)
+			break;
+
+		*now = arrival[head % 64];
+		segment = pending[head % 64];
+		++head;
+
+		/* the data is the offset of each byte, truncated */
+		{
+			rl_uint8 data[SEGMENT_SIZE];
+			const rl_uint32 base = segment * SEGMENT_SIZE;
+			const rl_uint32 size = RL_MIN_MACRO(SEGMENT_SIZE, length - base);
+			rl_uint32 i;
+
+			for (i = 0; i < size; ++i)
+				data[i] = (rl_uint8) (base + i);
+
+			CHECK(0 == rl_readwin_deliver(&win, segment, data, size, 1, *now));
+		}
+	}
+
+	CHECK(length == rl_readwin_result(&win));
+	rl_readwin_end(&win, *now);
+}
+
+/* Train a fresh or existing estimator with [count] reads over [link]. */
+static void
+sim_reads(rl_readwin_estimator_t *est, const sim_link_t *link, int count, rl_uint32 *now)
+{
+	static rl_uint8 buffer[32 * SEGMENT_SIZE];
+	int i;
+
+	for (i = 0; i < count; ++i)
+		sim_read(est, link, sizeof(buffer), now, buffer);
+}
+
+static void
+test_readwin_segments(void)
+{
+	static rl_uint8 buffer[100000];
+	rl_readwin_estimator_t est;
+	rl_readwin_t win;
+	rl_uint32 segment, offset, length;
+	rl_uint32 i;
+	rl_uint8 data[SEGMENT_SIZE];
+
+	rl_readwin_estimator_init(&est, 8);
+	rl_memset(buffer, 0, sizeof(buffer));
+
+	/* 100000 bytes are 7 segments, the last one short */
+	CHECK(0 == rl_readwin_begin(&win, &est, buffer, 1000, sizeof(buffer), SEGMENT_SIZE, 0));
+
+	for (i = 0; i < 4; ++i)
+	{
+		CHECK(rl_readwin_next(&win, 0, &segment, &offset, &length));
+		CHECK(i == segment);
+		CHECK(1000 + i * SEGMENT_SIZE == offset);
+		CHECK(SEGMENT_SIZE == length);
+	}
+
+	/* the initial window is full */
+	CHECK(!rl_readwin_next(&win, 0, &segment, &offset, &length));
+
+	/* answers come in any order and in pieces, and go to their place */
+	rl_memset(data, 2, sizeof(data));
+	CHECK(0 == rl_readwin_deliver(&win, 2, data, 100, 0, 1));
+	CHECK(0 == rl_readwin_deliver(&win, 2, data, SEGMENT_SIZE - 100, 1, 1));
+	CHECK(2 == buffer[2 * SEGMENT_SIZE] && 2 == buffer[3 * SEGMENT_SIZE - 1]);
+	CHECK(0 == buffer[2 * SEGMENT_SIZE - 1] && 0 == buffer[3 * SEGMENT_SIZE]);
+
+	/* data for segments that aren't outstanding is refused */
+	CHECK(0 != rl_readwin_deliver(&win, 2, data, 1, 1, 1));
+	CHECK(0 != rl_readwin_deliver(&win, 5, data, 1, 1, 1));
+	CHECK(0 != rl_readwin_deliver(&win, 7, data, 1, 1, 1));
+
+	/* nothing from the start yet */
+	CHECK(0 == rl_readwin_result(&win));
+
+	CHECK(rl_readwin_next(&win, 1, &segment, &offset, &length));
+	CHECK(4 == segment);
+
+	for (i = 0; i < 5; ++i)
+	{
+		if (2 != i)
+			CHECK(0 == rl_readwin_deliver(&win, i, data, SEGMENT_SIZE, 1, 2));
+	}
+
+	CHECK(rl_readwin_next(&win, 2, &segment, &offset, &length));
+	CHECK(5 == segment && SEGMENT_SIZE == length);
+	CHECK(rl_readwin_next(&win, 2, &segment, &offset, &length));
+	CHECK(6 == segment && sizeof(buffer) - 6 * SEGMENT_SIZE == length);
+	CHECK(!rl_readwin_next(&win, 2, &segment, &offset, &length));
+	CHECK(!rl_readwin_finished(&win));
+
+	CHECK(0 == rl_readwin_deliver(&win, 6, data, length, 1, 3));
+	CHECK(0 == rl_readwin_deliver(&win, 5, data, SEGMENT_SIZE, 1, 3));
+	CHECK(rl_readwin_finished(&win));
+	CHECK(sizeof(buffer) == rl_readwin_result(&win));
+	rl_readwin_end(&win, 3);
+}
+
+static void
+test_readwin_end_of_file(void)
+{
+	static rl_uint8 buffer[8 * SEGMENT_SIZE];
+	rl_readwin_estimator_t est;
+	rl_readwin_t win;
+	rl_uint32 segment, offset, length;
+	rl_uint8 data[SEGMENT_SIZE];
+
+	rl_memset(data, 0, sizeof(data));
+	rl_readwin_estimator_init(&est, 4);
+	CHECK(0 == rl_readwin_begin(&win, &est, buffer, 0, sizeof(buffer), SEGMENT_SIZE, 0));
+
+	while (rl_readwin_next(&win, 0, &segment, &offset, &length))
+		;
+
+	/* the file ends 100 bytes into the second segment */
+	CHECK(0 == rl_readwin_deliver(&win, 1, data, 100, 1, 1));
+	CHECK(0 == rl_readwin_deliver(&win, 0, data, SEGMENT_SIZE, 1, 1));
+	CHECK(!rl_readwin_finished(&win));
+
+	/* segments past the end are answered empty, and no more are asked for */
+	CHECK(0 == rl_readwin_deliver(&win, 2, data, 0, 1, 1));
+	CHECK(0 == rl_readwin_deliver(&win, 3, data, 0, 1, 1));
+	CHECK(!rl_readwin_next(&win, 1, &segment, &offset, &length));
+	CHECK(rl_readwin_finished(&win));
+	CHECK(SEGMENT_SIZE + 100 == rl_readwin_result(&win));
+	rl_readwin_end(&win, 1);
+}
+
+static void
+test_readwin_failure(void)
+{
+	static rl_uint8 buffer[8 * SEGMENT_SIZE];
+	rl_readwin_estimator_t est;
+	rl_readwin_t win;
+	rl_uint32 segment, offset, length;
+	rl_uint8 data[SEGMENT_SIZE];
+
+	rl_memset(data, 0, sizeof(data));
+	rl_readwin_estimator_init(&est, 4);
+	CHECK(0 == rl_readwin_begin(&win, &est, buffer, 0, sizeof(buffer), SEGMENT_SIZE, 0));
+
+	while (rl_readwin_next(&win, 0, &segment, &offset, &length))
+		;
+
+	/* a failed segment stops new requests, but the others are waited for */
+	rl_readwin_fail(&win, 1);
+	CHECK(!rl_readwin_next(&win, 1, &segment, &offset, &length));
+	CHECK(!rl_readwin_finished(&win));
+	CHECK(0 == rl_readwin_deliver(&win, 0, data, SEGMENT_SIZE, 1, 1));
+	CHECK(0 == rl_readwin_deliver(&win, 2, data, SEGMENT_SIZE, 1, 1));
+	CHECK(!rl_readwin_finished(&win));
+	rl_readwin_fail(&win, 3);
+	CHECK(rl_readwin_finished(&win));
+	CHECK(SEGMENT_SIZE == rl_readwin_result(&win));
+	rl_readwin_end(&win, 1);
+
+	/* failed reads don't feed the estimator */
+	CHECK(0 == est.rate && 0 == est.max_rate);
+}
+
+static void
+test_readwin_estimator(void)
+{
+	static const sim_link_t fast = { 50, 1000 };
+	static const sim_link_t slow = { 50, 250 };
+	static const sim_link_t far = { 400, 1000 };
+	rl_readwin_estimator_t est, reference;
+	rl_uint32 now = 0;
+	rl_uint32 fast_window, slow_window, far_window;
+
+	/* where the window settles on each link, starting from scratch */
+	rl_readwin_estimator_init(&reference, 32);
+	sim_reads(&reference, &fast, 40, &now);
+	fast_window = reference.window;
+
+	rl_readwin_estimator_init(&reference, 32);
+	sim_reads(&reference, &slow, 40, &now);
+	slow_window = reference.window;
+
+	rl_readwin_estimator_init(&reference, 32);
+	sim_reads(&reference, &far, 40, &now);
+	far_window = reference.window;
+
+	CHECK(slow_window < fast_window);
+	CHECK(fast_window < far_window);
+
+	/* the bandwidth-delay product of the fast link is about three segments */
+	CHECK(fast_window >= 6 && fast_window <= 10);
+
+	/* a window that grew on a fast link comes down when the link slows
+	 * down, and goes back up when it's fast again */
+	rl_readwin_estimator_init(&est, 32);
+	sim_reads(&est, &fast, 40, &now);
+	CHECK(fast_window == est.window);
+	sim_reads(&est, &slow, 40, &now);
+	CHECK(slow_window == est.window);
+	sim_reads(&est, &fast, 40, &now);
+	CHECK(fast_window == est.window);
+
+	/* the same for the round trip */
+	sim_reads(&est, &far, 40, &now);
+	CHECK(far_window == est.window);
+	sim_reads(&est, &fast, 40, &now);
+	CHECK(fast_window == est.window);
+
+	/* the window never goes past its bound */
+	rl_readwin_estimator_init(&est, 3);
+	sim_reads(&est, &far, 10, &now);
+	CHECK(3 == est.window);
+}
+
+/* Hash tables */
+
+typedef struct test_entry_tag
+{
+	rl_uint32 id;
+	char name[16];
+} test_entry_t;
+
+static int
+is_odd(const void *key, void *value, void *context)
+{
+	(void) value;
+	(void) context;
+	return *(const rl_uint32 *) key & 1;
+}
+
+static void
+test_dict(void)
+{
+	enum { COUNT = 5000 };
+	static test_entry_t entries[COUNT];
+	rl_dict_t by_id, by_name;
+	const void *key;
+	void *value;
+	size_t cursor = 0;
+	rl_uint32 i, seen = 0;
+
+	/* start small, so the tables grow a few times */
+	CHECK(0 == rl_dict_init(&by_id, 4, sizeof(rl_uint32), NULL, NULL, NULL));
+	CHECK(0 == rl_dict_init(&by_name, 4, 0, NULL, NULL, NULL));
+
+	for (i = 0; i < COUNT; ++i)
+	{
+		entries[i].id = i * 7919;
+		rl_format_msg(entries[i].name, sizeof(entries[i].name), "name%u", i);
+		CHECK(0 == rl_dict_insert(&by_id, &entries[i].id, &entries[i]));
+		CHECK(0 == rl_dict_insert(&by_name, entries[i].name, &entries[i]));
+	}
+
+	CHECK(COUNT == by_id.num_elements && COUNT == by_name.num_elements);
+
+	for (i = 0; i < COUNT; ++i)
+	{
+		rl_uint32 id = i * 7919;
+		char name[16];
+
+		/* looked up through copies, not the keys in the table */
+		rl_format_msg(name, sizeof(name), "name%u", i);
+		CHECK(&entries[i] == rl_dict_find(&by_id, &id));
+		CHECK(&entries[i] == rl_dict_find(&by_name, name));
+
+		id += 1;
+		CHECK(NULL == rl_dict_find(&by_id, &id));
+	}
+
+	CHECK(NULL == rl_dict_find(&by_name, "name"));
+	CHECK(NULL == rl_dict_find(&by_name, ""));
+
+	/* replacing keeps the count */
+	CHECK(0 == rl_dict_insert(&by_name, "name7", &entries[0]));
+	CHECK(&entries[0] == rl_dict_find(&by_name, "name7"));
+	CHECK(COUNT == by_name.num_elements);
+
+	/* erasing shifts entries back; the rest must still be found */
+	for (i = 0; i < COUNT; i += 3)
+		CHECK(0 == rl_dict_erase(&by_id, &entries[i].id));
+	CHECK(0 != rl_dict_erase(&by_id, &entries[0].id));
+
+	for (i = 0; i < COUNT; ++i)
+		CHECK((0 == i % 3 ? NULL : &entries[i]) == rl_dict_find(&by_id, &entries[i].id));
+
+	/* ids are odd where i is */
+	rl_dict_erase_if(&by_id, is_odd, NULL);
+
+	while (rl_dict_next(&by_id, &cursor, &key, &value))
+	{
+		const test_entry_t * const entry = (const test_entry_t *) value;
+		CHECK(key == &entry->id);
+		CHECK(0 == (entry->id & 1) && 0 != (entry->id / 7919) % 3);
+		++seen;
+	}
+
+	CHECK(seen == by_id.num_elements);
+	CHECK(COUNT / 3 == seen);
+
+	rl_dict_clear(&by_id);
+	CHECK(0 == by_id.num_elements);
+	CHECK(NULL == rl_dict_find(&by_id, &entries[1].id));
+
+	rl_dict_destroy(&by_id);
+	rl_dict_destroy(&by_name);
+}
+
+/* Frame compression */
+
+static void
+check_lz_round_trip(const rl_uint8 *data, rl_uint32 length, rl_uint32 *packed_length)
+{
+	static rl_uint32 table[RL_LZ_TABLE_SIZE];
+	/* what incompressible data grows by at worst */
+	const rl_uint32 packed_size = length + length / 255 + 16;
+	rl_uint8 *packed = (rl_uint8 *) malloc(packed_size);
+	rl_uint8 *unpacked = (rl_uint8 *) malloc(length + 16);
+
+	*packed_length = rl_lz_compress(data, length, packed, packed_size, table);
+	CHECK(*packed_length > 0);
+
+	rl_memset(unpacked, 0xcc, length + 16);
+	CHECK(0 == rl_lz_decompress(packed, *packed_length, unpacked, length));
+	CHECK(0 == memcmp(data, unpacked, length));
+
+	/* nothing past the end is touched */
+	CHECK(0xcc == unpacked[length]);
+
+	/* the length has to be right, and truncated data is refused */
+	if (length > 0)
+	{
+		CHECK(0 != rl_lz_decompress(packed, *packed_length, unpacked, length - 1));
+		CHECK(0 != rl_lz_decompress(packed, *packed_length / 2, unpacked, length));
+	}
+
+	free(packed);
+	free(unpacked);
+}
+
+static void
+test_lz(void)
+{
+	enum { SIZE = 200000 };
+	static rl_uint32 table[RL_LZ_TABLE_SIZE];
+	rl_uint8 *data = (rl_uint8 *) malloc(SIZE);
+	rl_uint8 out[64];
+	rl_uint32 packed, i;
+	static const rl_uint8 bogus[] = { 0x0f, 0x00, 0x00, 0x10, 0x00 };
+
+	/* text-like data: words from a small vocabulary, and a long repeat */
+	srand(1);
+	for (i = 0; i < SIZE; )
+	{
+		static const char * const words[] = { "the ", "library ", "opens ", "a ", "file\n", "handle, " };
+		const char *word = words[rand() % 6];
+
+		while (*word && i < SIZE)
+			data[i++] = (rl_uint8) *word++;
+	}
+	rl_memcpy(data + SIZE - 5000, data, 5000);
+
+	check_lz_round_trip(data, SIZE, &packed);
+	CHECK(packed < SIZE * 3 / 4);
+
+	/* long runs of one byte */
+	rl_memset(data, 'x', SIZE);
+	check_lz_round_trip(data, SIZE, &packed);
+	CHECK(packed < SIZE / 100);
+
+	/* noise still round trips, a little larger */
+	for (i = 0; i < SIZE; ++i)
+		data[i] = (rl_uint8) rand();
+	check_lz_round_trip(data, SIZE, &packed);
+	CHECK(packed > SIZE);
+
+	/* short inputs */
+	for (i = 0; i < 20; ++i)
+		check_lz_round_trip(data, i, &packed);
+
+	/* doesn't fit */
+	CHECK(0 == rl_lz_compress(data, SIZE, out, sizeof(out), table));
+
+	/* a match reaching back before the start of the output */
+	CHECK(0 != rl_lz_decompress(bogus, sizeof(bogus), out, 19));
+
+	free(data);
+}
+
+/* Delta encoding */
+
+#define DELTA_BLOCKS (16)
+
+static void
+make_signature(const rl_uint8 *block, rl_uint8 *out)
+{
+	const rl_uint32 weak = rl_rollsum(block, RL_HASH_BLOCK_SIZE);
+
+	out[0] = (rl_uint8) (weak >> 24);
+	out[1] = (rl_uint8) (weak >> 16);
+	out[2] = (rl_uint8) (weak >> 8);
+	out[3] = (rl_uint8) weak;
+	rl_xxhash64_encode(rl_xxhash64(block, RL_HASH_BLOCK_SIZE, 0), out + 4);
+}
+
+/* Rebuild from [instructions] and the blocks of [old], as the target does.
+ * Returns the number of bytes rebuilt, or ~0 if the instructions are bad. */
+static rl_uint32
+apply_delta(const rl_uint8 *old, const rl_uint8 *instructions, rl_uint32 length, rl_uint8 *out, rl_uint32 out_size)
+{
+	const rl_uint8 *end = instructions + length;
+	rl_uint32 used = 0;
+
+	while (instructions < end)
+	{
+		const rl_uint8 code = *instructions++;
+
+		if (RL_DELTA_COPY == code)
+		{
+			rl_uint8 hash[RL_HASH_SIZE];
+			int block;
+
+			if (end - instructions < RL_HASH_SIZE || used + RL_HASH_BLOCK_SIZE > out_size)
+				return ~0u;
+
+			for (block = 0; block < DELTA_BLOCKS; ++block)
+			{
+				rl_xxhash64_encode(rl_xxhash64(old + block * RL_HASH_BLOCK_SIZE, RL_HASH_BLOCK_SIZE, 0), hash);
+				if (0 == memcmp(hash, instructions, RL_HASH_SIZE))
+					break;
+			}
+
+			if (DELTA_BLOCKS == block)
+				return ~0u;
+
+			rl_memcpy(out + used, old + block * RL_HASH_BLOCK_SIZE, RL_HASH_BLOCK_SIZE);
+			used += RL_HASH_BLOCK_SIZE;
+			instructions += RL_HASH_SIZE;
+		}
+		else if (RL_DELTA_LITERAL == code)
+		{
+			rl_uint32 count;
+
+			if (end - instructions < 4)
+				return ~0u;
+
+			rl_decode_int4(&instructions, &count);
+
+			if ((rl_uint32) (end - instructions) < count || used + count > out_size)
+				return ~0u;
+
+			rl_memcpy(out + used, instructions, count);
+			used += count;
+			instructions += count;
+		}
+		else
+			return ~0u;
+	}
+
+	return used;
+}
+
+static void
+test_delta(void)
+{
+	enum { OLD_SIZE = DELTA_BLOCKS * RL_HASH_BLOCK_SIZE, NEW_SIZE = OLD_SIZE + 1000 };
+	rl_uint8 *old = (rl_uint8 *) malloc(OLD_SIZE);
+	rl_uint8 *now = (rl_uint8 *) malloc(NEW_SIZE);
+	rl_uint8 *rebuilt = (rl_uint8 *) malloc(NEW_SIZE);
+	rl_uint8 *out = (rl_uint8 *) malloc(NEW_SIZE + 4096);
+	rl_uint8 signatures[DELTA_BLOCKS * RL_DELTA_SIGNATURE_SIZE];
+	rl_delta_stats_t stats;
+	rl_uint32 out_length, covered, i;
+
+	srand(2);
+	for (i = 0; i < OLD_SIZE; ++i)
+		old[i] = (rl_uint8) rand();
+
+	for (i = 0; i < DELTA_BLOCKS; ++i)
+		make_signature(old + i * RL_HASH_BLOCK_SIZE, signatures + i * RL_DELTA_SIGNATURE_SIZE);
+
+	/* 1000 bytes inserted into the third block move everything after it,
+	 * and a byte of the tenth block changes */
+	rl_memcpy(now, old, 10000);
+	for (i = 0; i < 1000; ++i)
+		now[10000 + i] = (rl_uint8) rand();
+	rl_memcpy(now + 11000, old + 10000, OLD_SIZE - 10000);
+	now[1000 + 9 * RL_HASH_BLOCK_SIZE + 5] ^= 0xff;
+
+	rl_memset(&stats, 0, sizeof(stats));
+	CHECK(0 == rl_delta_encode(now, NEW_SIZE, signatures, DELTA_BLOCKS, out, NEW_SIZE + 4096, &out_length, &covered, &stats));
+	CHECK(NEW_SIZE == covered);
+	CHECK(covered == apply_delta(old, out, out_length, rebuilt, NEW_SIZE));
+	CHECK(0 == memcmp(now, rebuilt, NEW_SIZE));
+
+	/* the blocks that moved are found; the two touched ones aren't */
+	CHECK(DELTA_BLOCKS - 2 == stats.copied_blocks);
+	CHECK(NEW_SIZE - (DELTA_BLOCKS - 2) * RL_HASH_BLOCK_SIZE == stats.literal_bytes);
+	CHECK(out_length < 3 * RL_HASH_BLOCK_SIZE);
+
+	/* with little room, what fits still rebuilds a prefix */
+	rl_memset(&stats, 0, sizeof(stats));
+	CHECK(0 == rl_delta_encode(now, NEW_SIZE, signatures, DELTA_BLOCKS, out, 3000, &out_length, &covered, &stats));
+	CHECK(out_length <= 3000 && covered < NEW_SIZE);
+	CHECK(covered == apply_delta(old, out, out_length, rebuilt, NEW_SIZE));
+	CHECK(0 == memcmp(now, rebuilt, covered));
+
+	/* without signatures it's all literal */
+	rl_memset(&stats, 0, sizeof(stats));
+	CHECK(0 == rl_delta_encode(now, NEW_SIZE, signatures, 0, out, NEW_SIZE + 4096, &out_length, &covered, &stats));
+	CHECK(NEW_SIZE == covered && 0 == stats.copied_blocks);
+	CHECK(covered == apply_delta(old, out, out_length, rebuilt, NEW_SIZE));
+	CHECK(0 == memcmp(now, rebuilt, NEW_SIZE));
+
+	free(old);
+	free(now);
+	free(rebuilt);
+	free(out);
+}
+
+/* Message framing */
+
+static void
+test_framing(void)
+{
+	static rl_uint8 payload[100000];
+	static rl_uint8 buffer[sizeof(payload) + 64];
+	rl_msg_t msg, decoded;
+	size_t used;
+	rl_uint32 i;
+
+	for (i = 0; i < sizeof(payload); ++i)
+		payload[i] = (rl_uint8) (i * 13);
+
+	RL_MSG_INIT(msg, RL_MSG_READ_FILE_ANSWER);
+	msg.read_file_answer.hdr_in_reply_to = 1234;
+	msg.read_file_answer.data.base = payload;
+	msg.read_file_answer.data.length = 1000;
+
+	/* V1 has a 16-bit length, V2 a 32-bit one, big-endian after type and
+	 * flags */
+	CHECK(0 == rl_encode_msg(&msg, RL_FRAMING_V1, buffer, sizeof(buffer), &used));
+	CHECK(rl_msg_encoded_size(&msg, RL_FRAMING_V1) == used);
+	CHECK(2 + 2 + 4 + 4 + 1000 == used);
+	CHECK((used >> 8) == buffer[RL_FRAMING_LENGTH_OFFSET] && (used & 0xff) == buffer[RL_FRAMING_LENGTH_OFFSET + 1]);
+
+	rl_memset(&decoded, 0, sizeof(decoded));
+	CHECK(0 == rl_decode_msg(buffer, (int) used, RL_FRAMING_V1, &decoded));
+	CHECK(RL_MSG_READ_FILE_ANSWER == rl_msg_kind_of(&decoded));
+	CHECK(used == decoded.read_file_answer.hdr_length);
+	CHECK(1234 == decoded.read_file_answer.hdr_in_reply_to);
+	CHECK(1000 == decoded.read_file_answer.data.length);
+	CHECK(0 == memcmp(payload, decoded.read_file_answer.data.base, 1000));
+
+	CHECK(0 == rl_encode_msg(&msg, RL_FRAMING_V2, buffer, sizeof(buffer), &used));
+	CHECK(rl_msg_encoded_size(&msg, RL_FRAMING_V2) == used);
+	CHECK(2 + 4 + 4 + 4 + 1000 == used);
+	CHECK(0 == buffer[2] && 0 == buffer[3] && (used >> 8) == buffer[4] && (used & 0xff) == buffer[5]);
+
+	rl_memset(&decoded, 0, sizeof(decoded));
+	CHECK(0 == rl_decode_msg(buffer, (int) used, RL_FRAMING_V2, &decoded));
+	CHECK(used == decoded.read_file_answer.hdr_length);
+	CHECK(0 == memcmp(payload, decoded.read_file_answer.data.base, 1000));
+
+	/* messages past 64 KiB only go with V2 */
+	msg.read_file_answer.data.length = sizeof(payload);
+	CHECK(0 != rl_encode_msg(&msg, RL_FRAMING_V1, buffer, sizeof(buffer), &used));
+	CHECK(0 == rl_encode_msg(&msg, RL_FRAMING_V2, buffer, sizeof(buffer), &used));
+	CHECK(rl_msg_encoded_size(&msg, RL_FRAMING_V2) == used);
+
+	rl_memset(&decoded, 0, sizeof(decoded));
+	CHECK(0 == rl_decode_msg(buffer, (int) used, RL_FRAMING_V2, &decoded));
+	CHECK(used == decoded.read_file_answer.hdr_length);
+	CHECK(sizeof(payload) == decoded.read_file_answer.data.length);
+	CHECK(0 == memcmp(payload, decoded.read_file_answer.data.base, sizeof(payload)));
+
+	/* a buffer too small to encode into, and a truncated frame */
+	CHECK(0 != rl_encode_msg(&msg, RL_FRAMING_V2, buffer, (int) used - 1, &used));
+	CHECK(0 != rl_decode_msg(buffer, (int) sizeof(payload), RL_FRAMING_V2, &decoded));
+
+	/* strings */
+	RL_MSG_INIT(msg, RL_MSG_OPEN_HANDLE_REQUEST);
+	msg.open_handle_request.hdr_sequence_num = 7;
+	msg.open_handle_request.path = "libs/foo.library";
+	msg.open_handle_request.mode = RL_OPENFLAG_READ;
+
+	CHECK(0 == rl_encode_msg(&msg, RL_FRAMING_V2, buffer, sizeof(buffer), &used));
+	CHECK(rl_msg_encoded_size(&msg, RL_FRAMING_V2) == used);
+
+	rl_memset(&decoded, 0, sizeof(decoded));
+	CHECK(0 == rl_decode_msg(buffer, (int) used, RL_FRAMING_V2, &decoded));
+	CHECK(0 == strcmp("libs/foo.library", decoded.open_handle_request.path));
+	CHECK(RL_OPENFLAG_READ == decoded.open_handle_request.mode);
+
+	/* a string without its terminator */
+	buffer[(const rl_uint8 *) decoded.open_handle_request.path - buffer + strlen(decoded.open_handle_request.path)] = 'x';
+	CHECK(0 != rl_decode_msg(buffer, (int) used, RL_FRAMING_V2, &decoded));
+}
+
+int main(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	if (0 != rl_init_alloc())
+		return 1;
+
+	test_readwin_segments();
+	test_readwin_end_of_file();
+	test_readwin_failure();
+	test_readwin_estimator();
+	test_dict();
+	test_lz();
+	test_delta();
+	test_framing();
+
+	rl_fini_alloc();
+
+	if (check_failures)
+	{
+		fprintf(stderr, "%d checks failed\n", check_failures);
+		return 1;
+	}
+
+	printf("all tests passed\n");
+	return 0;
+}
@@ -2,25 +2,540 @@
 #include "util.h"
 #include "socket_includes.h"
 
-#define RL_TRANSPORT_MAX_POOLED_BUFFERS (4)
+#if defined(RL_LINUX)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include "uring.h"
+#endif
 
-static int rl_iobuf_init(rl_iobuf_t *buf, size_t size)
+/* Upper bound on the memory each size class may keep in its free list. */
+#if defined(RL_AMIGA)
+#define RL_TRANSPORT_MAX_POOL_BYTES (64 * 1024)
+#else
+#define RL_TRANSPORT_MAX_POOL_BYTES (512 * 1024)
+#endif
+
+/* Never keep more free buffers than this in any one class. */
+#define RL_TRANSPORT_MAX_POOL_DEPTH (64)
+
+static const size_t rl_size_class_capacity[RL_TRANSPORT_SIZE_CLASSES] =
+{
+	64, 512, 4096, 65536
+};
+
+/* Number of bytes that are always made contiguous before peeking at a
+ * message; enough to cover the message header. */
+#define RL_TRANSPORT_PEEK_SIZE (16)
+
+#if defined(RL_POSIX)
+/* Flag for recv() calls past the first one in a wakeup so that draining the
+ * socket never blocks. */
+#define RL_RECV_DONTWAIT MSG_DONTWAIT
+#endif
+
+#if defined(RL_LINUX) && defined(SYS_memfd_create)
+static int rl_ringbuf_map_mirrored(rl_ringbuf_t *buf, size_t size)
 {
+	const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	char *addr = NULL;
+	int fd = -1;
+
+	/* both mappings must start on a page boundary */
+	size = (size + page_size - 1) & ~(page_size - 1);
+
+	if (-1 == (fd = (int) syscall(SYS_memfd_create, "rlaunch-ring", 0)))
+		goto fail;
+
+	if (0 != ftruncate(fd, (off_t) size))
+		goto fail;
+
+	/* reserve twice the address space, then map the same pages into both halves */
+	addr = (char *) mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == (void *) addr)
+	{
+		addr = NULL;
+		goto fail;
+	}
+
+	if (MAP_FAILED == mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0))
+		goto fail;
+
+	if (MAP_FAILED == mmap(addr + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0))
+		goto fail;
+
+	close(fd);
+
+	buf->base_address = addr;
+	buf->size = size;
+	buf->mirrored = 1;
+	return 0;
+
+fail:
+	RL_LOG_DEBUG(("couldn't set up mirrored ring buffer; falling back to a plain one"));
+	if (addr)
+		munmap(addr, size * 2);
+	if (-1 != fd)
+		close(fd);
+	return 1;
+}
+#endif
+
+static int rl_ringbuf_init(rl_ringbuf_t *buf, size_t size)
+{
+	rl_memset(buf, 0, sizeof(rl_ringbuf_t));
+
+#if defined(RL_LINUX) && defined(SYS_memfd_create)
+	if (0 == rl_ringbuf_map_mirrored(buf, size))
+	{
+		buf->valid = 1;
+		return 0;
+	}
+#endif
+
 	buf->base_address = (char*) rl_alloc_sized(size);
-	buf->end_address = buf->base_address + size;
-	buf->write_cursor = buf->base_address;
-	buf->read_cursor = buf->base_address;
+	buf->size = size;
 	buf->valid = buf->base_address ? 1 : 0;
 	return buf->base_address ? 0 : 1;
 }
 
-static void rl_iobuf_destroy(rl_iobuf_t *buf)
+static void rl_ringbuf_destroy(rl_ringbuf_t *buf)
 {
 	if (buf->valid)
-		rl_free_sized(buf->base_address, buf->end_address - buf->base_address);
+	{
+#if defined(RL_LINUX) && defined(SYS_memfd_create)
+		if (buf->mirrored)
+			munmap(buf->base_address, buf->size * 2);
+		else
+#endif
+			rl_free_sized(buf->base_address, buf->size);
+	}
+
+	if (buf->scratch)
+		rl_free_sized(buf->scratch, buf->size);
+
+	buf->scratch = NULL;
 	buf->valid = 0;
 }
 
+/*
+ * Return a pointer to [len] unread bytes as one contiguous span. This only
+ * copies for a non-mirrored ring when the span wraps around the end.
+ */
+static char *rl_ringbuf_linear(rl_ringbuf_t *buf, size_t len)
+{
+	const size_t tail = buf->size - buf->read_index;
+	char * const read_ptr = buf->base_address + buf->read_index;
+
+	RL_ASSERT(len <= buf->fill);
+
+	if (buf->mirrored || len <= tail)
+		return read_ptr;
+
+	if (!buf->scratch && NULL == (buf->scratch = (char *) rl_alloc_sized(buf->size)))
+		return NULL;
+
+	rl_memcpy(buf->scratch, read_ptr, tail);
+	rl_memcpy(buf->scratch + tail, buf->base_address, len - tail);
+	return buf->scratch;
+}
+
+/* Number of unread bytes that can be addressed directly at the read index. */
+static INLINE size_t rl_ringbuf_contiguous(const rl_ringbuf_t *buf)
+{
+	if (buf->mirrored)
+		return buf->fill;
+	else
+		return RL_MIN_MACRO(buf->fill, buf->size - buf->read_index);
+}
+
+static INLINE void rl_ringbuf_consume(rl_ringbuf_t *buf, size_t len)
+{
+	RL_ASSERT(len <= buf->fill);
+
+	buf->fill -= len;
+
+	/* rewind an empty ring so that the next receive gets the whole buffer in one piece */
+	if (0 == buf->fill)
+		buf->read_index = 0;
+	else if ((buf->read_index += len) >= buf->size)
+		buf->read_index -= buf->size;
+}
+
+#if defined(RL_LINUX)
+enum
+{
+	/* payload read submitted, not finished */
+	RL_TRANSPORT_URING_READING		= 1 << 0,
+
+	/* payload is in memory */
+	RL_TRANSPORT_URING_READY		= 1 << 1
+};
+
+/* user_data of requests that aren't payload reads (those carry the buffer) */
+#define RL_TRANSPORT_URING_SEND		((__u64) 1)
+#define RL_TRANSPORT_URING_CANCEL	((__u64) 2)
+#define RL_TRANSPORT_URING_POLL		((__u64) 3)
+
+/* Don't read more payload bytes ahead of the socket than this. */
+#define RL_TRANSPORT_URING_READAHEAD (4 * 1024 * 1024)
+
+typedef struct rl_transport_uring_tag
+{
+	rl_uring_t ring;
+
+	/* the gather send in flight, if any; there's only ever one so that the
+	 * stream stays in order */
+	int send_in_flight;
+	struct msghdr send_msg;
+	struct iovec send_iov[RL_SOCKET_MAX_IOV];
+
+	/* set when a send found the socket full (kernels that don't wait on
+	 * non-blocking sockets themselves), and while the poll that waits for
+	 * room in its place is in flight */
+	int send_blocked;
+	int poll_in_flight;
+
+	/* memory held by payloads that have been read (or are being read) */
+	size_t readahead_bytes;
+} rl_transport_uring_t;
+
+int
+rl_transport_enable_uring(rl_transport_t *t, unsigned entries)
+{
+	rl_transport_uring_t *u;
+
+	if (NULL == (u = RL_ALLOC_TYPED_ZERO(rl_transport_uring_t)))
+		return 1;
+
+	if (0 != rl_uring_init(&u->ring, entries))
+	{
+		RL_FREE_TYPED(rl_transport_uring_t, u);
+		return 1;
+	}
+
+	u->send_msg.msg_iov = u->send_iov;
+	t->uring = u;
+	return 0;
+}
+
+int
+rl_transport_uring_fd(const rl_transport_t *t)
+{
+	return t->uring ? t->uring->ring.fd : -1;
+}
+
+/* Queue a read of the file payload of [msg] into memory. Returns the
+ * submission entry, or NULL if that's not possible right now. */
+static struct io_uring_sqe *
+uring_read_payload(rl_transport_t *t, rl_transport_buf_t *msg, int sqe_flags)
+{
+	rl_transport_uring_t * const u = t->uring;
+	struct io_uring_sqe *sqe;
+
+	if (!msg->payload)
+	{
+		if (NULL == (msg->payload = (rl_uint8 *) rl_alloc_sized(msg->file_remaining)))
+			return NULL;
+
+		msg->payload_size = msg->file_remaining;
+		u->readahead_bytes += msg->payload_size;
+	}
+
+	if (NULL == (sqe = rl_uring_get_sqe(&u->ring)))
+		return NULL;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->flags = (__u8) sqe_flags;
+	sqe->fd = msg->file_fd;
+	sqe->addr = (__u64) (uintptr_t) msg->payload;
+	sqe->len = msg->file_remaining;
+	sqe->off = msg->file_offset;
+	sqe->user_data = (__u64) (uintptr_t) msg;
+
+	msg->uring_flags |= RL_TRANSPORT_URING_READING;
+	return sqe;
+}
+
+/* Queue a poll for [sock] to become writable, linked to the request queued
+ * after it. Returns the submission entry, or NULL if the ring is full. */
+static struct io_uring_sqe *
+uring_poll_writable(rl_transport_t *t, rl_socket_t sock)
+{
+	rl_transport_uring_t * const u = t->uring;
+	struct io_uring_sqe *sqe;
+
+	if (NULL == (sqe = rl_uring_get_sqe(&u->ring)))
+		return NULL;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = sock;
+	sqe->poll_events = POLLOUT;
+	sqe->user_data = RL_TRANSPORT_URING_POLL;
+
+	u->poll_in_flight = 1;
+	return sqe;
+}
+
+static void
+uring_flush(rl_transport_t *t, rl_socket_t sock)
+{
+	rl_transport_uring_t * const u = t->uring;
+	rl_transport_buf_t *msg = t->out_queue;
+	int vec_count = 0;
+
+	if (t->error)
+		return;
+
+	if (!u->send_in_flight && !u->poll_in_flight)
+	{
+		struct io_uring_sqe *read_sqe = NULL;
+		struct io_uring_sqe *poll_sqe = NULL;
+		struct io_uring_sqe *sqe;
+
+		/* gather the buffers at the head of the queue whose data is in
+		 * memory, up to and including one whose payload is read right now */
+		for (; msg && vec_count + 2 <= RL_SOCKET_MAX_IOV; msg = msg->next)
+		{
+			if (msg->file_remaining > 0 && 0 == (RL_TRANSPORT_URING_READY & msg->uring_flags))
+			{
+				/* wait for the read that's already underway */
+				if (RL_TRANSPORT_URING_READING & msg->uring_flags)
+					break;
+
+				if (NULL == (read_sqe = uring_read_payload(t, msg, IOSQE_IO_LINK)))
+					break;
+			}
+
+			if (msg->remaining > 0)
+			{
+				u->send_iov[vec_count].iov_base = msg->buffer + (msg->used_size - msg->remaining);
+				u->send_iov[vec_count].iov_len = msg->remaining;
+				++vec_count;
+			}
+
+			if (msg->file_remaining > 0)
+			{
+				u->send_iov[vec_count].iov_base = msg->payload + (msg->payload_size - msg->file_remaining);
+				u->send_iov[vec_count].iov_len = msg->file_remaining;
+				++vec_count;
+			}
+
+			if (read_sqe)
+			{
+				msg = msg->next;
+				break;
+			}
+		}
+
+		/* After a send that found the socket full, the next one waits for
+		 * room behind a poll instead of failing again right away. */
+		if (vec_count > 0 && u->send_blocked && NULL == (poll_sqe = uring_poll_writable(t, sock)))
+		{
+			vec_count = 0;
+
+			if (read_sqe)
+				read_sqe->flags &= (__u8) ~IOSQE_IO_LINK;
+		}
+
+		if (vec_count > 0)
+		{
+			if (NULL != (sqe = rl_uring_get_sqe(&u->ring)))
+			{
+				u->send_msg.msg_iovlen = (size_t) vec_count;
+
+				sqe->opcode = IORING_OP_SENDMSG;
+				sqe->fd = sock;
+				sqe->addr = (__u64) (uintptr_t) &u->send_msg;
+				sqe->msg_flags = MSG_NOSIGNAL;
+				sqe->user_data = RL_TRANSPORT_URING_SEND;
+
+				u->send_in_flight = 1;
+				++t->stats.send_calls;
+			}
+			else
+			{
+				/* no room for the send; let the read and poll go ahead on
+				 * their own */
+				if (read_sqe)
+					read_sqe->flags &= (__u8) ~IOSQE_IO_LINK;
+				if (poll_sqe)
+					poll_sqe->flags &= (__u8) ~IOSQE_IO_LINK;
+			}
+		}
+	}
+
+	/* read payloads further down the queue ahead of time */
+	for (; msg && u->readahead_bytes < RL_TRANSPORT_URING_READAHEAD; msg = msg->next)
+	{
+		if (msg->file_remaining > 0 && 0 == ((RL_TRANSPORT_URING_READING | RL_TRANSPORT_URING_READY) & msg->uring_flags))
+		{
+			if (NULL == uring_read_payload(t, msg, 0))
+				break;
+		}
+	}
+
+	if (0 != rl_uring_submit(&u->ring))
+		t->error = 1;
+}
+
+static void
+uring_on_sent(rl_transport_t *t, int result)
+{
+	size_t consumed;
+
+	t->uring->send_in_flight = 0;
+
+	if (-EAGAIN == result)
+	{
+		t->uring->send_blocked = 1;
+		return;
+	}
+
+	if (result < 0)
+	{
+		/* -ECANCELED: the linked payload read or poll failed, which has
+		 * been dealt with already */
+		if (-ECANCELED != result)
+		{
+			RL_LOG_WARNING(("io_uring send failed: %s", strerror(-result)));
+			t->error = 1;
+		}
+		return;
+	}
+
+	consumed = (size_t) result;
+
+	++t->stats.flushes;
+	t->stats.bytes_sent += (rl_uint32) result;
+	if ((rl_uint32) result > t->stats.max_flush_bytes)
+		t->stats.max_flush_bytes = (rl_uint32) result;
+
+	/* retire what went out, header first and then payload */
+	while (consumed > 0)
+	{
+		rl_transport_buf_t *msg = t->out_queue;
+		size_t take;
+
+		RL_ASSERT(msg);
+
+		take = RL_MIN_MACRO(consumed, msg->remaining);
+		msg->remaining -= take;
+		consumed -= take;
+
+		take = RL_MIN_MACRO(consumed, (size_t) msg->file_remaining);
+		msg->file_remaining -= (rl_uint32) take;
+		consumed -= take;
+
+		if (msg->remaining > 0 || msg->file_remaining > 0)
+			break;
+
+		t->out_queue = msg->next;
+		rl_transport_free_buffer(t, msg);
+	}
+
+	if (!t->out_queue)
+		t->out_tail = NULL;
+}
+
+static void
+uring_on_complete(void *context, __u64 user_data, int result)
+{
+	rl_transport_t * const t = (rl_transport_t *) context;
+	rl_transport_buf_t *msg;
+
+	if (RL_TRANSPORT_URING_SEND == user_data)
+	{
+		uring_on_sent(t, result);
+		return;
+	}
+
+	if (RL_TRANSPORT_URING_CANCEL == user_data)
+		return;
+
+	if (RL_TRANSPORT_URING_POLL == user_data)
+	{
+		t->uring->poll_in_flight = 0;
+
+		if (result >= 0)
+			t->uring->send_blocked = 0;
+		else if (-ECANCELED != result)
+		{
+			RL_LOG_WARNING(("io_uring poll failed: %s", strerror(-result)));
+			t->error = 1;
+		}
+		return;
+	}
+
+	msg = (rl_transport_buf_t *) (uintptr_t) user_data;
+	msg->uring_flags &= ~RL_TRANSPORT_URING_READING;
+
+	if (result < 0)
+	{
+		RL_LOG_WARNING(("io_uring payload read failed: %s", strerror(-result)));
+		t->error = 1;
+	}
+	else if ((rl_uint32) result != msg->file_remaining)
+	{
+		/* as with sendfile, we can't make up the bytes we promised */
+		RL_LOG_WARNING(("file payload ended %u bytes early", msg->file_remaining - (rl_uint32) result));
+		t->error = 1;
+	}
+	else
+	{
+		msg->uring_flags |= RL_TRANSPORT_URING_READY;
+	}
+}
+
+void
+rl_transport_on_uring_ready(rl_transport_t *t)
+{
+	if (t->uring)
+		rl_uring_reap(&t->uring->ring, uring_on_complete, t);
+}
+
+/* Wait for all requests to finish; their buffers are about to go away. */
+static void
+uring_shutdown(rl_transport_t *t)
+{
+	rl_transport_uring_t * const u = t->uring;
+	struct io_uring_sqe *sqe;
+
+	/* a send (or the poll before it) can wait forever for a peer that
+	 * isn't reading */
+	if (u->send_in_flight && NULL != (sqe = rl_uring_get_sqe(&u->ring)))
+	{
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = RL_TRANSPORT_URING_SEND;
+		sqe->user_data = RL_TRANSPORT_URING_CANCEL;
+	}
+
+	if (u->poll_in_flight && NULL != (sqe = rl_uring_get_sqe(&u->ring)))
+	{
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = RL_TRANSPORT_URING_POLL;
+		sqe->user_data = RL_TRANSPORT_URING_CANCEL;
+	}
+
+	rl_uring_submit(&u->ring);
+
+	while (u->ring.in_flight > 0)
+	{
+		if (0 != rl_uring_wait(&u->ring))
+			break;
+		rl_uring_reap(&u->ring, uring_on_complete, t);
+	}
+
+	rl_uring_destroy(&u->ring);
+	RL_FREE_TYPED(rl_transport_uring_t, u);
+	t->uring = NULL;
+}
+#endif
+
 int
 rl_transport_init(rl_transport_t *t, const rl_transport_callbacks_t *callbacks, size_t buffer_size, void *userdata)
 {
@@ -30,11 +545,13 @@ rl_transport_init(rl_transport_t *t, const rl_transport_callbacks_t *callbacks,
 	RL_ASSERT(callbacks->peek_incoming);
 	RL_ASSERT(callbacks->deliver_incoming);
 
-	if (0 != rl_iobuf_init(&t->inbuf, buffer_size))
+	if (0 != rl_ringbuf_init(&t->inbuf, buffer_size))
 		goto cleanup;
 
 	t->callbacks = callbacks;
 	t->userdata = userdata;
+	t->max_input_size = t->inbuf.size;
+	t->max_output_size = (size_t) -1;
 	return 0;
 
 cleanup:
@@ -46,6 +563,11 @@ void
 rl_transport_destroy(rl_transport_t *t)
 {
 	rl_transport_buf_t *msg;
+
+#if defined(RL_LINUX)
+	if (t->uring)
+		uring_shutdown(t);
+#endif
 	
 	msg = t->out_queue;
 	while (msg)
@@ -55,15 +577,23 @@ rl_transport_destroy(rl_transport_t *t)
 		msg = next;
 	}
 
-	msg = t->next_free_buffer;
-	while (msg)
 	{
-		rl_transport_buf_t *next = msg->next;
-		rl_free_sized(msg, msg->total_size);
-		msg = next;
+		int i;
+		for (i = 0; i < RL_TRANSPORT_SIZE_CLASSES; ++i)
+		{
+			msg = t->pools[i].free_list;
+			while (msg)
+			{
+				rl_transport_buf_t *next = msg->next;
+				rl_free_sized(msg, msg->total_size);
+				msg = next;
+			}
+			t->pools[i].free_list = NULL;
+			t->pools[i].num_free = 0;
+		}
 	}
 
-	rl_iobuf_destroy(&t->inbuf);
+	rl_ringbuf_destroy(&t->inbuf);
 }
 
 int
@@ -76,12 +606,24 @@ rl_transport_update(rl_transport_t *t)
 	if (t->disconnect)
 		return RL_TRANSPORT_DISCONNECTED;
 
-	while (t->inbuf.read_cursor < t->inbuf.write_cursor)
+	while (t->inbuf.fill > 0)
 	{
 		int msg_size;
-		const ptrdiff_t avail_size = t->inbuf.write_cursor - t->inbuf.read_cursor;
+		size_t view_size = rl_ringbuf_contiguous(&t->inbuf);
+		char *view = t->inbuf.base_address + t->inbuf.read_index;
+
+		/* make sure the header can be examined even if it wraps */
+		if (view_size < t->inbuf.fill && view_size < RL_TRANSPORT_PEEK_SIZE)
+		{
+			view_size = RL_MIN_MACRO(t->inbuf.fill, RL_TRANSPORT_PEEK_SIZE);
+			if (NULL == (view = rl_ringbuf_linear(&t->inbuf, view_size)))
+			{
+				t->error = 1;
+				return RL_TRANSPORT_ERROR;
+			}
+		}
 
-		msg_size = (*t->callbacks->peek_incoming)(t, t->inbuf.read_cursor, avail_size);
+		msg_size = (*t->callbacks->peek_incoming)(t, view, view_size);
 
 		/* error? */
 		if (msg_size <= 0)
@@ -93,36 +635,32 @@ rl_transport_update(rl_transport_t *t)
 			}
 			break;
 		}
-		else if (msg_size > (t->inbuf.end_address - t->inbuf.base_address))
+		else if ((size_t) msg_size > t->max_input_size)
 		{
-			RL_LOG_WARNING(("message size %d will never fit in buffer", msg_size));
+			RL_LOG_WARNING(("message size %d exceeds the limit of %u bytes", msg_size, (unsigned int) t->max_input_size));
 			t->error = 1;
 			return RL_TRANSPORT_ERROR;
 		}
 
 		/* enough data available? */
-		if (avail_size < msg_size)
+		if (t->inbuf.fill < (size_t) msg_size)
 			break;
 
+		if ((size_t) msg_size > view_size && NULL == (view = rl_ringbuf_linear(&t->inbuf, (size_t) msg_size)))
+		{
+			t->error = 1;
+			return RL_TRANSPORT_ERROR;
+		}
+
 		/* deliver the message */
-		if (0 != (*t->callbacks->deliver_incoming)(t, t->inbuf.read_cursor, (size_t) msg_size))
+		if (0 != (*t->callbacks->deliver_incoming)(t, view, (size_t) msg_size))
 		{
 			t->error = 1;
 			return RL_TRANSPORT_ERROR;
 		}
 
 		/* advance buffer */
-		t->inbuf.read_cursor += msg_size;
-	}
-
-	if (t->inbuf.read_cursor != t->inbuf.base_address)
-	{
-		/* move back remaining (partial) data to the front of the buffer */
-		size_t trim = t->inbuf.write_cursor - t->inbuf.read_cursor;
-		if (trim > 0)
-			rl_memmove(t->inbuf.base_address, t->inbuf.read_cursor, trim);
-		t->inbuf.read_cursor = t->inbuf.base_address;
-		t->inbuf.write_cursor = t->inbuf.read_cursor + trim;
+		rl_ringbuf_consume(&t->inbuf, (size_t) msg_size);
 	}
 
 	if (t->out_queue)
@@ -134,40 +672,156 @@ rl_transport_update(rl_transport_t *t)
 void
 rl_transport_on_input_arrived(rl_transport_t *t, rl_socket_t sock)
 {
-	/* read as much as possible */
-	int read_result;
-	const int max_buffer_left = (int) (t->inbuf.end_address - t->inbuf.write_cursor);
-   
-	read_result = recv(sock, t->inbuf.write_cursor, max_buffer_left, 0 /* flags */);
+	rl_ringbuf_t * const buf = &t->inbuf;
+	int flags = 0;
 
-	RL_LOG_DEBUG(("read %d bytes (avail space pre:%d post:%d)",
-				read_result, max_buffer_left, max_buffer_left - read_result));
+	/* assume we stop early until the socket says otherwise */
+	t->input_pending = 1;
 
-	if (0 == read_result)
+	/* read as much as possible */
+	while (buf->fill < buf->size)
 	{
-		t->disconnect = 1;
+		int read_result;
+		size_t write_index = buf->read_index + buf->fill;
+		size_t space = buf->size - buf->fill;
+
+		if (write_index >= buf->size)
+			write_index -= buf->size;
+
+		/* without the mirror mapping we can only fill up to the end of the ring */
+		if (!buf->mirrored)
+			space = RL_MIN_MACRO(space, buf->size - write_index);
+
+		read_result = recv(sock, buf->base_address + write_index, (int) space, flags);
+
+		RL_LOG_DEBUG(("read %d bytes (avail space pre:%d post:%d)",
+					read_result, (int) space, (int) space - read_result));
+
+		if (0 == read_result)
+		{
+			t->disconnect = 1;
+			t->input_pending = 0;
+			break;
+		}
+		else if (-1 == read_result)
+		{
+			if (RL_LAST_SOCKET_ERROR != EWOULDBLOCK)
+				t->error = 1;	
+			t->input_pending = 0;
+			break;
+		}
+
+		buf->fill += (size_t) read_result;
+
+#if defined(RL_RECV_DONTWAIT)
+		/* keep draining without blocking until the socket runs dry */
+		flags = RL_RECV_DONTWAIT;
+#else
+		/* we can't tell whether another recv() would block, so leave the rest
+		 * for the next wakeup */
+		break;
+#endif
 	}
-	else if (-1 == read_result)
+}
+
+#if defined(RL_POSIX)
+/*
+ * Send (part of) the file payload of the buffer at the head of the output
+ * queue. Returns the number of bytes written, 0 if the socket is full or -1
+ * if the transport failed.
+ */
+static int
+send_file_payload(rl_transport_t *t, rl_socket_t sock, rl_transport_buf_t *msg)
+{
+	int write_rc;
+
+	write_rc = rl_socket_sendfile(sock, msg->file_fd, msg->file_offset, msg->file_remaining);
+	RL_LOG_DEBUG(("sent %d of %u file bytes", write_rc, msg->file_remaining));
+
+	if (write_rc < 0)
 	{
-		if (RL_LAST_SOCKET_ERROR != EWOULDBLOCK)
-			t->error = 1;	
+		if (EWOULDBLOCK == RL_LAST_SOCKET_ERROR)
+			return 0;
+		t->error = 1;
+		return -1;
 	}
-	else
+
+	/* The file got shorter after the message header went out; we can't
+	 * make up the bytes we promised, so the stream is broken. */
+	if (0 == write_rc)
 	{
-		t->inbuf.write_cursor += read_result;
+		RL_LOG_WARNING(("file payload ended %u bytes early", msg->file_remaining));
+		t->error = 1;
+		return -1;
 	}
+
+	msg->file_offset += (rl_uint32) write_rc;
+	msg->file_remaining -= (rl_uint32) write_rc;
+	return write_rc;
 }
+#endif
 
 void
 rl_transport_on_output_possible(rl_transport_t *t, rl_socket_t sock)
 {
+	rl_uint32 flush_bytes = 0;
+	rl_uint32 flush_calls = 0;
+
+#if defined(RL_LINUX)
+	if (t->uring)
+	{
+		uring_flush(t, sock);
+		return;
+	}
+#endif
+
 	while (t->out_queue)
 	{
-		rl_transport_buf_t *msg = t->out_queue;
+		rl_iovec_t vec[RL_SOCKET_MAX_IOV];
+		rl_transport_buf_t *msg;
+		int vec_count = 0;
+		size_t gathered = 0;
 		int write_rc = 0;
 
-		write_rc = send(sock, (const char *)msg->buffer + (msg->used_size - msg->remaining), (int) msg->remaining, /* flags*/ 0);
-		RL_LOG_DEBUG(("wrote %d bytes", write_rc));
+		msg = t->out_queue;
+
+		/* header written, file payload still pending */
+		if (0 == msg->remaining && msg->file_remaining > 0)
+		{
+#if defined(RL_POSIX)
+			write_rc = send_file_payload(t, sock, msg);
+			++flush_calls;
+
+			if (write_rc <= 0)
+				break;
+
+			flush_bytes += (rl_uint32) write_rc;
+
+			/* short write; the socket buffer is full */
+			if (msg->file_remaining > 0)
+				break;
+#endif
+			t->out_queue = msg->next;
+			rl_transport_free_buffer(t, msg);
+			continue;
+		}
+
+		/* gather as many queued buffers as we can pass in one call, stopping
+		 * after a buffer that is followed by a file payload */
+		for (; msg && vec_count < RL_SOCKET_MAX_IOV; msg = msg->next)
+		{
+			vec[vec_count].base = msg->buffer + (msg->used_size - msg->remaining);
+			vec[vec_count].length = msg->remaining;
+			gathered += msg->remaining;
+			++vec_count;
+
+			if (msg->file_remaining > 0)
+				break;
+		}
+
+		write_rc = rl_socket_sendv(sock, vec, vec_count);
+		++flush_calls;
+		RL_LOG_DEBUG(("wrote %d of %d bytes from %d buffers", write_rc, (int) gathered, vec_count));
 
 		if (write_rc < 0)
 		{
@@ -179,20 +833,67 @@ rl_transport_on_output_possible(rl_transport_t *t, rl_socket_t sock)
 		if (0 == write_rc)
 			break;
 
-		msg->remaining -= write_rc;
+		flush_bytes += (rl_uint32) write_rc;
 
-		if (0 == msg->remaining)
+		/* retire the buffers that were written out completely, and advance
+		 * into the one that was only partially written (if any) */
 		{
-			t->out_queue = msg->next;
-			rl_transport_free_buffer(t, msg);
+			size_t consumed = (size_t) write_rc;
+
+			while (consumed > 0)
+			{
+				msg = t->out_queue;
+				RL_ASSERT(msg);
+
+				if (consumed < msg->remaining)
+				{
+					msg->remaining -= consumed;
+					break;
+				}
+
+				consumed -= msg->remaining;
+				msg->remaining = 0;
+
+				/* keep it queued until the file payload has gone out */
+				if (msg->file_remaining > 0)
+					break;
+
+				t->out_queue = msg->next;
+				rl_transport_free_buffer(t, msg);
+			}
 		}
+
+		/* short write; the socket buffer is full */
+		if ((size_t) write_rc < gathered)
+			break;
+	}
+
+	if (!t->out_queue)
+		t->out_tail = NULL;
+
+	if (flush_bytes > 0)
+	{
+		++t->stats.flushes;
+		t->stats.bytes_sent += flush_bytes;
+		if (flush_bytes > t->stats.max_flush_bytes)
+			t->stats.max_flush_bytes = flush_bytes;
 	}
+	t->stats.send_calls += flush_calls;
 }
 
 int
 rl_transport_add_output_message(rl_transport_t *self, rl_transport_buf_t *buf)
 {
+	if (buf->used_size + buf->file_remaining > self->max_output_size)
+	{
+		RL_LOG_WARNING(("%u byte message exceeds the limit of %u bytes",
+					(unsigned int) (buf->used_size + buf->file_remaining),
+					(unsigned int) self->max_output_size));
+		return -1;
+	}
+
 	buf->remaining = buf->used_size;
+	buf->next = NULL;
 
 	if (!self->out_queue)
 	{
@@ -207,49 +908,126 @@ rl_transport_add_output_message(rl_transport_t *self, rl_transport_buf_t *buf)
 	return 0;
 }
 
+size_t
+rl_transport_size_class_capacity(int size_class)
+{
+	RL_ASSERT(size_class >= 0 && size_class < RL_TRANSPORT_SIZE_CLASSES);
+	return rl_size_class_capacity[size_class];
+}
+
 rl_transport_buf_t *
-rl_transport_alloc_buffer(rl_transport_t *self)
+rl_transport_alloc_buffer(rl_transport_t *self, size_t size)
 {
 	rl_transport_buf_t *result;
+	rl_transport_pool_t *pool = NULL;
+	size_t buffer_size = size;
+	size_t total_size;
+	int size_class;
+
+	for (size_class = 0; size_class < RL_TRANSPORT_SIZE_CLASSES; ++size_class)
+	{
+		if (size <= rl_size_class_capacity[size_class])
+		{
+			pool = &self->pools[size_class];
+			buffer_size = rl_size_class_capacity[size_class];
+			break;
+		}
+	}
 
-	if (self->num_free_buffers)
+	if (pool)
 	{
-		RL_ASSERT(self->next_free_buffer);
+		if (++pool->num_in_use > pool->high_water)
+			pool->high_water = pool->num_in_use;
 
-		--self->num_free_buffers;
+		if (pool->free_list)
+		{
+			++pool->hits;
+			--pool->num_free;
+
+			result = pool->free_list;
+			pool->free_list = result->next;
+			result->next = NULL;
+			result->userdata = NULL;
+			result->file_fd = -1;
+			result->file_offset = 0;
+			result->file_remaining = 0;
+#if defined(RL_LINUX)
+			result->payload = NULL;
+			result->payload_size = 0;
+			result->uring_flags = 0;
+#endif
+			return result;
+		}
 
-		result = self->next_free_buffer;
-		self->next_free_buffer = result->next;
-		result->next = NULL;
-		return result;
+		++pool->misses;
 	}
-	else
-	{
-		const size_t buffer_size = 8192;
-		const size_t total_size = sizeof(rl_transport_buf_t) + buffer_size;
 
-		result = (rl_transport_buf_t *) rl_alloc_sized_and_clear(total_size);
+	total_size = sizeof(rl_transport_buf_t) + buffer_size;
 
-		if (!result)
-			return NULL;
+	result = (rl_transport_buf_t *) rl_alloc_sized_and_clear(total_size);
 
-		result->total_size = total_size;
-		result->buffer_size = buffer_size;
-		return result;
+	if (!result)
+	{
+		if (pool)
+			--pool->num_in_use;
+		return NULL;
 	}
+
+	result->total_size = total_size;
+	result->buffer_size = buffer_size;
+	result->size_class = size_class;
+	result->file_fd = -1;
+	return result;
 }
 
 void
 rl_transport_free_buffer(rl_transport_t *self, rl_transport_buf_t *buf)
 {
-	if (self->num_free_buffers >= RL_TRANSPORT_MAX_POOLED_BUFFERS)
+	rl_transport_pool_t *pool;
+	rl_uint32 max_depth;
+
+#if defined(RL_POSIX)
+	if (-1 != buf->file_fd)
+	{
+		close(buf->file_fd);
+		buf->file_fd = -1;
+	}
+#endif
+
+#if defined(RL_LINUX)
+	if (buf->payload)
+	{
+		if (self->uring)
+			self->uring->readahead_bytes -= buf->payload_size;
+		rl_free_sized(buf->payload, buf->payload_size);
+		buf->payload = NULL;
+	}
+#endif
+
+	if (buf->size_class >= RL_TRANSPORT_SIZE_CLASSES)
+	{
+		rl_free_sized(buf, buf->total_size);
+		return;
+	}
+
+	pool = &self->pools[buf->size_class];
+
+	RL_ASSERT(pool->num_in_use > 0);
+	--pool->num_in_use;
+
+	/* keep enough buffers around to cover the worst burst seen so far */
+	max_depth = (rl_uint32) (RL_TRANSPORT_MAX_POOL_BYTES / buf->buffer_size);
+	max_depth = RL_MIN_MACRO(max_depth, RL_TRANSPORT_MAX_POOL_DEPTH);
+	max_depth = RL_MIN_MACRO(max_depth, pool->high_water);
+
+	if (pool->num_free >= max_depth)
 	{
 		rl_free_sized(buf, buf->total_size);
 	}
 	else
 	{
-		buf->next = self->next_free_buffer;
-		self->next_free_buffer = buf;
-		++self->num_free_buffers;
+		buf->next = pool->free_list;
+		pool->free_list = buf;
+		++pool->num_free;
 	}
 }
@@ -4,14 +4,34 @@
 #include "util.h"
 #include "socket_types.h"
 
-typedef struct rl_iobuf_tag
+/*
+ * Input ring buffer. Received bytes are never moved once they have been
+ * written; the read and write positions simply wrap around.
+ *
+ * On Linux the backing pages are mapped twice back to back ("mirrored"), so
+ * any span of up to [size] bytes starting inside the ring is contiguous in
+ * memory and can be handed to the message callbacks directly. Elsewhere the
+ * rare message that straddles the end of the ring is assembled in [scratch].
+ */
+typedef struct rl_ringbuf_tag
 {
 	char *base_address;
-	char *read_cursor;
-	char *write_cursor;
-	char *end_address;
+	size_t size;
+
+	/* offset of the first unread byte */
+	size_t read_index;
+
+	/* number of unread bytes */
+	size_t fill;
+
+	/* non-zero if base_address[size..2*size) aliases base_address[0..size) */
+	int mirrored;
+
+	/* linearization buffer for messages that wrap (non-mirrored rings only) */
+	char *scratch;
+
 	int valid;
-} rl_iobuf_t;
+} rl_ringbuf_t;
 
 typedef enum rl_message_delivery_result_tag
 {
@@ -42,6 +62,26 @@ typedef struct rl_transport_buf_tag
 	/* size of the buffer space */
 	size_t buffer_size;
 
+	/* pool size class this buffer belongs to (RL_TRANSPORT_SIZE_CLASSES for
+	 * oversized buffers that are never pooled) */
+	int size_class;
+
+	/* optional file payload written straight from the file to the socket
+	 * after the buffer contents (POSIX only). file_fd is -1 when unused;
+	 * otherwise the transport owns the descriptor and closes it when the
+	 * buffer is freed. */
+	int file_fd;
+	rl_uint32 file_offset;
+	rl_uint32 file_remaining;
+
+#if defined(RL_LINUX)
+	/* with io_uring, file payloads are read into [payload] ahead of sending
+	 * instead; [uring_flags] are RL_TRANSPORT_URING_xxx */
+	rl_uint8 *payload;
+	rl_uint32 payload_size;
+	int uring_flags;
+#endif
+
 	/* (variable) buffer--allocated immediately in the structure */
 	rl_uint8 buffer[1];
 } rl_transport_buf_t;
@@ -59,19 +99,78 @@ typedef struct rl_transport_callbacks_tag
 		 size_t							len);
 } rl_transport_callbacks_t;
 
+/*
+ * Outgoing buffers are pooled in a few size classes. Each class keeps as many
+ * free buffers around as it has ever had in use at once (its high-water
+ * mark), up to a per-class memory limit.
+ */
+enum
+{
+	RL_TRANSPORT_SIZE_CLASSES = 4
+};
+
+typedef struct rl_transport_pool_tag
+{
+	/* free buffers of this class */
+	struct rl_transport_buf_tag			*free_list;
+	rl_uint32							num_free;
+
+	/* buffers of this class currently handed out */
+	rl_uint32							num_in_use;
+
+	/* most buffers of this class ever in use at the same time */
+	rl_uint32							high_water;
+
+	/* allocations served from the free list vs. from the allocator */
+	rl_uint32							hits;
+	rl_uint32							misses;
+} rl_transport_pool_t;
+
+typedef struct rl_transport_stats_tag
+{
+	/* number of calls to rl_transport_on_output_possible() that wrote data */
+	rl_uint32							flushes;
+
+	/* number of send syscalls issued */
+	rl_uint32							send_calls;
+
+	/* number of bytes written to the socket */
+	rl_uint32							bytes_sent;
+
+	/* most bytes written in a single flush */
+	rl_uint32							max_flush_bytes;
+} rl_transport_stats_t;
+
 typedef struct rl_transport_tag
 {
 	const rl_transport_callbacks_t		*callbacks;
-	rl_iobuf_t							inbuf;
+	rl_ringbuf_t						inbuf;
 	void								*userdata;
 	rl_transport_buf_t					*out_queue;
 	rl_transport_buf_t					*out_tail;
 
-	int									num_free_buffers;
-	rl_transport_buf_t					*next_free_buffer;
+	rl_transport_pool_t					pools[RL_TRANSPORT_SIZE_CLASSES];
+
+	/* largest message accepted from the remote end (at most inbuf.size) */
+	size_t								max_input_size;
+
+	/* largest message the remote end accepts from us */
+	size_t								max_output_size;
 
 	int									error;
 	int									disconnect;
+
+	/* non-zero if the last rl_transport_on_input_arrived() stopped before the
+	 * socket ran dry (typically because the input ring filled up); an
+	 * edge-triggered poller won't report the rest */
+	int									input_pending;
+
+	rl_transport_stats_t				stats;
+
+#if defined(RL_LINUX)
+	/* io_uring state, if enabled */
+	struct rl_transport_uring_tag		*uring;
+#endif
 } rl_transport_t;
 
 int
@@ -93,11 +192,17 @@ enum {
 int
 rl_transport_update(rl_transport_t *t);
 
+/*
+ * Read everything the socket has buffered (or as much as fits in the input
+ * ring) straight into the input ring. Sets input_pending if data may be left.
+ */
 void
 rl_transport_on_input_arrived(rl_transport_t *t, rl_socket_t sock);
 
 /*
  * Write as much as possible from the output queue to the specified socket.
+ * Queued buffers are gathered so that a burst of small messages goes out in a
+ * single syscall. File payloads are sent with rl_socket_sendfile().
  */
 void
 rl_transport_on_output_possible(rl_transport_t *t, rl_socket_t sock);
@@ -105,10 +210,45 @@ rl_transport_on_output_possible(rl_transport_t *t, rl_socket_t sock);
 int
 rl_transport_add_output_message(rl_transport_t *t, rl_transport_buf_t *buffer);
 
+/*
+ * Allocate an output buffer with room for at least [size] bytes.
+ */
 rl_transport_buf_t *
-rl_transport_alloc_buffer(rl_transport_t *t);
+rl_transport_alloc_buffer(rl_transport_t *t, size_t size);
+
+/*
+ * Buffer capacity of a pool size class.
+ */
+size_t
+rl_transport_size_class_capacity(int size_class);
 
 void
 rl_transport_free_buffer(rl_transport_t *t, rl_transport_buf_t *buf);
 
+#if defined(RL_LINUX)
+/*
+ * Write through io_uring from now on. Socket writes are submitted as gather
+ * sends, one at a time, and file payloads are read into memory by the kernel
+ * ahead of them; a payload that's needed right away is read and sent as a
+ * linked pair of requests. Returns non-zero (and changes nothing) if io_uring
+ * is unavailable.
+ *
+ * rl_transport_on_output_possible() then only submits requests, so there's
+ * no need to wait for the socket to become writable; instead, watch
+ * rl_transport_uring_fd() for reading and call rl_transport_on_uring_ready().
+ * Kernels that give up on a full non-blocking socket make the ring wait for
+ * it with a poll before the next send.
+ */
+int
+rl_transport_enable_uring(rl_transport_t *t, unsigned entries);
+
+/* The io_uring descriptor, or -1 if io_uring isn't used. */
+int
+rl_transport_uring_fd(const rl_transport_t *t);
+
+/* Process finished io_uring requests. */
+void
+rl_transport_on_uring_ready(rl_transport_t *t);
+#endif
+
 #endif
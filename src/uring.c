@@ -0,0 +1,213 @@
+#include "uring.h"
+
+#if defined(RL_LINUX)
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int
+rl_uring_init(rl_uring_t *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+
+	rl_memset(ring, 0, sizeof(*ring));
+	rl_memset(&params, 0, sizeof(params));
+	ring->fd = -1;
+
+	if (-1 == (ring->fd = sys_io_uring_setup(entries, &params)))
+	{
+		RL_LOG_INFO(("io_uring unavailable: %s", strerror(errno)));
+		return 1;
+	}
+
+	/* Require a kernel (5.7+) that never drops completions and that polls
+	 * non-blocking sockets itself instead of failing with EAGAIN. */
+	if (0 == (params.features & IORING_FEAT_NODROP) || 0 == (params.features & IORING_FEAT_FAST_POLL))
+	{
+		RL_LOG_INFO(("io_uring too old (features 0x%x)", params.features));
+		goto error;
+	}
+
+	ring->entries = params.sq_entries;
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_map_size = ring->cq_map_size = RL_MAX_MACRO(ring->sq_map_size, ring->cq_map_size);
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_map)
+	{
+		ring->sq_map = NULL;
+		goto error;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cq_map = ring->sq_map;
+	}
+	else
+	{
+		ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_map)
+		{
+			ring->cq_map = NULL;
+			goto error;
+		}
+	}
+
+	ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == (void *) ring->sqes)
+	{
+		ring->sqes = NULL;
+		goto error;
+	}
+
+	sq = (char *) ring->sq_map;
+	ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+	cq = (char *) ring->cq_map;
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	RL_LOG_DEBUG(("io_uring ready with %u entries", ring->entries));
+	return 0;
+
+error:
+	RL_LOG_INFO(("io_uring setup failed: %s", strerror(errno)));
+	rl_uring_destroy(ring);
+	return 1;
+}
+
+void
+rl_uring_destroy(rl_uring_t *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_map && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	if (ring->sq_map)
+		munmap(ring->sq_map, ring->sq_map_size);
+	if (-1 != ring->fd)
+		close(ring->fd);
+
+	rl_memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+struct io_uring_sqe *
+rl_uring_get_sqe(rl_uring_t *ring)
+{
+	const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	const unsigned tail = *ring->sq_tail + ring->sq_pending;
+	const unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= ring->entries)
+		return NULL;
+
+	/* Don't queue more than the completion ring has room for either. */
+	if (ring->in_flight + ring->sq_pending >= ring->entries)
+		return NULL;
+
+	sqe = &ring->sqes[index];
+	rl_memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	++ring->sq_pending;
+	return sqe;
+}
+
+int
+rl_uring_submit(rl_uring_t *ring)
+{
+	unsigned to_submit = ring->sq_pending;
+
+	if (0 == to_submit)
+		return 0;
+
+	/* Publish the new entries before telling the kernel about them. */
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+	ring->sq_pending = 0;
+	ring->in_flight += to_submit;
+
+	while (to_submit > 0)
+	{
+		int rc = sys_io_uring_enter(ring->fd, to_submit, 0, 0);
+
+		if (rc < 0)
+		{
+			if (EINTR == errno || EAGAIN == errno || EBUSY == errno)
+				continue;
+
+			RL_LOG_WARNING(("io_uring_enter failed: %s", strerror(errno)));
+			return 1;
+		}
+
+		to_submit -= (unsigned) rc;
+	}
+
+	return 0;
+}
+
+int
+rl_uring_wait(rl_uring_t *ring)
+{
+	while (0 != sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS))
+	{
+		if (EINTR != errno)
+			return 1;
+	}
+
+	return 0;
+}
+
+int
+rl_uring_reap(rl_uring_t *ring, rl_uring_complete_fn fn, void *context)
+{
+	unsigned head = *ring->cq_head;
+	int count = 0;
+
+	for (;;)
+	{
+		const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		struct io_uring_cqe cqe;
+
+		if (head == tail)
+			break;
+
+		cqe = ring->cqes[head & *ring->cq_mask];
+
+		/* Hand the slot back before the callback, which may submit more. */
+		__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+		--ring->in_flight;
+		++count;
+
+		fn(context, cqe.user_data, cqe.res);
+	}
+
+	return count;
+}
+
+#endif
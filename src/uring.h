@@ -0,0 +1,83 @@
+#ifndef RLAUNCH_URING_H
+#define RLAUNCH_URING_H
+
+#include "util.h"
+
+/*
+ * Minimal io_uring wrapper (Linux only).
+ *
+ * Talks to the kernel through the raw system calls so that there's no
+ * library dependency. Requests are queued with rl_uring_get_sqe() and handed
+ * to the kernel in one go by rl_uring_submit(). The ring descriptor turns
+ * readable when completions are waiting, so it can be watched by the event
+ * loop; rl_uring_reap() then hands them to a callback.
+ *
+ * rl_uring_init() fails on kernels without io_uring (or where it has been
+ * disabled), and callers are expected to carry on without it.
+ */
+
+#if defined(RL_LINUX)
+
+#include <linux/io_uring.h>
+
+typedef struct rl_uring_tag
+{
+	int fd;
+
+	/* submission ring */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	/* entries handed out by rl_uring_get_sqe() but not submitted yet */
+	unsigned sq_pending;
+
+	/* completion ring */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* requests submitted whose completion hasn't been reaped */
+	unsigned in_flight;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+	unsigned entries;
+} rl_uring_t;
+
+typedef void (*rl_uring_complete_fn)(void *context, __u64 user_data, int result);
+
+int
+rl_uring_init(rl_uring_t *ring, unsigned entries);
+
+void
+rl_uring_destroy(rl_uring_t *ring);
+
+/*
+ * Get a cleared submission entry, or NULL if the ring is full (submit and
+ * reap first).
+ */
+struct io_uring_sqe *
+rl_uring_get_sqe(rl_uring_t *ring);
+
+/* Hand queued entries to the kernel. Returns non-zero on error. */
+int
+rl_uring_submit(rl_uring_t *ring);
+
+/* Block until at least one completion is waiting. */
+int
+rl_uring_wait(rl_uring_t *ring);
+
+/* Pass all waiting completions to [fn]; returns how many there were. */
+int
+rl_uring_reap(rl_uring_t *ring, rl_uring_complete_fn fn, void *context);
+
+#endif
+
+#endif
@@ -585,6 +585,357 @@ int rl_string_copy(size_t dest_size, char *dest, const char *source)
 	return dest == dest_max ? -1 : 0;
 }
 
+/*
+ * Hash table (see util.h)
+ */
+
+typedef struct rl_dict_bucket_tag
+{
+	/* Zero marks an empty bucket; real hashes of zero are stored as one. */
+	rl_uint32 hash;
+	const void *key;
+	void *value;
+} rl_dict_bucket_t;
+
+/* FNV-1a */
+rl_uint32 rl_hash_bytes(const void *datum, size_t len)
+{
+	const rl_uint8 *bytes = (const rl_uint8 *) datum;
+	rl_uint32 hash = 2166136261u;
+
+	if (0 == len)
+	{
+		while (*bytes)
+		{
+			hash ^= *bytes++;
+			hash *= 16777619u;
+		}
+	}
+	else
+	{
+		while (len--)
+		{
+			hash ^= *bytes++;
+			hash *= 16777619u;
+		}
+	}
+
+	return hash;
+}
+
+static rl_uint32 dict_hash(const rl_dict_t *dict, const void *key)
+{
+	const rl_uint32 hash = dict->hash_fn ?
+		(*dict->hash_fn)(key, dict->key_size) : rl_hash_bytes(key, dict->key_size);
+
+	return hash ? hash : 1;
+}
+
+static int dict_keys_equal(const rl_dict_t *dict, const void *lhs, const void *rhs)
+{
+	if (dict->compare_fn)
+		return 0 == (*dict->compare_fn)(lhs, rhs);
+
+	if (0 == dict->key_size)
+		return 0 == rl_strcmp((const char *) lhs, (const char *) rhs);
+	else
+	{
+		const rl_uint8 *a = (const rl_uint8 *) lhs;
+		const rl_uint8 *b = (const rl_uint8 *) rhs;
+		size_t len = dict->key_size;
+
+		while (len--)
+		{
+			if (*a++ != *b++)
+				return 0;
+		}
+
+		return 1;
+	}
+}
+
+/* How far the entry in bucket [index] is from its home bucket. */
+static INLINE size_t dict_distance(const rl_dict_t *dict, size_t index, rl_uint32 hash)
+{
+	return (index - (hash & (dict->num_buckets - 1))) & (dict->num_buckets - 1);
+}
+
+/* Returns the bucket holding [key], or NULL. */
+static rl_dict_bucket_t *dict_lookup(const rl_dict_t *dict, const void *key)
+{
+	const size_t mask = dict->num_buckets - 1;
+	const rl_uint32 hash = dict_hash(dict, key);
+	size_t index = hash & mask;
+	size_t distance = 0;
+
+	for (;;)
+	{
+		rl_dict_bucket_t * const bucket = &dict->buckets[index];
+
+		/* The key would have displaced anything closer to home. */
+		if (0 == bucket->hash || dict_distance(dict, index, bucket->hash) < distance)
+			return NULL;
+
+		if (hash == bucket->hash && dict_keys_equal(dict, bucket->key, key))
+			return bucket;
+
+		index = (index + 1) & mask;
+		++distance;
+	}
+}
+
+/* Place an entry known not to be in the table. */
+static void dict_place(rl_dict_t *dict, rl_dict_bucket_t entry)
+{
+	const size_t mask = dict->num_buckets - 1;
+	size_t index = entry.hash & mask;
+	size_t distance = 0;
+
+	for (;;)
+	{
+		rl_dict_bucket_t * const bucket = &dict->buckets[index];
+		size_t bucket_distance;
+
+		if (0 == bucket->hash)
+		{
+			*bucket = entry;
+			++dict->num_elements;
+			return;
+		}
+
+		/* Take from the rich: the resident is closer to home, so it moves
+		 * on instead. */
+		if ((bucket_distance = dict_distance(dict, index, bucket->hash)) < distance)
+		{
+			const rl_dict_bucket_t displaced = *bucket;
+			*bucket = entry;
+			entry = displaced;
+			distance = bucket_distance;
+		}
+
+		index = (index + 1) & mask;
+		++distance;
+	}
+}
+
+static int dict_resize(rl_dict_t *dict, size_t num_buckets)
+{
+	rl_dict_bucket_t * const old_buckets = dict->buckets;
+	const size_t old_count = dict->num_buckets;
+	size_t i;
+
+	if (NULL == (dict->buckets = (rl_dict_bucket_t *) rl_alloc_sized_and_clear(num_buckets * sizeof(rl_dict_bucket_t))))
+	{
+		dict->buckets = old_buckets;
+		return 1;
+	}
+
+	dict->num_buckets = num_buckets;
+	dict->num_elements = 0;
+
+	for (i = 0; i < old_count; ++i)
+	{
+		if (old_buckets[i].hash)
+			dict_place(dict, old_buckets[i]);
+	}
+
+	if (old_buckets)
+		rl_free_sized(old_buckets, old_count * sizeof(rl_dict_bucket_t));
+
+	return 0;
+}
+
+/* Empty bucket [index] by shifting the entries after it back a step, up to the
+ * first one that's home already. */
+static void dict_remove_bucket(rl_dict_t *dict, size_t index)
+{
+	const size_t mask = dict->num_buckets - 1;
+
+	for (;;)
+	{
+		const size_t next = (index + 1) & mask;
+		const rl_dict_bucket_t * const bucket = &dict->buckets[next];
+
+		if (0 == bucket->hash || 0 == dict_distance(dict, next, bucket->hash))
+			break;
+
+		dict->buckets[index] = *bucket;
+		index = next;
+	}
+
+	dict->buckets[index].hash = 0;
+	dict->buckets[index].key = NULL;
+	dict->buckets[index].value = NULL;
+	--dict->num_elements;
+}
+
+int rl_dict_init(
+	rl_dict_t *dict,
+	size_t buckets,
+	size_t key_size,
+	rl_hash_fn hash_fn,
+	rl_compare_fn compare_fn,
+	rl_destructor_fn destructor_fn)
+{
+	size_t num_buckets = 8;
+
+	rl_memset(dict, 0, sizeof(*dict));
+	dict->key_size = key_size;
+	dict->hash_fn = hash_fn;
+	dict->compare_fn = compare_fn;
+	dict->destructor_fn = destructor_fn;
+
+	/* Room for [buckets] entries without growing. */
+	while (num_buckets / 4 * 3 < buckets)
+		num_buckets *= 2;
+
+	return dict_resize(dict, num_buckets);
+}
+
+void rl_dict_destroy(rl_dict_t *dict)
+{
+	rl_dict_clear(dict);
+
+	if (dict->buckets)
+		rl_free_sized(dict->buckets, dict->num_buckets * sizeof(rl_dict_bucket_t));
+
+	rl_memset(dict, 0, sizeof(*dict));
+}
+
+int rl_dict_insert(rl_dict_t *dict, const void *key, void *value)
+{
+	rl_dict_bucket_t *bucket;
+	rl_dict_bucket_t entry;
+
+	if (NULL != (bucket = dict_lookup(dict, key)))
+	{
+		void * const old_value = bucket->value;
+
+		bucket->key = key;
+		bucket->value = value;
+
+		if (dict->destructor_fn && old_value != value)
+			(*dict->destructor_fn)(old_value);
+
+		return 0;
+	}
+
+	if ((dict->num_elements + 1) * 4 > dict->num_buckets * 3)
+	{
+		if (0 != dict_resize(dict, dict->num_buckets * 2))
+			return 1;
+	}
+
+	entry.hash = dict_hash(dict, key);
+	entry.key = key;
+	entry.value = value;
+	dict_place(dict, entry);
+	return 0;
+}
+
+void *rl_dict_find(const rl_dict_t *dict, const void *key)
+{
+	const rl_dict_bucket_t * const bucket = dict_lookup(dict, key);
+	return bucket ? bucket->value : NULL;
+}
+
+int rl_dict_erase(rl_dict_t *dict, const void *key)
+{
+	rl_dict_bucket_t *bucket;
+	void *value;
+
+	if (NULL == (bucket = dict_lookup(dict, key)))
+		return 1;
+
+	value = bucket->value;
+	dict_remove_bucket(dict, (size_t) (bucket - dict->buckets));
+
+	if (dict->destructor_fn)
+		(*dict->destructor_fn)(value);
+
+	return 0;
+}
+
+void rl_dict_erase_if(
+	rl_dict_t *dict,
+	int (*match_fn)(const void *key, void *value, void *context),
+	void *context)
+{
+	size_t i = 0;
+
+	/* An erase pulls the following entries back, so the bucket is looked at
+	 * again. An entry wrapping around from the front may be seen twice, but
+	 * none are skipped. */
+	while (i < dict->num_buckets)
+	{
+		rl_dict_bucket_t * const bucket = &dict->buckets[i];
+
+		if (bucket->hash && (*match_fn)(bucket->key, bucket->value, context))
+		{
+			void * const value = bucket->value;
+
+			dict_remove_bucket(dict, i);
+
+			if (dict->destructor_fn)
+				(*dict->destructor_fn)(value);
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+void rl_dict_clear(rl_dict_t *dict)
+{
+	size_t i;
+
+	for (i = 0; i < dict->num_buckets; ++i)
+	{
+		rl_dict_bucket_t * const bucket = &dict->buckets[i];
+
+		if (bucket->hash && dict->destructor_fn)
+			(*dict->destructor_fn)(bucket->value);
+	}
+
+	if (dict->buckets)
+		rl_memset(dict->buckets, 0, dict->num_buckets * sizeof(rl_dict_bucket_t));
+
+	dict->num_elements = 0;
+}
+
+int rl_dict_next(const rl_dict_t *dict, size_t *cursor, const void **key_out, void **value_out)
+{
+	while (*cursor < dict->num_buckets)
+	{
+		const rl_dict_bucket_t * const bucket = &dict->buckets[(*cursor)++];
+
+		if (bucket->hash)
+		{
+			*key_out = bucket->key;
+			*value_out = bucket->value;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+rl_uint32 rl_rollsum(const void *data, size_t length)
+{
+	const rl_uint8 *p = (const rl_uint8 *) data;
+	rl_uint32 a = 0, b = 0;
+
+	/* Each byte ends up in b once for every byte from it to the end. */
+	while (length--)
+	{
+		a += *p++;
+		b += a;
+	}
+
+	return (a & 0xffff) | (b << 16);
+}
+
 static INLINE void strbuf_append_ch(rl_strbuf_t *buf, char ch)
 {
 	if (buf->buffer != buf->max)
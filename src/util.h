@@ -209,6 +209,23 @@ int rl_strcmp(const char *lhs, const char* rhs);
  * Data structures
  */
 
+/*
+ * Hash table with open addressing.
+ *
+ * Entries live in one flat array of buckets (a power of two of them) and are
+ * placed with Robin Hood probing: an entry being inserted takes the bucket of
+ * any entry that is closer to its home bucket, so probe sequences stay short
+ * and lookups of missing keys stop early. Erasing shifts the following entries
+ * back instead of leaving tombstones. The table grows when it's 3/4 full.
+ *
+ * The dictionary doesn't copy keys; they must stay put while their entry is
+ * in the table, which is easiest when the key is a member of the value.
+ * [key_size] is the size of fixed-size keys, or zero for null-terminated
+ * strings. The hash and compare functions default to hashing and comparing
+ * the key bytes; [destructor_fn], if any, is called on values as they're
+ * erased or replaced.
+ */
+
 struct rl_dict_bucket_tag;
 
 typedef int (*rl_compare_fn)(const void *lhs, const void *rhs);
@@ -220,17 +237,69 @@ typedef struct rl_dict_tag
 	struct rl_dict_bucket_tag *buckets;
 	size_t num_buckets;
 	size_t num_elements;
+	size_t key_size;
 	rl_hash_fn hash_fn;
 	rl_compare_fn compare_fn;
 	rl_destructor_fn destructor_fn;
 } rl_dict_t;
 
+/* Hash [len] bytes of [datum], or the string [datum] if [len] is zero. */
+rl_uint32
+rl_hash_bytes(const void *datum, size_t len);
+
+/* [buckets] is the expected number of entries; it's only a hint. */
 int
-rl_dict_init(rl_dict_t *dict, size_t buckets);
+rl_dict_init(
+	rl_dict_t *dict,
+	size_t buckets,
+	size_t key_size,
+	rl_hash_fn hash_fn,
+	rl_compare_fn compare_fn,
+	rl_destructor_fn destructor_fn);
 
 void
 rl_dict_destroy(rl_dict_t *dict);
 
+/* Add or replace the entry for [key]. Returns non-zero if the table couldn't
+ * grow. */
+int
+rl_dict_insert(rl_dict_t *dict, const void *key, void *value);
+
+/* Returns the value for [key], or NULL. */
+void *
+rl_dict_find(const rl_dict_t *dict, const void *key);
+
+/* Returns non-zero if there's no entry for [key]. */
+int
+rl_dict_erase(rl_dict_t *dict, const void *key);
+
+/* Erase the entries [match_fn] returns non-zero for. */
+void
+rl_dict_erase_if(
+	rl_dict_t *dict,
+	int (*match_fn)(const void *key, void *value, void *context),
+	void *context);
+
+/* Erase all entries. */
+void
+rl_dict_clear(rl_dict_t *dict);
+
+/*
+ * Iterate over the entries: start with [*cursor] at zero and call until this
+ * returns zero. The table must not be changed in the meantime.
+ */
+int
+rl_dict_next(const rl_dict_t *dict, size_t *cursor, const void **key_out, void **value_out);
+
+/*
+ * Weak checksum of a block for delta transfers (see delta/request in
+ * rlnet.msg). The low word is the sum of the bytes, the high word the sum
+ * of each byte times its distance from the end of the block, both modulo
+ * 2^16. The window can be rolled along a byte at a time.
+ */
+rl_uint32
+rl_rollsum(const void *data, size_t length);
+
 /* String utilities */
 
 typedef struct rl_strbuf_tag
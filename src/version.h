@@ -8,7 +8,7 @@
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 
-#define RLAUNCH_VER_MAJOR 1
+#define RLAUNCH_VER_MAJOR 2
 /* NB: Interpreted as octal in the code.. */
 #define RLAUNCH_VER_MINOR 0
 
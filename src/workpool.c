@@ -0,0 +1,229 @@
+#include "workpool.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(RL_LINUX)
+#include <sys/eventfd.h>
+#endif
+
+static void
+push_completed(rl_workpool_t *pool, rl_work_t *work)
+{
+	rl_work_t *head = __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+
+	do
+	{
+		work->next = head;
+	} while (!__atomic_compare_exchange_n(&pool->completed, &head, work, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* Only the push onto an empty stack needs to wake up the owner; it
+	 * clears the descriptor before taking the stack. */
+	if (NULL == head)
+	{
+#if defined(RL_LINUX)
+		const uint64_t one = 1;
+#else
+		const char one = 1;
+#endif
+		ssize_t rc = write(pool->wake_fds[1], &one, sizeof(one));
+		(void) rc;
+	}
+}
+
+static void *
+worker_main(void *arg)
+{
+	rl_workpool_t * const pool = (rl_workpool_t *) arg;
+
+	for (;;)
+	{
+		rl_work_t *work;
+
+		pthread_mutex_lock(&pool->lock);
+
+		while (!pool->quit && NULL == pool->queue_head)
+			pthread_cond_wait(&pool->work_available, &pool->lock);
+
+		if (pool->quit)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		work = pool->queue_head;
+		if (NULL == (pool->queue_head = work->next))
+			pool->queue_tail = NULL;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		work->run(work);
+		push_completed(pool, work);
+	}
+
+	return NULL;
+}
+
+static int
+open_wakeup_fds(rl_workpool_t *pool)
+{
+#if defined(RL_LINUX)
+	if (-1 == (pool->wake_fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)))
+		return 1;
+
+	pool->wake_fds[1] = pool->wake_fds[0];
+	return 0;
+#else
+	int i;
+
+	if (0 != pipe(pool->wake_fds))
+		return 1;
+
+	for (i = 0; i < 2; ++i)
+	{
+		fcntl(pool->wake_fds[i], F_SETFL, fcntl(pool->wake_fds[i], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(pool->wake_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	return 0;
+#endif
+}
+
+static void
+close_wakeup_fds(rl_workpool_t *pool)
+{
+	if (-1 != pool->wake_fds[0])
+		close(pool->wake_fds[0]);
+	if (-1 != pool->wake_fds[1] && pool->wake_fds[1] != pool->wake_fds[0])
+		close(pool->wake_fds[1]);
+
+	pool->wake_fds[0] = pool->wake_fds[1] = -1;
+}
+
+int
+rl_workpool_init(rl_workpool_t *pool, int num_threads)
+{
+	rl_memset(pool, 0, sizeof(*pool));
+	pool->wake_fds[0] = pool->wake_fds[1] = -1;
+
+	num_threads = RL_MIN_MACRO(num_threads, RL_WORKPOOL_MAX_THREADS);
+
+	if (0 != open_wakeup_fds(pool))
+	{
+		RL_LOG_WARNING(("couldn't create worker wakeup descriptor: %s", strerror(errno)));
+		close_wakeup_fds(pool);
+		return 1;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_available, NULL);
+
+	for (pool->num_threads = 0; pool->num_threads < num_threads; ++pool->num_threads)
+	{
+		int rc;
+
+		if (0 != (rc = pthread_create(&pool->threads[pool->num_threads], NULL, worker_main, pool)))
+		{
+			RL_LOG_WARNING(("couldn't start worker thread: %s", strerror(rc)));
+			break;
+		}
+	}
+
+	if (0 == pool->num_threads)
+	{
+		rl_workpool_destroy(pool);
+		return 1;
+	}
+
+	RL_LOG_DEBUG(("started %d worker threads", pool->num_threads));
+	return 0;
+}
+
+void
+rl_workpool_stop(rl_workpool_t *pool)
+{
+	rl_work_t *work;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work_available);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_threads; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	pool->num_threads = 0;
+
+	while (NULL != (work = pool->queue_head))
+	{
+		pool->queue_head = work->next;
+		push_completed(pool, work);
+	}
+
+	pool->queue_tail = NULL;
+}
+
+void
+rl_workpool_destroy(rl_workpool_t *pool)
+{
+	rl_workpool_stop(pool);
+
+	pthread_cond_destroy(&pool->work_available);
+	pthread_mutex_destroy(&pool->lock);
+
+	close_wakeup_fds(pool);
+}
+
+void
+rl_workpool_submit(rl_workpool_t *pool, rl_work_t *work)
+{
+	work->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->queue_tail)
+		pool->queue_tail->next = work;
+	else
+		pool->queue_head = work;
+
+	pool->queue_tail = work;
+
+	pthread_cond_signal(&pool->work_available);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int
+rl_workpool_wakeup_fd(const rl_workpool_t *pool)
+{
+	return pool->wake_fds[0];
+}
+
+rl_work_t *
+rl_workpool_take_completed(rl_workpool_t *pool)
+{
+	rl_work_t *work, *ordered = NULL;
+	char drain[64];
+
+	/* Clear the wakeup first; anything pushed from here on either ends up
+	 * in this batch or wakes us up again. */
+	while (read(pool->wake_fds[0], drain, sizeof(drain)) > 0)
+	{
+	}
+
+	work = __atomic_exchange_n(&pool->completed, NULL, __ATOMIC_ACQUIRE);
+
+	/* The stack holds the most recent item first. */
+	while (work)
+	{
+		rl_work_t *next = work->next;
+		work->next = ordered;
+		ordered = work;
+		work = next;
+	}
+
+	return ordered;
+}
@@ -0,0 +1,81 @@
+#ifndef RLAUNCH_WORKPOOL_H
+#define RLAUNCH_WORKPOOL_H
+
+#include "util.h"
+
+/*
+ * A pool of threads for blocking work.
+ *
+ * Work items are handed to the threads through a locked FIFO. Finished items
+ * are pushed onto a lock-free stack that only the owning thread drains, and
+ * the owner is woken up through a file descriptor (an eventfd on Linux, a
+ * pipe elsewhere) that it can watch in its event loop.
+ *
+ * Work items are owned by the caller; the pool only links them. Items finish
+ * in whatever order the threads get through them.
+ *
+ * POSIX only.
+ */
+
+#include <pthread.h>
+
+typedef struct rl_work_tag
+{
+	struct rl_work_tag *next;
+
+	/* called on a worker thread */
+	void (*run)(struct rl_work_tag *work);
+} rl_work_t;
+
+enum
+{
+	RL_WORKPOOL_MAX_THREADS = 64
+};
+
+typedef struct rl_workpool_tag
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work_available;
+	rl_work_t *queue_head;
+	rl_work_t *queue_tail;
+	int quit;
+
+	/* finished items, most recently finished first */
+	rl_work_t *completed;
+
+	/* readable while there are finished items; [1] is the write end */
+	int wake_fds[2];
+
+	pthread_t threads[RL_WORKPOOL_MAX_THREADS];
+	int num_threads;
+} rl_workpool_t;
+
+int
+rl_workpool_init(rl_workpool_t *pool, int num_threads);
+
+/*
+ * Stop the threads once they're done with the items they're running. Items
+ * still queued are not run, but moved to the completed list so that the
+ * owner can reclaim everything with rl_workpool_take_completed().
+ */
+void
+rl_workpool_stop(rl_workpool_t *pool);
+
+void
+rl_workpool_destroy(rl_workpool_t *pool);
+
+void
+rl_workpool_submit(rl_workpool_t *pool, rl_work_t *work);
+
+/* The descriptor to watch for reading; see rl_workpool_take_completed(). */
+int
+rl_workpool_wakeup_fd(const rl_workpool_t *pool);
+
+/*
+ * Take all finished items, linked through [next] in the order they finished.
+ * Clears the wakeup descriptor. Owner thread only.
+ */
+rl_work_t *
+rl_workpool_take_completed(rl_workpool_t *pool);
+
+#endif
@@ -0,0 +1,119 @@
+#include "xxhash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* Input is read little-endian whatever the host, one byte at a time;
+ * compilers turn this into a plain load where they can. */
+static INLINE rl_uint64
+read64(const rl_uint8 *p)
+{
+	return (rl_uint64) p[0] | ((rl_uint64) p[1] << 8) | ((rl_uint64) p[2] << 16) | ((rl_uint64) p[3] << 24) |
+		((rl_uint64) p[4] << 32) | ((rl_uint64) p[5] << 40) | ((rl_uint64) p[6] << 48) | ((rl_uint64) p[7] << 56);
+}
+
+static INLINE rl_uint64
+read32(const rl_uint8 *p)
+{
+	return (rl_uint64) p[0] | ((rl_uint64) p[1] << 8) | ((rl_uint64) p[2] << 16) | ((rl_uint64) p[3] << 24);
+}
+
+static INLINE rl_uint64
+round64(rl_uint64 acc, rl_uint64 input)
+{
+	acc += input * PRIME64_2;
+	acc = ROTL64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static INLINE rl_uint64
+merge_round(rl_uint64 acc, rl_uint64 value)
+{
+	acc ^= round64(0, value);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+rl_uint64
+rl_xxhash64(const void *data, size_t length, rl_uint64 seed)
+{
+	const rl_uint8 *p = (const rl_uint8 *) data;
+	const rl_uint8 * const end = p + length;
+	rl_uint64 hash;
+
+	if (length >= 32)
+	{
+		const rl_uint8 * const limit = end - 32;
+		rl_uint64 v1 = seed + PRIME64_1 + PRIME64_2;
+		rl_uint64 v2 = seed + PRIME64_2;
+		rl_uint64 v3 = seed;
+		rl_uint64 v4 = seed - PRIME64_1;
+
+		do
+		{
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		hash = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+		hash = merge_round(hash, v1);
+		hash = merge_round(hash, v2);
+		hash = merge_round(hash, v3);
+		hash = merge_round(hash, v4);
+	}
+	else
+	{
+		hash = seed + PRIME64_5;
+	}
+
+	hash += (rl_uint64) length;
+
+	while (p + 8 <= end)
+	{
+		hash ^= round64(0, read64(p));
+		hash = ROTL64(hash, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+
+	if (p + 4 <= end)
+	{
+		hash ^= read32(p) * PRIME64_1;
+		hash = ROTL64(hash, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+
+	while (p < end)
+	{
+		hash ^= (rl_uint64) *p * PRIME64_5;
+		hash = ROTL64(hash, 11) * PRIME64_1;
+		++p;
+	}
+
+	/* Final avalanche */
+	hash ^= hash >> 33;
+	hash *= PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= PRIME64_3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+void
+rl_xxhash64_encode(rl_uint64 hash, rl_uint8 *out)
+{
+	int i;
+
+	for (i = 7; i >= 0; --i)
+	{
+		out[i] = (rl_uint8) hash;
+		hash >>= 8;
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef RLAUNCH_XXHASH_H
+#define RLAUNCH_XXHASH_H
+
+#include "util.h"
+
+/*
+ * 64-bit xxHash (XXH64) for the controller.
+ *
+ * Used to name blocks of file data by their contents, so that a target can
+ * tell which blocks it already holds without having them sent. The result
+ * matches the reference implementation for the same seed.
+ *
+ * Not built for the target; 64-bit arithmetic is slow on a 68000, and the
+ * target only ever compares hashes it has been sent.
+ */
+
+#if defined(_MSC_VER)
+typedef unsigned __int64 rl_uint64;
+#else
+typedef unsigned long long rl_uint64;
+#endif
+
+rl_uint64
+rl_xxhash64(const void *data, size_t length, rl_uint64 seed);
+
+/* Store [hash] at [out] as 8 bytes, most significant first. */
+void
+rl_xxhash64_encode(rl_uint64 hash, rl_uint8 *out);
+
+#endif
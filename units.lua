@@ -5,6 +5,8 @@ StaticLibrary {
 	Name = "common",
 	Sources =  {
 		"src/util.c", "src/transport.c", "src/peer.c", "src/protocol.c", "src/socket_includes.c",
+		"src/readwin.c", "src/blockcache.c", "src/evloop.c", "src/lz.c",
+		{ "src/uring.c"; Config = "linux-*-*" },
 		CompileNetMessages {
 			Pass = "Codegen",
 			Input = 'src/rlnet.msg',
@@ -27,13 +29,15 @@ Program {
 		"$(OBJECTDIR)/_generated", "src",
 	},
 	Sources = {
-		"src/controller.c", "src/file_server.c"
+		"src/controller.c", "src/file_server.c", "src/xxhash.c", "src/delta.c", "src/packcache.c",
+		{ "src/workpool.c", "src/statcache.c", "src/pathindex.c"; Config = { "macosx-*-*", "linux-*-*" } },
 	},
 	Depends = {
 		"common"
 	},
   Libs = {
     { "ws2_32.lib"; Config = "win64-*-*" },
+    { "pthread"; Config = { "macosx-*-*", "linux-*-*" } },
   },
 }
 
@@ -55,5 +59,37 @@ Program {
   },
 }
 
+Program {
+	Config = { "macosx-*-*", "linux-*-*" },
+	Name = "rl-tests",
+	Includes = {
+		"$(OBJECTDIR)/_generated", "src",
+	},
+	Sources = {
+		"src/tests.c",
+		"src/delta.c",
+		"src/xxhash.c",
+	},
+	Depends = {
+		"common"
+	},
+}
+
+Program {
+	Config = { "macosx-*-*", "linux-*-*" },
+	Name = "rl-bench",
+	Includes = {
+		"$(OBJECTDIR)/_generated", "src",
+	},
+	Sources = {
+		"src/bench.c",
+	},
+	Depends = {
+		"common"
+	},
+}
+
 Default "rl-controller"
 Default "rl-target"
+Default "rl-tests"
+Default "rl-bench"